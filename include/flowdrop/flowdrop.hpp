@@ -13,6 +13,8 @@
 #include <chrono> // milliseconds
 #include <filesystem> // path, perms
 #include <vector> // vector
+#include <utility> // pair
+#include <memory> // shared_ptr, unique_ptr
 
 namespace flowdrop {
     // auto define pointer to implementation
@@ -25,6 +27,36 @@ private: \
 
     void setDebug(bool enabled);
 
+    enum class LogLevel {
+        Debug,
+        Info,
+        Error
+    };
+
+    struct LogRecord {
+        LogLevel level;
+        std::chrono::system_clock::time_point time;
+        std::string message;
+        std::vector<std::pair<std::string, std::string>> fields; // structured context, e.g. {"ip", "10.0.0.2"}
+    };
+
+    // Records are delivered one at a time from a background logging thread; the sink must not
+    // block for long, records logged meanwhile are dropped once the queue is full.
+    // nullptr restores the default console (Android log) sink.
+    using logSink = std::function<void(const LogRecord &)>;
+    void setLogSink(const logSink &sink);
+
+    // Resolved peers are remembered so sends to recently seen receivers skip mDNS.
+    // The file is loaded immediately and rewritten whenever the cache changes.
+    void setPeerCacheFile(const std::filesystem::path &path);
+    void setPeerCacheTTL(const std::chrono::seconds &ttl);
+
+    // Paired devices send to each other without an ask, see SendRequest::setPairing and
+    // Server::setPairCallback. Without a file pairings last as long as the process; the file is
+    // loaded immediately and rewritten whenever a pairing is made or removed.
+    void setPairingFile(const std::filesystem::path &path);
+    void unpair(const std::string &id); // forgets the device both as a sender and as a receiver
+
     std::string generate_md5_id();
 
     struct DeviceInfo {
@@ -40,11 +72,45 @@ private: \
         std::uint64_t size;
     };
 
+    using fileVisitor = std::function<bool(const FileInfo &)>; // return false to stop
+
     struct SendAsk {
         DeviceInfo sender;
-        std::vector<FileInfo> files;
+        std::vector<FileInfo> files; // empty when the ask has more than AskLimits::inlineFiles files
+        std::uint64_t totalFiles = 0;
+        std::uint64_t totalSize = 0;
+        std::function<void(const fileVisitor &)> fileSource; // set by the receiver when files is not populated
+        bool estimated = false; // the sender enumerates while sending: files is empty, totals are its estimate
+
+        // visits every file of the ask, also the ones not kept in files
+        void forEachFile(const fileVisitor &visitor) const;
+    };
+
+    // Asks are parsed while they arrive; anything past these limits is refused.
+    struct AskLimits {
+        std::uint64_t maxFiles = 1000000;
+        std::size_t maxPathLength = 4096; // bytes
+        std::uint64_t maxBodyBytes = 256 * 1024 * 1024;
+        std::uint64_t inlineFiles = 10000;
     };
 
+    // Link to a receiver as measured by probe().
+    struct LinkProbe {
+        std::chrono::microseconds rtt{0}; // fastest of a few empty requests
+        std::uint64_t uploadRate = 0; // bytes per second to the receiver, 0 if not measured
+        std::uint64_t downloadRate = 0; // bytes per second from the receiver, 0 if not measured
+    };
+
+    // How often progress events are delivered: at most one per interval, and only after another
+    // granularity bytes. Starts, ends and the last progress of each file always are. Zero for
+    // both reports every chunk.
+    struct ProgressOptions {
+        std::chrono::milliseconds interval{50};
+        std::uint64_t granularity = 0; // bytes
+    };
+
+    // Progress events pass FileInfo objects that live as long as their file is transferred, no
+    // copies are made per event.
     class IEventListener {
     public:
         virtual ~IEventListener() = default;
@@ -56,6 +122,7 @@ private: \
         virtual void onAskingReceiver() {}
         virtual void onReceiverDeclined() {}
         virtual void onReceiverAccepted() {}
+        virtual void onLinkProbed(const LinkProbe &probe) {} // before the ask, with a transport preset
         virtual void onSendingStart() {}
         virtual void onSendingTotalProgress(std::uint64_t totalSize, std::uint64_t currentSize) {}
         virtual void onSendingFileStart(const FileInfo &fileInfo) {}
@@ -74,7 +141,73 @@ private: \
         virtual void onReceivingEnd(const DeviceInfo &sender, std::uint64_t totalSize, const std::vector<FileInfo> &receivedFiles) {}
     };
 
+    // Delivers the events of a listener away from the transfer threads, so a slow listener does
+    // not slow the transfer down. Events are queued and delivered in order on a thread of its
+    // own, or on the executor, which gets one task at a time. A progress event updates the
+    // waiting one of the same kind and file, if any, so it is delivered with the newest sizes.
+    // A transfer thread never waits for the listener: past capacity waiting events, file
+    // progress without a waiting event of its own is dropped, while the other events are still
+    // queued. Set it as the event listener in place of the wrapped one.
+    class EventDispatcher : public IEventListener {
+    public:
+        using executor = std::function<void(std::function<void()>)>;
+
+        explicit EventDispatcher(IEventListener *listener, std::size_t capacity = 1024);
+        EventDispatcher(IEventListener *listener, executor runner, std::size_t capacity = 1024);
+        ~EventDispatcher() override; // delivers what is queued first
+
+        void flush(); // waits until the queued events are delivered; not from the listener
+
+        void onResolving() override;
+        void onReceiverNotFound() override;
+        void onResolved() override;
+        void onAskingReceiver() override;
+        void onReceiverDeclined() override;
+        void onReceiverAccepted() override;
+        void onLinkProbed(const LinkProbe &probe) override;
+        void onSendingStart() override;
+        void onSendingTotalProgress(std::uint64_t totalSize, std::uint64_t currentSize) override;
+        void onSendingFileStart(const FileInfo &fileInfo) override;
+        void onSendingFileProgress(const FileInfo &fileInfo, std::uint64_t currentSize) override;
+        void onSendingFileEnd(const FileInfo &fileInfo) override;
+        void onSendingEnd() override;
+
+        void onReceiverStarted(unsigned short port) override;
+        void onSenderAsk(const DeviceInfo &sender) override;
+        void onReceivingStart(const DeviceInfo &sender, std::uint64_t totalSize) override;
+        void onReceivingTotalProgress(const DeviceInfo &sender, std::uint64_t totalSize, std::uint64_t receivedSize) override;
+        void onReceivingFileStart(const DeviceInfo &sender, const FileInfo &fileInfo) override;
+        void onReceivingFileProgress(const DeviceInfo &sender, const FileInfo &fileInfo, std::uint64_t receivedSize) override;
+        void onReceivingFileEnd(const DeviceInfo &sender, const FileInfo &fileInfo) override;
+        void onReceivingEnd(const DeviceInfo &sender, std::uint64_t totalSize, const std::vector<FileInfo> &receivedFiles) override;
+
+        FLOWDROP_PRIVATE
+    };
+
     using askCallback = std::function<bool(const SendAsk &)>;
+    using pairCallback = std::function<bool(const DeviceInfo &sender, bool repair)>;
+
+    // Socket tuning of the transfer connections, see SendRequest and Server setTransportOptions.
+    // Zero and empty leave the system default; settings the system lacks are skipped.
+    struct TransportOptions {
+        std::size_t uploadBufferSize = 0; // sending side only, 16 KiB to 2 MiB
+        int sendBufferSize = 0; // SO_SNDBUF, fixing it turns the kernel's autotuning off
+        int receiveBufferSize = 0; // SO_RCVBUF, as above
+        bool noDelay = true; // TCP_NODELAY
+        int notSentLowat = 0; // TCP_NOTSENT_LOWAT, unsent bytes queued in the kernel
+        std::string congestionControl; // TCP_CONGESTION, e.g. "bbr" where the kernel has it
+    };
+
+    enum class TransportPreset {
+        LanBulk, // wired gigabit, large buffers, BBR
+        WiFi, // buffers at twice the bandwidth-delay product, short unsent queue, BBR
+        LowMemory // at most 256 KiB per socket
+    };
+
+    // Buffers sized from the bandwidth-delay product of the link, rtt times bandwidth in bytes
+    // per second, e.g. as measured before the transfer. Zero assumes a typical link for the preset.
+    TransportOptions transportOptions(TransportPreset preset, const std::chrono::microseconds &rtt = std::chrono::microseconds(0),
+                                      std::uint64_t bandwidth = 0);
 
     class Server {
     public:
@@ -89,9 +222,32 @@ private: \
         void setAskCallback(const askCallback &);
         [[nodiscard]] const askCallback &getAskCallback() const;
 
+        // Called after an accepted ask whose sender wants to pair; true pairs. Sends of a paired
+        // sender are received without an ask. repair is set when a device with the sender's id
+        // is paired already: the id is self-declared, true replaces that pairing. Unset never
+        // pairs.
+        void setPairCallback(const pairCallback &);
+        [[nodiscard]] const pairCallback &getPairCallback() const;
+
         void setEventListener(IEventListener *);
         IEventListener *getEventListener();
 
+        void setAskLimits(const AskLimits &);
+        [[nodiscard]] const AskLimits &getAskLimits() const;
+
+        // Threads writing received stream archives, shared by all sessions; one file is always
+        // written by one thread. 0 writes on the connection's IO thread. Set before run().
+        void setWriterThreads(unsigned);
+        [[nodiscard]] unsigned getWriterThreads() const;
+
+        // Applied to the listening socket, which accepted connections inherit. Unset keeps the
+        // system defaults. Set before run().
+        void setTransportOptions(const std::optional<TransportOptions> &);
+        [[nodiscard]] const std::optional<TransportOptions> &getTransportOptions() const;
+
+        void setProgressOptions(const ProgressOptions &);
+        [[nodiscard]] const ProgressOptions &getProgressOptions() const;
+
         void run();
         void stop();
 
@@ -104,6 +260,39 @@ private: \
 
     void discover(const discoverCallback &callback);
 
+    enum class DiscoveryEvent {
+        Added,
+        Updated,
+        Removed
+    };
+
+    // called one event at a time, from discovery worker threads
+    using discoveryEventCallback = std::function<void(DiscoveryEvent, const DeviceInfo &)>;
+
+    // Long-running discovery. Peers are kept in a registry and only changes are reported.
+    // DNS-SD browse carries no removal, so a peer not seen for half the TTL is re-resolved
+    // and removed once the TTL expires without an answer.
+    class DiscoverySession {
+    public:
+        explicit DiscoverySession(const discoveryEventCallback &callback);
+        ~DiscoverySession();
+
+        [[maybe_unused]] [[nodiscard]] std::chrono::seconds getPeerTTL() const;
+        DiscoverySession &setPeerTTL(const std::chrono::seconds &ttl); // before start()
+
+        void start(); // non-blocking
+        void stop();
+
+        [[nodiscard]] std::vector<DeviceInfo> getPeers() const;
+
+        FLOWDROP_PRIVATE
+    };
+
+    // File::getSize() of a source whose length is not known up front, e.g. a pipe or a live
+    // capture. Such files are read until read() returns 0 and are listed in the ask with size 0;
+    // the receiver learns the size when the file ends.
+    inline constexpr std::uint64_t unknownFileSize = ~std::uint64_t(0);
+
     class File {
     public:
         virtual ~File() = default;
@@ -116,6 +305,55 @@ private: \
         virtual std::uint64_t read(char *buffer, std::uint64_t count) = 0;
     };
 
+    // A file that can be read at any offset without a shared read position, so several streams
+    // may read it at once. Size and times are captured when the file is opened.
+    class PositionalFile : public File {
+    public:
+        // pread semantics, returns less than count only at the end of the file or on error
+        virtual std::uint64_t readAt(std::uint64_t offset, char *buffer, std::uint64_t count) const = 0;
+        [[nodiscard]] virtual int nativeHandle() const { return -1; } // OS file descriptor, -1 if none
+    };
+
+    // Produces the files of a send one at a time, nullptr after the last one. It is called on
+    // the sending side while earlier files are already being transmitted; the files it returns
+    // are owned and deleted by the request. Throwing aborts the send.
+    using fileGenerator = std::function<File *()>;
+
+    // Totals announced in the ask of a generator send, before the files are known. Zero is fine.
+    struct SendEstimate {
+        std::uint64_t files = 0;
+        std::uint64_t size = 0;
+    };
+
+    // Integrity check of the files of a stream archive send, verified by the receiver after each
+    // file. XXH3Tree hashes 1 MiB blocks and then their hashes, so blocks can be checked alone.
+    enum class Checksum {
+        None,
+        XXH3,
+        XXH3Tree
+    };
+
+    // Tuning of the reliable UDP send, see SendRequest::setReliableUdp.
+    struct ReliableUdpOptions {
+        unsigned window = 1024; // segments of up to 1364 bytes in flight, 32 to 8192
+        std::uint64_t pacingRate = 0; // bytes per second, 0 does not pace
+        unsigned fecGroup = 0; // datagrams per XOR parity datagram, each group survives one loss; 0 is off, at most 64
+    };
+
+    // Lazily walks the regular files below root, relative paths are taken from root.
+    fileGenerator walkDirectory(const std::filesystem::path &root);
+
+    struct Address {
+        std::string host; // IPv4 or IPv6 literal
+        unsigned short port;
+    };
+
+    // Measures the link to a receiver in about budget, short bursts both ways. Results are
+    // cached per address for 10 minutes, refresh measures anyway. Empty when the receiver is
+    // unreachable or has no /probe.
+    std::optional<LinkProbe> probe(const Address &address, const std::chrono::milliseconds &budget = std::chrono::milliseconds(1000),
+                                   bool refresh = false);
+
     class SendRequest {
     public:
         SendRequest();
@@ -127,9 +365,64 @@ private: \
         [[maybe_unused]] [[nodiscard]] std::string getReceiverId() const;
         SendRequest &setReceiverId(const std::string &id);
 
+        // Known receiver addresses skip mDNS entirely; several candidates are raced
+        // within the resolve timeout. The receiver id is optional then.
+        [[maybe_unused]] [[nodiscard]] std::vector<Address> getReceiverAddresses() const;
+        SendRequest &setReceiverAddress(const Address &address);
+        SendRequest &setReceiverAddresses(const std::vector<Address> &addresses);
+
         [[maybe_unused]] [[nodiscard]] std::vector<File *> getFiles() const;
         SendRequest& setFiles(const std::vector<File *>& files);
 
+        // Pipelined send: the first files go out while the generator is still enumerating.
+        // Needs a receiver announcing the stream archive capability; otherwise, and when the
+        // receiver is given only by address, the generator is drained before the ask. Takes
+        // precedence over setFiles.
+        [[maybe_unused]] [[nodiscard]] fileGenerator getFileGenerator() const;
+        SendRequest &setFileGenerator(const fileGenerator &generator);
+
+        [[maybe_unused]] [[nodiscard]] SendEstimate getEstimate() const;
+        SendRequest &setEstimate(const SendEstimate &estimate);
+
+        // Default XXH3. Used only with receivers announcing the checksum capability.
+        [[maybe_unused]] [[nodiscard]] Checksum getChecksum() const;
+        SendRequest &setChecksum(Checksum checksum);
+
+        // Off by default. Agrees on a key with the receiver in the ask (X25519) and seals the
+        // files with ChaCha20-Poly1305. Only eavesdroppers are kept out, the receiver is not
+        // authenticated. A receiver that cannot encrypt gets nothing and execute fails.
+        [[maybe_unused]] [[nodiscard]] bool isEncrypted() const;
+        SendRequest &setEncrypted(bool encrypted);
+
+        // Off by default. Runs the files over KCP, a reliable UDP protocol that keeps its rate
+        // under loss where TCP backs off, when the receiver offers it in the ask answer. Stream
+        // archive sends only; TCP is used otherwise and when the receiver does not answer on UDP.
+        [[maybe_unused]] [[nodiscard]] std::optional<ReliableUdpOptions> getReliableUdp() const;
+        SendRequest &setReliableUdp(const std::optional<ReliableUdpOptions> &options);
+
+        // Off by default. Asks the receiver to pair in the ask, kept only when it answers with the
+        // receiver id the send is meant for; once paired, sends to it skip the
+        // ask and its events and start right away with proof of the pairing, sealed whether or
+        // not encryption is set. That needs the receiver id and a list of positional files, not
+        // a generator nor reliable UDP; such sends ask as before. A receiver that no longer
+        // knows the pairing refuses the send, which is then asked for again.
+        [[maybe_unused]] [[nodiscard]] bool isPairing() const;
+        SendRequest &setPairing(bool pairing);
+
+        // Applied to the connections of the ask and the send. Unset keeps curl's and the
+        // system's defaults. A connection kept open from an earlier send is reused as it is.
+        [[maybe_unused]] [[nodiscard]] std::optional<TransportOptions> getTransportOptions() const;
+        SendRequest &setTransportOptions(const std::optional<TransportOptions> &options);
+
+        // Probes the receiver before the ask, or takes the cached probe, and sizes the transport
+        // options of the preset from the measured RTT and upload rate. Explicit transport options
+        // take precedence. Unset by default.
+        [[maybe_unused]] [[nodiscard]] std::optional<TransportPreset> getTransportPreset() const;
+        SendRequest &setTransportPreset(const std::optional<TransportPreset> &preset);
+
+        [[maybe_unused]] [[nodiscard]] ProgressOptions getProgressOptions() const;
+        SendRequest &setProgressOptions(const ProgressOptions &options);
+
         [[maybe_unused]] [[nodiscard]] std::chrono::milliseconds getResolveTimeout() const;
         SendRequest &setResolveTimeout(const std::chrono::milliseconds &timeout);
 
@@ -144,7 +437,7 @@ private: \
         FLOWDROP_PRIVATE
     };
 
-    class NativeFile : public File {
+    class NativeFile : public PositionalFile {
     public:
         NativeFile(const std::filesystem::path& filePath, std::string relativePath);
         ~NativeFile() override;
@@ -155,6 +448,47 @@ private: \
         [[nodiscard]] std::filesystem::perms getPermissions() const override;
         void seek(std::uint64_t pos) override;
         std::uint64_t read(char *buffer, std::uint64_t count) override;
+        std::uint64_t readAt(std::uint64_t offset, char *buffer, std::uint64_t count) const override;
+        [[nodiscard]] int nativeHandle() const override;
+
+        FLOWDROP_PRIVATE
+    };
+
+    // Sends memory the caller already has, e.g. generated content, without a temp file.
+    // The span overload does not copy nor own: the memory must stay valid and unchanged until
+    // the send completes. The shared overload keeps the owner alive instead.
+    class MemoryFile : public PositionalFile {
+    public:
+        MemoryFile(std::string relativePath, const void *data, std::size_t size);
+        MemoryFile(std::string relativePath, std::shared_ptr<const void> owner, const void *data, std::size_t size);
+        ~MemoryFile() override;
+        [[nodiscard]] std::string getRelativePath() const override;
+        [[nodiscard]] std::uint64_t getSize() const override;
+        [[nodiscard]] std::uint64_t getCreatedTime() const override; // time of construction
+        [[nodiscard]] std::uint64_t getModifiedTime() const override;
+        [[nodiscard]] std::filesystem::perms getPermissions() const override; // rw-r--r--
+        void seek(std::uint64_t pos) override;
+        std::uint64_t read(char *buffer, std::uint64_t count) override;
+        std::uint64_t readAt(std::uint64_t offset, char *buffer, std::uint64_t count) const override;
+
+        FLOWDROP_PRIVATE
+    };
+
+    // Maps the file read-only with sequential read-ahead advice. The file must not be
+    // truncated while it is being sent.
+    class MappedFile : public PositionalFile {
+    public:
+        MappedFile(const std::filesystem::path &filePath, std::string relativePath);
+        ~MappedFile() override;
+        [[nodiscard]] std::string getRelativePath() const override;
+        [[nodiscard]] std::uint64_t getSize() const override;
+        [[nodiscard]] std::uint64_t getCreatedTime() const override;
+        [[nodiscard]] std::uint64_t getModifiedTime() const override;
+        [[nodiscard]] std::filesystem::perms getPermissions() const override;
+        void seek(std::uint64_t pos) override;
+        std::uint64_t read(char *buffer, std::uint64_t count) override;
+        std::uint64_t readAt(std::uint64_t offset, char *buffer, std::uint64_t count) const override;
+        [[nodiscard]] int nativeHandle() const override;
 
         FLOWDROP_PRIVATE
     };
@@ -0,0 +1,337 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+
+#include "archive_extractor.hpp"
+#include "logger.h"
+#include "os/file_io.h"
+#include <condition_variable>
+#include <mutex>
+#include <utility>
+
+// Data of a file is handed to the pool in batches of this size, small files in one piece.
+static const std::size_t dispatchSize = 256 * 1024;
+// per session, the IO thread waits for the writers beyond this
+static const std::uint64_t maxInFlightBytes = 32 * 1024 * 1024;
+// a flow controlled session is fed again below this
+static const std::uint64_t resumeInFlightBytes = maxInFlightBytes / 2;
+
+namespace archive {
+
+    std::optional<std::filesystem::path> safePath(const std::filesystem::path &destDir, const std::string &name) {
+        if (name.empty() || name.front() == '/' || name.front() == '\\') {
+            return std::nullopt;
+        }
+        std::filesystem::path path = destDir;
+        std::size_t start = 0;
+        while (start <= name.size()) {
+            std::size_t end = name.find_first_of("/\\", start);
+            if (end == std::string::npos) {
+                end = name.size();
+            }
+            std::string component = name.substr(start, end - start);
+            start = end + 1;
+            if (component.empty() || component == ".") {
+                continue;
+            }
+            if (component == "..") {
+                return std::nullopt;
+            }
+#if defined(WIN32)
+            if (component.find(':') != std::string::npos) {
+                return std::nullopt;
+            }
+#endif
+            path /= std::filesystem::u8path(component);
+        }
+        if (path == destDir) {
+            return std::nullopt;
+        }
+        return path;
+    }
+
+    struct Extractor::Entry {
+        std::filesystem::path path;
+        std::uint32_t mode = 0;
+        std::uint64_t mtime = 0;
+        flowdrop::FileInfo fileInfo;
+        EntryHasher hasher;
+        std::uint64_t checksum = 0; // expected, set before the last write
+        int fd = -1;
+        bool failed = false;
+    };
+
+    // shared with the pool tasks of one extractor
+    struct Extractor::State {
+        std::mutex mutex;
+        std::condition_variable changed;
+        std::uint64_t inFlightBytes = 0;
+        std::size_t pendingTasks = 0;
+        std::vector<flowdrop::FileInfo> written; // finished since last reported
+        bool failed = false;
+        std::function<void()> resume; // of a paused caller, once drained
+        std::function<void()> finished; // once no task is pending
+    };
+
+    Extractor::Extractor(std::filesystem::path destDir, flowdrop::DeviceInfo sender, flowdrop::IEventListener *listener,
+                         std::uint64_t totalSize, WriterPool *pool, const flowdrop::ProgressOptions &progress) :
+            _destDir(std::move(destDir)), _sender(std::move(sender)), _listener(listener), _progress(progress), _totalSize(totalSize),
+            _pool(pool), _state(std::make_shared<State>()) {}
+
+    Extractor::~Extractor() {
+        if (_entry != nullptr) {
+            if (_pool == nullptr) {
+                discardEntry(*_entry);
+            } else {
+                std::shared_ptr<Entry> entry = _entry;
+                std::lock_guard<std::mutex> lock(_state->mutex);
+                ++_state->pendingTasks;
+                _pool->submit(std::filesystem::hash_value(entry->path), [state = _state, entry]() {
+                    discardEntry(*entry);
+                    std::lock_guard<std::mutex> lock(state->mutex);
+                    --state->pendingTasks;
+                    state->changed.notify_all();
+                });
+            }
+        }
+        std::unique_lock<std::mutex> lock(_state->mutex);
+        _state->changed.wait(lock, [this] {
+            return _state->pendingTasks == 0;
+        });
+    }
+
+    const std::vector<flowdrop::FileInfo> &Extractor::receivedFiles() const {
+        return _receivedFiles;
+    }
+
+    std::uint64_t Extractor::receivedBytes() const {
+        return _receivedBytes;
+    }
+
+    bool Extractor::writeEntry(Entry &entry, const char *data, std::size_t size, bool last) {
+        if (entry.failed) {
+            return false;
+        }
+        if (entry.fd < 0) {
+            entry.fd = knotdrop_file_create(entry.path, entry.mode);
+            if (entry.fd < 0) {
+                LOG_ERROR("unable to create file" << Logger::kv("path", entry.path.u8string()));
+                entry.failed = true;
+                return false;
+            }
+        }
+        if (size > 0 && knotdrop_file_write(entry.fd, data, size) != 0) {
+            LOG_ERROR("unable to write file" << Logger::kv("path", entry.path.u8string()));
+            discardEntry(entry);
+            entry.failed = true;
+            return false;
+        }
+        if (size > 0) {
+            entry.hasher.update(data, size);
+        }
+        if (last && entry.hasher.digest() != entry.checksum) {
+            LOG_ERROR("checksum mismatch" << Logger::kv("path", entry.path.u8string()));
+            discardEntry(entry);
+            entry.failed = true;
+            return false;
+        }
+        if (last) {
+            knotdrop_file_set_mtime(entry.fd, entry.mtime);
+            knotdrop_file_close(entry.fd);
+            entry.fd = -1;
+        }
+        return true;
+    }
+
+    void Extractor::discardEntry(Entry &entry) {
+        if (entry.fd < 0) {
+            return;
+        }
+        knotdrop_file_close(entry.fd);
+        entry.fd = -1;
+        std::error_code ec;
+        std::filesystem::remove(entry.path, ec);
+    }
+
+    void Extractor::dispatch(bool last) {
+        std::shared_ptr<State> state = _state;
+        std::uint64_t bytes = _buffer.size();
+        {
+            std::unique_lock<std::mutex> lock(state->mutex);
+            if (!_flowControl) {
+                state->changed.wait(lock, [&state] {
+                    return state->inFlightBytes < maxInFlightBytes;
+                });
+            }
+            state->inFlightBytes += bytes;
+            ++state->pendingTasks;
+        }
+        _pool->submit(std::filesystem::hash_value(_entry->path), [state, entry = _entry, buffer = std::move(_buffer), last]() {
+            bool ok = writeEntry(*entry, buffer.data(), buffer.size(), last);
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->inFlightBytes -= buffer.size();
+            --state->pendingTasks;
+            if (!ok) {
+                state->failed = true;
+            } else if (last) {
+                state->written.push_back(entry->fileInfo);
+            }
+            // called under the lock, before the extractor can see the task gone and be destroyed
+            if (state->resume && state->inFlightBytes <= resumeInFlightBytes) {
+                std::exchange(state->resume, nullptr)();
+            }
+            if (state->finished && state->pendingTasks == 0) {
+                std::exchange(state->finished, nullptr)();
+            }
+            state->changed.notify_all();
+        });
+        _buffer = std::string();
+    }
+
+    bool Extractor::writeFailed() {
+        std::lock_guard<std::mutex> lock(_state->mutex);
+        return _state->failed;
+    }
+
+    void Extractor::reportWritten() {
+        std::vector<flowdrop::FileInfo> written;
+        {
+            std::lock_guard<std::mutex> lock(_state->mutex);
+            written.swap(_state->written);
+        }
+        if (_listener != nullptr) {
+            for (const flowdrop::FileInfo &fileInfo: written) {
+                _listener->onReceivingFileEnd(_sender, fileInfo);
+            }
+        }
+    }
+
+    bool Extractor::begin(const EntryHeader &header) {
+        if (_pool != nullptr) {
+            reportWritten();
+            if (writeFailed()) {
+                return false;
+            }
+        }
+        std::optional<std::filesystem::path> path = safePath(_destDir, header.name);
+        if (!path.has_value()) {
+            LOG_ERROR("unsafe entry name" << Logger::kv("name", header.name));
+            return false;
+        }
+        _entry = std::make_shared<Entry>();
+        _entry->path = std::move(path.value());
+        _entry->mode = header.mode;
+        _entry->mtime = header.mtime;
+        _entry->hasher = EntryHasher(header.checksumType);
+        _entry->fileInfo = {header.name, header.size.value_or(flowdrop::unknownFileSize)};
+        std::filesystem::path dir = _entry->path.parent_path();
+        if (dir != _lastDir) {
+            std::error_code ec;
+            std::filesystem::create_directories(dir, ec);
+            if (ec) {
+                LOG_ERROR("unable to create directory" << Logger::kv("path", dir.u8string()) << Logger::kv("error", ec.message()));
+                return false;
+            }
+            _lastDir = dir;
+        }
+        // without a pool the file is created right away, with one together with its first data
+        if (_pool == nullptr && !writeEntry(*_entry, nullptr, 0, false)) {
+            return false;
+        }
+        _entryBytes = 0;
+        if (_listener != nullptr) {
+            _listener->onReceivingFileStart(_sender, _entry->fileInfo);
+        }
+        return true;
+    }
+
+    bool Extractor::data(const char *data, std::size_t size) {
+        if (_pool == nullptr) {
+            if (!writeEntry(*_entry, data, size, false)) {
+                return false;
+            }
+        } else {
+            _buffer.append(data, size);
+            if (_buffer.size() >= dispatchSize) {
+                dispatch(false);
+                if (writeFailed()) {
+                    return false;
+                }
+            }
+        }
+        _entryBytes += size;
+        _receivedBytes += size;
+        if (_listener != nullptr && _progress.due(_receivedBytes)) {
+            _listener->onReceivingFileProgress(_sender, _entry->fileInfo, _entryBytes);
+            _listener->onReceivingTotalProgress(_sender, _totalSize, _receivedBytes);
+        }
+        return true;
+    }
+
+    bool Extractor::end(const EntryHeader &/*header*/, const EntryTrailer &trailer) {
+        _entry->fileInfo.size = trailer.size;
+        _entry->checksum = trailer.checksum;
+        _receivedFiles.push_back(_entry->fileInfo);
+        if (_listener != nullptr && _progress.flush()) {
+            _listener->onReceivingFileProgress(_sender, _entry->fileInfo, _entryBytes);
+            _listener->onReceivingTotalProgress(_sender, _totalSize, _receivedBytes);
+        }
+        if (_pool != nullptr) {
+            dispatch(true);
+            _entry = nullptr;
+            return !writeFailed();
+        }
+        bool ok = writeEntry(*_entry, nullptr, 0, true);
+        if (ok && _listener != nullptr) {
+            _listener->onReceivingFileEnd(_sender, _entry->fileInfo);
+        }
+        _entry = nullptr;
+        return ok;
+    }
+
+    void Extractor::setFlowControl(bool enabled) {
+        _flowControl = enabled;
+    }
+
+    bool Extractor::pauseUntilDrained(std::function<void()> resume) {
+        std::lock_guard<std::mutex> lock(_state->mutex);
+        if (_state->inFlightBytes < maxInFlightBytes) {
+            return false;
+        }
+        _state->resume = std::move(resume);
+        return true;
+    }
+
+    bool Extractor::drained() const {
+        std::lock_guard<std::mutex> lock(_state->mutex);
+        return _state->inFlightBytes <= resumeInFlightBytes;
+    }
+
+    void Extractor::whenWritten(std::function<void()> done) {
+        {
+            std::lock_guard<std::mutex> lock(_state->mutex);
+            if (_state->pendingTasks != 0) {
+                _state->finished = std::move(done);
+                return;
+            }
+        }
+        done();
+    }
+
+    bool Extractor::finish() {
+        bool failed;
+        {
+            std::unique_lock<std::mutex> lock(_state->mutex);
+            _state->changed.wait(lock, [this] {
+                return _state->pendingTasks == 0;
+            });
+            failed = _state->failed;
+        }
+        reportWritten();
+        return !failed;
+    }
+
+} // namespace archive
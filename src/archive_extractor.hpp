@@ -0,0 +1,79 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+#pragma once
+
+#include "flowdrop/flowdrop.hpp"
+#include "stream_archive.hpp"
+#include "writer_pool.hpp"
+
+namespace archive {
+
+    // Destination of an entry name below destDir; empty when the name is absolute or would
+    // leave destDir. Both '/' and '\' separate components.
+    std::optional<std::filesystem::path> safePath(const std::filesystem::path &destDir, const std::string &name);
+
+    // Writes stream archive entries below the destination directory and reports progress.
+    // Names are checked and directories created on the calling thread. With a pool the file
+    // writes are handed to it, keyed by path: data is batched per file, and a session keeps at
+    // most a bounded amount of it in flight before the caller waits. A flow controlled caller
+    // never waits, it stops feeding while pauseUntilDrained() and goes on when told. Without a
+    // pool everything is written on the calling thread.
+    // Entries with a checksum are hashed as they are written and verified after their last
+    // write; a file that does not match is removed and fails the session.
+    // A file that is still incomplete when the extractor is destroyed is removed.
+    class Extractor : public EntryHandler {
+    public:
+        Extractor(std::filesystem::path destDir, flowdrop::DeviceInfo sender, flowdrop::IEventListener *listener,
+                  std::uint64_t totalSize, WriterPool *pool = nullptr, const flowdrop::ProgressOptions &progress = {});
+        ~Extractor() override;
+
+        bool begin(const EntryHeader &header) override;
+        bool data(const char *data, std::size_t size) override;
+        bool end(const EntryHeader &header, const EntryTrailer &trailer) override;
+
+        // waits for the pending writes, false if any of them failed
+        bool finish();
+        // done is called once the pending writes are over: right away without any, otherwise on a
+        // pool thread, where it must not block. finish() then returns without waiting.
+        void whenWritten(std::function<void()> done);
+
+        void setFlowControl(bool enabled);
+        // False unless congested; then resume is called on a pool thread once the writes drained,
+        // it must not block.
+        bool pauseUntilDrained(std::function<void()> resume);
+        [[nodiscard]] bool drained() const;
+
+        [[nodiscard]] const std::vector<flowdrop::FileInfo> &receivedFiles() const;
+        [[nodiscard]] std::uint64_t receivedBytes() const;
+
+    private:
+        struct Entry;
+        struct State;
+
+        static bool writeEntry(Entry &entry, const char *data, std::size_t size, bool last);
+        static void discardEntry(Entry &entry);
+        void dispatch(bool last);
+        bool writeFailed();
+        void reportWritten();
+
+        std::filesystem::path _destDir;
+        flowdrop::DeviceInfo _sender;
+        flowdrop::IEventListener *_listener;
+        ProgressThrottle _progress; // over the received bytes, file and total progress go together
+        std::uint64_t _totalSize;
+        WriterPool *_pool;
+        bool _flowControl = false;
+        std::shared_ptr<State> _state;
+        std::filesystem::path _lastDir;
+        std::shared_ptr<Entry> _entry;
+        std::string _buffer;
+        std::uint64_t _entryBytes = 0;
+        std::uint64_t _receivedBytes = 0;
+        std::vector<flowdrop::FileInfo> _receivedFiles;
+    };
+
+} // namespace archive
@@ -0,0 +1,237 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+
+#include "ask_manifest.hpp"
+#include "core.h"
+#include "specification.h"
+#include "varint.hpp"
+#include <algorithm>
+#include <cstring>
+
+static const std::uint64_t maxSenderLength = 64 * 1024;
+static const std::uint64_t maxPathLength = 64 * 1024;
+static const std::size_t encodeBatch = 256; // files per refill of the pending buffer
+
+static std::size_t sharedPrefix(const std::string &a, const std::string &b) {
+    std::size_t limit = std::min(a.size(), b.size());
+    std::size_t i = 0;
+    while (i < limit && a[i] == b[i]) {
+        ++i;
+    }
+    return i;
+}
+
+namespace manifest {
+
+    Encoder::Encoder(const flowdrop::DeviceInfo &sender, const std::vector<flowdrop::FileInfo> &files) : _files(files) {
+        std::string senderJson = json(sender).dump();
+        std::uint64_t totalSize = 0;
+        for (const flowdrop::FileInfo &file: files) {
+            totalSize += file.size;
+        }
+        _header.append(flowdrop_ask_manifest_magic, sizeof(flowdrop_ask_manifest_magic));
+        varint::put(_header, senderJson.size());
+        _header += senderJson;
+        varint::put(_header, files.size());
+        varint::put(_header, totalSize);
+
+        _size = _header.size();
+        const std::string *previous = nullptr;
+        for (const flowdrop::FileInfo &file: files) {
+            std::size_t shared = previous != nullptr ? sharedPrefix(*previous, file.name) : 0;
+            std::size_t suffix = file.name.size() - shared;
+            _size += varint::size(shared) + varint::size(suffix) + suffix + varint::size(file.size);
+            previous = &file.name;
+        }
+    }
+
+    std::uint64_t Encoder::size() const {
+        return _size;
+    }
+
+    std::size_t Encoder::read(char *buffer, std::size_t count) {
+        std::size_t written = 0;
+        while (written < count) {
+            if (_pendingPos == _pending.size()) {
+                _pending.clear();
+                _pendingPos = 0;
+                encodeNext();
+                if (_pending.empty()) {
+                    break;
+                }
+            }
+            std::size_t n = std::min(count - written, _pending.size() - _pendingPos);
+            std::memcpy(buffer + written, _pending.data() + _pendingPos, n);
+            _pendingPos += n;
+            written += n;
+        }
+        return written;
+    }
+
+    void Encoder::encodeNext() {
+        if (!_headerDone) {
+            _headerDone = true;
+            _pending.swap(_header);
+            return;
+        }
+        std::size_t end = std::min(_next + encodeBatch, _files.size());
+        for (; _next < end; ++_next) {
+            const std::string &name = _files[_next].name;
+            std::size_t shared = _next > 0 ? sharedPrefix(_files[_next - 1].name, name) : 0;
+            varint::put(_pending, shared);
+            varint::put(_pending, name.size() - shared);
+            _pending.append(name, shared, std::string::npos);
+            varint::put(_pending, _files[_next].size);
+        }
+    }
+
+    Decoder::Decoder(headerCallback onHeader, fileCallback onFile) :
+            _onHeader(std::move(onHeader)), _onFile(std::move(onFile)) {}
+
+    bool Decoder::done() const {
+        return _state == DONE;
+    }
+
+    const std::string &Decoder::error() const {
+        return _error;
+    }
+
+    bool Decoder::fail(const std::string &error) {
+        _state = FAILED;
+        _error = error;
+        return false;
+    }
+
+    bool Decoder::feed(const char *data, std::size_t size) {
+        std::size_t pos = 0;
+        while (pos < size) {
+            switch (_state) {
+                case MAGIC: {
+                    std::size_t n = std::min(size - pos, sizeof(flowdrop_ask_manifest_magic) - _buffer.size());
+                    _buffer.append(data + pos, n);
+                    pos += n;
+                    if (_buffer.size() == sizeof(flowdrop_ask_manifest_magic)) {
+                        if (std::memcmp(_buffer.data(), flowdrop_ask_manifest_magic, sizeof(flowdrop_ask_manifest_magic)) != 0) {
+                            return fail("bad magic");
+                        }
+                        _buffer.clear();
+                        _state = SENDER_LENGTH;
+                    }
+                    break;
+                }
+                case SENDER:
+                case SUFFIX: {
+                    std::size_t n = static_cast<std::size_t>(std::min<std::uint64_t>(size - pos, _remaining));
+                    _buffer.append(data + pos, n);
+                    pos += n;
+                    _remaining -= n;
+                    if (_remaining == 0 && !fieldComplete()) {
+                        return false;
+                    }
+                    break;
+                }
+                case DONE:
+                    return fail("trailing data");
+                case FAILED:
+                    return false;
+                default:
+                    if (!varintByte(static_cast<unsigned char>(data[pos++]))) {
+                        return false;
+                    }
+                    break;
+            }
+        }
+        return _state != FAILED;
+    }
+
+    bool Decoder::varintByte(unsigned char byte) {
+        if (_varintShift >= 64 || (_varintShift == 63 && (byte & 0x7E) != 0)) {
+            return fail("varint overflow");
+        }
+        _varint |= static_cast<std::uint64_t>(byte & 0x7F) << _varintShift;
+        _varintShift += 7;
+        if ((byte & 0x80) != 0) {
+            return true;
+        }
+        bool result = fieldComplete();
+        _varint = 0;
+        _varintShift = 0;
+        return result;
+    }
+
+    bool Decoder::fieldComplete() {
+        switch (_state) {
+            case SENDER_LENGTH:
+                if (_varint == 0 || _varint > maxSenderLength) {
+                    return fail("bad sender length");
+                }
+                _remaining = _varint;
+                _state = SENDER;
+                return true;
+            case SENDER:
+                try {
+                    _sender = json::parse(_buffer);
+                } catch (const std::exception &e) {
+                    return fail(std::string("bad sender: ") + e.what());
+                }
+                _buffer.clear();
+                _state = TOTAL_FILES;
+                return true;
+            case TOTAL_FILES:
+                _totalFiles = _varint;
+                _state = TOTAL_SIZE;
+                return true;
+            case TOTAL_SIZE:
+                _totalSize = _varint;
+                if (!_onHeader(_sender, _totalFiles, _totalSize)) {
+                    return fail("rejected");
+                }
+                _state = _totalFiles == 0 ? DONE : SHARED;
+                return true;
+            case SHARED:
+                if (_varint > _path.size()) {
+                    return fail("bad shared prefix");
+                }
+                _path.resize(static_cast<std::size_t>(_varint));
+                _state = SUFFIX_LENGTH;
+                return true;
+            case SUFFIX_LENGTH:
+                if (_path.size() + _varint == 0 || _path.size() + _varint > maxPathLength) {
+                    return fail("bad path length");
+                }
+                _remaining = _varint;
+                _state = _remaining == 0 ? SIZE : SUFFIX;
+                return true;
+            case SUFFIX:
+                _path += _buffer;
+                _buffer.clear();
+                _state = SIZE;
+                return true;
+            case SIZE: {
+                if (_varint > _totalSize - _size) {
+                    return fail("sizes exceed total");
+                }
+                _size += _varint;
+                if (!_onFile({_path, _varint})) {
+                    return fail("rejected");
+                }
+                if (++_files < _totalFiles) {
+                    _state = SHARED;
+                    return true;
+                }
+                if (_size != _totalSize) {
+                    return fail("sizes do not match total");
+                }
+                _state = DONE;
+                return true;
+            }
+            default:
+                return fail("unexpected state");
+        }
+    }
+
+} // namespace manifest
@@ -0,0 +1,89 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+#pragma once
+
+#include "flowdrop/flowdrop.hpp"
+#include <cstdint>
+#include <string>
+
+// Binary ask body, sent as flowdrop_ask_manifest_content_type:
+//   magic "FDM1"
+//   varint length, sender device info as JSON
+//   varint file count, varint total size
+//   per file: varint bytes shared with the previous path, varint suffix length, suffix, varint size
+// Varints are unsigned LEB128. Sorted paths compress to a few bytes each.
+namespace manifest {
+
+    // Produces the body piece by piece, so it can be handed to curl as a read function.
+    class Encoder {
+    public:
+        Encoder(const flowdrop::DeviceInfo &sender, const std::vector<flowdrop::FileInfo> &files);
+
+        [[nodiscard]] std::uint64_t size() const;
+        std::size_t read(char *buffer, std::size_t count); // 0 at the end
+
+    private:
+        void encodeNext();
+
+        const std::vector<flowdrop::FileInfo> &_files;
+        std::string _header;
+        std::uint64_t _size = 0;
+        std::size_t _next = 0;
+        std::string _pending;
+        std::size_t _pendingPos = 0;
+        bool _headerDone = false;
+    };
+
+    // Push parser, memory use does not depend on the number of files.
+    class Decoder {
+    public:
+        // returning false aborts decoding
+        using headerCallback = std::function<bool(const flowdrop::DeviceInfo &sender, std::uint64_t totalFiles, std::uint64_t totalSize)>;
+        using fileCallback = std::function<bool(const flowdrop::FileInfo &fileInfo)>;
+
+        Decoder(headerCallback onHeader, fileCallback onFile);
+
+        bool feed(const char *data, std::size_t size); // false once the input is invalid or aborted
+        [[nodiscard]] bool done() const;
+        [[nodiscard]] const std::string &error() const;
+
+    private:
+        enum State {
+            MAGIC,
+            SENDER_LENGTH,
+            SENDER,
+            TOTAL_FILES,
+            TOTAL_SIZE,
+            SHARED,
+            SUFFIX_LENGTH,
+            SUFFIX,
+            SIZE,
+            DONE,
+            FAILED
+        };
+
+        bool fail(const std::string &error);
+        bool varintByte(unsigned char byte);
+        bool fieldComplete();
+
+        headerCallback _onHeader;
+        fileCallback _onFile;
+        State _state = MAGIC;
+        std::string _error;
+        std::uint64_t _varint = 0;
+        unsigned _varintShift = 0;
+        std::uint64_t _remaining = 0; // bytes left in a string field
+        std::string _buffer;
+        std::string _path;
+        flowdrop::DeviceInfo _sender;
+        std::uint64_t _totalFiles = 0;
+        std::uint64_t _totalSize = 0;
+        std::uint64_t _files = 0;
+        std::uint64_t _size = 0;
+    };
+
+} // namespace manifest
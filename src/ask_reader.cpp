@@ -0,0 +1,853 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+
+#include "ask_reader.hpp"
+#include "core.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <fstream>
+#include <random>
+#include <sstream>
+
+static const std::size_t spoolMemoryLimit = 1024 * 1024; // 1 MiB, larger asks go to a temp file
+static const std::size_t spoolReadBuffer = 64 * 1024;
+static const int maxJsonDepth = 16;
+
+// SAX handler for {"sender": {...}, "files": [{"name": "...", "size": 1}, ...]}, plus
+// "estimated", "total_files" and "total_size" of a pipelined send. Unknown keys are skipped;
+// the file list is never materialized.
+class AskSax : public nlohmann::json_sax<json> {
+public:
+    using senderCallback = std::function<void(const flowdrop::DeviceInfo &)>;
+
+    AskSax(senderCallback onSender, flowdrop::fileVisitor onFile) : _onSender(std::move(onSender)), _onFile(std::move(onFile)) {}
+
+    bool null() override {
+        return true;
+    }
+
+    bool boolean(bool value) override {
+        if (_depth == 1 && _key == "estimated") {
+            _estimated = value;
+        }
+        return true;
+    }
+
+    bool number_integer(number_integer_t value) override {
+        if (value < 0 && inFile() && _key == "size") {
+            return fail("negative file size");
+        }
+        return number_unsigned(static_cast<number_unsigned_t>(value));
+    }
+
+    bool number_unsigned(number_unsigned_t value) override {
+        if (inFile() && _key == "size") {
+            _file.size = value;
+            _hasSize = true;
+        } else if (_depth == 1 && _key == "total_files") {
+            _totalFiles = value;
+        } else if (_depth == 1 && _key == "total_size") {
+            _totalSize = value;
+        }
+        return true;
+    }
+
+    bool number_float(number_float_t, const string_t &) override {
+        if (inFile() && _key == "size") {
+            return fail("fractional file size");
+        }
+        return true;
+    }
+
+    bool string(string_t &value) override {
+        if (inFile() && _key == "name") {
+            _file.name = std::move(value);
+            _hasName = true;
+        } else if (_depth == 2 && _section == SENDER) {
+            if (_key == "id") _sender.id = std::move(value);
+            else if (value.empty()) return true;
+            else if (_key == "name") _sender.name = std::move(value);
+            else if (_key == "model") _sender.model = std::move(value);
+            else if (_key == "platform") _sender.platform = std::move(value);
+            else if (_key == "system_version") _sender.system_version = std::move(value);
+        }
+        return true;
+    }
+
+    bool binary(binary_t &) override {
+        return true;
+    }
+
+    bool start_object(std::size_t) override {
+        if (++_depth > maxJsonDepth) {
+            return fail("ask nested too deep");
+        }
+        if (_depth == 2 && _key == "sender") {
+            _section = SENDER;
+            _hasSender = true;
+        } else if (_depth == 3 && _section == FILES) {
+            _file = {};
+            _hasName = false;
+            _hasSize = false;
+        }
+        return true;
+    }
+
+    bool key(string_t &value) override {
+        _key = std::move(value);
+        return true;
+    }
+
+    bool end_object() override {
+        if (inFile()) {
+            if (!_hasName || !_hasSize) {
+                return fail("file without name or size");
+            }
+            if (!_onFile(_file)) {
+                return false;
+            }
+        } else if (_depth == 2 && _section == SENDER) {
+            if (_onSender != nullptr) {
+                _onSender(_sender);
+            }
+            _section = NONE;
+        }
+        --_depth;
+        _key.clear();
+        return true;
+    }
+
+    bool start_array(std::size_t) override {
+        if (++_depth > maxJsonDepth) {
+            return fail("ask nested too deep");
+        }
+        if (_depth == 2 && _key == "files") {
+            _section = FILES;
+            _hasFiles = true;
+        }
+        return true;
+    }
+
+    bool end_array() override {
+        if (_depth == 2 && _section == FILES) {
+            _section = NONE;
+        }
+        --_depth;
+        _key.clear();
+        return true;
+    }
+
+    bool parse_error(std::size_t position, const std::string &, const nlohmann::detail::exception &e) override {
+        return fail(e.what());
+    }
+
+    [[nodiscard]] bool complete() const {
+        return _hasSender && _hasFiles && !_sender.id.empty();
+    }
+
+    [[nodiscard]] const std::string &error() const {
+        return _error;
+    }
+
+    // the totals are only trusted from an estimated ask, otherwise they are counted from files
+    [[nodiscard]] bool estimated() const {
+        return _estimated;
+    }
+
+    [[nodiscard]] std::uint64_t totalFiles() const {
+        return _totalFiles;
+    }
+
+    [[nodiscard]] std::uint64_t totalSize() const {
+        return _totalSize;
+    }
+
+private:
+    enum Section {
+        NONE,
+        SENDER,
+        FILES
+    };
+
+    [[nodiscard]] bool inFile() const {
+        return _depth == 3 && _section == FILES;
+    }
+
+    bool fail(const std::string &error) {
+        _error = error;
+        return false;
+    }
+
+    senderCallback _onSender;
+    flowdrop::fileVisitor _onFile;
+    int _depth = 0;
+    Section _section = NONE;
+    std::string _key;
+    flowdrop::DeviceInfo _sender;
+    flowdrop::FileInfo _file;
+    bool _hasName = false;
+    bool _hasSize = false;
+    bool _hasSender = false;
+    bool _hasFiles = false;
+    bool _estimated = false;
+    std::uint64_t _totalFiles = 0;
+    std::uint64_t _totalSize = 0;
+    std::string _error;
+};
+
+// Push JSON parser feeding a SAX handler chunk by chunk, so an ask is checked while it arrives
+// instead of once it is spooled. Strict RFC 8259 like nlohmann's own; a string or number longer
+// than maxToken bytes is refused as too large before it is buffered.
+class JsonFeeder {
+public:
+    JsonFeeder(nlohmann::json_sax<json> &sax, std::size_t maxToken) : _sax(sax), _maxToken(maxToken) {}
+
+    bool feed(const char *data, std::size_t size) {
+        for (std::size_t i = 0; i < size && !_failed; ++i, ++_position) {
+            consume(static_cast<unsigned char>(data[i]));
+        }
+        return !_failed;
+    }
+
+    bool finish() {
+        if (!_failed && (_token == NUMBER || _token == LITERAL)) {
+            endToken();
+        }
+        if (!_failed && (_token != NONE || _expect != DONE)) {
+            syntaxError("unexpected end of input");
+        }
+        return !_failed;
+    }
+
+    [[nodiscard]] bool tooLarge() const {
+        return _tooLarge;
+    }
+
+    // empty when the handler refused, it has the reason then
+    [[nodiscard]] const std::string &error() const {
+        return _error;
+    }
+
+private:
+    enum Expect {
+        VALUE,
+        VALUE_OR_END, // after [
+        KEY_OR_END, // after {
+        KEY,
+        COLON,
+        COMMA_OR_END,
+        DONE
+    };
+
+    enum Token {
+        NONE,
+        STRING,
+        ESCAPE,
+        UNICODE,
+        NUMBER,
+        LITERAL
+    };
+
+    static bool whitespace(unsigned char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    }
+
+    void consume(unsigned char c) {
+        switch (_token) {
+            case STRING:
+                if (_highSurrogate != 0 && c != '\\') {
+                    syntaxError("unpaired surrogate");
+                } else if (c == '"') {
+                    endString();
+                } else if (c == '\\') {
+                    _token = ESCAPE;
+                } else if (c < 0x20) {
+                    syntaxError("control character in string");
+                } else {
+                    append(static_cast<char>(c));
+                }
+                return;
+            case ESCAPE:
+                escape(c);
+                return;
+            case UNICODE:
+                unicode(c);
+                return;
+            case NUMBER:
+                if ((c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E') {
+                    append(static_cast<char>(c));
+                    return;
+                }
+                endToken();
+                break;
+            case LITERAL:
+                if (c >= 'a' && c <= 'z') {
+                    append(static_cast<char>(c));
+                    return;
+                }
+                endToken();
+                break;
+            case NONE:
+                break;
+        }
+        if (!_failed && !whitespace(c)) {
+            structural(c);
+        }
+    }
+
+    void structural(unsigned char c) {
+        switch (_expect) {
+            case VALUE_OR_END:
+                if (c == ']') {
+                    endContainer('[');
+                    return;
+                }
+                value(c);
+                return;
+            case VALUE:
+                value(c);
+                return;
+            case KEY_OR_END:
+                if (c == '}') {
+                    endContainer('{');
+                    return;
+                }
+                [[fallthrough]];
+            case KEY:
+                if (c != '"') {
+                    syntaxError("expected a key");
+                    return;
+                }
+                startToken(STRING);
+                _key = true;
+                return;
+            case COLON:
+                if (c != ':') {
+                    syntaxError("expected ':'");
+                    return;
+                }
+                _expect = VALUE;
+                return;
+            case COMMA_OR_END:
+                if (c == ',') {
+                    _expect = _stack.back() == '{' ? KEY : VALUE;
+                } else if (c == '}' || c == ']') {
+                    endContainer(c == '}' ? '{' : '[');
+                } else {
+                    syntaxError("expected ',' or the end of a container");
+                }
+                return;
+            case DONE:
+                syntaxError("trailing characters");
+                return;
+        }
+    }
+
+    void value(unsigned char c) {
+        if (c == '{') {
+            _stack.push_back('{');
+            _expect = KEY_OR_END;
+            handled(_sax.start_object(static_cast<std::size_t>(-1)));
+        } else if (c == '[') {
+            _stack.push_back('[');
+            _expect = VALUE_OR_END;
+            handled(_sax.start_array(static_cast<std::size_t>(-1)));
+        } else if (c == '"') {
+            startToken(STRING);
+            _key = false;
+        } else if (c == '-' || (c >= '0' && c <= '9')) {
+            startToken(NUMBER);
+            append(static_cast<char>(c));
+        } else if (c >= 'a' && c <= 'z') {
+            startToken(LITERAL);
+            append(static_cast<char>(c));
+        } else {
+            syntaxError("expected a value");
+        }
+    }
+
+    void endContainer(char open) {
+        if (_stack.back() != open) {
+            syntaxError("mismatched brackets");
+            return;
+        }
+        _stack.pop_back();
+        valueDone();
+        handled(open == '{' ? _sax.end_object() : _sax.end_array());
+    }
+
+    void valueDone() {
+        _expect = _stack.empty() ? DONE : COMMA_OR_END;
+    }
+
+    void startToken(Token token) {
+        _token = token;
+        _buffer.clear();
+    }
+
+    void append(char c) {
+        if (_buffer.size() >= _maxToken) {
+            _tooLarge = true;
+            syntaxError("string longer than " + std::to_string(_maxToken) + " bytes");
+            return;
+        }
+        _buffer.push_back(c);
+    }
+
+    void appendCodePoint(std::uint32_t codePoint) {
+        if (codePoint < 0x80) {
+            append(static_cast<char>(codePoint));
+        } else if (codePoint < 0x800) {
+            append(static_cast<char>(0xC0 | (codePoint >> 6)));
+            append(static_cast<char>(0x80 | (codePoint & 0x3F)));
+        } else if (codePoint < 0x10000) {
+            append(static_cast<char>(0xE0 | (codePoint >> 12)));
+            append(static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F)));
+            append(static_cast<char>(0x80 | (codePoint & 0x3F)));
+        } else {
+            append(static_cast<char>(0xF0 | (codePoint >> 18)));
+            append(static_cast<char>(0x80 | ((codePoint >> 12) & 0x3F)));
+            append(static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F)));
+            append(static_cast<char>(0x80 | (codePoint & 0x3F)));
+        }
+    }
+
+    void escape(unsigned char c) {
+        _token = STRING;
+        switch (c) {
+            case '"': append('"'); break;
+            case '\\': append('\\'); break;
+            case '/': append('/'); break;
+            case 'b': append('\b'); break;
+            case 'f': append('\f'); break;
+            case 'n': append('\n'); break;
+            case 'r': append('\r'); break;
+            case 't': append('\t'); break;
+            case 'u':
+                _token = UNICODE;
+                _unit = 0;
+                _digits = 0;
+                return;
+            default:
+                syntaxError("invalid escape");
+                return;
+        }
+        if (_highSurrogate != 0) {
+            syntaxError("unpaired surrogate");
+        }
+    }
+
+    void unicode(unsigned char c) {
+        int digit;
+        if (c >= '0' && c <= '9') digit = c - '0';
+        else if (c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+        else {
+            syntaxError("invalid \\u escape");
+            return;
+        }
+        _unit = _unit << 4 | static_cast<std::uint32_t>(digit);
+        if (++_digits < 4) {
+            return;
+        }
+        _token = STRING;
+        if (_highSurrogate != 0) {
+            if (_unit < 0xDC00 || _unit > 0xDFFF) {
+                syntaxError("unpaired surrogate");
+                return;
+            }
+            appendCodePoint(0x10000 + ((_highSurrogate - 0xD800) << 10) + (_unit - 0xDC00));
+            _highSurrogate = 0;
+        } else if (_unit >= 0xD800 && _unit <= 0xDBFF) {
+            _highSurrogate = _unit;
+        } else if (_unit >= 0xDC00 && _unit <= 0xDFFF) {
+            syntaxError("unpaired surrogate");
+        } else {
+            appendCodePoint(_unit);
+        }
+    }
+
+    // a high surrogate must be followed by its low one right away
+    void endString() {
+        _token = NONE;
+        if (_highSurrogate != 0) {
+            syntaxError("unpaired surrogate");
+            return;
+        }
+        if (!validUtf8(_buffer)) {
+            syntaxError("invalid UTF-8 in string");
+            return;
+        }
+        if (_key) {
+            _expect = COLON;
+            handled(_sax.key(_buffer));
+        } else {
+            valueDone();
+            handled(_sax.string(_buffer));
+        }
+    }
+
+    void endToken() {
+        Token token = _token;
+        _token = NONE;
+        valueDone();
+        if (token == LITERAL) {
+            if (_buffer == "true" || _buffer == "false") {
+                handled(_sax.boolean(_buffer == "true"));
+            } else if (_buffer == "null") {
+                handled(_sax.null());
+            } else {
+                syntaxError("invalid literal");
+            }
+            return;
+        }
+        number();
+    }
+
+    // -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?, integers that do not fit are floats as in nlohmann
+    void number() {
+        const std::string &n = _buffer;
+        std::size_t i = n[0] == '-' ? 1 : 0;
+        auto digits = [&n, &i]() {
+            std::size_t start = i;
+            while (i < n.size() && n[i] >= '0' && n[i] <= '9') {
+                ++i;
+            }
+            return i - start;
+        };
+        std::size_t intDigits = digits();
+        bool integer = true;
+        bool valid = intDigits > 0 && !(intDigits > 1 && n[i - intDigits] == '0');
+        if (valid && i < n.size() && n[i] == '.') {
+            ++i;
+            integer = false;
+            valid = digits() > 0;
+        }
+        if (valid && i < n.size() && (n[i] == 'e' || n[i] == 'E')) {
+            ++i;
+            integer = false;
+            if (i < n.size() && (n[i] == '+' || n[i] == '-')) {
+                ++i;
+            }
+            valid = digits() > 0;
+        }
+        if (!valid || i != n.size()) {
+            syntaxError("invalid number");
+            return;
+        }
+        if (integer) {
+            errno = 0;
+            char *end = nullptr;
+            if (n[0] == '-') {
+                long long value = std::strtoll(n.c_str(), &end, 10);
+                if (errno != ERANGE) {
+                    handled(_sax.number_integer(value));
+                    return;
+                }
+            } else {
+                unsigned long long value = std::strtoull(n.c_str(), &end, 10);
+                if (errno != ERANGE) {
+                    handled(_sax.number_unsigned(value));
+                    return;
+                }
+            }
+        }
+        handled(_sax.number_float(std::strtod(n.c_str(), nullptr), n));
+    }
+
+    static bool validUtf8(const std::string &value) {
+        for (std::size_t i = 0; i < value.size();) {
+            auto c = static_cast<unsigned char>(value[i]);
+            std::size_t length;
+            std::uint32_t codePoint;
+            if (c < 0x80) {
+                ++i;
+                continue;
+            } else if ((c & 0xE0) == 0xC0) {
+                length = 2;
+                codePoint = c & 0x1F;
+            } else if ((c & 0xF0) == 0xE0) {
+                length = 3;
+                codePoint = c & 0x0F;
+            } else if ((c & 0xF8) == 0xF0) {
+                length = 4;
+                codePoint = c & 0x07;
+            } else {
+                return false;
+            }
+            if (i + length > value.size()) {
+                return false;
+            }
+            for (std::size_t j = 1; j < length; ++j) {
+                auto next = static_cast<unsigned char>(value[i + j]);
+                if ((next & 0xC0) != 0x80) {
+                    return false;
+                }
+                codePoint = codePoint << 6 | (next & 0x3F);
+            }
+            // overlong forms, surrogates and code points past U+10FFFF
+            static const std::uint32_t minimum[5] = {0, 0, 0x80, 0x800, 0x10000};
+            if (codePoint < minimum[length] || (codePoint >= 0xD800 && codePoint <= 0xDFFF) || codePoint > 0x10FFFF) {
+                return false;
+            }
+            i += length;
+        }
+        return true;
+    }
+
+    void handled(bool accepted) {
+        if (!accepted) {
+            _failed = true;
+        }
+    }
+
+    void syntaxError(const std::string &error) {
+        if (!_failed) {
+            _failed = true;
+            _error = "invalid ask at byte " + std::to_string(_position) + ": " + error;
+        }
+    }
+
+    nlohmann::json_sax<json> &_sax;
+    std::size_t _maxToken;
+    std::vector<char> _stack;
+    Expect _expect = VALUE;
+    Token _token = NONE;
+    bool _key = false;
+    std::string _buffer;
+    std::uint32_t _unit = 0;
+    int _digits = 0;
+    std::uint32_t _highSurrogate = 0;
+    std::uint64_t _position = 0;
+    bool _failed = false;
+    bool _tooLarge = false;
+    std::string _error;
+};
+
+namespace manifest {
+
+    class AskReader::Spool {
+    public:
+        ~Spool() {
+            if (_out.is_open()) {
+                _out.close();
+            }
+            if (_file.has_value()) {
+                std::error_code ec;
+                std::filesystem::remove(_file.value(), ec);
+            }
+        }
+
+        bool append(const char *data, std::size_t size) {
+            if (!_file.has_value() && _memory.size() + size > spoolMemoryLimit) {
+                std::random_device random;
+                std::ostringstream name;
+                name << "flowdrop-ask-" << std::hex << random() << random() << ".spool";
+                _file = std::filesystem::temp_directory_path() / name.str();
+                _out.open(_file.value(), std::ios::binary | std::ios::trunc);
+                _out.write(_memory.data(), static_cast<std::streamsize>(_memory.size()));
+                std::string().swap(_memory);
+            }
+            if (!_file.has_value()) {
+                _memory.append(data, size);
+                return true;
+            }
+            _out.write(data, static_cast<std::streamsize>(size));
+            return _out.good();
+        }
+
+        bool close() {
+            if (!_out.is_open()) {
+                return true;
+            }
+            _out.close();
+            return !_out.fail();
+        }
+
+        bool read(const std::function<bool(const char *, std::size_t)> &consumer) const {
+            if (!_file.has_value()) {
+                return consumer(_memory.data(), _memory.size());
+            }
+            std::ifstream in(_file.value(), std::ios::binary);
+            std::vector<char> buffer(spoolReadBuffer);
+            while (in) {
+                in.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+                auto n = static_cast<std::size_t>(in.gcount());
+                if (n > 0 && !consumer(buffer.data(), n)) {
+                    return false;
+                }
+            }
+            return in.eof();
+        }
+
+    private:
+        std::string _memory;
+        std::optional<std::filesystem::path> _file;
+        std::ofstream _out;
+    };
+
+    // A JSON ask parsed as it arrives, the limits apply before the rest is spooled.
+    class AskReader::JsonAsk {
+    public:
+        JsonAsk(AskSax::senderCallback onSender, flowdrop::fileVisitor onFile, std::size_t maxToken) :
+                sax(std::move(onSender), std::move(onFile)), feeder(sax, maxToken) {}
+
+        [[nodiscard]] const std::string &error() const {
+            return feeder.error().empty() ? sax.error() : feeder.error();
+        }
+
+        AskSax sax;
+        JsonFeeder feeder;
+    };
+
+    AskReader::AskReader(bool binaryManifest, const flowdrop::AskLimits &limits) :
+            _binaryManifest(binaryManifest), _limits(limits), _spool(std::make_shared<Spool>()) {
+        if (_binaryManifest) {
+            _decoder = std::make_unique<Decoder>([this](const flowdrop::DeviceInfo &sender, std::uint64_t totalFiles, std::uint64_t totalSize) {
+                return acceptHeader(sender, totalFiles, totalSize);
+            }, [this](const flowdrop::FileInfo &fileInfo) {
+                return acceptFile(fileInfo);
+            });
+        } else {
+            _json = std::make_unique<JsonAsk>([this](const flowdrop::DeviceInfo &sender) {
+                _ask.sender = sender;
+            }, [this](const flowdrop::FileInfo &fileInfo) {
+                return acceptFile(fileInfo);
+            }, _limits.maxPathLength);
+        }
+    }
+
+    AskReader::~AskReader() = default;
+
+    bool AskReader::tooLarge() const {
+        return _tooLarge;
+    }
+
+    const std::string &AskReader::error() const {
+        return _error;
+    }
+
+    bool AskReader::fail(const std::string &error, bool tooLarge) {
+        _failed = true;
+        _tooLarge = tooLarge;
+        _error = error;
+        return false;
+    }
+
+    bool AskReader::write(const char *data, std::size_t size) {
+        if (_failed) {
+            return false;
+        }
+        _bodyBytes += size;
+        if (_bodyBytes > _limits.maxBodyBytes) {
+            return fail("ask body exceeds " + std::to_string(_limits.maxBodyBytes) + " bytes", true);
+        }
+        if (!_spool->append(data, size)) {
+            return fail("unable to spool ask");
+        }
+        if (_decoder != nullptr && !_decoder->feed(data, size)) {
+            return _failed ? false : fail(_decoder->error());
+        }
+        if (_json != nullptr && !_json->feeder.feed(data, size)) {
+            return _failed ? false : fail(_json->error(), _json->feeder.tooLarge());
+        }
+        return true;
+    }
+
+    bool AskReader::acceptHeader(const flowdrop::DeviceInfo &sender, std::uint64_t totalFiles, std::uint64_t totalSize) {
+        if (totalFiles > _limits.maxFiles) {
+            return fail("ask has " + std::to_string(totalFiles) + " files", true);
+        }
+        _ask.sender = sender;
+        _ask.totalFiles = totalFiles;
+        _ask.totalSize = totalSize;
+        _inline = totalFiles <= _limits.inlineFiles;
+        return true;
+    }
+
+    bool AskReader::acceptFile(const flowdrop::FileInfo &fileInfo) {
+        if (++_files > _limits.maxFiles) {
+            return fail("ask has more than " + std::to_string(_limits.maxFiles) + " files", true);
+        }
+        if (fileInfo.name.size() > _limits.maxPathLength) {
+            return fail("path longer than " + std::to_string(_limits.maxPathLength) + " bytes", true);
+        }
+        if (!_binaryManifest) {
+            _ask.totalSize += fileInfo.size;
+            if (_inline && _files > _limits.inlineFiles) {
+                _inline = false;
+                std::vector<flowdrop::FileInfo>().swap(_ask.files);
+            }
+        }
+        if (_inline) {
+            _ask.files.push_back(fileInfo);
+        }
+        return true;
+    }
+
+    bool AskReader::finishJson(flowdrop::SendAsk &ask) {
+        if (!_json->feeder.finish()) {
+            return _failed ? false : fail(_json->error());
+        }
+        const AskSax &sax = _json->sax;
+        if (!sax.complete()) {
+            return fail("ask without sender or files");
+        }
+        _ask.totalFiles = _files;
+        if (sax.estimated()) {
+            if (sax.totalFiles() > _limits.maxFiles) {
+                return fail("ask has " + std::to_string(sax.totalFiles()) + " files", true);
+            }
+            _ask.estimated = true;
+            _ask.totalFiles = std::max(sax.totalFiles(), _ask.totalFiles);
+            _ask.totalSize = std::max(sax.totalSize(), _ask.totalSize);
+        }
+        if (!_inline) {
+            std::shared_ptr<Spool> spool = _spool;
+            std::size_t maxToken = _limits.maxPathLength;
+            _ask.fileSource = [spool, maxToken](const flowdrop::fileVisitor &visitor) {
+                AskSax fileSax(nullptr, visitor);
+                JsonFeeder feeder(fileSax, maxToken);
+                spool->read([&feeder](const char *data, std::size_t size) {
+                    return feeder.feed(data, size);
+                });
+            };
+        }
+        ask = std::move(_ask);
+        return true;
+    }
+
+    bool AskReader::finish(flowdrop::SendAsk &ask) {
+        if (_failed) {
+            return false;
+        }
+        if (!_spool->close()) {
+            return fail("unable to spool ask");
+        }
+        if (!_binaryManifest) {
+            return finishJson(ask);
+        }
+        if (!_decoder->done()) {
+            return fail("truncated manifest");
+        }
+        if (!_inline) {
+            std::shared_ptr<Spool> spool = _spool;
+            _ask.fileSource = [spool](const flowdrop::fileVisitor &visitor) {
+                Decoder decoder([](const flowdrop::DeviceInfo &, std::uint64_t, std::uint64_t) {
+                    return true;
+                }, visitor);
+                spool->read([&decoder](const char *data, std::size_t size) {
+                    return decoder.feed(data, size);
+                });
+            };
+        }
+        ask = std::move(_ask);
+        return true;
+    }
+
+} // namespace manifest
@@ -0,0 +1,53 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+#pragma once
+
+#include "flowdrop/flowdrop.hpp"
+#include "ask_manifest.hpp"
+#include <memory>
+
+namespace manifest {
+
+    // Receives an /ask body chunk by chunk, JSON or binary manifest. The body is parsed and
+    // checked against the limits as it arrives, and spooled (to a temp file past a small
+    // threshold); large file lists are not kept in memory but streamed from the spool by
+    // SendAsk::fileSource.
+    class AskReader {
+    public:
+        AskReader(bool binaryManifest, const flowdrop::AskLimits &limits);
+        ~AskReader();
+
+        bool write(const char *data, std::size_t size); // false once the ask is refused
+        bool finish(flowdrop::SendAsk &ask);
+
+        [[nodiscard]] bool tooLarge() const;
+        [[nodiscard]] const std::string &error() const;
+
+    private:
+        class Spool;
+        class JsonAsk;
+
+        bool fail(const std::string &error, bool tooLarge = false);
+        bool acceptHeader(const flowdrop::DeviceInfo &sender, std::uint64_t totalFiles, std::uint64_t totalSize);
+        bool acceptFile(const flowdrop::FileInfo &fileInfo);
+        bool finishJson(flowdrop::SendAsk &ask);
+
+        bool _binaryManifest;
+        flowdrop::AskLimits _limits;
+        std::shared_ptr<Spool> _spool;
+        std::unique_ptr<Decoder> _decoder;
+        std::unique_ptr<JsonAsk> _json;
+        flowdrop::SendAsk _ask;
+        std::uint64_t _bodyBytes = 0;
+        std::uint64_t _files = 0;
+        bool _inline = true;
+        bool _failed = false;
+        bool _tooLarge = false;
+        std::string _error;
+    };
+
+} // namespace manifest
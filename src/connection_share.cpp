@@ -0,0 +1,61 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+
+#include "connection_share.hpp"
+#include "logger.h"
+
+// below the receiver's keep-alive timeout (75 s in libhv), a reused connection is never one it is closing
+static const long maxIdleSeconds = 60;
+
+namespace transport {
+
+    void globalInit() {
+        static std::once_flag once;
+        std::call_once(once, []() {
+            curl_global_init(CURL_GLOBAL_NOTHING);
+        });
+    }
+
+    ConnectionShare &ConnectionShare::instance() {
+        // intentionally leaked, sends on detached threads may still hold the share at exit
+        static auto *share = new ConnectionShare;
+        return *share;
+    }
+
+    ConnectionShare::ConnectionShare() {
+        globalInit();
+        _share = curl_share_init();
+        if (_share == nullptr) {
+            LOG_ERROR("failed to create connection share");
+            return;
+        }
+        curl_share_setopt(_share, CURLSHOPT_LOCKFUNC, lock);
+        curl_share_setopt(_share, CURLSHOPT_UNLOCKFUNC, unlock);
+        curl_share_setopt(_share, CURLSHOPT_USERDATA, this);
+        if (curl_share_setopt(_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT) != CURLSHE_OK) {
+            LOG_ERROR("curl does not support sharing connections");
+            curl_share_cleanup(_share);
+            _share = nullptr;
+        }
+    }
+
+    void ConnectionShare::attach(CURL *curl) {
+        if (_share != nullptr) {
+            curl_easy_setopt(curl, CURLOPT_SHARE, _share);
+            curl_easy_setopt(curl, CURLOPT_MAXAGE_CONN, maxIdleSeconds);
+        }
+    }
+
+    void ConnectionShare::lock(CURL * /*handle*/, curl_lock_data data, curl_lock_access /*access*/, void *userptr) {
+        static_cast<ConnectionShare *>(userptr)->_mutexes[data].lock();
+    }
+
+    void ConnectionShare::unlock(CURL * /*handle*/, curl_lock_data data, void *userptr) {
+        static_cast<ConnectionShare *>(userptr)->_mutexes[data].unlock();
+    }
+
+} // namespace transport
@@ -0,0 +1,37 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+#pragma once
+
+#include "curl/curl.h"
+#include <mutex>
+
+namespace transport {
+
+    // Initializes curl for the process on the first call. It is never cleaned up: neither is
+    // thread-safe, and sends, probes and fetches run concurrently on threads of their own.
+    void globalInit();
+
+    // Process-wide curl connection cache. A request attached to it leaves its connection open
+    // for the next request to the same receiver, so the /send after an /ask and repeated sends
+    // skip the TCP handshake and slow start. Concurrent requests still get a connection each.
+    class ConnectionShare {
+    public:
+        static ConnectionShare &instance();
+
+        void attach(CURL *curl);
+
+    private:
+        ConnectionShare();
+
+        static void lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr);
+        static void unlock(CURL *handle, curl_lock_data data, void *userptr);
+
+        CURLSH *_share;
+        std::mutex _mutexes[CURL_LOCK_DATA_LAST];
+    };
+
+} // namespace transport
@@ -10,9 +10,10 @@
 #include <utility>
 #include <sstream>
 #include <iostream>
-#include "os/file_info.h"
+#include "os/file_io.h"
 #include "logger.h"
-#include "fstream"
+#include "peer_cache.hpp"
+#include "pairing.hpp"
 
 #if defined(__clang__)
 #include "sys/stat.h"
@@ -40,6 +41,26 @@ namespace flowdrop {
         Logger::set_debug(enabled);
     }
 
+    void setLogSink(const logSink &sink) {
+        Logger::set_sink(sink);
+    }
+
+    void setPeerCacheFile(const std::filesystem::path &path) {
+        discovery::PeerCache::instance().setFile(path);
+    }
+
+    void setPeerCacheTTL(const std::chrono::seconds &ttl) {
+        discovery::PeerCache::instance().setTTL(ttl);
+    }
+
+    void setPairingFile(const std::filesystem::path &path) {
+        pairing::Store::instance().setFile(path);
+    }
+
+    void unpair(const std::string &id) {
+        pairing::Store::instance().remove(id);
+    }
+
     std::string generate_md5_id() {
         auto now = std::chrono::system_clock::now();
         auto duration = now.time_since_epoch();
@@ -99,11 +120,40 @@ namespace flowdrop {
     void to_json(json &j, const SendAsk &d) {
         j["sender"] = d.sender;
         j["files"] = d.files;
+        j["total_files"] = d.totalFiles;
+        j["total_size"] = d.totalSize;
+        if (d.estimated) {
+            j["estimated"] = true;
+        }
     }
 
     void from_json(const json &j, SendAsk &d) {
         j.at("sender").get_to(d.sender);
         j.at("files").get_to(d.files);
+        if (j.contains("estimated") && j["estimated"].is_boolean() && j["estimated"].get<bool>()) {
+            d.estimated = true;
+            j.at("total_files").get_to(d.totalFiles);
+            j.at("total_size").get_to(d.totalSize);
+            return;
+        }
+        // older senders do not send totals
+        d.totalFiles = d.files.size();
+        d.totalSize = 0;
+        for (const FileInfo &file: d.files) {
+            d.totalSize += file.size;
+        }
+    }
+
+    void SendAsk::forEachFile(const fileVisitor &visitor) const {
+        if (fileSource != nullptr) {
+            fileSource(visitor);
+            return;
+        }
+        for (const FileInfo &file: files) {
+            if (!visitor(file)) {
+                return;
+            }
+        }
     }
 
     class NativeFile::Impl {
@@ -111,15 +161,12 @@ namespace flowdrop {
         Impl(std::filesystem::path filePath, std::string relativePath) :
                 _filePath(std::move(filePath)),
                 _relativePath(std::move(relativePath)),
-                _fileStream(_filePath, std::ios::binary | std::ios::in) {
-            if (!_fileStream) {
-                throw std::runtime_error("Error opening file: " + _filePath.string());
+                _fd(knotdrop_file_open(_filePath)) {
+            if (_fd < 0) {
+                throw std::runtime_error("Error opening file: " + _filePath.u8string());
             }
-            int result = knotdrop_util_fileinfo(_filePath.string().c_str(), &_createdTime, &_modifiedTime);
-            if (result == 1) {
-                Logger::log(Logger::LEVEL_ERROR, "knotdrop_util_fileinfo: error opening file");
-            } else if (result == 2) {
-                Logger::log(Logger::LEVEL_ERROR, "knotdrop_util_fileinfo: error getting file time");
+            if (knotdrop_file_stat(_fd, &_size, &_createdTime, &_modifiedTime) != 0) {
+                LOG_ERROR("knotdrop_file_stat: error getting file info" << Logger::kv("path", _filePath.u8string()));
             }
             if (_createdTime == 0) {
                 _createdTime = std::time(nullptr);
@@ -127,15 +174,19 @@ namespace flowdrop {
             if (_modifiedTime == 0) {
                 _modifiedTime = _createdTime;
             }
+            std::error_code ec;
+            _permissions = std::filesystem::status(_filePath, ec).permissions();
+        }
+        ~Impl() {
+            knotdrop_file_close(_fd);
         }
-        ~Impl() = default;
 
         [[nodiscard]] std::string getRelativePath() const {
             return _relativePath;
         }
 
         [[nodiscard]] std::uint64_t getSize() const {
-            return std::filesystem::file_size(_filePath);
+            return _size;
         }
 
         [[nodiscard]] std::uint64_t getCreatedTime() const {
@@ -146,25 +197,49 @@ namespace flowdrop {
             return _modifiedTime;
         }
 
-        [[nodiscard]] std::filesystem::file_status getStatus() const {
-            return std::filesystem::status(_filePath);
+        [[nodiscard]] std::filesystem::perms getPermissions() const {
+            return _permissions;
         }
 
         void seek(std::uint64_t pos) {
-            _fileStream.seekg(static_cast<std::ifstream::pos_type>(pos));
+            _position = pos;
         }
 
         std::uint64_t read(char *buffer, std::uint64_t count) {
-            _fileStream.read(buffer, static_cast<std::streamsize>(count));
-            return static_cast<std::uint64_t>(_fileStream.gcount());
+            std::uint64_t n = readAt(_position, buffer, count);
+            _position += n;
+            return n;
+        }
+
+        std::uint64_t readAt(std::uint64_t offset, char *buffer, std::uint64_t count) const {
+            std::uint64_t total = 0;
+            while (total < count) {
+                std::int64_t n = knotdrop_file_pread(_fd, buffer + total, count - total, offset + total);
+                if (n < 0) {
+                    LOG_ERROR("knotdrop_file_pread: read error" << Logger::kv("path", _filePath.string()));
+                    break;
+                }
+                if (n == 0) {
+                    break;
+                }
+                total += static_cast<std::uint64_t>(n);
+            }
+            return total;
+        }
+
+        [[nodiscard]] int nativeHandle() const {
+            return _fd;
         }
 
     private:
         std::filesystem::path _filePath;
         std::string _relativePath;
-        std::uint64_t _createdTime;
-        std::uint64_t _modifiedTime;
-        std::ifstream _fileStream;
+        int _fd;
+        std::uint64_t _size = 0;
+        std::uint64_t _createdTime = 0;
+        std::uint64_t _modifiedTime = 0;
+        std::filesystem::perms _permissions = std::filesystem::perms::unknown;
+        std::uint64_t _position = 0;
     };
 
     NativeFile::NativeFile(const std::filesystem::path& filePath, std::string relativePath) : pImpl(new Impl(filePath, std::move(relativePath))) {}
@@ -182,7 +257,7 @@ namespace flowdrop {
         return pImpl->getModifiedTime();
     }
     std::filesystem::perms NativeFile::getPermissions() const {
-        return pImpl->getStatus().permissions();
+        return pImpl->getPermissions();
     }
     void NativeFile::seek(std::uint64_t pos) {
         return pImpl->seek(pos);
@@ -190,5 +265,28 @@ namespace flowdrop {
     std::uint64_t NativeFile::read(char* buffer, std::uint64_t count) {
         return pImpl->read(buffer, count);
     }
+    std::uint64_t NativeFile::readAt(std::uint64_t offset, char *buffer, std::uint64_t count) const {
+        return pImpl->readAt(offset, buffer, count);
+    }
+    int NativeFile::nativeHandle() const {
+        return pImpl->nativeHandle();
+    }
+
+    fileGenerator walkDirectory(const std::filesystem::path &root) {
+        using std::filesystem::recursive_directory_iterator;
+        // the directory is read as the generator is pulled, not up front
+        auto it = std::make_shared<recursive_directory_iterator>(root, std::filesystem::directory_options::skip_permission_denied);
+        return [root, it]() -> File * {
+            for (; *it != recursive_directory_iterator(); ++*it) {
+                if (!(*it)->is_regular_file()) {
+                    continue;
+                }
+                std::filesystem::path path = (*it)->path();
+                ++*it;
+                return new NativeFile(path, path.lexically_relative(root).generic_string());
+            }
+            return nullptr;
+        };
+    }
 
 }
@@ -0,0 +1,1166 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+
+#include "crypto.hpp"
+#include "os/random.h"
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CHACHA_SSE2
+#include <emmintrin.h>
+#endif
+
+// AVX2 code is built for every x86-64 target and picked at run time
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CRYPTO_AVX2
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__GNUC__)
+#define CHACHA_NEON
+#endif
+
+typedef std::int64_t i64;
+typedef std::uint32_t u32;
+typedef std::uint64_t u64;
+typedef unsigned char u8;
+
+static const std::size_t chachaBlockSize = 64;
+
+static u32 load32(const u8 *p) {
+    return static_cast<u32>(p[0]) | static_cast<u32>(p[1]) << 8 | static_cast<u32>(p[2]) << 16 | static_cast<u32>(p[3]) << 24;
+}
+
+static void store32(u8 *p, u32 value) {
+    p[0] = static_cast<u8>(value);
+    p[1] = static_cast<u8>(value >> 8);
+    p[2] = static_cast<u8>(value >> 16);
+    p[3] = static_cast<u8>(value >> 24);
+}
+
+static u64 load64(const u8 *p) {
+    return static_cast<u64>(load32(p)) | static_cast<u64>(load32(p + 4)) << 32;
+}
+
+static void store64(u8 *p, u64 value) {
+    store32(p, static_cast<u32>(value));
+    store32(p + 4, static_cast<u32>(value >> 32));
+}
+
+#if defined(CRYPTO_AVX2)
+static bool hasAvx2() {
+    static const bool supported = __builtin_cpu_supports("avx2") != 0;
+    return supported;
+}
+#endif
+
+// --- X25519
+
+#if defined(__SIZEOF_INT128__)
+// Field elements are 5 limbs of 51 bits (curve25519-donna-c64).
+
+typedef unsigned __int128 u128;
+typedef u64 gf[5];
+
+static const int gfLimbs = 5;
+static const u64 mask51 = 0x7ffffffffffff;
+static const gf gf121665 = {121665};
+
+static void select25519(gf p, gf q, int bit) {
+    u64 mask = 0 - static_cast<u64>(bit);
+    for (int i = 0; i < 5; ++i) {
+        u64 t = mask & (p[i] ^ q[i]);
+        p[i] ^= t;
+        q[i] ^= t;
+    }
+}
+
+static void carry25519(gf o) {
+    for (int i = 0; i < 4; ++i) {
+        o[i + 1] += o[i] >> 51;
+        o[i] &= mask51;
+    }
+    o[0] += 19 * (o[4] >> 51);
+    o[4] &= mask51;
+}
+
+static void pack25519(u8 *o, const gf n) {
+    gf t;
+    std::memcpy(t, n, sizeof(gf));
+    carry25519(t);
+    carry25519(t);
+    // t is below 2^255, adding 19 carries into bit 255 exactly when t >= p
+    t[0] += 19;
+    carry25519(t);
+    // offset by 2^255 - 19 so the subtraction of p is a carry out of the top limb
+    t[0] += 0x8000000000000 - 19;
+    for (int i = 1; i < 5; ++i) {
+        t[i] += 0x8000000000000 - 1;
+    }
+    for (int i = 0; i < 4; ++i) {
+        t[i + 1] += t[i] >> 51;
+        t[i] &= mask51;
+    }
+    t[4] &= mask51;
+    store64(o, t[0] | t[1] << 51);
+    store64(o + 8, t[1] >> 13 | t[2] << 38);
+    store64(o + 16, t[2] >> 26 | t[3] << 25);
+    store64(o + 24, t[3] >> 39 | t[4] << 12);
+}
+
+static void unpack25519(gf o, const u8 *n) {
+    o[0] = load64(n) & mask51;
+    o[1] = (load64(n + 6) >> 3) & mask51;
+    o[2] = (load64(n + 12) >> 6) & mask51;
+    o[3] = (load64(n + 19) >> 1) & mask51;
+    o[4] = (load64(n + 24) >> 12) & mask51;
+}
+
+static void add25519(gf o, const gf a, const gf b) {
+    for (int i = 0; i < 5; ++i) {
+        o[i] = a[i] + b[i];
+    }
+}
+
+// adds 4p first, the limbs of b stay below it
+static void sub25519(gf o, const gf a, const gf b) {
+    o[0] = a[0] + 0x1fffffffffffb4 - b[0];
+    for (int i = 1; i < 5; ++i) {
+        o[i] = a[i] + 0x1ffffffffffffc - b[i];
+    }
+}
+
+static void reduce25519(gf o, u128 t0, u128 t1, u128 t2, u128 t3, u128 t4) {
+    t1 += static_cast<u64>(t0 >> 51);
+    t2 += static_cast<u64>(t1 >> 51);
+    t3 += static_cast<u64>(t2 >> 51);
+    t4 += static_cast<u64>(t3 >> 51);
+    u64 c = static_cast<u64>(t4 >> 51);
+    o[0] = (static_cast<u64>(t0) & mask51) + c * 19;
+    o[1] = (static_cast<u64>(t1) & mask51) + (o[0] >> 51);
+    o[0] &= mask51;
+    o[2] = static_cast<u64>(t2) & mask51;
+    o[3] = static_cast<u64>(t3) & mask51;
+    o[4] = static_cast<u64>(t4) & mask51;
+}
+
+static void mul25519(gf o, const gf a, const gf b) {
+    const u64 b1 = b[1] * 19, b2 = b[2] * 19, b3 = b[3] * 19, b4 = b[4] * 19;
+    u128 t0 = static_cast<u128>(a[0]) * b[0] + static_cast<u128>(a[1]) * b4 + static_cast<u128>(a[2]) * b3 +
+              static_cast<u128>(a[3]) * b2 + static_cast<u128>(a[4]) * b1;
+    u128 t1 = static_cast<u128>(a[0]) * b[1] + static_cast<u128>(a[1]) * b[0] + static_cast<u128>(a[2]) * b4 +
+              static_cast<u128>(a[3]) * b3 + static_cast<u128>(a[4]) * b2;
+    u128 t2 = static_cast<u128>(a[0]) * b[2] + static_cast<u128>(a[1]) * b[1] + static_cast<u128>(a[2]) * b[0] +
+              static_cast<u128>(a[3]) * b4 + static_cast<u128>(a[4]) * b3;
+    u128 t3 = static_cast<u128>(a[0]) * b[3] + static_cast<u128>(a[1]) * b[2] + static_cast<u128>(a[2]) * b[1] +
+              static_cast<u128>(a[3]) * b[0] + static_cast<u128>(a[4]) * b4;
+    u128 t4 = static_cast<u128>(a[0]) * b[4] + static_cast<u128>(a[1]) * b[3] + static_cast<u128>(a[2]) * b[2] +
+              static_cast<u128>(a[3]) * b[1] + static_cast<u128>(a[4]) * b[0];
+    reduce25519(o, t0, t1, t2, t3, t4);
+}
+
+static void square25519(gf o, const gf a) {
+    const u64 a0 = a[0] * 2, a1 = a[1] * 2, a3 = a[3] * 19, a4 = a[4] * 19;
+    u128 t0 = static_cast<u128>(a[0]) * a[0] + static_cast<u128>(a1) * a4 + static_cast<u128>(a[2] * 2) * a3;
+    u128 t1 = static_cast<u128>(a0) * a[1] + static_cast<u128>(a[2] * 2) * a4 + static_cast<u128>(a[3]) * a3;
+    u128 t2 = static_cast<u128>(a0) * a[2] + static_cast<u128>(a[1]) * a[1] + static_cast<u128>(a[3] * 2) * a4;
+    u128 t3 = static_cast<u128>(a0) * a[3] + static_cast<u128>(a1) * a[2] + static_cast<u128>(a[4]) * a4;
+    u128 t4 = static_cast<u128>(a0) * a[4] + static_cast<u128>(a1) * a[3] + static_cast<u128>(a[2]) * a[2];
+    reduce25519(o, t0, t1, t2, t3, t4);
+}
+
+#else
+// After TweetNaCl: field elements are 16 limbs of 16 bits.
+
+typedef i64 gf[16];
+
+static const int gfLimbs = 16;
+
+static const gf gf121665 = {0xDB41, 1};
+
+static void carry25519(gf o) {
+    for (int i = 0; i < 16; ++i) {
+        o[i] += 1LL << 16;
+        i64 c = o[i] >> 16;
+        if (i < 15) {
+            o[i + 1] += c - 1;
+        } else {
+            o[0] += 38 * (c - 1);
+        }
+        o[i] -= c * 65536;
+    }
+}
+
+static void select25519(gf p, gf q, int bit) {
+    i64 mask = ~(static_cast<i64>(bit) - 1);
+    for (int i = 0; i < 16; ++i) {
+        i64 t = mask & (p[i] ^ q[i]);
+        p[i] ^= t;
+        q[i] ^= t;
+    }
+}
+
+static void pack25519(u8 *o, const gf n) {
+    gf m, t;
+    std::memcpy(t, n, sizeof(gf));
+    carry25519(t);
+    carry25519(t);
+    carry25519(t);
+    for (int j = 0; j < 2; ++j) {
+        m[0] = t[0] - 0xffed;
+        for (int i = 1; i < 15; ++i) {
+            m[i] = t[i] - 0xffff - ((m[i - 1] >> 16) & 1);
+            m[i - 1] &= 0xffff;
+        }
+        m[15] = t[15] - 0x7fff - ((m[14] >> 16) & 1);
+        int bit = static_cast<int>((m[15] >> 16) & 1);
+        m[14] &= 0xffff;
+        select25519(t, m, 1 - bit);
+    }
+    for (int i = 0; i < 16; ++i) {
+        o[2 * i] = static_cast<u8>(t[i] & 0xff);
+        o[2 * i + 1] = static_cast<u8>(t[i] >> 8);
+    }
+}
+
+static void unpack25519(gf o, const u8 *n) {
+    for (int i = 0; i < 16; ++i) {
+        o[i] = n[2 * i] + (static_cast<i64>(n[2 * i + 1]) << 8);
+    }
+    o[15] &= 0x7fff;
+}
+
+static void add25519(gf o, const gf a, const gf b) {
+    for (int i = 0; i < 16; ++i) {
+        o[i] = a[i] + b[i];
+    }
+}
+
+static void sub25519(gf o, const gf a, const gf b) {
+    for (int i = 0; i < 16; ++i) {
+        o[i] = a[i] - b[i];
+    }
+}
+
+static void mul25519(gf o, const gf a, const gf b) {
+    i64 t[31] = {0};
+    for (int i = 0; i < 16; ++i) {
+        for (int j = 0; j < 16; ++j) {
+            t[i + j] += a[i] * b[j];
+        }
+    }
+    for (int i = 0; i < 15; ++i) {
+        t[i] += 38 * t[i + 16];
+    }
+    std::memcpy(o, t, sizeof(gf));
+    carry25519(o);
+    carry25519(o);
+}
+
+static void square25519(gf o, const gf a) {
+    mul25519(o, a, a);
+}
+
+#endif
+
+static void squareTimes25519(gf o, const gf a, int times) {
+    square25519(o, a);
+    for (int i = 1; i < times; ++i) {
+        square25519(o, o);
+    }
+}
+
+// in^(p - 2), the usual addition chain: 254 squarings and 11 multiplications
+static void invert25519(gf o, const gf in) {
+    gf z2, z9, z11, z2_5_0, z2_10_0, z2_20_0, z2_50_0, z2_100_0, t;
+    square25519(z2, in);
+    squareTimes25519(t, z2, 2);
+    mul25519(z9, t, in);
+    mul25519(z11, z9, z2);
+    square25519(t, z11);
+    mul25519(z2_5_0, t, z9);
+    squareTimes25519(t, z2_5_0, 5);
+    mul25519(z2_10_0, t, z2_5_0);
+    squareTimes25519(t, z2_10_0, 10);
+    mul25519(z2_20_0, t, z2_10_0);
+    squareTimes25519(t, z2_20_0, 20);
+    mul25519(t, t, z2_20_0);
+    squareTimes25519(t, t, 10);
+    mul25519(z2_50_0, t, z2_10_0);
+    squareTimes25519(t, z2_50_0, 50);
+    mul25519(z2_100_0, t, z2_50_0);
+    squareTimes25519(t, z2_100_0, 100);
+    mul25519(t, t, z2_100_0);
+    squareTimes25519(t, t, 50);
+    mul25519(t, t, z2_50_0);
+    squareTimes25519(t, t, 5);
+    mul25519(o, t, z11);
+}
+
+// --- ChaCha20
+
+#define CHACHA_ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define CHACHA_QUARTERROUND(a, b, c, d) \
+    a += b; d ^= a; d = CHACHA_ROTL(d, 16); \
+    c += d; b ^= c; b = CHACHA_ROTL(b, 12); \
+    a += b; d ^= a; d = CHACHA_ROTL(d, 8); \
+    c += d; b ^= c; b = CHACHA_ROTL(b, 7)
+
+static void chachaInit(u32 state[16], const crypto::Key &key, const u8 *tail) {
+    state[0] = 0x61707865;
+    state[1] = 0x3320646e;
+    state[2] = 0x79622d32;
+    state[3] = 0x6b206574;
+    for (int i = 0; i < 8; ++i) {
+        state[4 + i] = load32(key.data() + 4 * i);
+    }
+    for (int i = 0; i < 4; ++i) {
+        state[12 + i] = load32(tail + 4 * i);
+    }
+}
+
+static void chachaRounds(u32 x[16]) {
+    for (int i = 0; i < 10; ++i) {
+        CHACHA_QUARTERROUND(x[0], x[4], x[8], x[12]);
+        CHACHA_QUARTERROUND(x[1], x[5], x[9], x[13]);
+        CHACHA_QUARTERROUND(x[2], x[6], x[10], x[14]);
+        CHACHA_QUARTERROUND(x[3], x[7], x[11], x[15]);
+        CHACHA_QUARTERROUND(x[0], x[5], x[10], x[15]);
+        CHACHA_QUARTERROUND(x[1], x[6], x[11], x[12]);
+        CHACHA_QUARTERROUND(x[2], x[7], x[8], x[13]);
+        CHACHA_QUARTERROUND(x[3], x[4], x[9], x[14]);
+    }
+}
+
+static void chachaBlock(u8 out[64], const u32 state[16]) {
+    u32 x[16];
+    std::memcpy(x, state, sizeof(x));
+    chachaRounds(x);
+    for (int i = 0; i < 16; ++i) {
+        store32(out + 4 * i, x[i] + state[i]);
+    }
+}
+
+#if defined(CHACHA_SSE2)
+
+#define CHACHA_ROTL_SSE2(v, n) _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+#define CHACHA_ROTL16_SSE2(v) _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1)), _MM_SHUFFLE(2, 3, 0, 1))
+#define CHACHA_QUARTERROUND_SSE2(a, b, c, d) \
+    a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = CHACHA_ROTL16_SSE2(d); \
+    c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = CHACHA_ROTL_SSE2(b, 12); \
+    a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = CHACHA_ROTL_SSE2(d, 8); \
+    c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = CHACHA_ROTL_SSE2(b, 7)
+
+// Four consecutive blocks, lane j of every vector belongs to block counter + j.
+static void chachaXor4(u8 *out, const u8 *in, const u32 state[16]) {
+    __m128i x[16];
+    __m128i original[16];
+    for (int i = 0; i < 16; ++i) {
+        original[i] = _mm_set1_epi32(static_cast<int>(state[i]));
+    }
+    original[12] = _mm_add_epi32(original[12], _mm_set_epi32(3, 2, 1, 0));
+    for (int i = 0; i < 16; ++i) {
+        x[i] = original[i];
+    }
+    for (int i = 0; i < 10; ++i) {
+        CHACHA_QUARTERROUND_SSE2(x[0], x[4], x[8], x[12]);
+        CHACHA_QUARTERROUND_SSE2(x[1], x[5], x[9], x[13]);
+        CHACHA_QUARTERROUND_SSE2(x[2], x[6], x[10], x[14]);
+        CHACHA_QUARTERROUND_SSE2(x[3], x[7], x[11], x[15]);
+        CHACHA_QUARTERROUND_SSE2(x[0], x[5], x[10], x[15]);
+        CHACHA_QUARTERROUND_SSE2(x[1], x[6], x[11], x[12]);
+        CHACHA_QUARTERROUND_SSE2(x[2], x[7], x[8], x[13]);
+        CHACHA_QUARTERROUND_SSE2(x[3], x[4], x[9], x[14]);
+    }
+    for (int i = 0; i < 16; ++i) {
+        x[i] = _mm_add_epi32(x[i], original[i]);
+    }
+    // transpose each group of four words into the four blocks
+    for (int group = 0; group < 4; ++group) {
+        __m128i t0 = _mm_unpacklo_epi32(x[4 * group], x[4 * group + 1]);
+        __m128i t1 = _mm_unpacklo_epi32(x[4 * group + 2], x[4 * group + 3]);
+        __m128i t2 = _mm_unpackhi_epi32(x[4 * group], x[4 * group + 1]);
+        __m128i t3 = _mm_unpackhi_epi32(x[4 * group + 2], x[4 * group + 3]);
+        __m128i words[4] = {_mm_unpacklo_epi64(t0, t1), _mm_unpackhi_epi64(t0, t1),
+                            _mm_unpacklo_epi64(t2, t3), _mm_unpackhi_epi64(t2, t3)};
+        for (int block = 0; block < 4; ++block) {
+            std::size_t offset = block * chachaBlockSize + group * 16;
+            __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + offset));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + offset), _mm_xor_si128(data, words[block]));
+        }
+    }
+}
+
+#endif
+
+#if defined(CRYPTO_AVX2)
+
+#define CHACHA_ROTL_AVX2(v, n) _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - (n)))
+#define CHACHA_QUARTERROUND_AVX2(a, b, c, d) \
+    a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); d = _mm256_shuffle_epi8(d, rotl16); \
+    c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = CHACHA_ROTL_AVX2(b, 12); \
+    a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); d = _mm256_shuffle_epi8(d, rotl8); \
+    c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = CHACHA_ROTL_AVX2(b, 7)
+
+// Eight consecutive blocks, as chachaXor4; the two 128-bit halves hold blocks 0-3 and 4-7.
+__attribute__((target("avx2")))
+static void chachaXor8(u8 *out, const u8 *in, const u32 state[16]) {
+    const __m256i rotl16 = _mm256_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+                                           13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2);
+    const __m256i rotl8 = _mm256_set_epi8(14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3,
+                                          14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3);
+    __m256i x[16];
+    __m256i original[16];
+    for (int i = 0; i < 16; ++i) {
+        original[i] = _mm256_set1_epi32(static_cast<int>(state[i]));
+    }
+    original[12] = _mm256_add_epi32(original[12], _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+    for (int i = 0; i < 16; ++i) {
+        x[i] = original[i];
+    }
+    for (int i = 0; i < 10; ++i) {
+        CHACHA_QUARTERROUND_AVX2(x[0], x[4], x[8], x[12]);
+        CHACHA_QUARTERROUND_AVX2(x[1], x[5], x[9], x[13]);
+        CHACHA_QUARTERROUND_AVX2(x[2], x[6], x[10], x[14]);
+        CHACHA_QUARTERROUND_AVX2(x[3], x[7], x[11], x[15]);
+        CHACHA_QUARTERROUND_AVX2(x[0], x[5], x[10], x[15]);
+        CHACHA_QUARTERROUND_AVX2(x[1], x[6], x[11], x[12]);
+        CHACHA_QUARTERROUND_AVX2(x[2], x[7], x[8], x[13]);
+        CHACHA_QUARTERROUND_AVX2(x[3], x[4], x[9], x[14]);
+    }
+    for (int i = 0; i < 16; ++i) {
+        x[i] = _mm256_add_epi32(x[i], original[i]);
+    }
+    for (int group = 0; group < 4; ++group) {
+        __m256i t0 = _mm256_unpacklo_epi32(x[4 * group], x[4 * group + 1]);
+        __m256i t1 = _mm256_unpacklo_epi32(x[4 * group + 2], x[4 * group + 3]);
+        __m256i t2 = _mm256_unpackhi_epi32(x[4 * group], x[4 * group + 1]);
+        __m256i t3 = _mm256_unpackhi_epi32(x[4 * group + 2], x[4 * group + 3]);
+        __m256i words[4] = {_mm256_unpacklo_epi64(t0, t1), _mm256_unpackhi_epi64(t0, t1),
+                            _mm256_unpacklo_epi64(t2, t3), _mm256_unpackhi_epi64(t2, t3)};
+        for (int block = 0; block < 4; ++block) {
+            std::size_t low = block * chachaBlockSize + group * 16;
+            std::size_t high = low + 4 * chachaBlockSize;
+            __m128i lowData = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + low));
+            __m128i highData = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + high));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + low), _mm_xor_si128(lowData, _mm256_castsi256_si128(words[block])));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + high), _mm_xor_si128(highData, _mm256_extracti128_si256(words[block], 1)));
+        }
+    }
+}
+
+#endif
+
+#if defined(CHACHA_NEON)
+
+typedef u32 chachaVector __attribute__((vector_size(16)));
+
+// Four consecutive blocks, as chachaXor4 above; written with vector extensions, which become NEON.
+static void chachaXor4(u8 *out, const u8 *in, const u32 state[16]) {
+    chachaVector x[16];
+    chachaVector original[16];
+    for (int i = 0; i < 16; ++i) {
+        original[i] = chachaVector{state[i], state[i], state[i], state[i]};
+    }
+    original[12] += chachaVector{0, 1, 2, 3};
+    for (int i = 0; i < 16; ++i) {
+        x[i] = original[i];
+    }
+    for (int i = 0; i < 10; ++i) {
+        CHACHA_QUARTERROUND(x[0], x[4], x[8], x[12]);
+        CHACHA_QUARTERROUND(x[1], x[5], x[9], x[13]);
+        CHACHA_QUARTERROUND(x[2], x[6], x[10], x[14]);
+        CHACHA_QUARTERROUND(x[3], x[7], x[11], x[15]);
+        CHACHA_QUARTERROUND(x[0], x[5], x[10], x[15]);
+        CHACHA_QUARTERROUND(x[1], x[6], x[11], x[12]);
+        CHACHA_QUARTERROUND(x[2], x[7], x[8], x[13]);
+        CHACHA_QUARTERROUND(x[3], x[4], x[9], x[14]);
+    }
+    for (int i = 0; i < 16; ++i) {
+        x[i] += original[i];
+    }
+    for (int block = 0; block < 4; ++block) {
+        for (int i = 0; i < 16; ++i) {
+            std::size_t offset = block * chachaBlockSize + 4 * i;
+            store32(out + offset, load32(in + offset) ^ x[i][block]);
+        }
+    }
+}
+
+#endif
+
+namespace crypto {
+
+    void x25519(unsigned char out[32], const unsigned char scalar[32], const unsigned char point[32]) {
+        u8 z[32];
+        int r;
+        gf x, a, b, c, d, e, f;
+        std::memcpy(z, scalar, 32);
+        z[31] = (scalar[31] & 127) | 64;
+        z[0] &= 248;
+        unpack25519(x, point);
+        for (int i = 0; i < gfLimbs; ++i) {
+            b[i] = x[i];
+            d[i] = a[i] = c[i] = 0;
+        }
+        a[0] = d[0] = 1;
+        for (int i = 254; i >= 0; --i) {
+            r = (z[i >> 3] >> (i & 7)) & 1;
+            select25519(a, b, r);
+            select25519(c, d, r);
+            add25519(e, a, c);
+            sub25519(a, a, c);
+            add25519(c, b, d);
+            sub25519(b, b, d);
+            square25519(d, e);
+            square25519(f, a);
+            mul25519(a, c, a);
+            mul25519(c, b, e);
+            add25519(e, a, c);
+            sub25519(a, a, c);
+            square25519(b, a);
+            sub25519(c, d, f);
+            mul25519(a, c, gf121665);
+            add25519(a, a, d);
+            mul25519(c, c, a);
+            mul25519(a, d, f);
+            mul25519(d, b, x);
+            square25519(b, e);
+            select25519(a, b, r);
+            select25519(c, d, r);
+        }
+        invert25519(c, c);
+        mul25519(a, a, c);
+        pack25519(out, a);
+    }
+
+    void x25519Base(unsigned char out[32], const unsigned char scalar[32]) {
+        static const u8 basePoint[32] = {9};
+        x25519(out, scalar, basePoint);
+    }
+
+    void chacha20(unsigned char *out, const unsigned char *in, std::size_t size, const Key &key, const Nonce &nonce,
+                  std::uint32_t counter) {
+        u8 tail[16];
+        store32(tail, counter);
+        std::memcpy(tail + 4, nonce.data(), nonceSize);
+        u32 state[16];
+        chachaInit(state, key, tail);
+#if defined(CRYPTO_AVX2)
+        if (hasAvx2()) {
+            while (size >= 8 * chachaBlockSize) {
+                chachaXor8(out, in, state);
+                state[12] += 8;
+                out += 8 * chachaBlockSize;
+                in += 8 * chachaBlockSize;
+                size -= 8 * chachaBlockSize;
+            }
+        }
+#endif
+#if defined(CHACHA_SSE2) || defined(CHACHA_NEON)
+        while (size >= 4 * chachaBlockSize) {
+            chachaXor4(out, in, state);
+            state[12] += 4;
+            out += 4 * chachaBlockSize;
+            in += 4 * chachaBlockSize;
+            size -= 4 * chachaBlockSize;
+        }
+#endif
+        u8 block[chachaBlockSize];
+        while (size > 0) {
+            chachaBlock(block, state);
+            ++state[12];
+            std::size_t n = size < chachaBlockSize ? size : chachaBlockSize;
+            for (std::size_t i = 0; i < n; ++i) {
+                out[i] = in[i] ^ block[i];
+            }
+            out += n;
+            in += n;
+            size -= n;
+        }
+    }
+
+    void hchacha20(unsigned char out[32], const Key &key, const unsigned char input[16]) {
+        u32 x[16];
+        chachaInit(x, key, input);
+        chachaRounds(x);
+        for (int i = 0; i < 4; ++i) {
+            store32(out + 4 * i, x[i]);
+            store32(out + 16 + 4 * i, x[12 + i]);
+        }
+    }
+
+#if defined(__SIZEOF_INT128__)
+    // 44-bit limbs (poly1305-donna-64)
+    static const u64 mask44 = 0xfffffffffff;
+    static const u64 mask42 = 0x3ffffffffff;
+
+#if defined(CRYPTO_AVX2)
+    static const std::size_t polyWideMinSize = 256;
+
+    // a * b in 26-bit limbs, carried
+    static void polyMul26(u32 out[5], const u32 a[5], const u32 b[5]) {
+        const u64 s1 = b[1] * 5, s2 = b[2] * 5, s3 = b[3] * 5, s4 = b[4] * 5;
+        u64 d[5];
+        d[0] = static_cast<u64>(a[0]) * b[0] + a[1] * s4 + a[2] * s3 + a[3] * s2 + a[4] * s1;
+        d[1] = static_cast<u64>(a[0]) * b[1] + static_cast<u64>(a[1]) * b[0] + a[2] * s4 + a[3] * s3 + a[4] * s2;
+        d[2] = static_cast<u64>(a[0]) * b[2] + static_cast<u64>(a[1]) * b[1] + static_cast<u64>(a[2]) * b[0] + a[3] * s4 + a[4] * s3;
+        d[3] = static_cast<u64>(a[0]) * b[3] + static_cast<u64>(a[1]) * b[2] + static_cast<u64>(a[2]) * b[1] +
+               static_cast<u64>(a[3]) * b[0] + a[4] * s4;
+        d[4] = static_cast<u64>(a[0]) * b[4] + static_cast<u64>(a[1]) * b[3] + static_cast<u64>(a[2]) * b[2] +
+               static_cast<u64>(a[3]) * b[1] + static_cast<u64>(a[4]) * b[0];
+        for (int i = 0; i < 4; ++i) {
+            d[i + 1] += d[i] >> 26;
+            d[i] &= 0x3ffffff;
+        }
+        d[0] += (d[4] >> 26) * 5;
+        d[4] &= 0x3ffffff;
+        d[1] += d[0] >> 26;
+        d[0] &= 0x3ffffff;
+        for (int i = 0; i < 5; ++i) {
+            out[i] = static_cast<u32>(d[i]);
+        }
+    }
+
+    // h = h * r per 64-bit lane, 26-bit limbs and s = 5 * r; locals rather than arrays keep h in registers
+#define POLY_MUL4(h0, h1, h2, h3, h4, r, s) { \
+        __m256i d0 = _mm256_add_epi64(_mm256_add_epi64(_mm256_mul_epu32(h0, r[0]), _mm256_mul_epu32(h1, s[4])), \
+                                      _mm256_add_epi64(_mm256_add_epi64(_mm256_mul_epu32(h2, s[3]), _mm256_mul_epu32(h3, s[2])), \
+                                                       _mm256_mul_epu32(h4, s[1]))); \
+        __m256i d1 = _mm256_add_epi64(_mm256_add_epi64(_mm256_mul_epu32(h0, r[1]), _mm256_mul_epu32(h1, r[0])), \
+                                      _mm256_add_epi64(_mm256_add_epi64(_mm256_mul_epu32(h2, s[4]), _mm256_mul_epu32(h3, s[3])), \
+                                                       _mm256_mul_epu32(h4, s[2]))); \
+        __m256i d2 = _mm256_add_epi64(_mm256_add_epi64(_mm256_mul_epu32(h0, r[2]), _mm256_mul_epu32(h1, r[1])), \
+                                      _mm256_add_epi64(_mm256_add_epi64(_mm256_mul_epu32(h2, r[0]), _mm256_mul_epu32(h3, s[4])), \
+                                                       _mm256_mul_epu32(h4, s[3]))); \
+        __m256i d3 = _mm256_add_epi64(_mm256_add_epi64(_mm256_mul_epu32(h0, r[3]), _mm256_mul_epu32(h1, r[2])), \
+                                      _mm256_add_epi64(_mm256_add_epi64(_mm256_mul_epu32(h2, r[1]), _mm256_mul_epu32(h3, r[0])), \
+                                                       _mm256_mul_epu32(h4, s[4]))); \
+        __m256i d4 = _mm256_add_epi64(_mm256_add_epi64(_mm256_mul_epu32(h0, r[4]), _mm256_mul_epu32(h1, r[3])), \
+                                      _mm256_add_epi64(_mm256_add_epi64(_mm256_mul_epu32(h2, r[2]), _mm256_mul_epu32(h3, r[1])), \
+                                                       _mm256_mul_epu32(h4, r[0]))); \
+        d1 = _mm256_add_epi64(d1, _mm256_srli_epi64(d0, 26)); h0 = _mm256_and_si256(d0, mask26); \
+        d2 = _mm256_add_epi64(d2, _mm256_srli_epi64(d1, 26)); h1 = _mm256_and_si256(d1, mask26); \
+        d3 = _mm256_add_epi64(d3, _mm256_srli_epi64(d2, 26)); h2 = _mm256_and_si256(d2, mask26); \
+        d4 = _mm256_add_epi64(d4, _mm256_srli_epi64(d3, 26)); h3 = _mm256_and_si256(d3, mask26); \
+        __m256i c = _mm256_srli_epi64(d4, 26); h4 = _mm256_and_si256(d4, mask26); \
+        h0 = _mm256_add_epi64(h0, _mm256_add_epi64(c, _mm256_slli_epi64(c, 2))); \
+        h1 = _mm256_add_epi64(h1, _mm256_srli_epi64(h0, 26)); h0 = _mm256_and_si256(h0, mask26); \
+    }
+
+    // Four blocks at a time, lane j takes blocks j, j + 4, ... and is multiplied by r^4 between them;
+    // the last blocks are multiplied by r^4, r^3, r^2 and r so the lanes add up to the serial result.
+    // h is in 26-bit limbs, size a non-zero multiple of 64.
+    __attribute__((target("avx2")))
+    static void polyBlocks4(u64 h[5], const u32 powers[4][5], const u8 *data, std::size_t size) {
+        const __m256i mask26 = _mm256_set1_epi64x(0x3ffffff);
+        const __m256i hibit = _mm256_set1_epi64x(1 << 24);
+        __m256i r4[5], s4[5], rLast[5], sLast[5];
+        for (int i = 0; i < 5; ++i) {
+            r4[i] = _mm256_set1_epi64x(powers[3][i]);
+            s4[i] = _mm256_set1_epi64x(static_cast<u64>(powers[3][i]) * 5);
+            rLast[i] = _mm256_set_epi64x(powers[0][i], powers[1][i], powers[2][i], powers[3][i]);
+            sLast[i] = _mm256_set_epi64x(static_cast<u64>(powers[0][i]) * 5, static_cast<u64>(powers[1][i]) * 5,
+                                         static_cast<u64>(powers[2][i]) * 5, static_cast<u64>(powers[3][i]) * 5);
+        }
+        __m256i h0 = _mm256_set_epi64x(0, 0, 0, static_cast<long long>(h[0]));
+        __m256i h1 = _mm256_set_epi64x(0, 0, 0, static_cast<long long>(h[1]));
+        __m256i h2 = _mm256_set_epi64x(0, 0, 0, static_cast<long long>(h[2]));
+        __m256i h3 = _mm256_set_epi64x(0, 0, 0, static_cast<long long>(h[3]));
+        __m256i h4 = _mm256_set_epi64x(0, 0, 0, static_cast<long long>(h[4]));
+        while (true) {
+            __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data));
+            __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + 32));
+            // low and high halves of the four blocks, in block order
+            __m256i t0 = _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(a, b), 0xd8);
+            __m256i t1 = _mm256_permute4x64_epi64(_mm256_unpackhi_epi64(a, b), 0xd8);
+            h0 = _mm256_add_epi64(h0, _mm256_and_si256(t0, mask26));
+            h1 = _mm256_add_epi64(h1, _mm256_and_si256(_mm256_srli_epi64(t0, 26), mask26));
+            h2 = _mm256_add_epi64(h2, _mm256_and_si256(_mm256_or_si256(_mm256_srli_epi64(t0, 52), _mm256_slli_epi64(t1, 12)), mask26));
+            h3 = _mm256_add_epi64(h3, _mm256_and_si256(_mm256_srli_epi64(t1, 14), mask26));
+            h4 = _mm256_add_epi64(h4, _mm256_or_si256(_mm256_srli_epi64(t1, 40), hibit));
+            data += 64;
+            size -= 64;
+            if (size == 0) {
+                break;
+            }
+            POLY_MUL4(h0, h1, h2, h3, h4, r4, s4)
+        }
+        POLY_MUL4(h0, h1, h2, h3, h4, rLast, sLast)
+        __m256i limbs[5] = {h0, h1, h2, h3, h4};
+        for (int i = 0; i < 5; ++i) {
+            alignas(32) u64 lanes[4];
+            _mm256_store_si256(reinterpret_cast<__m256i *>(lanes), limbs[i]);
+            h[i] = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+        }
+    }
+#endif
+
+    Poly1305::Poly1305(const unsigned char key[32]) {
+        u64 t0 = load64(key);
+        u64 t1 = load64(key + 8);
+        _r[0] = t0 & 0xffc0fffffff;
+        _r[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffff;
+        _r[2] = (t1 >> 24) & 0x00ffffffc0f;
+        _pad[0] = load64(key + 16);
+        _pad[1] = load64(key + 24);
+#if defined(CRYPTO_AVX2)
+        if (hasAvx2()) {
+            _powers[0][0] = load32(key) & 0x3ffffff;
+            _powers[0][1] = (load32(key + 3) >> 2) & 0x3ffff03;
+            _powers[0][2] = (load32(key + 6) >> 4) & 0x3ffc0ff;
+            _powers[0][3] = (load32(key + 9) >> 6) & 0x3f03fff;
+            _powers[0][4] = (load32(key + 12) >> 8) & 0x00fffff;
+            polyMul26(_powers[1], _powers[0], _powers[0]);
+            polyMul26(_powers[2], _powers[1], _powers[0]);
+            polyMul26(_powers[3], _powers[1], _powers[1]);
+        }
+#endif
+    }
+
+    void Poly1305::blocks(const unsigned char *data, std::size_t size, std::uint32_t hibit) {
+#if defined(CRYPTO_AVX2)
+        if (hibit != 0 && size >= polyWideMinSize && hasAvx2()) {
+            std::size_t wide = size & ~static_cast<std::size_t>(63);
+            u64 h0 = _h[0], h1 = _h[1], h2 = _h[2];
+            h2 += h1 >> 44;
+            h1 &= mask44;
+            u64 h[5] = {h0 & 0x3ffffff, ((h0 >> 26) | (h1 << 18)) & 0x3ffffff, (h1 >> 8) & 0x3ffffff,
+                        ((h1 >> 34) | (h2 << 10)) & 0x3ffffff, h2 >> 16};
+            polyBlocks4(h, _powers, data, wide);
+            for (int i = 0; i < 4; ++i) {
+                h[i + 1] += h[i] >> 26;
+                h[i] &= 0x3ffffff;
+            }
+            h[0] += (h[4] >> 26) * 5;
+            h[4] &= 0x3ffffff;
+            for (int i = 0; i < 4; ++i) {
+                h[i + 1] += h[i] >> 26;
+                h[i] &= 0x3ffffff;
+            }
+            _h[0] = (h[0] | h[1] << 26) & mask44;
+            _h[1] = (h[1] >> 18 | h[2] << 8 | h[3] << 34) & mask44;
+            _h[2] = (h[3] >> 10) + (h[4] << 16);
+            data += wide;
+            size -= wide;
+        }
+#endif
+        const u64 r0 = _r[0], r1 = _r[1], r2 = _r[2];
+        const u64 s1 = r1 * (5 << 2), s2 = r2 * (5 << 2);
+        const u64 high = hibit != 0 ? 1ULL << 40 : 0;
+        u64 h0 = _h[0], h1 = _h[1], h2 = _h[2];
+        while (size >= 16) {
+            u64 t0 = load64(data);
+            u64 t1 = load64(data + 8);
+            h0 += t0 & mask44;
+            h1 += ((t0 >> 44) | (t1 << 20)) & mask44;
+            h2 += ((t1 >> 24) & mask42) | high;
+
+            u128 d0 = static_cast<u128>(h0) * r0 + static_cast<u128>(h1) * s2 + static_cast<u128>(h2) * s1;
+            u128 d1 = static_cast<u128>(h0) * r1 + static_cast<u128>(h1) * r0 + static_cast<u128>(h2) * s2;
+            u128 d2 = static_cast<u128>(h0) * r2 + static_cast<u128>(h1) * r1 + static_cast<u128>(h2) * r0;
+
+            u64 c = static_cast<u64>(d0 >> 44);
+            h0 = static_cast<u64>(d0) & mask44;
+            d1 += c;
+            c = static_cast<u64>(d1 >> 44);
+            h1 = static_cast<u64>(d1) & mask44;
+            d2 += c;
+            c = static_cast<u64>(d2 >> 42);
+            h2 = static_cast<u64>(d2) & mask42;
+            h0 += c * 5;
+            c = h0 >> 44;
+            h0 &= mask44;
+            h1 += c;
+
+            data += 16;
+            size -= 16;
+        }
+        _h[0] = h0;
+        _h[1] = h1;
+        _h[2] = h2;
+    }
+
+#else
+    // 26-bit limbs (poly1305-donna-32)
+    Poly1305::Poly1305(const unsigned char key[32]) {
+        _r[0] = load32(key) & 0x3ffffff;
+        _r[1] = (load32(key + 3) >> 2) & 0x3ffff03;
+        _r[2] = (load32(key + 6) >> 4) & 0x3ffc0ff;
+        _r[3] = (load32(key + 9) >> 6) & 0x3f03fff;
+        _r[4] = (load32(key + 12) >> 8) & 0x00fffff;
+        for (int i = 0; i < 4; ++i) {
+            _pad[i] = load32(key + 16 + 4 * i);
+        }
+    }
+
+    void Poly1305::blocks(const unsigned char *data, std::size_t size, std::uint32_t hibit) {
+        const u32 r0 = static_cast<u32>(_r[0]), r1 = static_cast<u32>(_r[1]), r2 = static_cast<u32>(_r[2]),
+                r3 = static_cast<u32>(_r[3]), r4 = static_cast<u32>(_r[4]);
+        const u32 s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+        u32 h0 = static_cast<u32>(_h[0]), h1 = static_cast<u32>(_h[1]), h2 = static_cast<u32>(_h[2]),
+                h3 = static_cast<u32>(_h[3]), h4 = static_cast<u32>(_h[4]);
+        while (size >= 16) {
+            h0 += load32(data) & 0x3ffffff;
+            h1 += (load32(data + 3) >> 2) & 0x3ffffff;
+            h2 += (load32(data + 6) >> 4) & 0x3ffffff;
+            h3 += (load32(data + 9) >> 6) & 0x3ffffff;
+            h4 += (load32(data + 12) >> 8) | hibit;
+
+            u64 d0 = static_cast<u64>(h0) * r0 + static_cast<u64>(h1) * s4 + static_cast<u64>(h2) * s3 +
+                     static_cast<u64>(h3) * s2 + static_cast<u64>(h4) * s1;
+            u64 d1 = static_cast<u64>(h0) * r1 + static_cast<u64>(h1) * r0 + static_cast<u64>(h2) * s4 +
+                     static_cast<u64>(h3) * s3 + static_cast<u64>(h4) * s2;
+            u64 d2 = static_cast<u64>(h0) * r2 + static_cast<u64>(h1) * r1 + static_cast<u64>(h2) * r0 +
+                     static_cast<u64>(h3) * s4 + static_cast<u64>(h4) * s3;
+            u64 d3 = static_cast<u64>(h0) * r3 + static_cast<u64>(h1) * r2 + static_cast<u64>(h2) * r1 +
+                     static_cast<u64>(h3) * r0 + static_cast<u64>(h4) * s4;
+            u64 d4 = static_cast<u64>(h0) * r4 + static_cast<u64>(h1) * r3 + static_cast<u64>(h2) * r2 +
+                     static_cast<u64>(h3) * r1 + static_cast<u64>(h4) * r0;
+
+            u32 c = static_cast<u32>(d0 >> 26);
+            h0 = static_cast<u32>(d0) & 0x3ffffff;
+            d1 += c;
+            c = static_cast<u32>(d1 >> 26);
+            h1 = static_cast<u32>(d1) & 0x3ffffff;
+            d2 += c;
+            c = static_cast<u32>(d2 >> 26);
+            h2 = static_cast<u32>(d2) & 0x3ffffff;
+            d3 += c;
+            c = static_cast<u32>(d3 >> 26);
+            h3 = static_cast<u32>(d3) & 0x3ffffff;
+            d4 += c;
+            c = static_cast<u32>(d4 >> 26);
+            h4 = static_cast<u32>(d4) & 0x3ffffff;
+            h0 += c * 5;
+            c = h0 >> 26;
+            h0 &= 0x3ffffff;
+            h1 += c;
+
+            data += 16;
+            size -= 16;
+        }
+        _h[0] = h0;
+        _h[1] = h1;
+        _h[2] = h2;
+        _h[3] = h3;
+        _h[4] = h4;
+    }
+
+#endif
+
+    void Poly1305::update(const unsigned char *data, std::size_t size) {
+        if (_buffered > 0) {
+            std::size_t n = std::min(size, sizeof(_buffer) - _buffered);
+            std::memcpy(_buffer + _buffered, data, n);
+            _buffered += n;
+            data += n;
+            size -= n;
+            if (_buffered < sizeof(_buffer)) {
+                return;
+            }
+            blocks(_buffer, sizeof(_buffer), 1u << 24);
+            _buffered = 0;
+        }
+        std::size_t whole = size & ~static_cast<std::size_t>(15);
+        if (whole > 0) {
+            blocks(data, whole, 1u << 24);
+            data += whole;
+            size -= whole;
+        }
+        if (size > 0) {
+            std::memcpy(_buffer, data, size);
+            _buffered = size;
+        }
+    }
+
+#if defined(__SIZEOF_INT128__)
+    void Poly1305::finish(unsigned char tag[16]) {
+        if (_buffered > 0) {
+            _buffer[_buffered] = 1;
+            std::memset(_buffer + _buffered + 1, 0, sizeof(_buffer) - _buffered - 1);
+            blocks(_buffer, sizeof(_buffer), 0);
+            _buffered = 0;
+        }
+        u64 h0 = _h[0], h1 = _h[1], h2 = _h[2];
+        u64 c = h1 >> 44;
+        h1 &= mask44;
+        h2 += c;
+        c = h2 >> 42;
+        h2 &= mask42;
+        h0 += c * 5;
+        c = h0 >> 44;
+        h0 &= mask44;
+        h1 += c;
+        c = h1 >> 44;
+        h1 &= mask44;
+        h2 += c;
+        c = h2 >> 42;
+        h2 &= mask42;
+        h0 += c * 5;
+        c = h0 >> 44;
+        h0 &= mask44;
+        h1 += c;
+
+        // h - p, used if it does not underflow
+        u64 g0 = h0 + 5;
+        c = g0 >> 44;
+        g0 &= mask44;
+        u64 g1 = h1 + c;
+        c = g1 >> 44;
+        g1 &= mask44;
+        u64 g2 = h2 + c - (1ULL << 42);
+
+        c = (g2 >> 63) - 1;
+        g0 &= c;
+        g1 &= c;
+        g2 &= c;
+        c = ~c;
+        h0 = (h0 & c) | g0;
+        h1 = (h1 & c) | g1;
+        h2 = (h2 & c) | g2;
+
+        u64 t0 = _pad[0];
+        u64 t1 = _pad[1];
+        h0 += t0 & mask44;
+        c = h0 >> 44;
+        h0 &= mask44;
+        h1 += (((t0 >> 44) | (t1 << 20)) & mask44) + c;
+        c = h1 >> 44;
+        h1 &= mask44;
+        h2 += ((t1 >> 24) & mask42) + c;
+        h2 &= mask42;
+
+        store64(tag, h0 | (h1 << 44));
+        store64(tag + 8, (h1 >> 20) | (h2 << 24));
+    }
+
+#else
+    void Poly1305::finish(unsigned char tag[16]) {
+        if (_buffered > 0) {
+            _buffer[_buffered] = 1;
+            std::memset(_buffer + _buffered + 1, 0, sizeof(_buffer) - _buffered - 1);
+            blocks(_buffer, sizeof(_buffer), 0);
+            _buffered = 0;
+        }
+        u32 h0 = static_cast<u32>(_h[0]), h1 = static_cast<u32>(_h[1]), h2 = static_cast<u32>(_h[2]),
+                h3 = static_cast<u32>(_h[3]), h4 = static_cast<u32>(_h[4]);
+        u32 c = h1 >> 26;
+        h1 &= 0x3ffffff;
+        h2 += c;
+        c = h2 >> 26;
+        h2 &= 0x3ffffff;
+        h3 += c;
+        c = h3 >> 26;
+        h3 &= 0x3ffffff;
+        h4 += c;
+        c = h4 >> 26;
+        h4 &= 0x3ffffff;
+        h0 += c * 5;
+        c = h0 >> 26;
+        h0 &= 0x3ffffff;
+        h1 += c;
+
+        // h - p, used if it does not underflow
+        u32 g0 = h0 + 5;
+        c = g0 >> 26;
+        g0 &= 0x3ffffff;
+        u32 g1 = h1 + c;
+        c = g1 >> 26;
+        g1 &= 0x3ffffff;
+        u32 g2 = h2 + c;
+        c = g2 >> 26;
+        g2 &= 0x3ffffff;
+        u32 g3 = h3 + c;
+        c = g3 >> 26;
+        g3 &= 0x3ffffff;
+        u32 g4 = h4 + c - (1u << 26);
+
+        u32 mask = (g4 >> 31) - 1;
+        g0 &= mask;
+        g1 &= mask;
+        g2 &= mask;
+        g3 &= mask;
+        g4 &= mask;
+        mask = ~mask;
+        h0 = (h0 & mask) | g0;
+        h1 = (h1 & mask) | g1;
+        h2 = (h2 & mask) | g2;
+        h3 = (h3 & mask) | g3;
+        h4 = (h4 & mask) | g4;
+
+        h0 = h0 | (h1 << 26);
+        h1 = (h1 >> 6) | (h2 << 20);
+        h2 = (h2 >> 12) | (h3 << 14);
+        h3 = (h3 >> 18) | (h4 << 8);
+
+        u64 f = static_cast<u64>(h0) + static_cast<u32>(_pad[0]);
+        store32(tag, static_cast<u32>(f));
+        f = static_cast<u64>(h1) + static_cast<u32>(_pad[1]) + (f >> 32);
+        store32(tag + 4, static_cast<u32>(f));
+        f = static_cast<u64>(h2) + static_cast<u32>(_pad[2]) + (f >> 32);
+        store32(tag + 8, static_cast<u32>(f));
+        f = static_cast<u64>(h3) + static_cast<u32>(_pad[3]) + (f >> 32);
+        store32(tag + 12, static_cast<u32>(f));
+    }
+
+#endif
+
+    static const u8 zeros[16] = {0};
+
+    // the first 32 bytes of block 0
+    static std::array<u8, chachaBlockSize> polyKey(const Key &key, const Nonce &nonce) {
+        std::array<u8, chachaBlockSize> block{};
+        chacha20(block.data(), block.data(), block.size(), key, nonce, 0);
+        return block;
+    }
+
+    static void polyFinish(Poly1305 &poly, unsigned char tag[16], std::uint64_t size, std::uint64_t aadSize) {
+        poly.update(zeros, (16 - size % 16) % 16);
+        u8 lengths[16];
+        store64(lengths, aadSize);
+        store64(lengths + 8, size);
+        poly.update(lengths, sizeof(lengths));
+        poly.finish(tag);
+    }
+
+    static bool tagsEqual(const unsigned char *a, const unsigned char *b) {
+        u8 difference = 0;
+        for (std::size_t i = 0; i < tagSize; ++i) {
+            difference |= a[i] ^ b[i];
+        }
+        return difference == 0;
+    }
+
+    static void aeadTag(unsigned char tag[16], const unsigned char *ciphertext, std::size_t size, const unsigned char *aad,
+                        std::size_t aadSize, const Key &key, const Nonce &nonce) {
+        Poly1305 poly(polyKey(key, nonce).data());
+        poly.update(aad, aadSize);
+        poly.update(zeros, (16 - aadSize % 16) % 16);
+        poly.update(ciphertext, size);
+        polyFinish(poly, tag, size, aadSize);
+    }
+
+    void seal(unsigned char *out, unsigned char tag[16], const unsigned char *plaintext, std::size_t size,
+              const unsigned char *aad, std::size_t aadSize, const Key &key, const Nonce &nonce) {
+        chacha20(out, plaintext, size, key, nonce, 1);
+        aeadTag(tag, out, size, aad, aadSize, key, nonce);
+    }
+
+    bool open(unsigned char *out, const unsigned char *ciphertext, std::size_t size, const unsigned char tag[16],
+              const unsigned char *aad, std::size_t aadSize, const Key &key, const Nonce &nonce) {
+        u8 expected[tagSize];
+        aeadTag(expected, ciphertext, size, aad, aadSize, key, nonce);
+        if (!tagsEqual(expected, tag)) {
+            return false;
+        }
+        chacha20(out, ciphertext, size, key, nonce, 1);
+        return true;
+    }
+
+    OpenStream::OpenStream(const Key &key, const Nonce &nonce, const unsigned char *aad, std::size_t aadSize) :
+            _key(key), _nonce(nonce), _poly(polyKey(key, nonce).data()), _aadSize(aadSize) {
+        _poly.update(aad, aadSize);
+        _poly.update(zeros, (16 - aadSize % 16) % 16);
+    }
+
+    // Whole blocks go straight through chacha20(), a block split between pieces is kept.
+    void OpenStream::update(unsigned char *out, const unsigned char *ciphertext, std::size_t size) {
+        _poly.update(ciphertext, size);
+        _size += size;
+        while (size > 0 && _keystreamPos < sizeof(_keystream)) {
+            *out++ = *ciphertext++ ^ _keystream[_keystreamPos++];
+            --size;
+        }
+        std::size_t whole = size - size % chachaBlockSize;
+        if (whole > 0) {
+            chacha20(out, ciphertext, whole, _key, _nonce, _counter);
+            _counter += static_cast<u32>(whole / chachaBlockSize);
+            out += whole;
+            ciphertext += whole;
+            size -= whole;
+        }
+        if (size > 0) {
+            std::memset(_keystream, 0, sizeof(_keystream));
+            chacha20(_keystream, _keystream, sizeof(_keystream), _key, _nonce, _counter++);
+            for (_keystreamPos = 0; _keystreamPos < size; ++_keystreamPos) {
+                out[_keystreamPos] = ciphertext[_keystreamPos] ^ _keystream[_keystreamPos];
+            }
+        }
+    }
+
+    bool OpenStream::verify(const unsigned char tag[16]) {
+        u8 expected[tagSize];
+        polyFinish(_poly, expected, _size, _aadSize);
+        return tagsEqual(expected, tag);
+    }
+
+    std::optional<KeyPair> KeyPair::generate() {
+        KeyPair pair;
+        if (knotdrop_random_bytes(pair.secretKey.data(), pair.secretKey.size()) != 0) {
+            return std::nullopt;
+        }
+        x25519Base(pair.publicKey.data(), pair.secretKey.data());
+        return pair;
+    }
+
+    std::optional<Key> sessionKey(const KeyPair &own, const Key &peerPublic) {
+        Key shared;
+        x25519(shared.data(), own.secretKey.data(), peerPublic.data());
+        u8 check = 0;
+        for (u8 byte: shared) {
+            check |= byte;
+        }
+        if (check == 0) {
+            return std::nullopt;
+        }
+        static const u8 zeros[16] = {0};
+        Key key;
+        hchacha20(key.data(), shared, zeros);
+        return key;
+    }
+
+    std::string toHex(const unsigned char *data, std::size_t size) {
+        static const char digits[] = "0123456789abcdef";
+        std::string hex(size * 2, '0');
+        for (std::size_t i = 0; i < size; ++i) {
+            hex[2 * i] = digits[data[i] >> 4];
+            hex[2 * i + 1] = digits[data[i] & 15];
+        }
+        return hex;
+    }
+
+    static int hexDigit(char c) {
+        if (c >= '0' && c <= '9') {
+            return c - '0';
+        }
+        if (c >= 'a' && c <= 'f') {
+            return c - 'a' + 10;
+        }
+        if (c >= 'A' && c <= 'F') {
+            return c - 'A' + 10;
+        }
+        return -1;
+    }
+
+    bool fromHex(const std::string &hex, unsigned char *out, std::size_t size) {
+        if (hex.size() != size * 2) {
+            return false;
+        }
+        for (std::size_t i = 0; i < size; ++i) {
+            int high = hexDigit(hex[2 * i]);
+            int low = hexDigit(hex[2 * i + 1]);
+            if (high < 0 || low < 0) {
+                return false;
+            }
+            out[i] = static_cast<u8>(high << 4 | low);
+        }
+        return true;
+    }
+
+} // namespace crypto
@@ -0,0 +1,98 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+
+// X25519 (RFC 7748) and ChaCha20-Poly1305 (RFC 8439), enough for the session encryption.
+// ChaCha20 runs eight blocks at a time with AVX2 and four with SSE2 on x86-64, four with NEON
+// on AArch64; Poly1305 takes four blocks at a time with AVX2. X25519 and Poly1305 use 64-bit
+// limbs where 128-bit products exist; portable code elsewhere.
+namespace crypto {
+
+    static const std::size_t keySize = 32;
+    static const std::size_t nonceSize = 12;
+    static const std::size_t tagSize = 16;
+
+    using Key = std::array<unsigned char, keySize>;
+    using Nonce = std::array<unsigned char, nonceSize>;
+
+    void x25519(unsigned char out[32], const unsigned char scalar[32], const unsigned char point[32]);
+    void x25519Base(unsigned char out[32], const unsigned char scalar[32]);
+
+    // XORs size bytes of keystream starting at block counter into out
+    void chacha20(unsigned char *out, const unsigned char *in, std::size_t size, const Key &key, const Nonce &nonce,
+                  std::uint32_t counter);
+    void hchacha20(unsigned char out[32], const Key &key, const unsigned char input[16]);
+
+    class Poly1305 {
+    public:
+        explicit Poly1305(const unsigned char key[32]);
+
+        void update(const unsigned char *data, std::size_t size);
+        void finish(unsigned char tag[16]);
+
+    private:
+        void blocks(const unsigned char *data, std::size_t size, std::uint32_t hibit);
+
+        // 44-bit limbs where 128-bit products are available, 26-bit limbs elsewhere
+        std::uint64_t _r[5] = {};
+        std::uint64_t _h[5] = {};
+        std::uint64_t _pad[4] = {};
+        // r to r^4 in 26-bit limbs, for four blocks at a time with AVX2
+        std::uint32_t _powers[4][5] = {};
+        unsigned char _buffer[16];
+        std::size_t _buffered = 0;
+    };
+
+    // AEAD_CHACHA20_POLY1305, ciphertext has the size of the plaintext; in place is fine
+    void seal(unsigned char *out, unsigned char tag[16], const unsigned char *plaintext, std::size_t size,
+              const unsigned char *aad, std::size_t aadSize, const Key &key, const Nonce &nonce);
+    // false and out untouched if the tag does not match
+    bool open(unsigned char *out, const unsigned char *ciphertext, std::size_t size, const unsigned char tag[16],
+              const unsigned char *aad, std::size_t aadSize, const Key &key, const Nonce &nonce);
+
+    // AEAD_CHACHA20_POLY1305 opened as the ciphertext arrives, a piece at a time. The plaintext
+    // is not authentic before verify() returned true.
+    class OpenStream {
+    public:
+        OpenStream(const Key &key, const Nonce &nonce, const unsigned char *aad, std::size_t aadSize);
+
+        void update(unsigned char *out, const unsigned char *ciphertext, std::size_t size); // in place is fine
+        bool verify(const unsigned char tag[16]);
+
+    private:
+        Key _key;
+        Nonce _nonce;
+        Poly1305 _poly;
+        std::uint64_t _aadSize;
+        std::uint64_t _size = 0;
+        std::uint32_t _counter = 1;
+        unsigned char _keystream[64];
+        std::size_t _keystreamPos = sizeof(_keystream);
+    };
+
+    // Ephemeral X25519 key pair, one per session.
+    struct KeyPair {
+        Key publicKey{};
+        Key secretKey{};
+
+        static std::optional<KeyPair> generate();
+    };
+
+    // Shared session key: HChaCha20 of the X25519 result, as NaCl's crypto_box does.
+    // Empty for low-order peer keys.
+    std::optional<Key> sessionKey(const KeyPair &own, const Key &peerPublic);
+
+    std::string toHex(const unsigned char *data, std::size_t size);
+    bool fromHex(const std::string &hex, unsigned char *out, std::size_t size); // exactly 2 * size digits
+
+} // namespace crypto
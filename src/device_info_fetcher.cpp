@@ -0,0 +1,172 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+
+#include "device_info_fetcher.hpp"
+#include "core.h"
+#include "specification.h"
+#include "logger.h"
+#include "connection_share.hpp"
+#include <algorithm>
+#include <vector>
+
+static const unsigned fetchMaxAttempts = 3;
+static const long fetchConnectTimeoutMs = 2 * 1000; // 2 secs
+static const long fetchTimeoutMs = 5 * 1000; // 5 secs
+static const std::chrono::milliseconds fetchRetryBackoff(250);
+
+static size_t fetchWriteFunction(char *data, size_t size, size_t nmemb, std::string *response) {
+    size_t totalSize = size * nmemb;
+    response->append(data, totalSize);
+    return totalSize;
+}
+
+namespace discovery {
+
+    DeviceInfoFetcher::DeviceInfoFetcher(fetchCallback callback, std::size_t maxConcurrent) :
+            _callback(std::move(callback)), _maxConcurrent(maxConcurrent) {
+        transport::globalInit();
+        _multi = curl_multi_init();
+        curl_multi_setopt(_multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, static_cast<long>(maxConcurrent));
+        curl_multi_setopt(_multi, CURLMOPT_MAXCONNECTS, static_cast<long>(maxConcurrent));
+        _thread = std::thread([this]() {
+            loop();
+        });
+    }
+
+    DeviceInfoFetcher::~DeviceInfoFetcher() {
+        stop();
+        for (Job *job: _pending) {
+            delete job;
+        }
+        curl_multi_cleanup(_multi);
+    }
+
+    void DeviceInfoFetcher::fetch(const Remote &remote) {
+        if (_stopped) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _pending.push_back(new Job{remote});
+        }
+        curl_multi_wakeup(_multi);
+    }
+
+    void DeviceInfoFetcher::stop() {
+        if (_stopped.exchange(true)) {
+            return;
+        }
+        curl_multi_wakeup(_multi);
+        if (_thread.joinable()) {
+            _thread.join();
+        }
+    }
+
+    void DeviceInfoFetcher::loop() {
+        std::vector<CURL *> active;
+        std::vector<CURL *> idle;
+
+        while (!_stopped) {
+            auto now = std::chrono::steady_clock::now();
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                for (auto it = _pending.begin(); it != _pending.end() && active.size() < _maxConcurrent;) {
+                    Job *job = *it;
+                    if (job->notBefore > now) {
+                        ++it;
+                        continue;
+                    }
+                    it = _pending.erase(it);
+
+                    CURL *curl;
+                    if (idle.empty()) {
+                        curl = curl_easy_init();
+                        if (!curl) {
+                            LOG_ERROR("Failed to initialize curl");
+                            delete job;
+                            continue;
+                        }
+                    } else {
+                        curl = idle.back();
+                        idle.pop_back();
+                        curl_easy_reset(curl);
+                    }
+                    std::string url = toBaseUrl(job->remote) + flowdrop_endpoint_device_info;
+                    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+                    curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+                    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+                    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+                    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, fetchConnectTimeoutMs);
+                    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, fetchTimeoutMs);
+                    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, fetchWriteFunction);
+                    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &job->response);
+                    curl_easy_setopt(curl, CURLOPT_PRIVATE, job);
+                    curl_multi_add_handle(_multi, curl);
+                    active.push_back(curl);
+                }
+            }
+
+            int running = 0;
+            curl_multi_perform(_multi, &running);
+
+            CURLMsg *msg;
+            int queued = 0;
+            while ((msg = curl_multi_info_read(_multi, &queued)) != nullptr) {
+                if (msg->msg != CURLMSG_DONE) {
+                    continue;
+                }
+                CURL *curl = msg->easy_handle;
+                CURLcode result = msg->data.result;
+                Job *job = nullptr;
+                long status = 0;
+                curl_easy_getinfo(curl, CURLINFO_PRIVATE, &job);
+                curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+                curl_multi_remove_handle(_multi, curl);
+                active.erase(std::find(active.begin(), active.end(), curl));
+                idle.push_back(curl);
+
+                if (result == CURLE_OK && status == 200) {
+                    try {
+                        flowdrop::DeviceInfo deviceInfo = json::parse(job->response);
+                        _callback(deviceInfo);
+                    } catch (const std::exception &e) {
+                        LOG_DEBUG("Invalid device_info" << Logger::kv("ip", job->remote.ip) << Logger::kv("error", e.what()));
+                    }
+                    delete job;
+                    continue;
+                }
+                if (++job->attempt < fetchMaxAttempts) {
+                    job->response.clear();
+                    job->notBefore = std::chrono::steady_clock::now() + fetchRetryBackoff * job->attempt;
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    _pending.push_back(job);
+                    continue;
+                }
+                if (result != CURLE_OK) {
+                    LOG_DEBUG("Failed to fetch device_info" << Logger::kv("ip", job->remote.ip) << Logger::kv("error", curl_easy_strerror(result)));
+                } else {
+                    LOG_DEBUG("Failed to fetch device_info" << Logger::kv("ip", job->remote.ip) << Logger::kv("status", status));
+                }
+                delete job;
+            }
+
+            curl_multi_poll(_multi, nullptr, 0, running > 0 ? 100 : static_cast<int>(fetchRetryBackoff.count()), nullptr);
+        }
+
+        for (CURL *curl: active) {
+            Job *job = nullptr;
+            curl_easy_getinfo(curl, CURLINFO_PRIVATE, &job);
+            curl_multi_remove_handle(_multi, curl);
+            curl_easy_cleanup(curl);
+            delete job;
+        }
+        for (CURL *curl: idle) {
+            curl_easy_cleanup(curl);
+        }
+    }
+
+} // namespace discovery
@@ -0,0 +1,50 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+#pragma once
+
+#include "flowdrop/flowdrop.hpp"
+#include "discovery.hpp"
+#include "curl/curl.h"
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace discovery {
+
+    // Fetches /device_info of discovered peers on a single curl_multi event loop,
+    // so the thread count stays constant no matter how many peers are on the network.
+    class DeviceInfoFetcher {
+    public:
+        using fetchCallback = std::function<void(const flowdrop::DeviceInfo &)>;
+
+        explicit DeviceInfoFetcher(fetchCallback callback, std::size_t maxConcurrent = 16);
+        ~DeviceInfoFetcher();
+
+        void fetch(const Remote &remote);
+        void stop();
+
+    private:
+        struct Job {
+            Remote remote;
+            unsigned attempt = 0;
+            std::chrono::steady_clock::time_point notBefore;
+            std::string response;
+        };
+
+        void loop();
+
+        fetchCallback _callback;
+        std::size_t _maxConcurrent;
+        CURLM *_multi;
+        std::mutex _mutex;
+        std::deque<Job *> _pending;
+        std::atomic<bool> _stopped{false};
+        std::thread _thread;
+    };
+
+} // namespace discovery
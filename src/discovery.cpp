@@ -7,35 +7,155 @@
 
 #include "flowdrop/flowdrop.hpp"
 #include "core.h"
-#include "knot/dnssd.h"
+#include "dnssd_backend.h"
 #include "discovery.hpp"
 #include "specification.h"
-#include "curl/curl.h"
 #include "logger.h"
-#include <set>
+#include "happy_eyeballs.hpp"
+#include <condition_variable>
+#include <mutex>
 #include <thread>
 
-size_t curl_write_function(void *contents, size_t size, size_t nmemb, std::string *output) {
-    size_t totalSize = size * nmemb;
-    output->append(static_cast<char *>(contents), totalSize);
-    return totalSize;
+static const std::chrono::milliseconds queryTimeout(5 * 1000); // 5 secs
+static const std::chrono::milliseconds resolutionDelay(50); // RFC 8305, section 3
+static const std::chrono::milliseconds raceTimeout(3 * 1000); // 3 secs
+static const std::chrono::milliseconds discoverPollInterval(50);
+
+// truncates to at most maxLength bytes without splitting a UTF-8 sequence
+std::string truncateUtf8(const std::string &value, size_t maxLength) {
+    if (value.size() <= maxLength) {
+        return value;
+    }
+    size_t length = maxLength;
+    while (length > 0 && (static_cast<unsigned char>(value[length]) & 0xC0) == 0x80) {
+        --length;
+    }
+    return value.substr(0, length);
 }
 
-void discovery::announce(const std::string &id, unsigned short port, bool useIPv4, const std::function<bool()> &isStopped) {
+void setTxtOptional(std::unordered_map<std::string, std::string> &txt, const char *key, const std::optional<std::string> &value) {
+    if (value.has_value() && !value->empty()) {
+        txt[key] = truncateUtf8(value.value(), flowdrop_txt_value_max_length);
+    }
+}
+
+void getTxtOptional(const std::unordered_map<std::string, std::string> &txt, const char *key, std::optional<std::string> &value) {
+    auto it = txt.find(key);
+    if (it != txt.end() && !it->second.empty()) {
+        value = it->second;
+    }
+}
+
+std::optional<flowdrop::DeviceInfo> deviceInfoFromTxt(const std::string &id, const std::unordered_map<std::string, std::string> &txt) {
+    auto it = txt.find(flowdrop_txt_key_info_version);
+    if (it == txt.end() || it->second != std::to_string(flowdrop_txt_info_version)) {
+        return std::nullopt;
+    }
+    flowdrop::DeviceInfo deviceInfo;
+    deviceInfo.id = id;
+    getTxtOptional(txt, flowdrop_txt_key_name, deviceInfo.name);
+    getTxtOptional(txt, flowdrop_txt_key_model, deviceInfo.model);
+    getTxtOptional(txt, flowdrop_txt_key_platform, deviceInfo.platform);
+    getTxtOptional(txt, flowdrop_txt_key_system_version, deviceInfo.system_version);
+    return deviceInfo;
+}
+
+void discovery::announce(const flowdrop::DeviceInfo &deviceInfo, unsigned short port, bool useIPv4, const std::function<bool()> &isStopped) {
     std::unordered_map<std::string, std::string> txt;
     txt[flowdrop_txt_key_version] = std::to_string(flowdrop_version);
     if (useIPv4) {
         txt[flowdrop_txt_key_ipfamily] = "4";
     }
-    registerService(id.c_str(), flowdrop_reg_type, flowdrop_dns_domain, port, txt, isStopped);
+    txt[flowdrop_txt_key_info_version] = std::to_string(flowdrop_txt_info_version);
+    setTxtOptional(txt, flowdrop_txt_key_name, deviceInfo.name);
+    setTxtOptional(txt, flowdrop_txt_key_model, deviceInfo.model);
+    setTxtOptional(txt, flowdrop_txt_key_platform, deviceInfo.platform);
+    setTxtOptional(txt, flowdrop_txt_key_system_version, deviceInfo.system_version);
+    txt[flowdrop_txt_key_capabilities] = std::to_string(flowdrop_capabilities);
+    registerService(deviceInfo.id.c_str(), flowdrop_reg_type, flowdrop_dns_domain, port, txt, isStopped);
 }
 
 discovery::IPType convert(IPType ipType) {
     return ipType == IPv6 ? discovery::IPv6 : discovery::IPv4;
 }
 
+std::string discovery::toBaseUrl(const Remote &remote) {
+    std::string host = remote.ip;
+    if (remote.ipType == IPv6) {
+        host = "[" + host + "]";
+    }
+    return "http://" + host + ":" + std::to_string(remote.port) + "/";
+}
+
+struct AddressQuery {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<discovery::Remote> ipv6;
+    std::vector<discovery::Remote> ipv4;
+    std::optional<std::chrono::steady_clock::time_point> ipv4AnsweredAt;
+    int pending = 0;
+};
+
+// Queries AAAA and A records in parallel. Always waits for A, peers announcing ipf=4 may only be
+// reachable over it. AAAA is waited for unless A answers first, in which case it gets one
+// resolution delay to catch up (RFC 8305, section 3). The preferred family comes first, the
+// connection race interleaves the two.
+std::vector<discovery::Remote> queryAddresses(const std::string &hostName, unsigned short port, bool preferIPv4) {
+    auto query = std::make_shared<AddressQuery>();
+    auto start = [&query, &hostName, port](bool ipv4) {
+        {
+            std::lock_guard<std::mutex> lock(query->mutex);
+            ++query->pending;
+        }
+        std::thread([query, hostName, port, ipv4]() {
+            queryCallback qCallback = [query, port, ipv4](const std::optional<IPAddress> &ipOpt) {
+                std::lock_guard<std::mutex> lock(query->mutex);
+                if (ipOpt.has_value()) {
+                    const IPAddress &ip = ipOpt.value();
+                    (ipv4 ? query->ipv4 : query->ipv6).push_back({convert(ip.type), ip.value, port});
+                    if (ipv4 && !query->ipv4AnsweredAt.has_value()) {
+                        query->ipv4AnsweredAt = std::chrono::steady_clock::now();
+                    }
+                }
+                --query->pending;
+                query->cv.notify_all();
+            };
+            if (ipv4) {
+                queryIPv4Address(hostName.c_str(), qCallback);
+            } else {
+                queryIPv6Address(hostName.c_str(), qCallback);
+            }
+        }).detach();
+    };
+#if !defined(IPV6_NOT_SUPPORTED)
+    start(false);
+#endif
+    start(true);
+
+    std::unique_lock<std::mutex> lock(query->mutex);
+    auto deadline = std::chrono::steady_clock::now() + queryTimeout;
+    while (query->pending != 0) {
+        auto wakeUp = query->ipv4AnsweredAt.has_value() ? std::min(*query->ipv4AnsweredAt + resolutionDelay, deadline) : deadline;
+        if (std::chrono::steady_clock::now() >= wakeUp) {
+            break;
+        }
+        query->cv.wait_until(lock, wakeUp);
+    }
+
+    std::vector<discovery::Remote> candidates;
+    const std::vector<discovery::Remote> &first = preferIPv4 ? query->ipv4 : query->ipv6;
+    const std::vector<discovery::Remote> &second = preferIPv4 ? query->ipv6 : query->ipv4;
+    candidates.insert(candidates.end(), first.begin(), first.end());
+    candidates.insert(candidates.end(), second.begin(), second.end());
+    return candidates;
+}
+
 void discovery::resolveAndQuery(const std::string &id, const resolveCallback &callback) {
-    resolveService(id.c_str(), flowdrop_reg_type, flowdrop_dns_domain, [callback](const std::optional<ResolveReply> &replyOpt) {
+    resolveAndQuery(id, callback, nullptr);
+}
+
+void discovery::resolveAndQuery(const std::string &id, const resolveCallback &callback, const txtInfoCallback &txtInfoCallback) {
+    resolveService(id.c_str(), flowdrop_reg_type, flowdrop_dns_domain, [id, callback, txtInfoCallback](const std::optional<ResolveReply> &replyOpt) {
         if (!replyOpt.has_value()) {
             callback(std::nullopt);
             return;
@@ -46,102 +166,55 @@ void discovery::resolveAndQuery(const std::string &id, const resolveCallback &ca
             callback(std::nullopt);
             return;
         }
+        if (txtInfoCallback != nullptr) {
+            std::optional<flowdrop::DeviceInfo> deviceInfo = deviceInfoFromTxt(id, txt);
+            if (deviceInfo.has_value()) {
+                txtInfoCallback(deviceInfo.value());
+            }
+        }
         unsigned short port = reply.port;
+        unsigned capabilities = 0;
+        try {
+            capabilities = static_cast<unsigned>(std::stoul(txt[flowdrop_txt_key_capabilities]));
+        } catch (const std::exception &) {
+            // peer is older than capabilities
+        }
         if (reply.ip.has_value()) {
             const IPAddress &ip = reply.ip.value();
-            callback({{convert(ip.type), ip.value, port}});
+            callback({{convert(ip.type), ip.value, port, capabilities}});
             return;
         }
         if (!reply.hostName.has_value()) {
             throw std::runtime_error("ip and hostName cannot be irrelevant at the same time");
         }
-#if defined(IPV6_NOT_SUPPORTED)
-        bool useIPv4 = true;
-#else
-        bool useIPv4 = txt[flowdrop_txt_key_ipfamily] == "4";
-#endif
-        const char *hostName = reply.hostName.value().c_str();
-        queryCallback qCallback = [callback, port](const std::optional<IPAddress> &ipOpt){
-            if (!ipOpt.has_value()) {
-                callback(std::nullopt);
-                return;
-            }
-            const IPAddress &ip = ipOpt.value();
-            callback({{convert(ip.type), ip.value, port}});
-        };
-        if (!useIPv4) {
-            queryIPv6Address(hostName, qCallback);
-        } else {
-            queryIPv4Address(hostName, qCallback);
+        bool preferIPv4 = txt[flowdrop_txt_key_ipfamily] == "4";
+        std::vector<Remote> candidates = queryAddresses(reply.hostName.value(), port, preferIPv4);
+        for (Remote &candidate: candidates) {
+            candidate.capabilities = capabilities;
         }
+        if (candidates.size() <= 1) {
+            callback(candidates.empty() ? std::nullopt : std::optional<Remote>(candidates.front()));
+            return;
+        }
+        std::optional<Remote> winner = raceConnect(candidates, raceTimeout);
+        if (winner.has_value()) {
+            LOG_DEBUG("happy eyeballs winner" << Logger::kv("ip", winner->ip));
+        }
+        callback(winner);
     });
 }
 
 void flowdrop::discover(const flowdrop::discoverCallback &callback, const std::function<bool()> &isStopped) {
-    std::set<std::string> foundServices;
-
-    findService(flowdrop_reg_type, flowdrop_dns_domain, [callback, &foundServices](const FindReply &findReply) {
-        auto it = foundServices.find(findReply.serviceName);
-        if (it != foundServices.end()) {
-            return;
+    DiscoverySession session([callback](DiscoveryEvent event, const DeviceInfo &deviceInfo) {
+        if (event == DiscoveryEvent::Added) {
+            callback(deviceInfo);
         }
-        foundServices.insert(findReply.serviceName);
-
-        Logger::log(Logger::LEVEL_DEBUG, "found: " + std::string(findReply.serviceName) + " " + findReply.regType + " " + findReply.replyDomain);
-
-        discovery::resolveAndQuery(findReply.serviceName, [callback](const std::optional<discovery::Remote> &remoteOpt) {
-            if (!remoteOpt.has_value()) return;
-            const discovery::Remote &remote = remoteOpt.value();
-            Logger::log(Logger::LEVEL_DEBUG, "fully resolved: " + remote.ip + " " + std::to_string(remote.port));
-
-            std::thread fetchDeviceInfo([remote, callback](){
-                curl_global_init(CURL_GLOBAL_NOTHING);
-
-                CURL *curl = curl_easy_init();
-                if (!curl) {
-                    Logger::log(Logger::LEVEL_ERROR, "Failed to initialize curl");
-                    return;
-                }
-
-                std::string host = remote.ip;
-                if (remote.ipType == discovery::IPv6) {
-                    host = "[" + host + "]";
-                }
-                std::string baseUrl = "http://" + host + ":" + std::to_string(remote.port) + "/";
-
-                std::string url = baseUrl + "device_info";
-                curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-                curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
-
-                std::string response;
-                curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_function);
-                curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-
-                CURLcode res = curl_easy_perform(curl);
-                if (res != CURLE_OK) {
-                    Logger::log(Logger::LEVEL_DEBUG, "Failed to execute GET request: " + std::string(curl_easy_strerror(res)));
-                    curl_easy_cleanup(curl);
-                    curl_global_cleanup();
-                    return;
-                }
-
-                curl_easy_cleanup(curl);
-                curl_global_cleanup();
-
-                json jsonData;
-                try {
-                    jsonData = json::parse(response);
-                } catch (const std::exception &) {
-                    return;
-                }
-                DeviceInfo deviceInfo;
-                from_json(jsonData, deviceInfo);
-
-                callback(deviceInfo);
-            });
-            fetchDeviceInfo.detach();
-        });
-    }, isStopped);
+    });
+    session.start();
+    while (!isStopped()) {
+        std::this_thread::sleep_for(discoverPollInterval);
+    }
+    session.stop();
 }
 
 void flowdrop::discover(const flowdrop::discoverCallback &callback) {
@@ -8,7 +8,7 @@
 
 namespace discovery {
 
-    void announce(const std::string &id, unsigned short port, bool useIPv4, const std::function<bool()> &isStopped);
+    void announce(const flowdrop::DeviceInfo &deviceInfo, unsigned short port, bool useIPv4, const std::function<bool()> &isStopped);
 
     enum IPType {
         IPv6,
@@ -19,10 +19,18 @@ namespace discovery {
         IPType ipType;
         std::string ip;
         unsigned short port;
+        unsigned capabilities = 0; // flowdrop_capability_* announced by the peer
     };
 
+    std::string toBaseUrl(const Remote &remote);
+
     using resolveCallback = std::function<void(const std::optional<Remote> &)>;
 
+    using txtInfoCallback = std::function<void(const flowdrop::DeviceInfo &)>;
+
     void resolveAndQuery(const std::string &id, const resolveCallback &callback);
 
+    // txtInfoCallback is called before the address query when the TXT record carries device info
+    void resolveAndQuery(const std::string &id, const resolveCallback &callback, const txtInfoCallback &txtInfoCallback);
+
 } // namespace discovery
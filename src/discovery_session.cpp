@@ -0,0 +1,319 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+
+#include "flowdrop/flowdrop.hpp"
+#include "dnssd_backend.h"
+#include "discovery.hpp"
+#include "specification.h"
+#include "logger.h"
+#include "peer_cache.hpp"
+#include "device_info_fetcher.hpp"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+using Clock = std::chrono::steady_clock;
+
+static const std::chrono::seconds defaultPeerTTL(120); // SRV record TTL, RFC 6762 section 10
+static const std::chrono::milliseconds minSweepInterval(100);
+// resolves block until the backend gives up on a dead peer, so the pool grows while all workers are busy
+static const std::size_t maxResolveWorkers = 64;
+static const std::chrono::seconds resolveWorkerIdleTimeout(10);
+
+static bool sameDeviceInfo(const flowdrop::DeviceInfo &a, const flowdrop::DeviceInfo &b) {
+    return a.id == b.id && a.name == b.name && a.model == b.model && a.platform == b.platform &&
+           a.system_version == b.system_version;
+}
+
+// Shared with the detached resolve workers, which may finish a resolve after the session is gone.
+struct DiscoveryState : std::enable_shared_from_this<DiscoveryState> {
+    struct Peer {
+        std::optional<flowdrop::DeviceInfo> deviceInfo;
+        Clock::time_point seen;
+        bool resolving = false;
+    };
+
+    flowdrop::discoveryEventCallback callback;
+    std::chrono::seconds ttl = defaultPeerTTL;
+    std::atomic<bool> stopped{false};
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::unordered_map<std::string, Peer> peers;
+    std::deque<std::string> resolveQueue;
+    std::size_t workers = 0;
+    std::size_t idleWorkers = 0;
+
+    std::mutex callbackMutex;
+    std::shared_ptr<discovery::DeviceInfoFetcher> fetcher;
+
+    void emit(flowdrop::DiscoveryEvent event, const flowdrop::DeviceInfo &deviceInfo) {
+        std::lock_guard<std::mutex> lock(callbackMutex);
+        if (stopped) {
+            return;
+        }
+        callback(event, deviceInfo);
+    }
+
+    // caller must hold the mutex
+    void enqueueResolve(const std::string &id, Peer &peer) {
+        if (peer.resolving) {
+            return;
+        }
+        peer.resolving = true;
+        resolveQueue.push_back(id);
+        if (idleWorkers < resolveQueue.size() && workers < maxResolveWorkers) {
+            ++workers;
+            std::thread([state = shared_from_this()]() {
+                state->resolveLoop();
+            }).detach();
+        }
+        cv.notify_all();
+    }
+
+    void found(const std::string &id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = peers.find(id);
+        if (it != peers.end()) {
+            it->second.seen = Clock::now();
+            return;
+        }
+        LOG_DEBUG("found" << Logger::kv("id", id));
+        Peer &peer = peers[id];
+        peer.seen = Clock::now();
+        enqueueResolve(id, peer);
+    }
+
+    void deviceInfoReceived(const flowdrop::DeviceInfo &deviceInfo) {
+        std::optional<flowdrop::DiscoveryEvent> event;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = peers.find(deviceInfo.id);
+            if (it == peers.end()) {
+                return;
+            }
+            Peer &peer = it->second;
+            peer.seen = Clock::now();
+            if (!peer.deviceInfo.has_value()) {
+                event = flowdrop::DiscoveryEvent::Added;
+            } else if (!sameDeviceInfo(peer.deviceInfo.value(), deviceInfo)) {
+                event = flowdrop::DiscoveryEvent::Updated;
+            }
+            peer.deviceInfo = deviceInfo;
+        }
+        if (event.has_value()) {
+            emit(event.value(), deviceInfo);
+        }
+    }
+
+    void resolve(const std::string &id) {
+        auto txtInfo = std::make_shared<std::optional<flowdrop::DeviceInfo>>();
+        bool resolved = false;
+        try {
+            discovery::resolveAndQuery(id, [this, &id, &resolved, txtInfo](const std::optional<discovery::Remote> &remoteOpt) {
+                if (!remoteOpt.has_value()) return;
+                resolved = true;
+                const discovery::Remote &remote = remoteOpt.value();
+                LOG_DEBUG("fully resolved" << Logger::kv("ip", remote.ip) << Logger::kv("port", remote.port));
+                discovery::PeerCache &peerCache = discovery::PeerCache::instance();
+                peerCache.put(id, remote);
+                if (txtInfo->has_value()) {
+                    peerCache.putDeviceInfo(txtInfo->value());
+                    return;
+                }
+                bool known;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    auto it = peers.find(id);
+                    known = it != peers.end() && it->second.deviceInfo.has_value();
+                    if (known) {
+                        it->second.seen = Clock::now();
+                    }
+                }
+                if (!known) {
+                    // peer is older than TXT device info
+                    fetcher->fetch(remote);
+                }
+            }, [this, txtInfo](const flowdrop::DeviceInfo &deviceInfo) {
+                *txtInfo = deviceInfo;
+                deviceInfoReceived(deviceInfo);
+            });
+        } catch (const std::exception &e) {
+            LOG_DEBUG("resolve error: " << e.what());
+        }
+        if (!resolved) {
+            LOG_DEBUG("not resolved" << Logger::kv("id", id));
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = peers.find(id);
+        if (it != peers.end()) {
+            it->second.resolving = false;
+        }
+    }
+
+    void resolveLoop() {
+        while (true) {
+            std::string id;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ++idleWorkers;
+                bool ready = cv.wait_for(lock, resolveWorkerIdleTimeout, [this]() { return stopped || !resolveQueue.empty(); });
+                --idleWorkers;
+                if (stopped || !ready) {
+                    --workers;
+                    return;
+                }
+                id = resolveQueue.front();
+                resolveQueue.pop_front();
+            }
+            resolve(id);
+        }
+    }
+
+    // Re-resolves peers that were not seen for half the TTL and drops the ones past it.
+    void sweepLoop() {
+        auto interval = std::max<Clock::duration>(std::chrono::duration_cast<Clock::duration>(ttl) / 4, minSweepInterval);
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!cv.wait_for(lock, interval, [this]() { return stopped.load(); })) {
+            Clock::time_point now = Clock::now();
+            std::vector<flowdrop::DeviceInfo> removed;
+            for (auto it = peers.begin(); it != peers.end();) {
+                Peer &peer = it->second;
+                auto age = now - peer.seen;
+                // a peer waiting for its revalidation is not expired, dead peers can hold the workers
+                if (age > ttl && !peer.resolving) {
+                    if (peer.deviceInfo.has_value()) {
+                        removed.push_back(peer.deviceInfo.value());
+                    }
+                    discovery::PeerCache::instance().invalidate(it->first);
+                    it = peers.erase(it);
+                    continue;
+                }
+                if (age > ttl / 2) {
+                    enqueueResolve(it->first, peer);
+                }
+                ++it;
+            }
+            if (removed.empty()) {
+                continue;
+            }
+            lock.unlock();
+            for (const flowdrop::DeviceInfo &deviceInfo: removed) {
+                LOG_DEBUG("lost" << Logger::kv("id", deviceInfo.id));
+                emit(flowdrop::DiscoveryEvent::Removed, deviceInfo);
+            }
+            lock.lock();
+        }
+    }
+};
+
+class flowdrop::DiscoverySession::Impl {
+public:
+    explicit Impl(const discoveryEventCallback &callback) : _state(std::make_shared<DiscoveryState>()) {
+        _state->callback = callback;
+    }
+
+    ~Impl() {
+        stop();
+    }
+
+    [[nodiscard]] std::chrono::seconds getPeerTTL() const {
+        return _state->ttl;
+    }
+
+    void setPeerTTL(const std::chrono::seconds &ttl) {
+        _state->ttl = ttl;
+    }
+
+    void start() {
+        if (_started) {
+            return;
+        }
+        _started = true;
+        DiscoveryState *state = _state.get();
+        // the fetcher is stopped before the state can go away, a raw pointer avoids a cycle
+        state->fetcher = std::make_shared<discovery::DeviceInfoFetcher>([state](const DeviceInfo &deviceInfo) {
+            discovery::PeerCache::instance().putDeviceInfo(deviceInfo);
+            state->deviceInfoReceived(deviceInfo);
+        });
+        _sweepThread = std::thread([state]() {
+            state->sweepLoop();
+        });
+        _browseThread = std::thread([state]() {
+            findService(flowdrop_reg_type, flowdrop_dns_domain, [state](const FindReply &findReply) {
+                state->found(findReply.serviceName);
+            }, [state]() {
+                return state->stopped.load();
+            });
+        });
+    }
+
+    void stop() {
+        if (!_started || _state->stopped.exchange(true)) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(_state->mutex);
+            _state->cv.notify_all();
+        }
+        if (_browseThread.joinable()) {
+            _browseThread.join();
+        }
+        if (_sweepThread.joinable()) {
+            _sweepThread.join();
+        }
+        _state->fetcher->stop();
+        // wait for an event being delivered, later ones are dropped
+        std::lock_guard<std::mutex> lock(_state->callbackMutex);
+    }
+
+    [[nodiscard]] std::vector<DeviceInfo> getPeers() const {
+        std::vector<DeviceInfo> result;
+        std::lock_guard<std::mutex> lock(_state->mutex);
+        for (const auto &[id, peer]: _state->peers) {
+            if (peer.deviceInfo.has_value()) {
+                result.push_back(peer.deviceInfo.value());
+            }
+        }
+        return result;
+    }
+
+private:
+    std::shared_ptr<DiscoveryState> _state;
+    bool _started = false;
+    std::thread _browseThread;
+    std::thread _sweepThread;
+};
+
+flowdrop::DiscoverySession::DiscoverySession(const discoveryEventCallback &callback) : pImpl(new Impl(callback)) {}
+
+flowdrop::DiscoverySession::~DiscoverySession() = default;
+
+std::chrono::seconds flowdrop::DiscoverySession::getPeerTTL() const {
+    return pImpl->getPeerTTL();
+}
+
+flowdrop::DiscoverySession &flowdrop::DiscoverySession::setPeerTTL(const std::chrono::seconds &ttl) {
+    pImpl->setPeerTTL(ttl);
+    return *this;
+}
+
+void flowdrop::DiscoverySession::start() {
+    pImpl->start();
+}
+
+void flowdrop::DiscoverySession::stop() {
+    pImpl->stop();
+}
+
+std::vector<flowdrop::DeviceInfo> flowdrop::DiscoverySession::getPeers() const {
+    return pImpl->getPeers();
+}
@@ -0,0 +1,13 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+#pragma once
+
+#if defined(FLOWDROP_LOOPBACK_DNSSD)
+#include "loopback_dnssd/loopback_dnssd.h"
+#else
+#include "knot/dnssd.h"
+#endif
@@ -0,0 +1,428 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+
+#include "flowdrop/flowdrop.hpp"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+namespace flowdrop {
+
+    class EventDispatcher::Impl {
+    public:
+        enum Type {
+            Resolving,
+            ReceiverNotFound,
+            Resolved,
+            AskingReceiver,
+            ReceiverDeclined,
+            ReceiverAccepted,
+            LinkProbed,
+            SendingStart,
+            SendingTotalProgress,
+            SendingFileStart,
+            SendingFileProgress,
+            SendingFileEnd,
+            SendingEnd,
+            ReceiverStarted,
+            SenderAsk,
+            ReceivingStart,
+            ReceivingTotalProgress,
+            ReceivingFileStart,
+            ReceivingFileProgress,
+            ReceivingFileEnd,
+            ReceivingEnd
+        };
+
+        // Every event in one struct, the fields an event does not use stay empty. The sender is
+        // shared between the events of one device.
+        struct Event {
+            Type type;
+            std::shared_ptr<const DeviceInfo> sender;
+            FileInfo file{};
+            std::uint64_t totalSize = 0;
+            std::uint64_t currentSize = 0;
+            LinkProbe probe{};
+            unsigned short port = 0;
+            std::vector<FileInfo> files;
+        };
+
+        Impl(IEventListener *listener, executor runner, std::size_t capacity) :
+                _listener(listener), _runner(std::move(runner)), _capacity(std::max<std::size_t>(capacity, 1)) {
+            if (!_runner) {
+                _thread = std::thread([this]() {
+                    run();
+                });
+            }
+        }
+
+        ~Impl() {
+            flush();
+            if (_thread.joinable()) {
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    _stopped = true;
+                }
+                _changed.notify_all();
+                _thread.join();
+            }
+        }
+
+        void post(Event event, const DeviceInfo *sender = nullptr) {
+            if (_listener == nullptr) {
+                return;
+            }
+            std::unique_lock<std::mutex> lock(_mutex);
+            // never dropped, past capacity the queue grows by what the transfer itself holds per file
+            if (sender != nullptr) {
+                event.sender = intern(*sender);
+            }
+            _queue.push_back(std::move(event));
+            schedule(lock);
+        }
+
+        // A progress event takes the place of the waiting one of the same kind and key, which
+        // is delivered with the newest sizes; nothing is copied then. Past capacity file progress
+        // of a file without a waiting event is dropped, the end of the file or a later update
+        // tells the listener.
+        void progress(Type type, const DeviceInfo *sender, const FileInfo *file, std::uint64_t totalSize, std::uint64_t currentSize) {
+            if (_listener == nullptr) {
+                return;
+            }
+            const std::string &id = sender != nullptr ? sender->id : noId;
+            const std::string &name = file != nullptr ? file->name : noId;
+            std::size_t key = progressKey(type, id, name);
+            std::unique_lock<std::mutex> lock(_mutex);
+            auto waiting = _progress.find(key);
+            if (waiting != _progress.end() && sameProgress(*waiting->second, type, id, name)) {
+                waiting->second->totalSize = totalSize;
+                waiting->second->currentSize = currentSize;
+                return;
+            }
+            if (_queue.size() >= _capacity && (type == SendingFileProgress || type == ReceivingFileProgress)) {
+                return;
+            }
+            Event event{type};
+            if (sender != nullptr) {
+                event.sender = intern(*sender);
+            }
+            if (file != nullptr) {
+                event.file = *file;
+            }
+            event.totalSize = totalSize;
+            event.currentSize = currentSize;
+            _queue.push_back(std::move(event));
+            // deque elements stay where they are while others are added or taken off the ends
+            _progress[key] = &_queue.back();
+            schedule(lock);
+        }
+
+        void flush() {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _changed.wait(lock, [this]() {
+                return _queue.empty() && !_delivering;
+            });
+        }
+
+    private:
+        static const std::string noId;
+
+        static bool isProgress(Type type) {
+            return type == SendingTotalProgress || type == SendingFileProgress || type == ReceivingTotalProgress ||
+                   type == ReceivingFileProgress;
+        }
+
+        static std::size_t progressKey(Type type, const std::string &id, const std::string &name) {
+            std::size_t key = std::hash<std::string>()(id);
+            key ^= std::hash<std::string>()(name) + 0x9e3779b97f4a7c15 + (key << 6) + (key >> 2);
+            return key ^ (static_cast<std::size_t>(type) << 1);
+        }
+
+        static bool sameProgress(const Event &event, Type type, const std::string &id, const std::string &name) {
+            return event.type == type && (event.sender ? event.sender->id : noId) == id && event.file.name == name;
+        }
+
+        static bool sameDevice(const DeviceInfo &a, const DeviceInfo &b) {
+            return a.id == b.id && a.name == b.name && a.model == b.model && a.platform == b.platform &&
+                   a.system_version == b.system_version;
+        }
+
+        // one copy per device, made again only when its details change
+        std::shared_ptr<const DeviceInfo> intern(const DeviceInfo &sender) {
+            std::shared_ptr<const DeviceInfo> &known = _senders[sender.id];
+            if (!known || !sameDevice(*known, sender)) {
+                known = std::make_shared<const DeviceInfo>(sender);
+            }
+            return known;
+        }
+
+        void schedule(std::unique_lock<std::mutex> &lock) {
+            if (!_runner) {
+                lock.unlock();
+                _changed.notify_all();
+                return;
+            }
+            if (_delivering) {
+                return;
+            }
+            _delivering = true;
+            lock.unlock();
+            _runner([this]() {
+                drain();
+            });
+        }
+
+        void run() {
+            std::unique_lock<std::mutex> lock(_mutex);
+            while (true) {
+                _changed.wait(lock, [this]() {
+                    return _stopped || !_queue.empty();
+                });
+                if (_queue.empty()) {
+                    return;
+                }
+                deliverFront(lock);
+            }
+        }
+
+        // one executor task delivers until the queue is empty, the next post schedules another
+        void drain() {
+            std::unique_lock<std::mutex> lock(_mutex);
+            while (!_queue.empty()) {
+                deliverFront(lock);
+            }
+            _delivering = false;
+            _changed.notify_all();
+        }
+
+        void deliverFront(std::unique_lock<std::mutex> &lock) {
+            const Event &front = _queue.front();
+            if (isProgress(front.type)) {
+                auto waiting = _progress.find(progressKey(front.type, front.sender ? front.sender->id : noId, front.file.name));
+                if (waiting != _progress.end() && waiting->second == &front) {
+                    _progress.erase(waiting);
+                }
+            }
+            Event event = std::move(_queue.front());
+            _queue.pop_front();
+            bool delivering = _delivering;
+            _delivering = true;
+            lock.unlock();
+            deliver(event);
+            lock.lock();
+            _delivering = delivering;
+            if (!_runner) {
+                _changed.notify_all();
+            }
+        }
+
+        void deliver(const Event &event) {
+            IEventListener &listener = *_listener;
+            const DeviceInfo &sender = event.sender ? *event.sender : noDevice;
+            switch (event.type) {
+                case Resolving:
+                    listener.onResolving();
+                    break;
+                case ReceiverNotFound:
+                    listener.onReceiverNotFound();
+                    break;
+                case Resolved:
+                    listener.onResolved();
+                    break;
+                case AskingReceiver:
+                    listener.onAskingReceiver();
+                    break;
+                case ReceiverDeclined:
+                    listener.onReceiverDeclined();
+                    break;
+                case ReceiverAccepted:
+                    listener.onReceiverAccepted();
+                    break;
+                case LinkProbed:
+                    listener.onLinkProbed(event.probe);
+                    break;
+                case SendingStart:
+                    listener.onSendingStart();
+                    break;
+                case SendingTotalProgress:
+                    listener.onSendingTotalProgress(event.totalSize, event.currentSize);
+                    break;
+                case SendingFileStart:
+                    listener.onSendingFileStart(event.file);
+                    break;
+                case SendingFileProgress:
+                    listener.onSendingFileProgress(event.file, event.currentSize);
+                    break;
+                case SendingFileEnd:
+                    listener.onSendingFileEnd(event.file);
+                    break;
+                case SendingEnd:
+                    listener.onSendingEnd();
+                    break;
+                case ReceiverStarted:
+                    listener.onReceiverStarted(event.port);
+                    break;
+                case SenderAsk:
+                    listener.onSenderAsk(sender);
+                    break;
+                case ReceivingStart:
+                    listener.onReceivingStart(sender, event.totalSize);
+                    break;
+                case ReceivingTotalProgress:
+                    listener.onReceivingTotalProgress(sender, event.totalSize, event.currentSize);
+                    break;
+                case ReceivingFileStart:
+                    listener.onReceivingFileStart(sender, event.file);
+                    break;
+                case ReceivingFileProgress:
+                    listener.onReceivingFileProgress(sender, event.file, event.currentSize);
+                    break;
+                case ReceivingFileEnd:
+                    listener.onReceivingFileEnd(sender, event.file);
+                    break;
+                case ReceivingEnd:
+                    listener.onReceivingEnd(sender, event.totalSize, event.files);
+                    break;
+            }
+        }
+
+        static const DeviceInfo noDevice;
+
+        IEventListener *_listener;
+        executor _runner;
+        std::size_t _capacity;
+        std::mutex _mutex;
+        std::condition_variable _changed;
+        std::deque<Event> _queue;
+        std::unordered_map<std::size_t, Event *> _progress; // waiting progress events by progressKey()
+        std::unordered_map<std::string, std::shared_ptr<const DeviceInfo>> _senders; // by id
+        bool _delivering = false; // an event is being delivered, or an executor task is scheduled
+        bool _stopped = false;
+        std::thread _thread;
+    };
+
+    const std::string EventDispatcher::Impl::noId;
+    const DeviceInfo EventDispatcher::Impl::noDevice;
+
+    EventDispatcher::EventDispatcher(IEventListener *listener, std::size_t capacity) :
+            pImpl(new Impl(listener, nullptr, capacity)) {}
+
+    EventDispatcher::EventDispatcher(IEventListener *listener, executor runner, std::size_t capacity) :
+            pImpl(new Impl(listener, std::move(runner), capacity)) {}
+
+    EventDispatcher::~EventDispatcher() = default;
+
+    void EventDispatcher::flush() {
+        pImpl->flush();
+    }
+
+    void EventDispatcher::onResolving() {
+        pImpl->post({Impl::Resolving});
+    }
+
+    void EventDispatcher::onReceiverNotFound() {
+        pImpl->post({Impl::ReceiverNotFound});
+    }
+
+    void EventDispatcher::onResolved() {
+        pImpl->post({Impl::Resolved});
+    }
+
+    void EventDispatcher::onAskingReceiver() {
+        pImpl->post({Impl::AskingReceiver});
+    }
+
+    void EventDispatcher::onReceiverDeclined() {
+        pImpl->post({Impl::ReceiverDeclined});
+    }
+
+    void EventDispatcher::onReceiverAccepted() {
+        pImpl->post({Impl::ReceiverAccepted});
+    }
+
+    void EventDispatcher::onLinkProbed(const LinkProbe &probe) {
+        Impl::Event event{Impl::LinkProbed};
+        event.probe = probe;
+        pImpl->post(std::move(event));
+    }
+
+    void EventDispatcher::onSendingStart() {
+        pImpl->post({Impl::SendingStart});
+    }
+
+    void EventDispatcher::onSendingTotalProgress(std::uint64_t totalSize, std::uint64_t currentSize) {
+        pImpl->progress(Impl::SendingTotalProgress, nullptr, nullptr, totalSize, currentSize);
+    }
+
+    void EventDispatcher::onSendingFileStart(const FileInfo &fileInfo) {
+        Impl::Event event{Impl::SendingFileStart};
+        event.file = fileInfo;
+        pImpl->post(std::move(event));
+    }
+
+    void EventDispatcher::onSendingFileProgress(const FileInfo &fileInfo, std::uint64_t currentSize) {
+        pImpl->progress(Impl::SendingFileProgress, nullptr, &fileInfo, 0, currentSize);
+    }
+
+    void EventDispatcher::onSendingFileEnd(const FileInfo &fileInfo) {
+        Impl::Event event{Impl::SendingFileEnd};
+        event.file = fileInfo;
+        pImpl->post(std::move(event));
+    }
+
+    void EventDispatcher::onSendingEnd() {
+        pImpl->post({Impl::SendingEnd});
+    }
+
+    void EventDispatcher::onReceiverStarted(unsigned short port) {
+        Impl::Event event{Impl::ReceiverStarted};
+        event.port = port;
+        pImpl->post(std::move(event));
+    }
+
+    void EventDispatcher::onSenderAsk(const DeviceInfo &sender) {
+        pImpl->post({Impl::SenderAsk}, &sender);
+    }
+
+    void EventDispatcher::onReceivingStart(const DeviceInfo &sender, std::uint64_t totalSize) {
+        Impl::Event event{Impl::ReceivingStart};
+        event.totalSize = totalSize;
+        pImpl->post(std::move(event), &sender);
+    }
+
+    void EventDispatcher::onReceivingTotalProgress(const DeviceInfo &sender, std::uint64_t totalSize, std::uint64_t receivedSize) {
+        pImpl->progress(Impl::ReceivingTotalProgress, &sender, nullptr, totalSize, receivedSize);
+    }
+
+    void EventDispatcher::onReceivingFileStart(const DeviceInfo &sender, const FileInfo &fileInfo) {
+        Impl::Event event{Impl::ReceivingFileStart};
+        event.file = fileInfo;
+        pImpl->post(std::move(event), &sender);
+    }
+
+    void EventDispatcher::onReceivingFileProgress(const DeviceInfo &sender, const FileInfo &fileInfo, std::uint64_t receivedSize) {
+        pImpl->progress(Impl::ReceivingFileProgress, &sender, &fileInfo, 0, receivedSize);
+    }
+
+    void EventDispatcher::onReceivingFileEnd(const DeviceInfo &sender, const FileInfo &fileInfo) {
+        Impl::Event event{Impl::ReceivingFileEnd};
+        event.file = fileInfo;
+        pImpl->post(std::move(event), &sender);
+    }
+
+    void EventDispatcher::onReceivingEnd(const DeviceInfo &sender, std::uint64_t totalSize, const std::vector<FileInfo> &receivedFiles) {
+        Impl::Event event{Impl::ReceivingEnd};
+        event.totalSize = totalSize;
+        event.files = receivedFiles;
+        pImpl->post(std::move(event), &sender);
+    }
+
+} // namespace flowdrop
@@ -0,0 +1,106 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+
+#include "happy_eyeballs.hpp"
+#include "hv/hsocket.h"
+#include "logger.h"
+#include <algorithm>
+
+// RFC 8305, section 5
+static const std::chrono::milliseconds connectionAttemptDelay(250);
+
+struct Attempt {
+    int fd;
+    std::size_t index;
+};
+
+static std::vector<discovery::Remote> interleaveFamilies(const std::vector<discovery::Remote> &candidates) {
+    std::vector<discovery::Remote> first, second;
+    for (const discovery::Remote &remote: candidates) {
+        (remote.ipType == candidates.front().ipType ? first : second).push_back(remote);
+    }
+    std::vector<discovery::Remote> ordered;
+    for (std::size_t i = 0; i < std::max(first.size(), second.size()); ++i) {
+        if (i < first.size()) ordered.push_back(first[i]);
+        if (i < second.size()) ordered.push_back(second[i]);
+    }
+    return ordered;
+}
+
+std::optional<discovery::Remote> discovery::raceConnect(const std::vector<Remote> &candidates, const std::chrono::milliseconds &timeout) {
+    if (candidates.empty()) {
+        return std::nullopt;
+    }
+    std::vector<Remote> ordered = interleaveFamilies(candidates);
+    std::vector<Attempt> attempts;
+    std::optional<Remote> winner;
+    std::size_t next = 0;
+    auto now = std::chrono::steady_clock::now();
+    auto deadline = now + timeout;
+    auto nextStart = now;
+
+    while (!winner.has_value() && now < deadline) {
+        if (next < ordered.size() && (now >= nextStart || attempts.empty())) {
+            const Remote &remote = ordered[next];
+            int fd = ConnectNonblock(remote.ip.c_str(), remote.port);
+            if (fd < 0) {
+                LOG_DEBUG("connect failed" << Logger::kv("ip", remote.ip));
+            } else {
+                attempts.push_back({fd, next});
+            }
+            ++next;
+            nextStart = now + connectionAttemptDelay;
+            continue;
+        }
+        if (attempts.empty()) {
+            break;
+        }
+
+        fd_set writeFds, exceptFds;
+        FD_ZERO(&writeFds);
+        FD_ZERO(&exceptFds);
+        int maxFd = 0;
+        for (const Attempt &attempt: attempts) {
+            FD_SET(attempt.fd, &writeFds);
+            FD_SET(attempt.fd, &exceptFds);
+            maxFd = std::max(maxFd, attempt.fd);
+        }
+        auto wakeUp = next < ordered.size() ? std::min(nextStart, deadline) : deadline;
+        auto wait = std::chrono::duration_cast<std::chrono::microseconds>(wakeUp - now);
+        struct timeval tv{};
+        tv.tv_sec = static_cast<long>(wait.count() / 1000000);
+        tv.tv_usec = static_cast<long>(wait.count() % 1000000);
+        int ready = select(maxFd + 1, nullptr, &writeFds, &exceptFds, &tv);
+        now = std::chrono::steady_clock::now();
+        if (ready <= 0) {
+            continue;
+        }
+
+        for (auto it = attempts.begin(); it != attempts.end();) {
+            if (!FD_ISSET(it->fd, &writeFds) && !FD_ISSET(it->fd, &exceptFds)) {
+                ++it;
+                continue;
+            }
+            int error = 0;
+            socklen_t len = sizeof(error);
+            getsockopt(it->fd, SOL_SOCKET, SO_ERROR, reinterpret_cast<char *>(&error), &len);
+            if (error == 0 && !FD_ISSET(it->fd, &exceptFds)) {
+                winner = ordered[it->index];
+                break;
+            }
+            LOG_DEBUG("connect failed" << Logger::kv("ip", ordered[it->index].ip) << Logger::kv("error", socket_strerror(error)));
+            closesocket(it->fd);
+            it = attempts.erase(it);
+            nextStart = now; // start the next attempt immediately
+        }
+    }
+
+    for (const Attempt &attempt: attempts) {
+        closesocket(attempt.fd);
+    }
+    return winner;
+}
@@ -0,0 +1,19 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+#pragma once
+
+#include "flowdrop/flowdrop.hpp"
+#include "discovery.hpp"
+
+namespace discovery {
+
+    // Races TCP connects to the candidates in RFC 8305 style: families are interleaved
+    // and a new attempt starts every connection attempt delay or as soon as one fails.
+    // Returns the first candidate that accepted a connection.
+    std::optional<Remote> raceConnect(const std::vector<Remote> &candidates, const std::chrono::milliseconds &timeout);
+
+} // namespace discovery
@@ -0,0 +1,246 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+
+#include "link_probe.hpp"
+#include "discovery.hpp"
+#include "logger.h"
+#include "connection_share.hpp"
+#include "specification.h"
+#include "curl/curl.h"
+#include <algorithm>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+static const int maxPings = 5;
+static const double pingShare = 0.2; // of the budget, the rest is split between the two directions
+static const std::size_t firstBurst = 64 * 1024;
+static const std::size_t burstGrowth = 4;
+static const std::chrono::minutes probeLifetime(10);
+static const double peerProbeBytes = 4.0 * flowdrop_probe_max_bytes; // a full probe each way with room to spare
+static const std::chrono::minutes peerProbeRefill(1); // of all of peerProbeBytes
+static const std::size_t probeRequestBytes = 4 * 1024; // charged on top, pings are not free either
+static const std::size_t maxProbePeers = 1024; // past it, peers with a full budget are forgotten
+
+namespace {
+
+    size_t discardCallback(char * /*buffer*/, size_t size, size_t nmemb, void *userdata) {
+        *static_cast<std::size_t *>(userdata) += size * nmemb;
+        return size * nmemb;
+    }
+
+    // One request on the probe connection, timed; negative on failure.
+    class Prober {
+    public:
+        Prober(const std::string &baseUrl, Clock::time_point deadline) :
+                _url(baseUrl + flowdrop_endpoint_probe), _deadline(deadline) {
+            _curl = curl_easy_init();
+            // the 100-continue round trip would count as transfer time
+            _headers = curl_slist_append(nullptr, "Expect:");
+            // not shared: the send that follows opens its connections with the tuning probed for
+            if (_curl != nullptr) {
+                curl_easy_setopt(_curl, CURLOPT_HTTPHEADER, _headers);
+                curl_easy_setopt(_curl, CURLOPT_WRITEFUNCTION, discardCallback);
+                curl_easy_setopt(_curl, CURLOPT_WRITEDATA, &_received);
+            }
+        }
+
+        ~Prober() {
+            if (_curl != nullptr) {
+                curl_easy_cleanup(_curl);
+            }
+            curl_slist_free_all(_headers);
+        }
+
+        double download(std::size_t size) {
+            std::string url = _url + "?bytes=" + std::to_string(size);
+            curl_easy_setopt(_curl, CURLOPT_URL, url.c_str());
+            curl_easy_setopt(_curl, CURLOPT_HTTPGET, 1L);
+            _received = 0;
+            double seconds = perform();
+            return _received == size ? seconds : -1;
+        }
+
+        double upload(std::size_t size) {
+            curl_easy_setopt(_curl, CURLOPT_URL, _url.c_str());
+            curl_easy_setopt(_curl, CURLOPT_POSTFIELDS, transport::probeFill());
+            curl_easy_setopt(_curl, CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(size));
+            return perform();
+        }
+
+        [[nodiscard]] bool valid() const {
+            return _curl != nullptr;
+        }
+
+    private:
+        double perform() {
+            auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(_deadline - Clock::now());
+            if (remaining.count() <= 0) {
+                return -1;
+            }
+            curl_easy_setopt(_curl, CURLOPT_TIMEOUT_MS, static_cast<long>(remaining.count()));
+            Clock::time_point start = Clock::now();
+            CURLcode res = curl_easy_perform(_curl);
+            double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+            long code = 0;
+            curl_easy_getinfo(_curl, CURLINFO_RESPONSE_CODE, &code);
+            return res == CURLE_OK && code == 200 ? seconds : -1;
+        }
+
+        std::string _url;
+        Clock::time_point _deadline;
+        CURL *_curl = nullptr;
+        curl_slist *_headers = nullptr;
+        std::size_t _received = 0;
+    };
+
+    // Bursts growing until the next one would not fit in share; the best rate in bytes per second.
+    template<typename Transfer>
+    std::uint64_t burstRate(double rtt, const Clock::duration &share, Transfer transfer) {
+        Clock::time_point start = Clock::now();
+        double best = 0;
+        std::size_t size = firstBurst;
+        while (true) {
+            double seconds = transfer(size);
+            if (seconds < 0) {
+                break;
+            }
+            // the request itself takes a round trip, what is left is the transfer
+            double transferSeconds = std::max(seconds - rtt, seconds / 2);
+            best = std::max(best, static_cast<double>(size) / transferSeconds);
+            Clock::duration next = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds * burstGrowth));
+            if (size >= flowdrop_probe_max_bytes || Clock::now() - start + next > share) {
+                break;
+            }
+            size = std::min(size * burstGrowth, flowdrop_probe_max_bytes);
+        }
+        return static_cast<std::uint64_t>(best);
+    }
+
+} // namespace
+
+namespace transport {
+
+    const char *probeFill() {
+        static const std::vector<char> fill(flowdrop_probe_max_bytes);
+        return fill.data();
+    }
+
+    std::optional<flowdrop::LinkProbe> probeLink(const std::string &baseUrl, const std::chrono::milliseconds &budget) {
+        globalInit();
+        Clock::time_point start = Clock::now();
+        std::optional<flowdrop::LinkProbe> result;
+        {
+            Prober prober(baseUrl, start + budget);
+            double rtt = -1;
+            auto pingBudget = std::chrono::duration_cast<Clock::duration>(budget * pingShare);
+            for (int i = 0; prober.valid() && i < maxPings && (i == 0 || Clock::now() - start < pingBudget); ++i) {
+                double seconds = prober.download(0);
+                if (seconds < 0) {
+                    break;
+                }
+                rtt = rtt < 0 ? seconds : std::min(rtt, seconds);
+            }
+            if (rtt >= 0) {
+                flowdrop::LinkProbe probe;
+                probe.rtt = std::chrono::microseconds(static_cast<std::int64_t>(rtt * 1e6));
+                Clock::duration share = (start + budget - Clock::now()) / 2;
+                probe.uploadRate = burstRate(rtt, share, [&prober](std::size_t size) {
+                    return prober.upload(size);
+                });
+                share = start + budget - Clock::now();
+                probe.downloadRate = burstRate(rtt, share, [&prober](std::size_t size) {
+                    return prober.download(size);
+                });
+                LOG_DEBUG("link probed" << Logger::kv("url", baseUrl) << Logger::kv("rtt_us", probe.rtt.count())
+                                        << Logger::kv("up", probe.uploadRate) << Logger::kv("down", probe.downloadRate));
+                result = probe;
+            }
+        }
+        return result;
+    }
+
+    ProbeCache &ProbeCache::instance() {
+        // intentionally leaked, like the connection share
+        static auto *cache = new ProbeCache;
+        return *cache;
+    }
+
+    std::optional<flowdrop::LinkProbe> ProbeCache::get(const std::string &baseUrl) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _entries.find(baseUrl);
+        if (it == _entries.end()) {
+            return std::nullopt;
+        }
+        if (Clock::now() - it->second.measured > probeLifetime) {
+            _entries.erase(it);
+            return std::nullopt;
+        }
+        return it->second.probe;
+    }
+
+    void ProbeCache::put(const std::string &baseUrl, const flowdrop::LinkProbe &probe) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _entries[baseUrl] = {probe, Clock::now()};
+    }
+
+    bool ProbeBudget::take(const std::string &ip, std::size_t bytes) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        Clock::time_point now = Clock::now();
+        auto refilled = [now](const Bucket &bucket) {
+            double elapsed = std::chrono::duration<double>(now - bucket.updated) / peerProbeRefill;
+            return std::min(peerProbeBytes, bucket.bytes + elapsed * peerProbeBytes);
+        };
+        auto it = _buckets.find(ip);
+        if (it == _buckets.end()) {
+            if (_buckets.size() >= maxProbePeers) {
+                for (auto bucket = _buckets.begin(); bucket != _buckets.end();) {
+                    bucket = refilled(bucket->second) >= peerProbeBytes ? _buckets.erase(bucket) : std::next(bucket);
+                }
+            }
+            it = _buckets.emplace(ip, Bucket{peerProbeBytes, now}).first;
+        }
+        Bucket &bucket = it->second;
+        bucket.bytes = refilled(bucket);
+        bucket.updated = now;
+        double cost = static_cast<double>(bytes + probeRequestBytes);
+        if (bucket.bytes < cost) {
+            return false;
+        }
+        bucket.bytes -= cost;
+        return true;
+    }
+
+    std::optional<flowdrop::LinkProbe> cachedProbe(const std::string &baseUrl, const std::chrono::milliseconds &budget) {
+        std::optional<flowdrop::LinkProbe> probe = ProbeCache::instance().get(baseUrl);
+        if (!probe.has_value()) {
+            probe = probeLink(baseUrl, budget);
+            if (probe.has_value()) {
+                ProbeCache::instance().put(baseUrl, probe.value());
+            }
+        }
+        return probe;
+    }
+
+} // namespace transport
+
+namespace flowdrop {
+
+    std::optional<LinkProbe> probe(const Address &address, const std::chrono::milliseconds &budget, bool refresh) {
+        discovery::IPType ipType = address.host.find(':') != std::string::npos ? discovery::IPv6 : discovery::IPv4;
+        std::string baseUrl = discovery::toBaseUrl({ipType, address.host, address.port});
+        if (!refresh) {
+            return transport::cachedProbe(baseUrl, budget);
+        }
+        std::optional<LinkProbe> result = transport::probeLink(baseUrl, budget);
+        if (result.has_value()) {
+            transport::ProbeCache::instance().put(baseUrl, result.value());
+        }
+        return result;
+    }
+
+} // namespace flowdrop
@@ -0,0 +1,63 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+#pragma once
+
+#include "flowdrop/flowdrop.hpp"
+#include <mutex>
+#include <unordered_map>
+
+namespace transport {
+
+    // flowdrop_probe_max_bytes of zeros, the body of a burst either way; never freed.
+    const char *probeFill();
+
+    // Measures the link to the receiver at baseUrl in about budget: pings for the RTT, then a
+    // burst each way that grows while the budget allows. Empty if the receiver has no /probe.
+    std::optional<flowdrop::LinkProbe> probeLink(const std::string &baseUrl, const std::chrono::milliseconds &budget);
+
+    // Process-wide probe results by receiver base URL, so repeated sends probe once.
+    class ProbeCache {
+    public:
+        static ProbeCache &instance();
+
+        std::optional<flowdrop::LinkProbe> get(const std::string &baseUrl);
+        void put(const std::string &baseUrl, const flowdrop::LinkProbe &probe);
+
+    private:
+        ProbeCache() = default;
+
+        struct Entry {
+            flowdrop::LinkProbe probe;
+            std::chrono::steady_clock::time_point measured;
+        };
+
+        std::mutex _mutex;
+        std::unordered_map<std::string, Entry> _entries;
+    };
+
+    // Probe bytes a receiver serves each peer address, either way. /probe is answered unasked, so
+    // without it anyone on the network could draw flowdrop_probe_max_bytes per request without
+    // end. A request takes its bytes up front, concurrent ones of a peer share the budget too.
+    class ProbeBudget {
+    public:
+        // false, and nothing taken, when the peer has less than bytes left
+        bool take(const std::string &ip, std::size_t bytes);
+
+    private:
+        struct Bucket {
+            double bytes;
+            std::chrono::steady_clock::time_point updated;
+        };
+
+        std::mutex _mutex;
+        std::unordered_map<std::string, Bucket> _buckets;
+    };
+
+    // The cached probe, or a new one within budget when there is none.
+    std::optional<flowdrop::LinkProbe> cachedProbe(const std::string &baseUrl, const std::chrono::milliseconds &budget);
+
+} // namespace transport
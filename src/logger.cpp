@@ -6,33 +6,184 @@
  */
 
 #include "logger.h"
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <thread>
 
 #if defined(ANDROID)
 #include <android/log.h>
 #define LOG_TAG "JNI"
-#else
-#include <iostream>
 #endif
 
-bool Logger::debug = false;
+static const std::size_t queueCapacity = 4096; // power of two
+static const std::chrono::milliseconds consumerIdleWait(100);
+static const std::chrono::seconds exitFlushTimeout(1);
 
-void Logger::set_debug(bool enabled) {
-    debug = enabled;
-}
+// Bounded MPMC ring (Vyukov); producers never block, the single consumer runs on its own
+// thread. Slots keep their string capacity: records are swapped in and out, not copied.
+class LogQueue {
+public:
+    static LogQueue &instance() {
+        // leaked on purpose, the consumer thread may outlive static destruction
+        static auto *queue = new LogQueue();
+        return *queue;
+    }
+
+    bool push(flowdrop::LogRecord &record) {
+        std::size_t pos = _enqueuePos.load(std::memory_order_relaxed);
+        Slot *slot;
+        for (;;) {
+            slot = &_slots[pos & (queueCapacity - 1)];
+            std::size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(pos);
+            if (diff == 0) {
+                if (_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                _dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            } else {
+                pos = _enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+        std::swap(slot->record, record);
+        slot->sequence.store(pos + 1, std::memory_order_release);
+        if (_sleeping.load()) {
+            _wakeup.notify_one();
+        }
+        return true;
+    }
+
+    void setSink(const flowdrop::logSink &sink) {
+        std::lock_guard<std::mutex> lock(_sinkMutex);
+        _sink = sink;
+    }
+
+    void flush(std::chrono::milliseconds timeout) {
+        std::size_t target = _enqueuePos.load(std::memory_order_acquire);
+        std::unique_lock<std::mutex> lock(_mutex);
+        _wakeup.notify_one();
+        _drained.wait_for(lock, timeout, [this, target] {
+            return _dequeuePos.load(std::memory_order_acquire) >= target;
+        });
+    }
+
+private:
+    struct Slot {
+        std::atomic<std::size_t> sequence;
+        flowdrop::LogRecord record;
+    };
+
+    LogQueue() : _slots(new Slot[queueCapacity]) {
+        for (std::size_t i = 0; i < queueCapacity; ++i) {
+            _slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        std::thread(&LogQueue::consume, this).detach();
+        std::atexit([] {
+            LogQueue::instance().flush(exitFlushTimeout);
+        });
+    }
+
+    bool pop() {
+        std::size_t pos = _dequeuePos.load(std::memory_order_relaxed);
+        Slot &slot = _slots[pos & (queueCapacity - 1)];
+        if (slot.sequence.load(std::memory_order_acquire) != pos + 1) {
+            return false;
+        }
+        deliver(slot.record);
+        slot.sequence.store(pos + queueCapacity, std::memory_order_release);
+        _dequeuePos.store(pos + 1, std::memory_order_release);
+        return true;
+    }
 
-void Logger::log(Logger::LogLevel level, const std::string &message) {
-    if (level == LEVEL_DEBUG) {
-        if (!debug) return;
-        level = LEVEL_INFO;
+    void consume() {
+        for (;;) {
+            bool any = false;
+            while (pop()) {
+                any = true;
+            }
+            std::uint64_t dropped = _dropped.exchange(0, std::memory_order_relaxed);
+            if (dropped > 0) {
+                flowdrop::LogRecord record{flowdrop::LogLevel::Error, std::chrono::system_clock::now(),
+                                           std::to_string(dropped) + " log records dropped", {}};
+                deliver(record);
+            }
+            if (any) {
+                std::fflush(stdout);
+                std::lock_guard<std::mutex> lock(_mutex);
+                _drained.notify_all();
+            }
+            std::unique_lock<std::mutex> lock(_mutex);
+            _sleeping.store(true);
+            std::size_t pos = _dequeuePos.load(std::memory_order_relaxed);
+            _wakeup.wait_for(lock, consumerIdleWait, [this, pos] {
+                return _slots[pos & (queueCapacity - 1)].sequence.load(std::memory_order_acquire) == pos + 1;
+            });
+            _sleeping.store(false, std::memory_order_relaxed);
+        }
     }
+
+    void deliver(const flowdrop::LogRecord &record) {
+        std::lock_guard<std::mutex> lock(_sinkMutex);
+        if (_sink != nullptr) {
+            _sink(record);
+            return;
+        }
+        std::string line = record.message;
+        for (const auto &[key, value]: record.fields) {
+            line += ' ';
+            line += key;
+            line += '=';
+            line += value;
+        }
 #if defined(ANDROID)
-    __android_log_print(level == LEVEL_ERROR ? ANDROID_LOG_ERROR : ANDROID_LOG_INFO, LOG_TAG, "%s", message.c_str());
+        __android_log_print(record.level == flowdrop::LogLevel::Error ? ANDROID_LOG_ERROR : ANDROID_LOG_INFO, LOG_TAG, "%s", line.c_str());
 #else
-    if (level == LEVEL_INFO) {
-        std::cout << message << std::endl;
-    } else if (level == LEVEL_ERROR) {
-        std::cerr << message << std::endl;
-    }
+        line += '\n';
+        std::fwrite(line.data(), 1, line.size(), record.level == flowdrop::LogLevel::Error ? stderr : stdout);
 #endif
+    }
+
+    std::unique_ptr<Slot[]> _slots;
+    std::atomic<std::size_t> _enqueuePos{0};
+    std::atomic<std::size_t> _dequeuePos{0};
+    std::atomic<std::uint64_t> _dropped{0};
+    std::atomic<bool> _sleeping{false};
+    std::mutex _mutex;
+    std::condition_variable _wakeup;
+    std::condition_variable _drained;
+    std::mutex _sinkMutex;
+    flowdrop::logSink _sink;
+};
+
+static thread_local flowdrop::LogRecord threadRecord;
+
+std::atomic<bool> Logger::debug{false};
+
+Logger::Record::Record(flowdrop::LogLevel level) : _record(threadRecord) {
+    _record.level = level;
+    _record.time = std::chrono::system_clock::now();
+    _record.message.clear();
+    _record.fields.clear();
 }
 
+Logger::Record::~Record() {
+    LogQueue::instance().push(_record);
+}
+
+std::string &Logger::Record::addField(const char *key) {
+    return _record.fields.emplace_back(key, std::string()).second;
+}
+
+void Logger::set_debug(bool enabled) {
+    debug.store(enabled, std::memory_order_relaxed);
+}
+
+void Logger::set_sink(const flowdrop::logSink &sink) {
+    LogQueue::instance().setSink(sink);
+}
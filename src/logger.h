@@ -6,21 +6,91 @@
  */
 #pragma once
 
-#include "string"
+#include "flowdrop/flowdrop.hpp"
+#include <atomic>
+#include <string>
+#include <type_traits>
 
+// Use the LOG_* macros: the level is checked before any of the message is formatted.
+//   LOG_DEBUG("connect failed" << Logger::kv("ip", remote.ip) << Logger::kv("port", remote.port));
+// Records are built in a per-thread buffer and handed to a background thread through a
+// bounded lock-free queue, so logging never blocks the caller. When the queue is full the
+// record is dropped and counted.
 class Logger {
 public:
-    enum LogLevel {
-        LEVEL_INFO,
-        LEVEL_DEBUG,
-        LEVEL_ERROR
+    template<typename T>
+    struct Field {
+        const char *key;
+        const T &value;
+    };
+
+    template<typename T>
+    static Field<T> kv(const char *key, const T &value) {
+        return {key, value};
+    }
+
+    class Record {
+    public:
+        explicit Record(flowdrop::LogLevel level);
+        ~Record();
+
+        Record(const Record &) = delete;
+        Record &operator=(const Record &) = delete;
+
+        template<typename T>
+        Record &operator<<(const T &value) {
+            append(_record.message, value);
+            return *this;
+        }
+
+        template<typename T>
+        Record &operator<<(const Field<T> &field) {
+            append(addField(field.key), field.value);
+            return *this;
+        }
+
+    private:
+        std::string &addField(const char *key);
+
+        static void append(std::string &out, const std::string &value) {
+            out += value;
+        }
+
+        static void append(std::string &out, const char *value) {
+            out += value;
+        }
+
+        static void append(std::string &out, char value) {
+            out += value;
+        }
+
+        template<typename T, std::enable_if_t<std::is_arithmetic_v<T>, int> = 0>
+        static void append(std::string &out, T value) {
+            out += std::to_string(value);
+        }
+
+        flowdrop::LogRecord &_record;
     };
 
     static void set_debug(bool enabled);
 
-    static void log(LogLevel, const std::string&);
+    static bool enabled(flowdrop::LogLevel level) {
+        return level != flowdrop::LogLevel::Debug || debug.load(std::memory_order_relaxed);
+    }
+
+    static void set_sink(const flowdrop::logSink &sink);
 
 private:
-    static bool debug;
+    static std::atomic<bool> debug;
 };
 
+#define FLOWDROP_LOG(level, message) \
+    do { \
+        if (Logger::enabled(level)) { \
+            Logger::Record(level) << message; \
+        } \
+    } while (false)
+
+#define LOG_DEBUG(message) FLOWDROP_LOG(flowdrop::LogLevel::Debug, message)
+#define LOG_INFO(message) FLOWDROP_LOG(flowdrop::LogLevel::Info, message)
+#define LOG_ERROR(message) FLOWDROP_LOG(flowdrop::LogLevel::Error, message)
@@ -0,0 +1,233 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+
+#include "loopback_dnssd.h"
+#include <mutex>
+#include <random>
+#include <set>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+static const char *loopbackHostSuffix = ".local.";
+static const std::chrono::milliseconds browsePollInterval(10);
+static const std::chrono::milliseconds registerPollInterval(50);
+
+struct LoopbackService {
+    std::string regType;
+    unsigned short port;
+    std::unordered_map<std::string, std::string> txt;
+    Clock::time_point registeredAt;
+};
+
+struct LoopbackState {
+    std::mutex mutex;
+    std::unordered_map<std::string, LoopbackService> services;
+    loopback_dnssd::Conditions conditions;
+    std::mt19937 rng{1};
+
+    // caller must hold the mutex
+    Clock::duration replyDelay() {
+        auto delay = Clock::duration(conditions.latency);
+        if (conditions.jitter.count() > 0) {
+            std::uniform_int_distribution<long long> jitter(0, conditions.jitter.count());
+            delay += std::chrono::milliseconds(jitter(rng));
+        }
+        return delay;
+    }
+
+    // caller must hold the mutex
+    bool replyLost() {
+        if (conditions.lossRate <= 0) return false;
+        return std::bernoulli_distribution(std::min(conditions.lossRate, 1.0))(rng);
+    }
+};
+
+static LoopbackState &loopbackState() {
+    static LoopbackState state;
+    return state;
+}
+
+// Simulates a query/reply exchange with mDNS retransmission: every attempt waits for the
+// reply latency and may be lost. Returns the answer or std::nullopt once the timeout expires.
+template<typename T>
+static std::optional<T> exchange(const std::function<std::optional<T>()> &answer) {
+    LoopbackState &state = loopbackState();
+    Clock::time_point deadline;
+    {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        deadline = Clock::now() + state.conditions.timeout;
+    }
+    while (true) {
+        Clock::duration delay;
+        bool lost;
+        Clock::duration retryInterval;
+        {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            delay = state.replyDelay();
+            lost = state.replyLost();
+            retryInterval = state.conditions.retryInterval;
+        }
+        Clock::time_point attemptStart = Clock::now();
+        if (attemptStart + delay >= deadline) {
+            std::this_thread::sleep_until(deadline);
+            return std::nullopt;
+        }
+        std::this_thread::sleep_for(delay);
+        if (!lost) {
+            std::optional<T> result = answer();
+            if (result.has_value()) {
+                return result;
+            }
+        }
+        Clock::time_point retryAt = attemptStart + retryInterval;
+        if (retryAt >= deadline) {
+            std::this_thread::sleep_until(deadline);
+            return std::nullopt;
+        }
+        std::this_thread::sleep_until(retryAt);
+    }
+}
+
+static bool isRegisteredHost(const std::string &hostName) {
+    std::string suffix = loopbackHostSuffix;
+    if (hostName.size() <= suffix.size() || hostName.compare(hostName.size() - suffix.size(), suffix.size(), suffix) != 0) {
+        return false;
+    }
+    LoopbackState &state = loopbackState();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    return state.services.count(hostName.substr(0, hostName.size() - suffix.size())) != 0;
+}
+
+void registerService(const char *serviceName, const char *regType, const char * /*domain*/, unsigned short port,
+                     const std::unordered_map<std::string, std::string> &txt, const std::function<bool()> &isStopped) {
+    loopback_dnssd::addService(serviceName, regType, port, txt);
+    while (!isStopped()) {
+        std::this_thread::sleep_for(registerPollInterval);
+    }
+    loopback_dnssd::removeService(serviceName);
+}
+
+void findService(const char *regType, const char *domain, const findCallback &callback, const std::function<bool()> &isStopped) {
+    LoopbackState &state = loopbackState();
+    std::unordered_map<std::string, Clock::time_point> nextAttempt;
+    std::set<std::string> reported;
+    while (!isStopped()) {
+        std::vector<std::string> due;
+        {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            Clock::time_point now = Clock::now();
+            for (const auto &[name, service]: state.services) {
+                if (service.regType != regType || reported.count(name) != 0) {
+                    continue;
+                }
+                auto it = nextAttempt.find(name);
+                if (it == nextAttempt.end()) {
+                    nextAttempt[name] = std::max(now, service.registeredAt) + state.replyDelay();
+                } else if (it->second <= now) {
+                    if (state.replyLost()) {
+                        it->second = now + state.conditions.retryInterval;
+                    } else {
+                        due.push_back(name);
+                    }
+                }
+            }
+            // forget services that went away, so they are reported again when re-registered
+            for (auto it = reported.begin(); it != reported.end();) {
+                it = state.services.count(*it) == 0 ? reported.erase(it) : std::next(it);
+            }
+            for (auto it = nextAttempt.begin(); it != nextAttempt.end();) {
+                it = state.services.count(it->first) == 0 ? nextAttempt.erase(it) : std::next(it);
+            }
+        }
+        for (const std::string &name: due) {
+            reported.insert(name);
+            nextAttempt.erase(name);
+            callback(FindReply{0, name, regType, domain});
+        }
+        std::this_thread::sleep_for(browsePollInterval);
+    }
+}
+
+void resolveService(const char *serviceName, const char * /*regType*/, const char * /*domain*/, const resolveCallback &callback) {
+    std::string name = serviceName;
+    callback(exchange<ResolveReply>([&name]() -> std::optional<ResolveReply> {
+        LoopbackState &state = loopbackState();
+        std::lock_guard<std::mutex> lock(state.mutex);
+        auto it = state.services.find(name);
+        if (it == state.services.end()) {
+            return std::nullopt;
+        }
+        ResolveReply reply;
+        reply.hostName = name + loopbackHostSuffix;
+        reply.port = it->second.port;
+        reply.txt = it->second.txt;
+        return reply;
+    }));
+}
+
+void queryIPv4Address(const char *hostName, const queryCallback &callback) {
+    std::string host = hostName;
+    callback(exchange<IPAddress>([&host]() -> std::optional<IPAddress> {
+        if (!isRegisteredHost(host)) {
+            return std::nullopt;
+        }
+        return IPAddress{IPv4, "127.0.0.1"};
+    }));
+}
+
+void queryIPv6Address(const char *hostName, const queryCallback &callback) {
+    std::string host = hostName;
+    callback(exchange<IPAddress>([&host]() -> std::optional<IPAddress> {
+        bool ipv6;
+        {
+            LoopbackState &state = loopbackState();
+            std::lock_guard<std::mutex> lock(state.mutex);
+            ipv6 = state.conditions.ipv6;
+        }
+        if (!ipv6 || !isRegisteredHost(host)) {
+            return std::nullopt;
+        }
+        return IPAddress{IPv6, "::1"};
+    }));
+}
+
+namespace loopback_dnssd {
+
+    void setConditions(const Conditions &conditions) {
+        LoopbackState &state = loopbackState();
+        std::lock_guard<std::mutex> lock(state.mutex);
+        state.conditions = conditions;
+    }
+
+    void setSeed(unsigned seed) {
+        LoopbackState &state = loopbackState();
+        std::lock_guard<std::mutex> lock(state.mutex);
+        state.rng.seed(seed);
+    }
+
+    void addService(const std::string &serviceName, const std::string &regType, unsigned short port,
+                    const std::unordered_map<std::string, std::string> &txt) {
+        LoopbackState &state = loopbackState();
+        std::lock_guard<std::mutex> lock(state.mutex);
+        state.services[serviceName] = {regType, port, txt, Clock::now()};
+    }
+
+    void removeService(const std::string &serviceName) {
+        LoopbackState &state = loopbackState();
+        std::lock_guard<std::mutex> lock(state.mutex);
+        state.services.erase(serviceName);
+    }
+
+    void clear() {
+        LoopbackState &state = loopbackState();
+        std::lock_guard<std::mutex> lock(state.mutex);
+        state.services.clear();
+    }
+
+} // namespace loopback_dnssd
@@ -0,0 +1,79 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+#pragma once
+
+// In-process DNS-SD backend with the same calls as knot/dnssd.h. Services live in a
+// process-wide registry and every reply can be delayed or dropped, so discovery can be
+// tested and benchmarked deterministically on machines without avahi or Bonjour.
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+enum IPType {
+    IPv6,
+    IPv4
+};
+
+struct IPAddress {
+    IPType type;
+    std::string value;
+};
+
+struct FindReply {
+    std::uint32_t interfaceIndex;
+    std::string serviceName;
+    std::string regType;
+    std::string replyDomain;
+};
+
+struct ResolveReply {
+    std::optional<std::string> hostName;
+    std::optional<IPAddress> ip;
+    unsigned short port;
+    std::unordered_map<std::string, std::string> txt;
+};
+
+using findCallback = std::function<void(const FindReply &)>;
+using resolveCallback = std::function<void(const std::optional<ResolveReply> &)>;
+using queryCallback = std::function<void(const std::optional<IPAddress> &)>;
+
+void registerService(const char *serviceName, const char *regType, const char *domain, unsigned short port,
+                     const std::unordered_map<std::string, std::string> &txt, const std::function<bool()> &isStopped);
+
+void findService(const char *regType, const char *domain, const findCallback &callback, const std::function<bool()> &isStopped);
+
+void resolveService(const char *serviceName, const char *regType, const char *domain, const resolveCallback &callback);
+
+void queryIPv4Address(const char *hostName, const queryCallback &callback);
+
+void queryIPv6Address(const char *hostName, const queryCallback &callback);
+
+namespace loopback_dnssd {
+
+    struct Conditions {
+        std::chrono::milliseconds latency{0}; // per reply
+        std::chrono::milliseconds jitter{0}; // uniformly added on top of latency
+        double lossRate = 0; // probability that a single reply is dropped
+        std::chrono::milliseconds retryInterval{1000}; // mDNS query retransmission
+        std::chrono::milliseconds timeout{5 * 1000}; // resolve and query give up after this
+        bool ipv6 = true; // answer AAAA queries
+    };
+
+    void setConditions(const Conditions &conditions);
+    void setSeed(unsigned seed);
+
+    // non-blocking registration of simulated peers, registerService() blocks like the real backend
+    void addService(const std::string &serviceName, const std::string &regType, unsigned short port,
+                    const std::unordered_map<std::string, std::string> &txt);
+    void removeService(const std::string &serviceName);
+    void clear();
+
+} // namespace loopback_dnssd
@@ -0,0 +1,150 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+
+#include "flowdrop/flowdrop.hpp"
+#include "os/file_io.h"
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+
+// Both files are one contiguous span, a read is a single memcpy into the caller's buffer.
+static std::uint64_t copySpan(const char *data, std::uint64_t size, std::uint64_t offset, char *buffer, std::uint64_t count) {
+    if (offset >= size) {
+        return 0;
+    }
+    std::uint64_t n = std::min(count, size - offset);
+    std::memcpy(buffer, data + offset, static_cast<std::size_t>(n));
+    return n;
+}
+
+namespace flowdrop {
+
+    class MemoryFile::Impl {
+    public:
+        Impl(std::string relativePath, std::shared_ptr<const void> owner, const void *data, std::size_t size) :
+                _relativePath(std::move(relativePath)),
+                _owner(std::move(owner)),
+                _data(static_cast<const char *>(data)),
+                _size(size),
+                _createdTime(static_cast<std::uint64_t>(std::time(nullptr))) {}
+
+        std::string _relativePath;
+        std::shared_ptr<const void> _owner;
+        const char *_data;
+        std::uint64_t _size;
+        std::uint64_t _createdTime;
+        std::uint64_t _position = 0;
+    };
+
+    MemoryFile::MemoryFile(std::string relativePath, const void *data, std::size_t size) :
+            pImpl(new Impl(std::move(relativePath), nullptr, data, size)) {}
+    MemoryFile::MemoryFile(std::string relativePath, std::shared_ptr<const void> owner, const void *data, std::size_t size) :
+            pImpl(new Impl(std::move(relativePath), std::move(owner), data, size)) {}
+    MemoryFile::~MemoryFile() = default;
+    std::string MemoryFile::getRelativePath() const {
+        return pImpl->_relativePath;
+    }
+    std::uint64_t MemoryFile::getSize() const {
+        return pImpl->_size;
+    }
+    std::uint64_t MemoryFile::getCreatedTime() const {
+        return pImpl->_createdTime;
+    }
+    std::uint64_t MemoryFile::getModifiedTime() const {
+        return pImpl->_createdTime;
+    }
+    std::filesystem::perms MemoryFile::getPermissions() const {
+        using std::filesystem::perms;
+        return perms::owner_read | perms::owner_write | perms::group_read | perms::others_read;
+    }
+    void MemoryFile::seek(std::uint64_t pos) {
+        pImpl->_position = pos;
+    }
+    std::uint64_t MemoryFile::read(char *buffer, std::uint64_t count) {
+        std::uint64_t n = readAt(pImpl->_position, buffer, count);
+        pImpl->_position += n;
+        return n;
+    }
+    std::uint64_t MemoryFile::readAt(std::uint64_t offset, char *buffer, std::uint64_t count) const {
+        return copySpan(pImpl->_data, pImpl->_size, offset, buffer, count);
+    }
+
+    class MappedFile::Impl {
+    public:
+        Impl(std::filesystem::path filePath, std::string relativePath) :
+                _filePath(std::move(filePath)),
+                _relativePath(std::move(relativePath)),
+                _fd(knotdrop_file_open(_filePath)) {
+            if (_fd < 0) {
+                throw std::runtime_error("Error opening file: " + _filePath.u8string());
+            }
+            if (knotdrop_file_stat(_fd, &_size, &_createdTime, &_modifiedTime) != 0) {
+                knotdrop_file_close(_fd);
+                throw std::runtime_error("Error getting file info: " + _filePath.u8string());
+            }
+            if (_size > 0) {
+                _data = static_cast<const char *>(knotdrop_file_map(_fd, _size));
+                if (_data == nullptr) {
+                    knotdrop_file_close(_fd);
+                    throw std::runtime_error("Error mapping file: " + _filePath.u8string());
+                }
+            }
+            std::error_code ec;
+            _permissions = std::filesystem::status(_filePath, ec).permissions();
+        }
+        ~Impl() {
+            if (_data != nullptr) {
+                knotdrop_file_unmap(const_cast<char *>(_data), _size);
+            }
+            knotdrop_file_close(_fd);
+        }
+
+        std::filesystem::path _filePath;
+        std::string _relativePath;
+        int _fd;
+        const char *_data = nullptr;
+        std::uint64_t _size = 0;
+        std::uint64_t _createdTime = 0;
+        std::uint64_t _modifiedTime = 0;
+        std::filesystem::perms _permissions = std::filesystem::perms::unknown;
+        std::uint64_t _position = 0;
+    };
+
+    MappedFile::MappedFile(const std::filesystem::path &filePath, std::string relativePath) :
+            pImpl(new Impl(filePath, std::move(relativePath))) {}
+    MappedFile::~MappedFile() = default;
+    std::string MappedFile::getRelativePath() const {
+        return pImpl->_relativePath;
+    }
+    std::uint64_t MappedFile::getSize() const {
+        return pImpl->_size;
+    }
+    std::uint64_t MappedFile::getCreatedTime() const {
+        return pImpl->_createdTime;
+    }
+    std::uint64_t MappedFile::getModifiedTime() const {
+        return pImpl->_modifiedTime;
+    }
+    std::filesystem::perms MappedFile::getPermissions() const {
+        return pImpl->_permissions;
+    }
+    void MappedFile::seek(std::uint64_t pos) {
+        pImpl->_position = pos;
+    }
+    std::uint64_t MappedFile::read(char *buffer, std::uint64_t count) {
+        std::uint64_t n = readAt(pImpl->_position, buffer, count);
+        pImpl->_position += n;
+        return n;
+    }
+    std::uint64_t MappedFile::readAt(std::uint64_t offset, char *buffer, std::uint64_t count) const {
+        return copySpan(pImpl->_data, pImpl->_size, offset, buffer, count);
+    }
+    int MappedFile::nativeHandle() const {
+        return pImpl->_fd;
+    }
+
+}
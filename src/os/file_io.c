@@ -0,0 +1,213 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+
+#include "file_io.h"
+
+#if defined(WIN32)
+
+#include <Windows.h>
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+
+static uint64_t knotdrop_file_filetime_to_unixtime(FILETIME fileTime) {
+    ULARGE_INTEGER largeInt;
+    largeInt.LowPart = fileTime.dwLowDateTime;
+    largeInt.HighPart = fileTime.dwHighDateTime;
+    return (largeInt.QuadPart - 116444736000000000ULL) / 10000000ULL;
+}
+
+int knotdrop_file_open(const char *filePath) {
+    return _open(filePath, _O_RDONLY | _O_BINARY | _O_NOINHERIT);
+}
+
+int knotdrop_file_wopen(const wchar_t *filePath) {
+    return _wopen(filePath, _O_RDONLY | _O_BINARY | _O_NOINHERIT);
+}
+
+void knotdrop_file_close(int fd) {
+    _close(fd);
+}
+
+int knotdrop_file_stat(int fd, uint64_t *size, uint64_t *ctime, uint64_t *mtime) {
+    HANDLE fileHandle = (HANDLE) _get_osfhandle(fd);
+    LARGE_INTEGER fileSize;
+    FILETIME creationTime, lastAccessTime, lastWriteTime;
+    if (fileHandle == INVALID_HANDLE_VALUE || !GetFileSizeEx(fileHandle, &fileSize) ||
+        !GetFileTime(fileHandle, &creationTime, &lastAccessTime, &lastWriteTime)) {
+        return 1;
+    }
+    *size = (uint64_t) fileSize.QuadPart;
+    *ctime = knotdrop_file_filetime_to_unixtime(creationTime);
+    *mtime = knotdrop_file_filetime_to_unixtime(lastWriteTime);
+    return 0;
+}
+
+int64_t knotdrop_file_pread(int fd, void *buffer, uint64_t count, uint64_t offset) {
+    HANDLE fileHandle = (HANDLE) _get_osfhandle(fd);
+    OVERLAPPED overlapped = {0};
+    DWORD bytesRead = 0;
+    overlapped.Offset = (DWORD) (offset & 0xFFFFFFFFULL);
+    overlapped.OffsetHigh = (DWORD) (offset >> 32);
+    if (count > 0x40000000ULL) {
+        count = 0x40000000ULL;
+    }
+    if (!ReadFile(fileHandle, buffer, (DWORD) count, &bytesRead, &overlapped)) {
+        return GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
+    }
+    return (int64_t) bytesRead;
+}
+
+int knotdrop_file_create(const char *filePath, unsigned mode) {
+    return _open(filePath, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY | _O_NOINHERIT,
+                 (mode & 0200) != 0 ? _S_IREAD | _S_IWRITE : _S_IREAD);
+}
+
+int knotdrop_file_wcreate(const wchar_t *filePath, unsigned mode) {
+    return _wopen(filePath, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY | _O_NOINHERIT,
+                  (mode & 0200) != 0 ? _S_IREAD | _S_IWRITE : _S_IREAD);
+}
+
+int knotdrop_file_create_new(const char *filePath, unsigned mode) {
+    return _open(filePath, _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY | _O_NOINHERIT,
+                 (mode & 0200) != 0 ? _S_IREAD | _S_IWRITE : _S_IREAD);
+}
+
+int knotdrop_file_wcreate_new(const wchar_t *filePath, unsigned mode) {
+    return _wopen(filePath, _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY | _O_NOINHERIT,
+                  (mode & 0200) != 0 ? _S_IREAD | _S_IWRITE : _S_IREAD);
+}
+
+int knotdrop_file_write(int fd, const void *buffer, uint64_t count) {
+    const char *data = (const char *) buffer;
+    while (count > 0) {
+        unsigned chunk = count > 0x40000000ULL ? 0x40000000U : (unsigned) count;
+        int written = _write(fd, data, chunk);
+        if (written <= 0) {
+            return 1;
+        }
+        data += written;
+        count -= (uint64_t) written;
+    }
+    return 0;
+}
+
+int knotdrop_file_set_mtime(int fd, uint64_t mtime) {
+    ULARGE_INTEGER largeInt;
+    FILETIME lastWriteTime;
+    largeInt.QuadPart = mtime * 10000000ULL + 116444736000000000ULL;
+    lastWriteTime.dwLowDateTime = largeInt.LowPart;
+    lastWriteTime.dwHighDateTime = largeInt.HighPart;
+    return SetFileTime((HANDLE) _get_osfhandle(fd), NULL, NULL, &lastWriteTime) ? 0 : 1;
+}
+
+void *knotdrop_file_map(int fd, uint64_t size) {
+    HANDLE mapping;
+    void *address;
+    if (size == 0 || size > (uint64_t) SIZE_MAX) {
+        return NULL;
+    }
+    mapping = CreateFileMappingA((HANDLE) _get_osfhandle(fd), NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL) {
+        return NULL;
+    }
+    address = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, (SIZE_T) size);
+    CloseHandle(mapping); /* the view keeps the mapping alive */
+    return address;
+}
+
+void knotdrop_file_unmap(void *address, uint64_t size) {
+    (void) size;
+    UnmapViewOfFile(address);
+}
+
+#else
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int knotdrop_file_open(const char *filePath) {
+    return open(filePath, O_RDONLY | O_CLOEXEC);
+}
+
+void knotdrop_file_close(int fd) {
+    close(fd);
+}
+
+int knotdrop_file_stat(int fd, uint64_t *size, uint64_t *ctime, uint64_t *mtime) {
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0) {
+        return 1;
+    }
+    *size = (uint64_t) fileStat.st_size;
+    *ctime = (uint64_t) fileStat.st_ctime;
+    *mtime = (uint64_t) fileStat.st_mtime;
+    return 0;
+}
+
+int64_t knotdrop_file_pread(int fd, void *buffer, uint64_t count, uint64_t offset) {
+    ssize_t result;
+    do {
+        result = pread(fd, buffer, (size_t) count, (off_t) offset);
+    } while (result < 0 && errno == EINTR);
+    return (int64_t) result;
+}
+
+int knotdrop_file_create(const char *filePath, unsigned mode) {
+    return open(filePath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, (mode_t) (mode & 0777));
+}
+
+int knotdrop_file_create_new(const char *filePath, unsigned mode) {
+    return open(filePath, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, (mode_t) (mode & 0777));
+}
+
+int knotdrop_file_write(int fd, const void *buffer, uint64_t count) {
+    const char *data = (const char *) buffer;
+    while (count > 0) {
+        ssize_t written = write(fd, data, (size_t) count);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return 1;
+        }
+        data += written;
+        count -= (uint64_t) written;
+    }
+    return 0;
+}
+
+int knotdrop_file_set_mtime(int fd, uint64_t mtime) {
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = (time_t) mtime;
+    times[1].tv_nsec = 0;
+    return futimens(fd, times) == 0 ? 0 : 1;
+}
+
+void *knotdrop_file_map(int fd, uint64_t size) {
+    void *address;
+    if (size == 0 || size > (uint64_t) SIZE_MAX) {
+        return NULL;
+    }
+    address = mmap(NULL, (size_t) size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (address == MAP_FAILED) {
+        return NULL;
+    }
+    madvise(address, (size_t) size, MADV_SEQUENTIAL);
+    return address;
+}
+
+void knotdrop_file_unmap(void *address, uint64_t size) {
+    munmap(address, (size_t) size);
+}
+
+#endif
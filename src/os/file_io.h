@@ -0,0 +1,90 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#if defined(WIN32)
+#include <wchar.h>
+#endif
+
+/* read-only descriptor, -1 on error */
+int knotdrop_file_open(const char *filePath);
+
+#if defined(WIN32)
+/* as knotdrop_file_open, the path is UTF-16 instead of the ANSI code page */
+int knotdrop_file_wopen(const wchar_t *filePath);
+#endif
+
+void knotdrop_file_close(int fd);
+
+/* 0 on success */
+int knotdrop_file_stat(int fd, uint64_t *size, uint64_t *ctime, uint64_t *mtime);
+
+/* positional read, the file offset is not used; bytes read, 0 at the end, -1 on error */
+int64_t knotdrop_file_pread(int fd, void *buffer, uint64_t count, uint64_t offset);
+
+/* creates or truncates a file for writing, -1 on error */
+int knotdrop_file_create(const char *filePath, unsigned mode);
+
+#if defined(WIN32)
+/* as knotdrop_file_create, the path is UTF-16 instead of the ANSI code page */
+int knotdrop_file_wcreate(const wchar_t *filePath, unsigned mode);
+#endif
+
+/* as knotdrop_file_create, but fails when the file exists: the mode holds from the start */
+int knotdrop_file_create_new(const char *filePath, unsigned mode);
+
+#if defined(WIN32)
+/* as knotdrop_file_create_new, the path is UTF-16 instead of the ANSI code page */
+int knotdrop_file_wcreate_new(const wchar_t *filePath, unsigned mode);
+#endif
+
+/* writes everything unless an error occurs; 0 on success */
+int knotdrop_file_write(int fd, const void *buffer, uint64_t count);
+
+/* 0 on success */
+int knotdrop_file_set_mtime(int fd, uint64_t mtime);
+
+/* read-only mapping of the whole file, advised for sequential access; NULL on error */
+void *knotdrop_file_map(int fd, uint64_t size);
+
+void knotdrop_file_unmap(void *address, uint64_t size);
+
+#ifdef __cplusplus
+} /* end of extern "C" */
+
+#include <filesystem>
+
+// std::filesystem paths are UTF-16 on Windows, a narrow one could not name every file.
+inline int knotdrop_file_open(const std::filesystem::path &filePath) {
+#if defined(WIN32)
+    return knotdrop_file_wopen(filePath.c_str());
+#else
+    return knotdrop_file_open(filePath.c_str());
+#endif
+}
+
+inline int knotdrop_file_create(const std::filesystem::path &filePath, unsigned mode) {
+#if defined(WIN32)
+    return knotdrop_file_wcreate(filePath.c_str(), mode);
+#else
+    return knotdrop_file_create(filePath.c_str(), mode);
+#endif
+}
+
+inline int knotdrop_file_create_new(const std::filesystem::path &filePath, unsigned mode) {
+#if defined(WIN32)
+    return knotdrop_file_wcreate_new(filePath.c_str(), mode);
+#else
+    return knotdrop_file_create_new(filePath.c_str(), mode);
+#endif
+}
+#endif
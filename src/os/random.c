@@ -0,0 +1,56 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+
+#include "random.h"
+
+#if defined(WIN32)
+
+#include <Windows.h>
+#include <bcrypt.h>
+
+int knotdrop_random_bytes(void *buffer, size_t size) {
+    return BCryptGenRandom(NULL, (PUCHAR) buffer, (ULONG) size, BCRYPT_USE_SYSTEM_PREFERRED_RNG) == 0 ? 0 : -1;
+}
+
+#elif defined(__APPLE__)
+
+#include <stdlib.h>
+
+int knotdrop_random_bytes(void *buffer, size_t size) {
+    arc4random_buf(buffer, size);
+    return 0;
+}
+
+#else
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+int knotdrop_random_bytes(void *buffer, size_t size) {
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    unsigned char *out = (unsigned char *) buffer;
+    while (size > 0) {
+        ssize_t n = read(fd, out, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            close(fd);
+            return -1;
+        }
+        out += n;
+        size -= (size_t) n;
+    }
+    close(fd);
+    return 0;
+}
+
+#endif
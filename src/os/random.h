@@ -10,10 +10,10 @@
 extern "C" {
 #endif
 
-#include <stdint.h>
-#include <stdio.h>
+#include <stddef.h>
 
-int knotdrop_util_fileinfo(const char *filePath, uint64_t *ctime, uint64_t *mtime);
+/* fills buffer from the OS CSPRNG; 0 on success */
+int knotdrop_random_bytes(void *buffer, size_t size);
 
 #ifdef __cplusplus
 } /* end of extern "C" */
@@ -0,0 +1,323 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+
+#include "pairing.hpp"
+#include "core.h"
+#include "logger.h"
+#include "os/file_io.h"
+#include "os/random.h"
+#include <cstring>
+#include <fstream>
+#include <thread>
+
+namespace {
+
+    std::chrono::system_clock::time_point nonceTime(const crypto::Nonce &nonce) {
+        std::uint64_t seconds = 0;
+        for (int i = 7; i >= 0; --i) {
+            seconds = seconds << 8 | nonce[i];
+        }
+        return std::chrono::system_clock::time_point(std::chrono::seconds(static_cast<std::int64_t>(seconds)));
+    }
+
+    // value of name= in a header of "; " separated parameters
+    std::string parameter(const std::string &header, const std::string &name) {
+        std::size_t at = header.find(name + "=");
+        if (at == std::string::npos) {
+            return {};
+        }
+        at += name.size() + 1;
+        return header.substr(at, header.find(';', at) - at);
+    }
+
+    bool equal(const unsigned char *a, const unsigned char *b, std::size_t size) {
+        unsigned char difference = 0;
+        for (std::size_t i = 0; i < size; ++i) {
+            difference |= a[i] ^ b[i];
+        }
+        return difference == 0;
+    }
+
+    void mac(unsigned char tag[crypto::tagSize], const pairing::Credential &credential, const std::string &binding) {
+        crypto::Poly1305 poly(credential.macKey.data());
+        poly.update(reinterpret_cast<const unsigned char *>(binding.data()), binding.size());
+        poly.finish(tag);
+    }
+
+    std::int64_t seconds(std::chrono::system_clock::time_point time) {
+        return std::chrono::duration_cast<std::chrono::seconds>(time.time_since_epoch()).count();
+    }
+
+    json keyJson(const crypto::Key &key) {
+        return crypto::toHex(key.data(), key.size());
+    }
+
+    crypto::Key keyFromJson(const json &j) {
+        crypto::Key key{};
+        if (!crypto::fromHex(j.get<std::string>(), key.data(), key.size())) {
+            throw std::runtime_error("bad token");
+        }
+        return key;
+    }
+
+} // namespace
+
+namespace pairing {
+
+    Credential credential(const crypto::Key &token, const crypto::Nonce &nonce) {
+        unsigned char stream[2 * crypto::keySize] = {0};
+        crypto::chacha20(stream, stream, sizeof(stream), token, nonce, 0);
+        Credential result;
+        result.nonce = nonce;
+        std::memcpy(result.macKey.data(), stream, crypto::keySize);
+        std::memcpy(result.key.data(), stream + crypto::keySize, crypto::keySize);
+        return result;
+    }
+
+    std::optional<Credential> newCredential(const crypto::Key &token) {
+        crypto::Nonce nonce{};
+        auto now = static_cast<std::uint64_t>(seconds(std::chrono::system_clock::now()));
+        for (int i = 0; i < 8; ++i) {
+            nonce[i] = static_cast<unsigned char>(now >> (8 * i));
+        }
+        if (knotdrop_random_bytes(nonce.data() + 8, nonce.size() - 8) != 0) {
+            return std::nullopt;
+        }
+        return credential(token, nonce);
+    }
+
+    std::string requestBinding(const std::string &method, const std::string &path, const std::string &deviceInfo, bool streamArchive,
+                               const std::string &totalSize) {
+        return method + ' ' + path + '\n' + deviceInfo + '\n' + (streamArchive ? "stream" : "tfa") + '\n' + totalSize;
+    }
+
+    std::string trustHeader(const Credential &credential, const std::string &binding) {
+        unsigned char tag[crypto::tagSize];
+        mac(tag, credential, binding);
+        return "nonce=" + crypto::toHex(credential.nonce.data(), credential.nonce.size()) + "; mac=" + crypto::toHex(tag, sizeof(tag));
+    }
+
+    Store &Store::instance() {
+        // intentionally leaked, like the peer cache
+        static auto *store = new Store;
+        return *store;
+    }
+
+    std::optional<Receiver> Store::receiver(const std::string &id) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _receivers.find(id);
+        if (it == _receivers.end()) {
+            return std::nullopt;
+        }
+        return it->second;
+    }
+
+    void Store::putReceiver(const std::string &id, const Receiver &receiver) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _receivers[id] = receiver;
+        save();
+    }
+
+    bool Store::hasSender(const std::string &id) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _senders.count(id) != 0;
+    }
+
+    bool Store::putSender(const std::string &id, const crypto::Key &token, bool replace) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto [it, added] = _senders.emplace(id, token);
+        if (!added) {
+            if (!replace) {
+                return false;
+            }
+            it->second = token;
+        }
+        save();
+        return true;
+    }
+
+    void Store::remove(const std::string &id) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_receivers.erase(id) + _senders.erase(id) != 0) {
+            save();
+        }
+    }
+
+    void Store::removeReceiver(const std::string &id) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_receivers.erase(id) != 0) {
+            save();
+        }
+    }
+
+    std::optional<Credential> Store::verify(const std::string &senderId, const std::string &trust, const std::string &binding) {
+        crypto::Nonce nonce{};
+        unsigned char tag[crypto::tagSize];
+        if (!crypto::fromHex(parameter(trust, "nonce"), nonce.data(), nonce.size()) ||
+            !crypto::fromHex(parameter(trust, "mac"), tag, sizeof(tag))) {
+            return std::nullopt;
+        }
+        auto now = std::chrono::system_clock::now();
+        std::chrono::system_clock::time_point sent = nonceTime(nonce);
+        if (sent < now - trustWindow || sent > now + trustWindow) {
+            LOG_DEBUG("trusted send outside the window" << Logger::kv("id", senderId));
+            return std::nullopt;
+        }
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _senders.find(senderId);
+        if (it == _senders.end()) {
+            return std::nullopt;
+        }
+        Credential result = credential(it->second, nonce);
+        unsigned char expected[crypto::tagSize];
+        mac(expected, result, binding);
+        if (!equal(expected, tag, sizeof(tag))) {
+            return std::nullopt;
+        }
+        for (auto used = _usedNonces.begin(); used != _usedNonces.end();) {
+            used = used->second < now ? _usedNonces.erase(used) : std::next(used);
+        }
+        // a replay within the window is refused, older ones are by their time
+        if (!_usedNonces.emplace(senderId + '/' + crypto::toHex(nonce.data(), nonce.size()), sent + trustWindow).second) {
+            LOG_DEBUG("trusted send replayed" << Logger::kv("id", senderId));
+            return std::nullopt;
+        }
+        saveNonces();
+        return result;
+    }
+
+    void Store::setFile(const std::filesystem::path &path) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _file = path;
+        load();
+    }
+
+    void Store::load() {
+        if (!_file.has_value()) {
+            return;
+        }
+        std::ifstream in(_file.value());
+        if (!in) {
+            return;
+        }
+        try {
+            json j = json::parse(in);
+            for (const json &entry: j.at("receivers")) {
+                Receiver receiver;
+                receiver.token = keyFromJson(entry.at("token"));
+                entry.at("cap").get_to(receiver.capabilities);
+                _receivers[entry.at("id").get<std::string>()] = receiver;
+            }
+            for (const json &entry: j.at("senders")) {
+                _senders[entry.at("id").get<std::string>()] = keyFromJson(entry.at("token"));
+            }
+            // files of older versions have none
+            auto now = std::chrono::system_clock::now();
+            for (const json &entry: j.value("nonces", json::array())) {
+                std::chrono::system_clock::time_point until(std::chrono::seconds(entry.at("until").get<std::int64_t>()));
+                if (until >= now) {
+                    _usedNonces[entry.at("id").get<std::string>()] = until;
+                }
+            }
+        } catch (const std::exception &e) {
+            LOG_ERROR("pairing load error: " << e.what());
+        }
+    }
+
+    void Store::save() {
+        if (!_file.has_value()) {
+            return;
+        }
+        write(_file.value(), content(), ++_generation);
+    }
+
+    void Store::saveNonces() {
+        if (!_file.has_value() || _noncesPending) {
+            return;
+        }
+        _noncesPending = true;
+        // the nonces of the sends verified until it runs go out with one write
+        std::thread([this]() {
+            std::filesystem::path file;
+            std::string snapshot;
+            std::uint64_t generation;
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _noncesPending = false;
+                if (!_file.has_value()) {
+                    return;
+                }
+                file = _file.value();
+                snapshot = content();
+                generation = ++_generation;
+            }
+            write(file, snapshot, generation);
+        }).detach();
+    }
+
+    std::string Store::content() const {
+        json receivers = json::array();
+        for (const auto &[id, receiver]: _receivers) {
+            json entry;
+            entry["id"] = id;
+            entry["token"] = keyJson(receiver.token);
+            entry["cap"] = receiver.capabilities;
+            receivers.push_back(entry);
+        }
+        json senders = json::array();
+        for (const auto &[id, token]: _senders) {
+            json entry;
+            entry["id"] = id;
+            entry["token"] = keyJson(token);
+            senders.push_back(entry);
+        }
+        json nonces = json::array();
+        for (const auto &[id, until]: _usedNonces) {
+            json entry;
+            entry["id"] = id;
+            entry["until"] = seconds(until);
+            nonces.push_back(entry);
+        }
+        json j;
+        j["receivers"] = receivers;
+        j["senders"] = senders;
+        j["nonces"] = nonces;
+        return j.dump();
+    }
+
+    void Store::write(const std::filesystem::path &file, const std::string &content, std::uint64_t generation) {
+        std::lock_guard<std::mutex> lock(_fileMutex);
+        // a background write may come after a newer one
+        if (generation <= _writtenGeneration) {
+            return;
+        }
+        _writtenGeneration = generation;
+        // the tokens are secrets, the file is owner-only from its creation on
+        std::filesystem::path tmp = file;
+        tmp += ".tmp";
+        std::error_code ec;
+        std::filesystem::remove(tmp, ec);
+        int fd = knotdrop_file_create_new(tmp, 0600);
+        if (fd < 0) {
+            LOG_ERROR("pairing save error: unable to create " << tmp.string());
+            return;
+        }
+        bool written = knotdrop_file_write(fd, content.data(), content.size()) == 0;
+        knotdrop_file_close(fd);
+        if (!written) {
+            LOG_ERROR("pairing save error: unable to write " << tmp.string());
+            std::filesystem::remove(tmp, ec);
+            return;
+        }
+        std::filesystem::rename(tmp, file, ec);
+        if (ec) {
+            LOG_ERROR("pairing save error: " << ec.message());
+        }
+    }
+
+} // namespace pairing
@@ -0,0 +1,97 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+#pragma once
+
+#include "flowdrop/flowdrop.hpp"
+#include "crypto.hpp"
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
+// Devices pair in an accepted ask: the sender sends an ephemeral X25519 key with it, a receiver
+// agreeing to pair answers with its own, and both keep the session key of the two as the token
+// of the pairing, which never crosses the wire. Later sends of the sender skip the ask and carry
+// a MAC of the request under the token instead:
+//   x-trust: nonce=<24 hex>; mac=<32 hex>
+// The nonce is the u64le UNIX time of the send and four random bytes. The first 64 bytes of the
+// ChaCha20 keystream of the token and the nonce are a one-time Poly1305 key and the key of the
+// body, which a trusted send always seals. The MAC covers the method, the path, the device info,
+// the archive format and the payload size, so neither the headers nor the body can be swapped.
+// The receiver takes a nonce once, and only within trustWindow of its own clock; the nonces it
+// took are kept with the pairings, written in the background, a restart does not make them new
+// again.
+namespace pairing {
+
+    static const std::chrono::minutes trustWindow(5);
+
+    // A receiver the sender is paired with.
+    struct Receiver {
+        crypto::Key token{};
+        unsigned capabilities = 0; // answered in the ask of the pairing
+    };
+
+    // What a trusted send is authenticated with.
+    struct Credential {
+        crypto::Nonce nonce{};
+        crypto::Key macKey{}; // one-time, of the request
+        crypto::Key key{}; // of the sealed body
+    };
+
+    Credential credential(const crypto::Key &token, const crypto::Nonce &nonce);
+
+    // Credential of a new send; empty without randomness.
+    std::optional<Credential> newCredential(const crypto::Key &token);
+
+    // What the MAC of a trusted send covers; totalSize is the header value, empty without one.
+    std::string requestBinding(const std::string &method, const std::string &path, const std::string &deviceInfo, bool streamArchive,
+                               const std::string &totalSize);
+
+    // x-trust value of the request with the binding.
+    std::string trustHeader(const Credential &credential, const std::string &binding);
+
+    // Process-wide pairings, both the receivers this device sends to and the senders it trusts.
+    // The file is loaded when set and rewritten whenever a pairing is made or removed; the nonces
+    // of verified sends are written off the calling thread, a burst of them at once.
+    class Store {
+    public:
+        static Store &instance();
+
+        std::optional<Receiver> receiver(const std::string &id);
+        void putReceiver(const std::string &id, const Receiver &receiver);
+        bool hasSender(const std::string &id);
+        // false, and the pairing kept, when the sender is paired already and replace is not set
+        bool putSender(const std::string &id, const crypto::Key &token, bool replace);
+        void remove(const std::string &id); // both ways
+        void removeReceiver(const std::string &id);
+
+        // The credential of a trusted send of the sender; empty unless the header carries a fresh
+        // nonce and the MAC of the binding under the token of its pairing.
+        std::optional<Credential> verify(const std::string &senderId, const std::string &trust, const std::string &binding);
+
+        void setFile(const std::filesystem::path &path);
+
+    private:
+        Store() = default;
+
+        void load();
+        void save();
+        void saveNonces();
+        [[nodiscard]] std::string content() const;
+        void write(const std::filesystem::path &file, const std::string &content, std::uint64_t generation);
+
+        std::mutex _mutex;
+        std::unordered_map<std::string, Receiver> _receivers;
+        std::unordered_map<std::string, crypto::Key> _senders;
+        std::map<std::string, std::chrono::system_clock::time_point> _usedNonces; // sender id and nonce, until out of the window; saved
+        std::optional<std::filesystem::path> _file;
+        bool _noncesPending = false;
+        std::uint64_t _generation = 0; // of the last content taken for the file
+        std::mutex _fileMutex; // taken after _mutex, never the other way
+        std::uint64_t _writtenGeneration = 0;
+    };
+
+} // namespace pairing
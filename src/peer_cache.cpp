@@ -0,0 +1,191 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+
+#include "peer_cache.hpp"
+#include "core.h"
+#include "logger.h"
+#include <fstream>
+#include <thread>
+
+namespace discovery {
+
+    // a peer seen again at the same address is only written this often, it is seen on every discovery hit and send
+    static const std::chrono::seconds refreshSaveInterval(60); // 1 min
+
+    PeerCache &PeerCache::instance() {
+        // intentionally leaked, revalidation threads are detached and may outlive static destruction
+        static auto *cache = new PeerCache;
+        return *cache;
+    }
+
+    std::optional<Remote> PeerCache::get(const std::string &id) {
+        std::optional<Peer> peerOpt = peer(id);
+        if (!peerOpt.has_value()) {
+            return std::nullopt;
+        }
+        return peerOpt->remote;
+    }
+
+    std::optional<Peer> PeerCache::peer(const std::string &id) {
+        bool stale;
+        Peer result;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto it = _peers.find(id);
+            if (it == _peers.end()) {
+                return std::nullopt;
+            }
+            auto age = std::chrono::system_clock::now() - it->second.seen;
+            if (age > _ttl) {
+                return std::nullopt;
+            }
+            stale = age > _ttl / 2;
+            result = it->second;
+        }
+        if (stale) {
+            revalidate(id);
+        }
+        return result;
+    }
+
+    void PeerCache::put(const std::string &id, const Remote &remote) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        Peer &peer = _peers[id];
+        bool changed = peer.remote.ipType != remote.ipType || peer.remote.ip != remote.ip || peer.remote.port != remote.port ||
+                       peer.remote.capabilities != remote.capabilities;
+        peer.remote = remote;
+        peer.seen = std::chrono::system_clock::now();
+        if (changed || peer.seen - _savedAt >= refreshSaveInterval) {
+            save();
+        }
+    }
+
+    void PeerCache::putDeviceInfo(const flowdrop::DeviceInfo &deviceInfo) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _peers.find(deviceInfo.id);
+        if (it == _peers.end()) {
+            return;
+        }
+        bool changed = !it->second.deviceInfo.has_value() || json(it->second.deviceInfo.value()) != json(deviceInfo);
+        it->second.deviceInfo = deviceInfo;
+        if (changed) {
+            save();
+        }
+    }
+
+    void PeerCache::invalidate(const std::string &id) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_peers.erase(id) != 0) {
+            save();
+        }
+    }
+
+    void PeerCache::setTTL(const std::chrono::seconds &ttl) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _ttl = ttl;
+    }
+
+    void PeerCache::setFile(const std::filesystem::path &path) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _file = path;
+        load();
+    }
+
+    void PeerCache::revalidate(const std::string &id) {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (!_refreshing.insert(id).second) {
+                return;
+            }
+        }
+        LOG_DEBUG("peer cache revalidate" << Logger::kv("id", id));
+        std::thread([this, id]() {
+            try {
+                resolveAndQuery(id, [this, id](const std::optional<Remote> &remoteOpt) {
+                    if (remoteOpt.has_value()) {
+                        put(id, remoteOpt.value());
+                    } else {
+                        invalidate(id);
+                    }
+                });
+            } catch (const std::exception &e) {
+                LOG_DEBUG("peer cache revalidate error: " << e.what());
+            }
+            std::lock_guard<std::mutex> lock(_mutex);
+            _refreshing.erase(id);
+        }).detach();
+    }
+
+    void PeerCache::load() {
+        if (!_file.has_value()) {
+            return;
+        }
+        std::ifstream in(_file.value());
+        if (!in) {
+            return;
+        }
+        try {
+            json j = json::parse(in);
+            for (const json &entry: j.at("peers")) {
+                Peer peer;
+                peer.remote.ipType = entry.at("ipf").get<int>() == 4 ? IPv4 : IPv6;
+                entry.at("ip").get_to(peer.remote.ip);
+                entry.at("port").get_to(peer.remote.port);
+                if (entry.count("cap") != 0) {
+                    entry.at("cap").get_to(peer.remote.capabilities);
+                }
+                peer.seen = std::chrono::system_clock::time_point(std::chrono::seconds(entry.at("seen").get<std::int64_t>()));
+                if (entry.count("device") != 0) {
+                    peer.deviceInfo = entry.at("device").get<flowdrop::DeviceInfo>();
+                }
+                _peers[entry.at("id").get<std::string>()] = peer;
+            }
+        } catch (const std::exception &e) {
+            LOG_ERROR("peer cache load error: " << e.what());
+        }
+    }
+
+    void PeerCache::save() {
+        if (!_file.has_value()) {
+            return;
+        }
+        _savedAt = std::chrono::system_clock::now();
+        json peers = json::array();
+        for (const auto &[id, peer]: _peers) {
+            json entry;
+            entry["id"] = id;
+            entry["ipf"] = peer.remote.ipType == IPv4 ? 4 : 6;
+            entry["ip"] = peer.remote.ip;
+            entry["port"] = peer.remote.port;
+            entry["cap"] = peer.remote.capabilities;
+            entry["seen"] = std::chrono::duration_cast<std::chrono::seconds>(peer.seen.time_since_epoch()).count();
+            if (peer.deviceInfo.has_value()) {
+                entry["device"] = peer.deviceInfo.value();
+            }
+            peers.push_back(entry);
+        }
+        json j;
+        j["peers"] = peers;
+
+        std::filesystem::path tmp = _file.value();
+        tmp += ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::trunc);
+            if (!out) {
+                LOG_ERROR("peer cache save error: unable to open " << tmp.string());
+                return;
+            }
+            out << j.dump();
+        }
+        std::error_code ec;
+        std::filesystem::rename(tmp, _file.value(), ec);
+        if (ec) {
+            LOG_ERROR("peer cache save error: " << ec.message());
+        }
+    }
+
+} // namespace discovery
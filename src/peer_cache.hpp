@@ -0,0 +1,56 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+#pragma once
+
+#include "flowdrop/flowdrop.hpp"
+#include "discovery.hpp"
+#include <mutex>
+#include <set>
+#include <unordered_map>
+
+namespace discovery {
+
+    struct Peer {
+        Remote remote;
+        std::optional<flowdrop::DeviceInfo> deviceInfo;
+        std::chrono::system_clock::time_point seen;
+    };
+
+    // Process-wide registry of resolved peers, populated by discover() and send().
+    // Lookups of entries older than half of the TTL trigger a background re-resolve,
+    // entries older than the TTL are treated as missing.
+    // The file is written when a peer changes, a peer only seen again is written at most once a minute.
+    class PeerCache {
+    public:
+        static PeerCache &instance();
+
+        std::optional<Remote> get(const std::string &id);
+        std::optional<Peer> peer(const std::string &id);
+
+        void put(const std::string &id, const Remote &remote);
+        void putDeviceInfo(const flowdrop::DeviceInfo &deviceInfo);
+        void invalidate(const std::string &id);
+
+        void setTTL(const std::chrono::seconds &ttl);
+        void setFile(const std::filesystem::path &path);
+
+    private:
+        PeerCache() = default;
+
+        void revalidate(const std::string &id);
+        void load();
+        void save();
+
+        std::mutex _mutex;
+        std::unordered_map<std::string, Peer> _peers;
+        std::set<std::string> _refreshing;
+        std::chrono::seconds _ttl = std::chrono::seconds(10 * 60); // 10 mins
+        std::optional<std::filesystem::path> _file;
+        std::chrono::system_clock::time_point _savedAt; // last write of the file
+    };
+
+} // namespace discovery
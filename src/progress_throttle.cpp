@@ -0,0 +1,49 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+
+#include "progress_throttle.hpp"
+
+ProgressThrottle::ProgressThrottle(const flowdrop::ProgressOptions &options) :
+        _interval(options.interval), _granularity(options.granularity) {}
+
+bool ProgressThrottle::due(std::uint64_t position) {
+    _held = position;
+    _pending = true;
+    if (position < _reported + _granularity) {
+        return false;
+    }
+    // the clock is only read once the bytes are there
+    if (_interval.count() > 0) {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (now - _last < _interval) {
+            return false;
+        }
+        _last = now;
+    }
+    _reported = position;
+    _pending = false;
+    return true;
+}
+
+bool ProgressThrottle::flush() {
+    if (!_pending) {
+        return false;
+    }
+    _reported = _held;
+    _pending = false;
+    return true;
+}
+
+std::uint64_t ProgressThrottle::held() const {
+    return _held;
+}
+
+void ProgressThrottle::restart() {
+    _reported = 0;
+    _held = 0;
+    _pending = false;
+}
@@ -0,0 +1,32 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+#pragma once
+
+#include "flowdrop/flowdrop.hpp"
+
+// Coalesces progress updates as set by ProgressOptions. Positions only grow, except after
+// restart(). Updates held back are not lost: flush() reports the last of them.
+class ProgressThrottle {
+public:
+    explicit ProgressThrottle(const flowdrop::ProgressOptions &options);
+
+    // true when the update at position is to be reported
+    bool due(std::uint64_t position);
+    // true once if an update was held back since the last report, held() is its position
+    bool flush();
+    [[nodiscard]] std::uint64_t held() const;
+    // positions start over, e.g. for the next file; the interval keeps running
+    void restart();
+
+private:
+    std::chrono::steady_clock::duration _interval;
+    std::uint64_t _granularity;
+    std::chrono::steady_clock::time_point _last;
+    std::uint64_t _reported = 0;
+    std::uint64_t _held = 0;
+    bool _pending = false;
+};
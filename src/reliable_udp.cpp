@@ -0,0 +1,647 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+
+#include "reliable_udp.hpp"
+#include "hv/hsocket.h"
+#include "ikcp.h"
+#include "logger.h"
+#include "os/random.h"
+#include "specification.h"
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+static const std::size_t datagramSize = 1400; // fits a 1500 byte Ethernet MTU with the IP and UDP headers
+static const std::size_t headerSize = 10; // conv, kind, FEC group size, datagram sequence number
+static const int kcpMtu = static_cast<int>(datagramSize - headerSize - 2); // parity also covers the datagram lengths
+static const unsigned sendChunkSegments = 64; // per ikcp_send, which takes fewer than 128 segments at once
+static const std::size_t fecGroupsKept = 32;
+static const int socketBufferSize = 4 * 1024 * 1024;
+static const double pacingBurst = 64 * 1024;
+static const std::chrono::milliseconds maxWait(100);
+static const std::chrono::milliseconds helloTimeout(3000);
+static const std::chrono::seconds stallTimeout(30);
+static const std::chrono::seconds idleTimeout(30);
+static const std::chrono::seconds lingerTimeout(10);
+static const std::chrono::minutes offerLifetime(10);
+static const std::size_t helloSize = 12; // magic, then the payload size as u64le
+
+// one byte replies of the receiver
+static const char replyReady = 'R';
+static const char replyDone = 'K';
+static const char replyFailed = 'E';
+
+enum DatagramKind : unsigned char {
+    kindData = 0,
+    kindParity = 1
+};
+
+static std::atomic<double> injectedLoss{0};
+static std::atomic<long long> injectedDelayMs{0};
+
+static std::uint32_t load32(const unsigned char *p) {
+    return static_cast<std::uint32_t>(p[0]) | static_cast<std::uint32_t>(p[1]) << 8 |
+           static_cast<std::uint32_t>(p[2]) << 16 | static_cast<std::uint32_t>(p[3]) << 24;
+}
+
+static void store32(unsigned char *p, std::uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        p[i] = static_cast<unsigned char>(value >> (8 * i));
+    }
+}
+
+static IUINT32 kcpClock(Clock::time_point now) {
+    return static_cast<IUINT32>(std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count());
+}
+
+static bool sameAddress(const sockaddr_u &a, const sockaddr_u &b) {
+    if (a.sa.sa_family != b.sa.sa_family) {
+        return false;
+    }
+    if (a.sa.sa_family == AF_INET) {
+        return a.sin.sin_port == b.sin.sin_port && a.sin.sin_addr.s_addr == b.sin.sin_addr.s_addr;
+    }
+    return a.sin6.sin6_port == b.sin6.sin6_port && std::memcmp(&a.sin6.sin6_addr, &b.sin6.sin6_addr, sizeof(a.sin6.sin6_addr)) == 0;
+}
+
+// Blocks until the socket is readable or the deadline passes.
+static void waitReadable(int fd, Clock::time_point deadline) {
+    auto wait = std::chrono::duration_cast<std::chrono::microseconds>(deadline - Clock::now());
+    wait = std::max(std::chrono::microseconds(0), std::min<std::chrono::microseconds>(wait, maxWait));
+    fd_set readFds;
+    FD_ZERO(&readFds);
+    FD_SET(fd, &readFds);
+    struct timeval tv{};
+    tv.tv_sec = static_cast<long>(wait.count() / 1000000);
+    tv.tv_usec = static_cast<long>(wait.count() % 1000000);
+    select(fd + 1, &readFds, nullptr, nullptr, &tv);
+}
+
+static void setSocketBuffers(int fd) {
+    so_sndbuf(fd, socketBufferSize);
+    so_rcvbuf(fd, socketBufferSize);
+}
+
+namespace {
+
+    // One KCP session with a peer: our datagram header, XOR parity FEC over groups of outgoing
+    // datagrams, and a queue for pacing and injected delay in front of the socket.
+    class Link {
+    public:
+        Link(int fd, const sockaddr_u &peer, std::uint32_t conv, unsigned window, unsigned fecGroup, std::uint64_t pacingRate) :
+                _fd(fd), _peer(peer), _conv(conv), _fecGroup(std::min(fecGroup, transport::maxFecGroup)),
+                _pacingRate(static_cast<double>(pacingRate)), _tokens(pacingBurst) {
+            _kcp = ikcp_create(conv, this);
+            _kcp->output = output;
+            _kcp->stream = 1;
+            ikcp_nodelay(_kcp, 1, 10, 2, 1);
+            ikcp_wndsize(_kcp, static_cast<int>(window), static_cast<int>(window));
+            ikcp_setmtu(_kcp, kcpMtu);
+            _now = Clock::now();
+            _refilled = _now;
+            ikcp_update(_kcp, kcpClock(_now));
+            _parity.assign(static_cast<std::size_t>(kcpMtu) + 2, '\0');
+        }
+
+        ~Link() {
+            ikcp_release(_kcp);
+        }
+
+        Link(const Link &) = delete;
+        Link &operator=(const Link &) = delete;
+
+        [[nodiscard]] const sockaddr_u &peer() const {
+            return _peer;
+        }
+
+        [[nodiscard]] std::size_t segmentSize() const {
+            return _kcp->mss;
+        }
+
+        int send(const char *data, std::size_t size) {
+            return ikcp_send(_kcp, data, static_cast<int>(size));
+        }
+
+        int recv(char *buffer, std::size_t size) {
+            return ikcp_recv(_kcp, buffer, static_cast<int>(size));
+        }
+
+        [[nodiscard]] unsigned waitSend() const {
+            return static_cast<unsigned>(ikcp_waitsnd(_kcp));
+        }
+
+        [[nodiscard]] bool dead() const {
+            return _kcp->state != 0;
+        }
+
+        // a datagram from the peer, header included
+        void input(const unsigned char *data, std::size_t size, Clock::time_point now) {
+            _now = now;
+            if (size <= headerSize) {
+                return;
+            }
+            unsigned char kind = data[4];
+            unsigned group = data[5];
+            std::uint32_t seq = load32(data + 6);
+            const unsigned char *payload = data + headerSize;
+            std::size_t payloadSize = size - headerSize;
+            if (kind == kindData) {
+                ikcp_input(_kcp, reinterpret_cast<const char *>(payload), static_cast<long>(payloadSize));
+                if (group > 1) {
+                    FecGroup &fec = fecGroup(seq - seq % group, group);
+                    std::size_t index = seq % group;
+                    if (!fec.have[index]) {
+                        fec.have[index] = true;
+                        fec.packets[index].assign(reinterpret_cast<const char *>(payload), payloadSize);
+                        ++fec.count;
+                        recover(fec);
+                    }
+                }
+            } else if (kind == kindParity && group > 1 && seq % group == 0) {
+                FecGroup &fec = fecGroup(seq, group);
+                if (fec.parity.empty()) {
+                    fec.parity.assign(reinterpret_cast<const char *>(payload), payloadSize);
+                    recover(fec);
+                }
+            }
+            _dirty = true;
+        }
+
+        // Runs the KCP timers, flushes after input and sends what is due. Returns when it wants
+        // to run again.
+        Clock::time_point update(Clock::time_point now) {
+            _now = now;
+            IUINT32 current = kcpClock(now);
+            ikcp_update(_kcp, current);
+            if (_dirty) {
+                ikcp_flush(_kcp);
+                _dirty = false;
+            }
+            Clock::time_point next = now + std::chrono::milliseconds(ikcp_check(_kcp, current) - current);
+            if (!_queue.empty()) {
+                next = std::min(next, drain(now));
+            }
+            return next;
+        }
+
+        // sends the acknowledgements now, then whatever is still queued
+        void flush(Clock::time_point until) {
+            _now = Clock::now();
+            ikcp_flush(_kcp);
+            while (!_queue.empty() && _now < until) {
+                std::this_thread::sleep_until(std::min(drain(_now), until));
+                _now = Clock::now();
+            }
+        }
+
+    private:
+        struct FecGroup {
+            std::uint32_t first;
+            std::vector<std::string> packets;
+            std::vector<bool> have;
+            std::string parity;
+            unsigned count = 0;
+            bool recovered = false;
+        };
+
+        static int output(const char *buf, int len, ikcpcb * /*kcp*/, void *user) {
+            static_cast<Link *>(user)->emitData(buf, static_cast<std::size_t>(len));
+            return 0;
+        }
+
+        void emitData(const char *data, std::size_t size) {
+            std::uint32_t seq = _sendSeq++;
+            emit(kindData, seq, data, size);
+            if (_fecGroup < 2) {
+                return;
+            }
+            unsigned char length[2] = {static_cast<unsigned char>(size), static_cast<unsigned char>(size >> 8)};
+            _parity[0] = static_cast<char>(_parity[0] ^ length[0]);
+            _parity[1] = static_cast<char>(_parity[1] ^ length[1]);
+            for (std::size_t i = 0; i < size; ++i) {
+                _parity[2 + i] = static_cast<char>(_parity[2 + i] ^ data[i]);
+            }
+            _parityUsed = std::max(_parityUsed, size + 2);
+            if (seq % _fecGroup == _fecGroup - 1) {
+                emit(kindParity, seq - (_fecGroup - 1), _parity.data(), _parityUsed);
+                std::fill(_parity.begin(), _parity.begin() + static_cast<std::ptrdiff_t>(_parityUsed), '\0');
+                _parityUsed = 0;
+            }
+        }
+
+        void emit(unsigned char kind, std::uint32_t seq, const char *payload, std::size_t size) {
+            unsigned char header[headerSize];
+            store32(header, _conv);
+            header[4] = kind;
+            header[5] = static_cast<unsigned char>(_fecGroup);
+            store32(header + 6, seq);
+            long long delayMs = injectedDelayMs.load(std::memory_order_relaxed);
+            if (_queue.empty() && _pacingRate <= 0 && delayMs <= 0) {
+                char datagram[datagramSize + 16];
+                std::memcpy(datagram, header, headerSize);
+                std::memcpy(datagram + headerSize, payload, size);
+                transmit(datagram, headerSize + size);
+                return;
+            }
+            std::string datagram(reinterpret_cast<const char *>(header), headerSize);
+            datagram.append(payload, size);
+            _queue.push_back({_now + std::chrono::milliseconds(delayMs), std::move(datagram)});
+        }
+
+        void transmit(const char *data, std::size_t size) {
+            double loss = injectedLoss.load(std::memory_order_relaxed);
+            if (loss > 0) {
+                thread_local std::minstd_rand random(std::random_device{}());
+                if (std::uniform_real_distribution<double>(0, 1)(random) < loss) {
+                    return;
+                }
+            }
+            sendto(_fd, data, static_cast<int>(size), 0, &_peer.sa, sockaddr_len(const_cast<sockaddr_u *>(&_peer)));
+        }
+
+        // sends the queued datagrams that are due and within the pacing budget; returns when the next one is
+        Clock::time_point drain(Clock::time_point now) {
+            if (_pacingRate > 0) {
+                _tokens = std::min(pacingBurst, _tokens + _pacingRate * std::chrono::duration<double>(now - _refilled).count());
+                _refilled = now;
+            }
+            while (!_queue.empty() && _queue.front().due <= now) {
+                const std::string &datagram = _queue.front().datagram;
+                if (_pacingRate > 0) {
+                    if (_tokens < static_cast<double>(datagram.size())) {
+                        auto wait = std::chrono::duration<double>((static_cast<double>(datagram.size()) - _tokens) / _pacingRate);
+                        return now + std::chrono::duration_cast<Clock::duration>(wait) + std::chrono::microseconds(1);
+                    }
+                    _tokens -= static_cast<double>(datagram.size());
+                }
+                transmit(datagram.data(), datagram.size());
+                _queue.pop_front();
+            }
+            return _queue.empty() ? Clock::time_point::max() : _queue.front().due;
+        }
+
+        FecGroup &fecGroup(std::uint32_t first, unsigned size) {
+            for (FecGroup &fec: _fecGroups) {
+                if (fec.first == first && fec.packets.size() == size) {
+                    return fec;
+                }
+            }
+            if (_fecGroups.size() >= fecGroupsKept) {
+                _fecGroups.pop_front();
+            }
+            FecGroup fec;
+            fec.first = first;
+            fec.packets.resize(size);
+            fec.have.assign(size, false);
+            _fecGroups.push_back(std::move(fec));
+            return _fecGroups.back();
+        }
+
+        // rebuilds the one missing datagram of a group from the others and the parity
+        void recover(FecGroup &fec) {
+            if (fec.recovered || fec.parity.size() < 2 || fec.count + 1 != fec.packets.size()) {
+                return;
+            }
+            fec.recovered = true;
+            std::string missing = fec.parity;
+            for (std::size_t i = 0; i < fec.packets.size(); ++i) {
+                if (!fec.have[i]) {
+                    continue;
+                }
+                const std::string &packet = fec.packets[i];
+                if (packet.size() + 2 > missing.size()) {
+                    return;
+                }
+                missing[0] = static_cast<char>(missing[0] ^ static_cast<char>(packet.size()));
+                missing[1] = static_cast<char>(missing[1] ^ static_cast<char>(packet.size() >> 8));
+                for (std::size_t j = 0; j < packet.size(); ++j) {
+                    missing[2 + j] = static_cast<char>(missing[2 + j] ^ packet[j]);
+                }
+            }
+            std::size_t size = static_cast<unsigned char>(missing[0]) | static_cast<std::size_t>(static_cast<unsigned char>(missing[1])) << 8;
+            if (size + 2 <= missing.size()) {
+                ikcp_input(_kcp, missing.data() + 2, static_cast<long>(size));
+            }
+        }
+
+        struct Pending {
+            Clock::time_point due;
+            std::string datagram;
+        };
+
+        int _fd;
+        sockaddr_u _peer;
+        std::uint32_t _conv;
+        unsigned _fecGroup;
+        double _pacingRate;
+        double _tokens;
+        ikcpcb *_kcp;
+        Clock::time_point _now;
+        Clock::time_point _refilled;
+        bool _dirty = false;
+        std::uint32_t _sendSeq = 0;
+        std::string _parity;
+        std::size_t _parityUsed = 0;
+        std::deque<FecGroup> _fecGroups;
+        std::deque<Pending> _queue;
+    };
+
+    // Reads every datagram waiting on the socket; handler(data, size, from).
+    template<typename Handler>
+    void receiveDatagrams(int fd, Handler handler) {
+        unsigned char buffer[2048];
+        for (;;) {
+            sockaddr_u from{};
+            socklen_t fromSize = sizeof(from);
+            int n = static_cast<int>(recvfrom(fd, reinterpret_cast<char *>(buffer), sizeof(buffer), 0, &from.sa, &fromSize));
+            if (n <= 0) {
+                return;
+            }
+            if (static_cast<std::size_t>(n) > headerSize) {
+                handler(buffer, static_cast<std::size_t>(n), from);
+            }
+        }
+    }
+
+} // namespace
+
+namespace transport {
+
+    void setLossInjection(double lossRate, const std::chrono::milliseconds &delay) {
+        injectedLoss = lossRate;
+        injectedDelayMs = delay.count();
+    }
+
+    UdpSendResult sendReliableUdp(const std::string &ip, unsigned short port, std::uint32_t conv,
+                                  const flowdrop::ReliableUdpOptions &options, std::uint64_t payloadSize, const udpSource &source) {
+        sockaddr_u peer{};
+        if (sockaddr_set_ipport(&peer, ip.c_str(), port) != 0) {
+            return UdpSendResult::Unreachable;
+        }
+        int fd = static_cast<int>(socket(peer.sa.sa_family, SOCK_DGRAM, 0));
+        if (fd < 0) {
+            return UdpSendResult::Unreachable;
+        }
+        nonblocking(fd);
+        setSocketBuffers(fd);
+        unsigned window = std::clamp(options.window, minUdpWindow, maxUdpWindow);
+        auto link = std::make_unique<Link>(fd, peer, conv, window, options.fecGroup, options.pacingRate);
+
+        char hello[helloSize];
+        std::memcpy(hello, flowdrop_reliable_udp_magic, sizeof(flowdrop_reliable_udp_magic));
+        for (int i = 0; i < 8; ++i) {
+            hello[4 + i] = static_cast<char>(payloadSize >> (8 * i));
+        }
+        link->send(hello, sizeof(hello));
+
+        std::vector<char> chunk(link->segmentSize() * sendChunkSegments);
+        Clock::time_point start = Clock::now();
+        Clock::time_point lastProgress = start;
+        unsigned lastWaiting = 0;
+        bool ready = false;
+        bool sourceDone = false;
+        std::optional<UdpSendResult> result;
+        while (!result.has_value()) {
+            Clock::time_point now = Clock::now();
+            while (ready && !sourceDone && link->waitSend() < 2 * window) {
+                std::int64_t n = source(chunk.data(), chunk.size());
+                if (n < 0) {
+                    result = UdpSendResult::Failed;
+                    break;
+                }
+                if (n == 0) {
+                    sourceDone = true;
+                    break;
+                }
+                link->send(chunk.data(), static_cast<std::size_t>(n));
+            }
+            if (result.has_value()) {
+                break;
+            }
+            Clock::time_point next = link->update(now);
+            if (link->dead()) {
+                LOG_ERROR("reliable UDP peer stopped answering" << Logger::kv("ip", ip));
+                result = ready ? UdpSendResult::Failed : UdpSendResult::Unreachable;
+                break;
+            }
+            waitReadable(fd, next);
+            now = Clock::now();
+            receiveDatagrams(fd, [&](const unsigned char *data, std::size_t size, const sockaddr_u &from) {
+                if (load32(data) == conv && sameAddress(from, peer)) {
+                    link->input(data, size, now);
+                }
+            });
+            char reply[256];
+            int n;
+            while (!result.has_value() && (n = link->recv(reply, sizeof(reply))) > 0) {
+                for (int i = 0; i < n && !result.has_value(); ++i) {
+                    if (reply[i] == replyReady) {
+                        ready = true;
+                        lastProgress = now;
+                    } else if (reply[i] == replyDone) {
+                        result = UdpSendResult::Sent;
+                    } else {
+                        LOG_ERROR("receiver failed the reliable UDP transfer" << Logger::kv("ip", ip));
+                        result = UdpSendResult::Failed;
+                    }
+                }
+            }
+            unsigned waiting = link->waitSend();
+            if (waiting < lastWaiting || (!sourceDone && waiting < 2 * window)) {
+                lastProgress = now;
+            }
+            lastWaiting = waiting;
+            if (!result.has_value() && !ready && now - start > helloTimeout) {
+                result = UdpSendResult::Unreachable;
+            } else if (!result.has_value() && ready && now - lastProgress > stallTimeout) {
+                LOG_ERROR("reliable UDP transfer stalled" << Logger::kv("ip", ip));
+                result = UdpSendResult::Failed;
+            }
+        }
+        // acknowledges the receiver's last reply so that it does not linger
+        link->flush(Clock::now() + std::chrono::seconds(1));
+        link.reset();
+        closesocket(fd);
+        return result.value();
+    }
+
+    // receiver side of a session, owned by the receiver thread
+    struct UdpSession {
+        std::unique_ptr<Link> link;
+        std::unique_ptr<ReliableUdpSink> sink;
+        sinkFactory factory;
+        std::string hello;
+        bool closing = false;
+        Clock::time_point lastHeard;
+        Clock::time_point closingSince;
+
+        void reply(char code) {
+            link->send(&code, 1);
+            closing = code != replyReady;
+            closingSince = lastHeard;
+        }
+
+        void receive() {
+            char buffer[64 * 1024];
+            int n;
+            while ((n = link->recv(buffer, sizeof(buffer))) > 0) {
+                if (closing) {
+                    continue;
+                }
+                const char *data = buffer;
+                std::size_t size = static_cast<std::size_t>(n);
+                if (sink == nullptr) {
+                    std::size_t take = std::min(size, helloSize - hello.size());
+                    hello.append(data, take);
+                    data += take;
+                    size -= take;
+                    if (hello.size() < helloSize) {
+                        continue;
+                    }
+                    if (std::memcmp(hello.data(), flowdrop_reliable_udp_magic, sizeof(flowdrop_reliable_udp_magic)) != 0) {
+                        LOG_ERROR("bad reliable UDP hello");
+                        reply(replyFailed);
+                        continue;
+                    }
+                    std::uint64_t payloadSize = 0;
+                    for (int i = 0; i < 8; ++i) {
+                        payloadSize |= static_cast<std::uint64_t>(static_cast<unsigned char>(hello[4 + i])) << (8 * i);
+                    }
+                    sink = factory(payloadSize);
+                    factory = nullptr;
+                    if (sink == nullptr) {
+                        reply(replyFailed);
+                        continue;
+                    }
+                    reply(replyReady);
+                }
+                if (size > 0 && !sink->write(data, size)) {
+                    reply(replyFailed);
+                    continue;
+                }
+                if (sink->complete()) {
+                    reply(sink->finish() ? replyDone : replyFailed);
+                }
+            }
+        }
+    };
+
+    ReliableUdpReceiver::ReliableUdpReceiver(unsigned short port, bool ipv4) {
+        const char *host = ipv4 ? "0.0.0.0" : "::";
+        _fd = Bind(port, host, SOCK_DGRAM);
+        if (_fd < 0) {
+            _fd = Bind(0, host, SOCK_DGRAM);
+        }
+        if (_fd < 0) {
+            LOG_ERROR("unable to open the reliable UDP socket");
+            _fd = -1;
+            return;
+        }
+        sockaddr_u local{};
+        socklen_t localSize = sizeof(local);
+        getsockname(_fd, &local.sa, &localSize);
+        _port = sockaddr_port(&local);
+        nonblocking(_fd);
+        setSocketBuffers(_fd);
+        _thread = std::thread(&ReliableUdpReceiver::run, this);
+    }
+
+    ReliableUdpReceiver::~ReliableUdpReceiver() {
+        stop();
+    }
+
+    bool ReliableUdpReceiver::running() const {
+        return _fd >= 0 && !_stopped;
+    }
+
+    unsigned short ReliableUdpReceiver::port() const {
+        return _port;
+    }
+
+    std::uint32_t ReliableUdpReceiver::offer(unsigned window, sinkFactory factory) {
+        std::uint32_t conv = 0;
+        auto now = Clock::now();
+        std::lock_guard<std::mutex> lock(_offersMutex);
+        for (auto it = _offers.begin(); it != _offers.end();) {
+            it = it->second.expires < now ? _offers.erase(it) : std::next(it);
+        }
+        while (conv == 0 || _offers.count(conv) != 0) {
+            if (knotdrop_random_bytes(&conv, sizeof(conv)) != 0) {
+                return 0;
+            }
+        }
+        _offers[conv] = {std::clamp(window, minUdpWindow, maxUdpWindow), std::move(factory), now + offerLifetime};
+        return conv;
+    }
+
+    void ReliableUdpReceiver::stop() {
+        _stopped = true;
+        if (_thread.joinable()) {
+            _thread.join();
+        }
+        if (_fd >= 0) {
+            closesocket(_fd);
+            _fd = -1;
+        }
+    }
+
+    void ReliableUdpReceiver::run() {
+        std::unordered_map<std::uint32_t, std::unique_ptr<UdpSession>> sessions;
+        while (!_stopped) {
+            Clock::time_point now = Clock::now();
+            Clock::time_point next = now + maxWait;
+            for (auto it = sessions.begin(); it != sessions.end();) {
+                UdpSession &session = *it->second;
+                next = std::min(next, session.link->update(now));
+                bool finished = session.closing && (session.link->waitSend() == 0 || now - session.closingSince > lingerTimeout);
+                if (finished || session.link->dead() || now - session.lastHeard > idleTimeout) {
+                    it = sessions.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            waitReadable(_fd, next);
+            now = Clock::now();
+            std::vector<UdpSession *> touched;
+            receiveDatagrams(_fd, [&](const unsigned char *data, std::size_t size, const sockaddr_u &from) {
+                std::uint32_t conv = load32(data);
+                auto it = sessions.find(conv);
+                if (it == sessions.end()) {
+                    std::lock_guard<std::mutex> lock(_offersMutex);
+                    auto offer = _offers.find(conv);
+                    if (offer == _offers.end()) {
+                        return;
+                    }
+                    auto session = std::make_unique<UdpSession>();
+                    session->link = std::make_unique<Link>(_fd, from, conv, offer->second.window, 0, 0);
+                    session->factory = std::move(offer->second.factory);
+                    _offers.erase(offer);
+                    it = sessions.emplace(conv, std::move(session)).first;
+                } else if (!sameAddress(from, it->second->link->peer())) {
+                    return;
+                }
+                UdpSession *session = it->second.get();
+                session->lastHeard = now;
+                session->link->input(data, size, now);
+                if (std::find(touched.begin(), touched.end(), session) == touched.end()) {
+                    touched.push_back(session);
+                }
+            });
+            for (UdpSession *session: touched) {
+                session->receive();
+                session->link->update(now);
+            }
+        }
+    }
+
+} // namespace transport
@@ -0,0 +1,90 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+#pragma once
+
+#include "flowdrop/flowdrop.hpp"
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+// Reliable UDP for the send phase: the stream archive runs over KCP (ikcp, bundled with libhv)
+// on a plain UDP socket. Datagrams carry a small header of their own for the session and the
+// optional XOR parity FEC; outgoing datagrams can be paced.
+namespace transport {
+
+    static const unsigned minUdpWindow = 32;
+    static const unsigned maxUdpWindow = 8192;
+    static const unsigned maxFecGroup = 64;
+
+    // Drops outgoing datagrams at lossRate and holds them for delay, in this process only.
+    // For benchmarks, off by default.
+    void setLossInjection(double lossRate, const std::chrono::milliseconds &delay);
+
+    enum class UdpSendResult {
+        Sent,
+        Unreachable, // the receiver never answered and nothing was read from the source
+        Failed
+    };
+
+    // returns the bytes read, 0 at the end, -1 on failure
+    using udpSource = std::function<std::int64_t(char *, std::size_t)>;
+
+    // Streams the source to a receiver that offered conv in its ask answer.
+    UdpSendResult sendReliableUdp(const std::string &ip, unsigned short port, std::uint32_t conv,
+                                  const flowdrop::ReliableUdpOptions &options, std::uint64_t payloadSize, const udpSource &source);
+
+    // Where a reliable UDP session delivers its stream; called on the receiver thread only.
+    class ReliableUdpSink {
+    public:
+        virtual ~ReliableUdpSink() = default; // without a successful finish() the transfer is dropped
+
+        virtual bool write(const char *data, std::size_t size) = 0; // false fails the transfer
+        [[nodiscard]] virtual bool complete() const = 0; // the whole stream arrived
+        virtual bool finish() = 0; // once complete, true when everything is stored
+    };
+
+    // creates the sink when the sender starts, with the payload size it announced
+    using sinkFactory = std::function<std::unique_ptr<ReliableUdpSink>(std::uint64_t payloadSize)>;
+
+    // One UDP socket and thread serving every reliable UDP session of a server. Sessions are
+    // offered in accepted asks; datagrams of other sessions are ignored.
+    class ReliableUdpReceiver {
+    public:
+        ReliableUdpReceiver(unsigned short port, bool ipv4); // the port if free, any port otherwise
+        ~ReliableUdpReceiver();
+
+        ReliableUdpReceiver(const ReliableUdpReceiver &) = delete;
+        ReliableUdpReceiver &operator=(const ReliableUdpReceiver &) = delete;
+
+        [[nodiscard]] bool running() const;
+        [[nodiscard]] unsigned short port() const;
+
+        // the returned conv is the sender's ticket for one transfer, 0 on failure
+        std::uint32_t offer(unsigned window, sinkFactory factory);
+
+        void stop();
+
+    private:
+        struct Offer {
+            unsigned window;
+            sinkFactory factory;
+            std::chrono::steady_clock::time_point expires;
+        };
+
+        void run();
+
+        int _fd = -1;
+        unsigned short _port = 0;
+        std::mutex _offersMutex;
+        std::unordered_map<std::uint32_t, Offer> _offers;
+        std::atomic<bool> _stopped{false};
+        std::thread _thread;
+    };
+
+} // namespace transport
@@ -0,0 +1,150 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+
+#include "sealed_stream.hpp"
+#include <algorithm>
+#include <cstring>
+
+static const std::size_t headerSize = 4;
+static const std::uint32_t lastRecordFlag = 1u << 31;
+
+static crypto::Nonce recordNonce(std::uint64_t sequence) {
+    crypto::Nonce nonce{};
+    for (int i = 0; i < 8; ++i) {
+        nonce[4 + i] = static_cast<unsigned char>(sequence >> (8 * i));
+    }
+    return nonce;
+}
+
+namespace crypto {
+
+    Sealer::Sealer(const Key &key, source source) : _key(key), _source(std::move(source)) {}
+
+    bool Sealer::failed() const {
+        return _failed;
+    }
+
+    std::size_t Sealer::read(char *buffer, std::size_t count) {
+        std::size_t written = 0;
+        while (written < count && !_failed) {
+            if (_recordPos == _recordSize) {
+                if (_finished) {
+                    break;
+                }
+                if (count - written >= maxSealedRecordSize) {
+                    written += sealRecord(reinterpret_cast<unsigned char *>(buffer + written));
+                    continue;
+                }
+                // a short read rather than a record split across calls
+                if (written > 0) {
+                    break;
+                }
+                _record.resize(maxSealedRecordSize);
+                _recordSize = sealRecord(_record.data());
+                _recordPos = 0;
+                continue;
+            }
+            std::size_t n = std::min(count - written, _recordSize - _recordPos);
+            std::memcpy(buffer + written, _record.data() + _recordPos, n);
+            _recordPos += n;
+            written += n;
+        }
+        return _failed ? 0 : written;
+    }
+
+    // A full record is not known to be the last one, the source may end right after it.
+    std::size_t Sealer::sealRecord(unsigned char *record) {
+        std::size_t plaintextSize = 0;
+        bool last = false;
+        while (plaintextSize < maxRecordSize) {
+            std::int64_t n = _source(reinterpret_cast<char *>(record + headerSize + plaintextSize), maxRecordSize - plaintextSize);
+            if (n < 0) {
+                _failed = true;
+                return 0;
+            }
+            if (n == 0) {
+                last = true;
+                break;
+            }
+            plaintextSize += static_cast<std::size_t>(n);
+        }
+        std::uint32_t header = static_cast<std::uint32_t>(plaintextSize) | (last ? lastRecordFlag : 0);
+        for (std::size_t i = 0; i < headerSize; ++i) {
+            record[i] = static_cast<unsigned char>(header >> (8 * i));
+        }
+        seal(record + headerSize, record + headerSize + plaintextSize, record + headerSize, plaintextSize,
+             record, headerSize, _key, recordNonce(_sequence++));
+        _finished = last;
+        return headerSize + plaintextSize + tagSize;
+    }
+
+    Opener::Opener(const Key &key) : _key(key) {}
+
+    bool Opener::done() const {
+        return _done;
+    }
+
+    bool Opener::feed(const char *data, std::size_t size, const sink &sink) {
+        const auto *bytes = reinterpret_cast<const unsigned char *>(data);
+        std::size_t pos = 0;
+        while (pos < size && !_failed) {
+            if (_done) {
+                _failed = true;
+                break;
+            }
+            if (!_stream) {
+                std::size_t n = std::min(size - pos, headerSize - _headerFilled);
+                std::memcpy(_header + _headerFilled, bytes + pos, n);
+                _headerFilled += n;
+                pos += n;
+                if (_headerFilled < headerSize) {
+                    break;
+                }
+                std::uint32_t header = static_cast<std::uint32_t>(_header[0]) | static_cast<std::uint32_t>(_header[1]) << 8 |
+                                       static_cast<std::uint32_t>(_header[2]) << 16 | static_cast<std::uint32_t>(_header[3]) << 24;
+                _plaintextSize = header & ~lastRecordFlag;
+                if (_plaintextSize > maxRecordSize) {
+                    _failed = true;
+                    break;
+                }
+                _last = (header & lastRecordFlag) != 0;
+                _stream.emplace(_key, recordNonce(_sequence++), _header, headerSize);
+                _plaintext.resize(maxRecordSize);
+                _opened = 0;
+                _tagFilled = 0;
+                continue;
+            }
+            if (_opened < _plaintextSize) {
+                std::size_t n = std::min(size - pos, _plaintextSize - _opened);
+                _stream->update(reinterpret_cast<unsigned char *>(&_plaintext[_opened]), bytes + pos, n);
+                _opened += n;
+                pos += n;
+                continue;
+            }
+            std::size_t n = std::min(size - pos, tagSize - _tagFilled);
+            std::memcpy(_tag + _tagFilled, bytes + pos, n);
+            _tagFilled += n;
+            pos += n;
+            if (_tagFilled < tagSize) {
+                break;
+            }
+            if (!_stream->verify(_tag)) {
+                _failed = true;
+                break;
+            }
+            if (_plaintextSize > 0 && !sink(_plaintext.data(), _plaintextSize)) {
+                _failed = true;
+                break;
+            }
+            _stream.reset();
+            _headerFilled = 0;
+            _done = _last;
+        }
+        return !_failed;
+    }
+
+} // namespace crypto
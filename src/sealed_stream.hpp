@@ -0,0 +1,79 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+#pragma once
+
+#include "crypto.hpp"
+#include <functional>
+#include <optional>
+#include <vector>
+
+// Body of an encrypted /send, a sequence of records:
+//   u32le header: plaintext length, bit 31 set on the last record
+//   ciphertext, 16 byte tag
+// Records are sealed with ChaCha20-Poly1305 under the session key, the nonce is four zero bytes
+// and the u64le record number, the header is the associated data. The last record may be empty;
+// a body without one was truncated.
+namespace crypto {
+
+    static const std::size_t maxRecordSize = 64 * 1024;
+    // header, the largest plaintext and the tag
+    static const std::size_t maxSealedRecordSize = 4 + maxRecordSize + tagSize;
+
+    // Pulls plaintext from a source and hands out sealed records, for a curl read function.
+    // Records are sealed in place in the caller's buffer while a whole one fits in what is left of it.
+    class Sealer {
+    public:
+        // fills up to count bytes, 0 at the end, -1 on failure
+        using source = std::function<std::int64_t(char *buffer, std::size_t count)>;
+
+        Sealer(const Key &key, source source);
+
+        std::size_t read(char *buffer, std::size_t count); // 0 at the end or on failure
+        [[nodiscard]] bool failed() const;
+
+    private:
+        std::size_t sealRecord(unsigned char *record); // the record size, 0 on failure
+
+        Key _key;
+        source _source;
+        std::vector<unsigned char> _record; // a record for a buffer with less room than a whole one
+        std::size_t _recordSize = 0;
+        std::size_t _recordPos = 0;
+        std::uint64_t _sequence = 0;
+        bool _finished = false;
+        bool _failed = false;
+    };
+
+    // Push parser, opened plaintext goes to the sink a record at a time. The ciphertext is decrypted
+    // as it arrives, it is not gathered first.
+    class Opener {
+    public:
+        // returning false aborts
+        using sink = std::function<bool(const char *data, std::size_t size)>;
+
+        explicit Opener(const Key &key);
+
+        bool feed(const char *data, std::size_t size, const sink &sink); // false on a bad record or an aborting sink
+        [[nodiscard]] bool done() const; // the last record was opened
+
+    private:
+        Key _key;
+        std::optional<OpenStream> _stream; // set once the header of a record is complete
+        unsigned char _header[4] = {};
+        unsigned char _tag[tagSize] = {};
+        std::size_t _headerFilled = 0;
+        std::size_t _tagFilled = 0;
+        std::vector<char> _plaintext;
+        std::size_t _plaintextSize = 0; // of the record being opened
+        std::size_t _opened = 0;
+        std::uint64_t _sequence = 0;
+        bool _last = false;
+        bool _done = false;
+        bool _failed = false;
+    };
+
+} // namespace crypto
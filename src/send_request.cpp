@@ -12,10 +12,25 @@
 #include <string>
 #include <thread>
 #include <future>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <algorithm>
 #include "specification.h"
 #include "virtualtfa.h"
 #include "discovery.hpp"
 #include "logger.h"
+#include "peer_cache.hpp"
+#include "happy_eyeballs.hpp"
+#include "ask_manifest.hpp"
+#include "stream_archive.hpp"
+#include "progress_throttle.hpp"
+#include "sealed_stream.hpp"
+#include "connection_share.hpp"
+#include "socket_tuning.hpp"
+#include "link_probe.hpp"
+#include "reliable_udp.hpp"
+#include "pairing.hpp"
 
 size_t writeCallback(char *data, size_t size, size_t nmemb, std::string *response) {
     size_t totalSize = size * nmemb;
@@ -23,28 +38,135 @@ size_t writeCallback(char *data, size_t size, size_t nmemb, std::string *respons
     return totalSize;
 }
 
-bool ask(const std::string &baseUrl, const std::vector<flowdrop::FileInfo> &files, const std::chrono::milliseconds &timeout, const flowdrop::DeviceInfo &deviceInfo) {
-    flowdrop::SendAsk askData;
-    askData.sender = deviceInfo;
-    askData.files = files;
+enum AskResult {
+    ASK_ACCEPTED,
+    ASK_DECLINED,
+    ASK_UNREACHABLE, // no connection, or another device at the address; the ask did not reach the receiver
+    ASK_LOST, // the ask may have reached the receiver but was not answered, it is not asked again
+    ASK_UNSUPPORTED, // receiver does not understand the binary manifest
+    ASK_FAILED, // nothing was asked, or the files were sent but not received whole
+    ASK_INCOMPATIBLE, // the receiver cannot take files of unknown size, they were not sent
+    ASK_INSECURE // encryption was requested but the receiver answered without a key
+};
+
+// Session encryption negotiated in the ask: the sender's ephemeral key goes out with it, the
+// receiver answers with its own key and the session id to present on /send.
+struct SessionCipher {
+    crypto::KeyPair keyPair;
+    std::string session;
+    crypto::Key key{};
+};
 
-    std::string jsonData = json(askData).dump();
+// Reliable UDP send asked for in the ask; the receiver answers with the port and the session.
+struct UdpOffer {
+    unsigned window = 0;
+    unsigned short port = 0; // 0 if not offered, TCP is used
+    std::uint32_t conv = 0;
+};
+
+// Pairing asked for in the ask: the sender's pairing key goes out with it, a receiver agreeing to
+// pair answers with its own key and its id.
+struct PairingOffer {
+    crypto::KeyPair keyPair;
+    std::string receiverId; // empty unless the receiver paired
+    crypto::Key token{};
+};
+
+// Whether a request failed before it was connected, only then another address may be tried.
+// A shared connection is reused without a connect time, nothing sent on it tells it apart.
+bool connectFailed(CURL *curl, CURLcode res) {
+    if (res == CURLE_COULDNT_CONNECT || res == CURLE_COULDNT_RESOLVE_HOST) {
+        return true;
+    }
+    double connectTime = 0;
+    long requestSize = 0;
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &connectTime);
+    curl_easy_getinfo(curl, CURLINFO_REQUEST_SIZE, &requestSize);
+    return res == CURLE_OPERATION_TIMEDOUT && connectTime == 0 && requestSize == 0;
+}
+
+size_t manifestReadFunction(char *buffer, size_t size, size_t nmemb, void *userdata) {
+    auto *encoder = static_cast<manifest::Encoder *>(userdata);
+    return encoder->read(buffer, size * nmemb);
+}
 
+// Every request goes through the connection share, tuned when the send request has transport options.
+void prepareConnection(CURL *curl, const flowdrop::TransportOptions *transportOptions) {
+    transport::ConnectionShare::instance().attach(curl);
+    if (transportOptions != nullptr) {
+        transport::tuneCurl(curl, *transportOptions);
+    }
+}
+
+// capabilities is set from the receiver's answer, older receivers do not send any. With an
+// estimate the ask is sent as JSON and carries the estimated totals instead of the files.
+// With a cipher the session key is agreed on, an accepting receiver must answer with its key.
+// With a UDP offer a reliable UDP send is asked for, the receiver may not offer it. With a
+// pairing offer the receiver is asked to pair, it may not. A receiverId, when known, is sent for
+// the receiver to check, another device at the address refuses the ask.
+AskResult ask(const std::string &baseUrl, const std::string &receiverId, const std::vector<flowdrop::FileInfo> &files,
+              const std::chrono::milliseconds &timeout, const std::chrono::milliseconds &connectTimeout,
+              const flowdrop::DeviceInfo &deviceInfo, bool binaryManifest,
+              const flowdrop::SendEstimate *estimate, unsigned &capabilities, SessionCipher *cipher, UdpOffer *udp, PairingOffer *pair,
+              const flowdrop::TransportOptions *transportOptions) {
+    transport::globalInit();
     CURL *curl = curl_easy_init();
     if (!curl) {
-        return false;
+        return ASK_FAILED;
     }
 
     std::string url = baseUrl + flowdrop_endpoint_ask;
 
     curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, static_cast<double>(timeout.count()) / 1000.0);
+    prepareConnection(curl, transportOptions);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, static_cast<long>(timeout.count()));
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, static_cast<long>(connectTimeout.count()));
     curl_easy_setopt(curl, CURLOPT_POST, 1L);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, jsonData.c_str());
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, jsonData.size());
 
     struct curl_slist *headers = nullptr;
-    headers = curl_slist_append(headers, "Content-Type: application/json");
+    std::string jsonData;
+    std::optional<manifest::Encoder> encoder;
+    if (binaryManifest) {
+        encoder.emplace(deviceInfo, files);
+        curl_easy_setopt(curl, CURLOPT_READFUNCTION, manifestReadFunction);
+        curl_easy_setopt(curl, CURLOPT_READDATA, &encoder.value());
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(encoder->size()));
+        headers = curl_slist_append(headers, (std::string("Content-Type: ") + flowdrop_ask_manifest_content_type).c_str());
+        // the receiver reads the whole ask anyway, waiting for 100-continue only adds a round trip
+        headers = curl_slist_append(headers, "Expect:");
+    } else {
+        flowdrop::SendAsk askData;
+        askData.sender = deviceInfo;
+        askData.files = files;
+        askData.totalFiles = files.size();
+        for (const flowdrop::FileInfo &file: files) {
+            askData.totalSize += file.size;
+        }
+        if (estimate != nullptr) {
+            askData.estimated = true;
+            askData.totalFiles = estimate->files;
+            askData.totalSize = estimate->size;
+        }
+        jsonData = json(askData).dump();
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, jsonData.c_str());
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, jsonData.size());
+        headers = curl_slist_append(headers, "Content-Type: application/json");
+    }
+    if (cipher != nullptr) {
+        std::string publicKey = crypto::toHex(cipher->keyPair.publicKey.data(), cipher->keyPair.publicKey.size());
+        headers = curl_slist_append(headers, (std::string(flowdrop_session_key_header) + ": " + publicKey).c_str());
+    }
+    if (udp != nullptr) {
+        std::string transport = std::string(flowdrop_transport_kcp) + "; window=" + std::to_string(udp->window);
+        headers = curl_slist_append(headers, (std::string(flowdrop_transport_header) + ": " + transport).c_str());
+    }
+    if (pair != nullptr) {
+        std::string publicKey = crypto::toHex(pair->keyPair.publicKey.data(), pair->keyPair.publicKey.size());
+        headers = curl_slist_append(headers, (std::string(flowdrop_pair_header) + ": " + publicKey).c_str());
+    }
+    if (!receiverId.empty()) {
+        headers = curl_slist_append(headers, (std::string(flowdrop_receiver_id_header) + ": " + receiverId).c_str());
+    }
     curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
 
     std::string response;
@@ -52,23 +174,68 @@ bool ask(const std::string &baseUrl, const std::vector<flowdrop::FileInfo> &file
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
 
     CURLcode res = curl_easy_perform(curl);
+    long status = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    // the user of the receiver may be looking at the ask already, only an unconnected one is retried
+    bool unreachable = res != CURLE_OK && connectFailed(curl, res);
+    curl_easy_cleanup(curl);
+    curl_slist_free_all(headers);
     if (res != CURLE_OK) {
-        Logger::log(Logger::LEVEL_ERROR, "Ask error: " + std::string(curl_easy_strerror(res)));
-        curl_easy_cleanup(curl);
-        curl_global_cleanup();
-        return false;
+        LOG_ERROR("Ask error: " << curl_easy_strerror(res));
+        return unreachable ? ASK_UNREACHABLE : ASK_LOST;
+    }
+    // Misdirected Request
+    if (status == 421) {
+        LOG_DEBUG("another device at the address" << Logger::kv("url", baseUrl));
+        return ASK_UNREACHABLE;
+    }
+    if (binaryManifest && (status == 400 || status == 415)) {
+        return ASK_UNSUPPORTED;
     }
-    curl_easy_cleanup(curl);
-    curl_global_cleanup();
 
     json responseJson;
     try {
         responseJson = json::parse(response);
     } catch (std::exception &) {
-        return false;
+        return ASK_DECLINED;
     }
 
-    return responseJson["accepted"].get<bool>();
+    if (responseJson.contains("capabilities") && responseJson["capabilities"].is_number_unsigned()) {
+        capabilities = responseJson["capabilities"].get<unsigned>();
+    }
+    if (!responseJson["accepted"].get<bool>()) {
+        return ASK_DECLINED;
+    }
+    if (cipher != nullptr) {
+        crypto::Key peerKey;
+        std::optional<crypto::Key> key;
+        if (responseJson.contains("key") && responseJson["key"].is_string() && responseJson.contains("session") &&
+            responseJson["session"].is_string() &&
+            crypto::fromHex(responseJson["key"].get<std::string>(), peerKey.data(), peerKey.size())) {
+            key = crypto::sessionKey(cipher->keyPair, peerKey);
+        }
+        if (!key.has_value()) {
+            LOG_ERROR("receiver does not support encryption");
+            return ASK_INSECURE;
+        }
+        cipher->key = key.value();
+        cipher->session = responseJson["session"].get<std::string>();
+    }
+    if (udp != nullptr && responseJson.contains("udpPort") && responseJson["udpPort"].is_number_unsigned() &&
+        responseJson.contains("conv") && responseJson["conv"].is_number_unsigned()) {
+        udp->port = responseJson["udpPort"].get<unsigned short>();
+        udp->conv = responseJson["conv"].get<std::uint32_t>();
+    }
+    crypto::Key pairKey;
+    if (pair != nullptr && responseJson.contains("pairKey") && responseJson["pairKey"].is_string() && responseJson.contains("id") &&
+        responseJson["id"].is_string() && crypto::fromHex(responseJson["pairKey"].get<std::string>(), pairKey.data(), pairKey.size())) {
+        std::optional<crypto::Key> token = crypto::sessionKey(pair->keyPair, pairKey);
+        if (token.has_value()) {
+            pair->token = token.value();
+            pair->receiverId = responseJson["id"].get<std::string>();
+        }
+    }
+    return ASK_ACCEPTED;
 }
 
 size_t ignoreDataCallback(char * /*buffer*/, size_t size, size_t nmemb, void * /*userdata*/) {
@@ -80,36 +247,44 @@ size_t tfaWriterReadFunc(char *buffer, size_t size, size_t nmemb, void *userdata
     size_t bytes_written = 0;
     int result = virtual_tfa_writer_write(tfa, buffer, size * nmemb, &bytes_written);
     if (result != 0) {
-        Logger::log(Logger::LEVEL_ERROR, "failed to read archive, code: " + std::to_string(result));
+        LOG_ERROR("failed to read archive" << Logger::kv("code", result));
     }
     return bytes_written;
 }
 
 class SendProgressListener {
 public:
-    explicit SendProgressListener(flowdrop::IEventListener *eventListener) : _eventListener(eventListener) {}
+    SendProgressListener(flowdrop::IEventListener *eventListener, const flowdrop::ProgressOptions &progress) :
+            _eventListener(eventListener), _fileThrottle(progress), _totalThrottle(progress) {}
 
     void totalProgress(tfa_size_t currentSize) {
-        if (_eventListener != nullptr) {
+        // the last update always gets through
+        if (_eventListener != nullptr && (_totalThrottle.due(currentSize) || currentSize == _totalSize)) {
             _eventListener->onSendingTotalProgress(_totalSize, currentSize);
         }
     }
 
     void fileStart(const virtual_tfa_file_info *fileInfo) {
+        _file = {fileInfo->name, fileInfo->size};
+        _fileThrottle.restart();
         if (_eventListener != nullptr) {
-            _eventListener->onSendingFileStart({fileInfo->name, fileInfo->size});
+            _eventListener->onSendingFileStart(_file);
         }
     }
 
-    void fileProgress(const virtual_tfa_file_info *fileInfo, tfa_size_t currentSize) {
-        if (_eventListener != nullptr) {
-            _eventListener->onSendingFileProgress({fileInfo->name, fileInfo->size}, currentSize);
+    void fileProgress(const virtual_tfa_file_info * /*fileInfo*/, tfa_size_t currentSize) {
+        if (_eventListener != nullptr && _fileThrottle.due(currentSize)) {
+            _eventListener->onSendingFileProgress(_file, currentSize);
         }
     }
 
     void fileEnd(const virtual_tfa_file_info *fileInfo) {
+        _file.size = fileInfo->size;
         if (_eventListener != nullptr) {
-            _eventListener->onSendingFileEnd({fileInfo->name, fileInfo->size});
+            if (_fileThrottle.flush()) {
+                _eventListener->onSendingFileProgress(_file, _fileThrottle.held());
+            }
+            _eventListener->onSendingFileEnd(_file);
         }
     }
 
@@ -120,6 +295,9 @@ public:
 private:
     flowdrop::IEventListener *_eventListener;
     tfa_size_t _totalSize = 0;
+    flowdrop::FileInfo _file; // of the file being sent, passed to every event about it
+    ProgressThrottle _fileThrottle;
+    ProgressThrottle _totalThrottle;
 };
 
 namespace send_request_listener {
@@ -144,40 +322,128 @@ namespace send_request_listener {
     }
 }
 
+// Input stream over a File. Positional files are read with readAt at the stream's own
+// offset and never touch the file's shared read position.
+struct FileStream {
+    flowdrop::File *file;
+    flowdrop::PositionalFile *positional;
+    std::uint64_t offset = 0;
+};
+
 tfa_size_t streamReadFunc(void *userdata, char *buffer, tfa_size_t size) {
-    auto *file = static_cast<flowdrop::File *>(userdata);
-    return file->read(buffer, size);
+    auto *stream = static_cast<FileStream *>(userdata);
+    if (stream->positional == nullptr) {
+        return stream->file->read(buffer, size);
+    }
+    std::uint64_t n = stream->positional->readAt(stream->offset, buffer, size);
+    stream->offset += n;
+    return n;
 }
 
 void streamCloseFunc(void *userdata) {
-    auto *file = static_cast<flowdrop::File *>(userdata);
-    delete file;
+    auto *stream = static_cast<FileStream *>(userdata);
+    delete stream->file;
+    delete stream;
 }
 
 virtual_tfa_input_stream *streamSupplier(void *userdata) {
     virtual_tfa_input_stream *input_stream = virtual_tfa_input_stream_new();
 
+    auto *file = static_cast<flowdrop::File *>(userdata);
+    auto *stream = new FileStream{file, dynamic_cast<flowdrop::PositionalFile *>(file)};
+
     virtual_tfa_input_stream_set_read_function(input_stream, streamReadFunc);
-    virtual_tfa_input_stream_set_read_userdata(input_stream, userdata);
+    virtual_tfa_input_stream_set_read_userdata(input_stream, stream);
     virtual_tfa_input_stream_set_close_function(input_stream, streamCloseFunc);
-    virtual_tfa_input_stream_set_close_userdata(input_stream, userdata);
+    virtual_tfa_input_stream_set_close_userdata(input_stream, stream);
 
     return input_stream;
 }
 
-void sendFiles(const std::string &baseUrl, std::vector<flowdrop::File *> &files, flowdrop::IEventListener *listener, const flowdrop::DeviceInfo &deviceInfo) {
+// room for several whole records, which are then sealed in place
+static const long sealedUploadBufferSize = 8 * crypto::maxSealedRecordSize;
+
+size_t sealedReadFunc(char *buffer, size_t size, size_t nmemb, void *userdata) {
+    auto *sealer = static_cast<crypto::Sealer *>(userdata);
+    size_t n = sealer->read(buffer, size * nmemb);
+    return sealer->failed() ? CURL_READFUNC_ABORT : n;
+}
+
+// A sealed body has no size up front, it goes chunked with the plaintext size in a header.
+curl_slist *sealedBody(CURL *curl, crypto::Sealer &sealer, const SessionCipher &cipher, std::uint64_t payloadSize, curl_slist *headers) {
+    curl_easy_setopt(curl, CURLOPT_READDATA, &sealer);
+    curl_easy_setopt(curl, CURLOPT_READFUNCTION, sealedReadFunc);
+    curl_easy_setopt(curl, CURLOPT_UPLOAD_BUFFERSIZE, sealedUploadBufferSize);
+    // a trusted send has no session, the key comes from the pairing
+    if (!cipher.session.empty()) {
+        headers = curl_slist_append(headers, (std::string(flowdrop_session_header) + ": " + cipher.session).c_str());
+    }
+    headers = curl_slist_append(headers, "Transfer-Encoding: chunked");
+    if (payloadSize != flowdrop::unknownFileSize) {
+        headers = curl_slist_append(headers, (std::string(flowdrop_total_size_header) + ": " + std::to_string(payloadSize)).c_str());
+    }
+    return headers;
+}
+
+// A send to a paired receiver: the credential of the pairing and the id it was made with.
+struct TrustedSend {
+    pairing::Credential credential;
+    std::string receiverId;
+};
+
+// The trust header of a send to a paired receiver, with a MAC over the request as sealedBody
+// sends it. It names the receiver, another device at its address refuses it.
+curl_slist *trustedRequest(const TrustedSend &trust, const std::string &deviceInfo, bool streamArchive,
+                           std::uint64_t payloadSize, curl_slist *headers) {
+    std::string totalSize = payloadSize != flowdrop::unknownFileSize ? std::to_string(payloadSize) : std::string();
+    std::string binding = pairing::requestBinding("POST", std::string("/") + flowdrop_endpoint_send, deviceInfo, streamArchive, totalSize);
+    headers = curl_slist_append(headers, (std::string(flowdrop_trust_header) + ": " + pairing::trustHeader(trust.credential, binding)).c_str());
+    headers = curl_slist_append(headers, (std::string(flowdrop_receiver_id_header) + ": " + trust.receiverId).c_str());
+    // the body goes out with the headers, a refusing receiver answers before reading it
+    return curl_slist_append(headers, "Expect:");
+}
+
+// Outcome of a /send: the HTTP status of the answer, 0 without one; unreachable when it failed
+// before it was connected, nothing of it reached the receiver then. receiverId is the id a
+// receiver refusing a trust header answers with.
+struct SendResult {
+    long status = 0;
+    bool unreachable = false;
+    std::string receiverId;
+};
+
+SendResult sendResult(CURL *curl, CURLcode res) {
+    SendResult result;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &result.status);
+    if (res != CURLE_OK) {
+        LOG_ERROR("Send file error: " << curl_easy_strerror(res));
+        result.unreachable = connectFailed(curl, res);
+    } else if (result.status != 200) {
+        LOG_ERROR("Send file error" << Logger::kv("status", result.status));
+    }
+    struct curl_header *header = nullptr;
+    if (curl_easy_header(curl, flowdrop_receiver_id_header, 0, CURLH_HEADER, -1, &header) == CURLHE_OK) {
+        result.receiverId = header->value;
+    }
+    return result;
+}
+
+// A trusted send carries the trust header instead of following an ask, and is sealed.
+SendResult sendFiles(const std::string &baseUrl, std::vector<flowdrop::File *> &files, flowdrop::IEventListener *listener, const flowdrop::DeviceInfo &deviceInfo,
+               const SessionCipher *cipher, const TrustedSend *trust, const flowdrop::TransportOptions *transportOptions,
+               const flowdrop::ProgressOptions &progress) {
     virtual_tfa_archive *tfa_archive = virtual_tfa_archive_new();
     if (!tfa_archive) {
-        Logger::log(Logger::LEVEL_ERROR, "Failed to initialize virtual_tfa_archive");
-        return;
+        LOG_ERROR("Failed to initialize virtual_tfa_archive");
+        return {};
     }
 
     for (flowdrop::File *file: files) {
         virtual_tfa_entry *entry = virtual_tfa_entry_new();
         if (!entry) {
-            Logger::log(Logger::LEVEL_ERROR, "Failed to initialize virtual_tfa_entry");
+            LOG_ERROR("Failed to initialize virtual_tfa_entry");
             virtual_tfa_archive_free(tfa_archive);
-            return;
+            return {};
         }
 
         const std::string& relativePath = file->getRelativePath();
@@ -201,7 +467,7 @@ void sendFiles(const std::string &baseUrl, std::vector<flowdrop::File *> &files,
     SendProgressListener *progressListener;
     virtual_tfa_listener *tfa_listener;
     if (listener != nullptr) {
-        progressListener = new SendProgressListener(listener);
+        progressListener = new SendProgressListener(listener, progress);
         void *userdata = static_cast<void *>(progressListener);
 
         tfa_listener = new virtual_tfa_listener{
@@ -221,16 +487,16 @@ void sendFiles(const std::string &baseUrl, std::vector<flowdrop::File *> &files,
 
     virtual_tfa_writer *tfa_writer = virtual_tfa_writer_new();
     if (!tfa_writer) {
-        Logger::log(Logger::LEVEL_ERROR, "Failed to initialize virtual_tfa_writer");
+        LOG_ERROR("Failed to initialize virtual_tfa_writer");
         virtual_tfa_archive_free(tfa_archive);
-        return;
+        return {};
     }
 
     virtual_tfa_writer_set_archive(tfa_writer, tfa_archive);
     virtual_tfa_writer_set_listener(tfa_writer, tfa_listener);
 
     tfa_size_t totalSize = virtual_tfa_writer_calc_size(tfa_writer);
-    Logger::log(Logger::LEVEL_DEBUG, "tfa size: " + std::to_string(totalSize));
+    LOG_DEBUG("tfa size: " << totalSize);
 
     if (progressListener != nullptr) {
         progressListener->setTotalSize(totalSize);
@@ -240,91 +506,585 @@ void sendFiles(const std::string &baseUrl, std::vector<flowdrop::File *> &files,
         listener->onSendingStart();
     }
 
-    curl_global_init(CURL_GLOBAL_NOTHING);
-
+    transport::globalInit();
     CURL *curl = curl_easy_init();
     if (!curl) {
         virtual_tfa_writer_free(tfa_writer);
         virtual_tfa_archive_free(tfa_archive);
         delete tfa_listener;
         delete progressListener;
-        Logger::log(Logger::LEVEL_ERROR, "Failed to initialize curl");
-        return;
+        LOG_ERROR("Failed to initialize curl");
+        return {};
     }
 
     curl_easy_setopt(curl, CURLOPT_URL, (baseUrl + flowdrop_endpoint_send).c_str());
+    prepareConnection(curl, transportOptions);
     curl_easy_setopt(curl, CURLOPT_POST, 1L);
-    curl_easy_setopt(curl, CURLOPT_READDATA, tfa_writer);
-    curl_easy_setopt(curl, CURLOPT_READFUNCTION, tfaWriterReadFunc);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, totalSize);
 
-    std::string header = std::string(flowdrop_deviceinfo_header) + ": " + json(deviceInfo).dump();
+    std::string deviceInfoJson = json(deviceInfo).dump();
     struct curl_slist *headers = nullptr;
-    headers = curl_slist_append(headers, header.c_str());
+    headers = curl_slist_append(headers, (std::string(flowdrop_deviceinfo_header) + ": " + deviceInfoJson).c_str());
+    if (trust != nullptr) {
+        headers = trustedRequest(*trust, deviceInfoJson, false, totalSize, headers);
+    }
+    std::optional<crypto::Sealer> sealer;
+    if (cipher != nullptr) {
+        sealer.emplace(cipher->key, [tfa_writer](char *buffer, std::size_t count) -> std::int64_t {
+            size_t bytes_written = 0;
+            if (virtual_tfa_writer_write(tfa_writer, buffer, count, &bytes_written) != 0) {
+                LOG_ERROR("failed to read archive");
+                return -1;
+            }
+            return static_cast<std::int64_t>(bytes_written);
+        });
+        headers = sealedBody(curl, sealer.value(), *cipher, totalSize, headers);
+    } else {
+        curl_easy_setopt(curl, CURLOPT_READDATA, tfa_writer);
+        curl_easy_setopt(curl, CURLOPT_READFUNCTION, tfaWriterReadFunc);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, totalSize);
+    }
     curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
 
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, ignoreDataCallback);
 
-    CURLcode res = curl_easy_perform(curl);
-    if (res != CURLE_OK) {
-        Logger::log(Logger::LEVEL_ERROR, "Send file error: " + std::string(curl_easy_strerror(res)));
-    }
+    SendResult result = sendResult(curl, curl_easy_perform(curl));
 
     curl_easy_cleanup(curl);
-
-    curl_global_cleanup();
+    curl_slist_free_all(headers);
 
     virtual_tfa_writer_free(tfa_writer);
     virtual_tfa_archive_free(tfa_archive);
 
     delete tfa_listener;
     delete progressListener;
+    return result;
 }
 
-bool askAndSend(const discovery::Remote &remote, std::vector<flowdrop::File *> &files, const std::chrono::milliseconds askTimeout,
-                flowdrop::IEventListener *listener, const flowdrop::DeviceInfo &deviceInfo) {
-    std::string host = remote.ip;
-    if (remote.ipType == discovery::IPv6) {
-        host = "[" + host + "]";
+size_t streamWriterReadFunc(char *buffer, size_t size, size_t nmemb, void *userdata) {
+    auto *writer = static_cast<archive::Writer *>(userdata);
+    size_t n = writer->read(buffer, size * nmemb);
+    return writer->failed() ? CURL_READFUNC_ABORT : n;
+}
+
+static const std::size_t prefetchFiles = 64;
+
+// Runs a file generator on its own thread, up to prefetchFiles ahead of the upload, so walking
+// directories and opening files does not stall the connection between two files.
+class FilePrefetcher {
+public:
+    explicit FilePrefetcher(flowdrop::fileGenerator generator) :
+            _generator(std::move(generator)), _thread(&FilePrefetcher::run, this) {}
+
+    ~FilePrefetcher() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stopped = true;
+        }
+        _space.notify_one();
+        _thread.join();
+        for (flowdrop::File *file: _queue) {
+            delete file;
+        }
     }
-    std::string baseUrl = "http://" + host + ":" + std::to_string(remote.port) + "/";
 
+    // blocks until the next file is there, nullptr at the end; rethrows the generator's error
+    flowdrop::File *next() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _ready.wait(lock, [this] {
+            return !_queue.empty() || _done;
+        });
+        if (_queue.empty()) {
+            if (_error != nullptr) {
+                std::rethrow_exception(_error);
+            }
+            return nullptr;
+        }
+        flowdrop::File *file = _queue.front();
+        _queue.pop_front();
+        _space.notify_one();
+        return file;
+    }
+
+private:
+    void run() {
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _space.wait(lock, [this] {
+                    return _queue.size() < prefetchFiles || _stopped;
+                });
+                if (_stopped) {
+                    return;
+                }
+            }
+            flowdrop::File *file = nullptr;
+            std::exception_ptr error;
+            try {
+                file = _generator();
+            } catch (...) {
+                error = std::current_exception();
+            }
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (file == nullptr) {
+                _error = error;
+                _done = true;
+                _ready.notify_one();
+                return;
+            }
+            _queue.push_back(file);
+            _ready.notify_one();
+        }
+    }
+
+    flowdrop::fileGenerator _generator;
+    std::mutex _mutex;
+    std::condition_variable _ready;
+    std::condition_variable _space;
+    std::deque<flowdrop::File *> _queue;
+    std::exception_ptr _error;
+    bool _done = false;
+    bool _stopped = false;
+    std::thread _thread;
+};
+
+// Sends the stream archive with chunked transfer encoding, no size is needed up front. As with
+// sendFiles for a trust header.
+SendResult sendStream(const std::string &baseUrl, archive::Writer &writer, const flowdrop::DeviceInfo &deviceInfo, const SessionCipher *cipher,
+                const TrustedSend *trust, const flowdrop::TransportOptions *transportOptions) {
+    transport::globalInit();
+    CURL *curl = curl_easy_init();
+    if (!curl) {
+        LOG_ERROR("Failed to initialize curl");
+        return {};
+    }
+
+    curl_easy_setopt(curl, CURLOPT_URL, (baseUrl + flowdrop_endpoint_send).c_str());
+    prepareConnection(curl, transportOptions);
+    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+
+    std::string deviceInfoJson = json(deviceInfo).dump();
+    struct curl_slist *headers = nullptr;
+    headers = curl_slist_append(headers, (std::string(flowdrop_deviceinfo_header) + ": " + deviceInfoJson).c_str());
+    headers = curl_slist_append(headers, (std::string("Content-Type: ") + flowdrop_stream_archive_content_type).c_str());
+    if (trust != nullptr) {
+        headers = trustedRequest(*trust, deviceInfoJson, true, writer.payloadSize(), headers);
+    }
+    std::optional<crypto::Sealer> sealer;
+    if (cipher != nullptr) {
+        sealer.emplace(cipher->key, [&writer](char *buffer, std::size_t count) -> std::int64_t {
+            std::size_t n = writer.read(buffer, count);
+            return writer.failed() ? -1 : static_cast<std::int64_t>(n);
+        });
+        headers = sealedBody(curl, sealer.value(), *cipher, writer.payloadSize(), headers);
+    } else {
+        curl_easy_setopt(curl, CURLOPT_READDATA, &writer);
+        curl_easy_setopt(curl, CURLOPT_READFUNCTION, streamWriterReadFunc);
+        headers = curl_slist_append(headers, "Transfer-Encoding: chunked");
+        if (writer.payloadSize() != flowdrop::unknownFileSize) {
+            headers = curl_slist_append(headers, (std::string(flowdrop_total_size_header) + ": " + std::to_string(writer.payloadSize())).c_str());
+        }
+    }
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, ignoreDataCallback);
+
+    SendResult result = sendResult(curl, curl_easy_perform(curl));
+
+    curl_easy_cleanup(curl);
+    curl_slist_free_all(headers);
+    return result;
+}
+
+// The stream archive over reliable UDP when the receiver offered it, over TCP when it does not
+// answer there or did not offer it. True once the receiver confirmed it wrote all of it.
+bool sendArchive(const discovery::Remote &remote, archive::Writer &writer, flowdrop::IEventListener *listener, const flowdrop::DeviceInfo &deviceInfo,
+                 const SessionCipher *cipher, const UdpOffer &udp, const flowdrop::ReliableUdpOptions &udpOptions,
+                 const flowdrop::TransportOptions *transportOptions) {
     if (listener != nullptr) {
-        listener->onAskingReceiver();
+        listener->onSendingStart();
+    }
+    if (udp.port != 0) {
+        std::optional<crypto::Sealer> sealer;
+        transport::udpSource source = [&writer](char *buffer, std::size_t count) -> std::int64_t {
+            std::size_t n = writer.read(buffer, count);
+            return writer.failed() ? -1 : static_cast<std::int64_t>(n);
+        };
+        if (cipher != nullptr) {
+            sealer.emplace(cipher->key, source);
+            source = [&sealer](char *buffer, std::size_t count) -> std::int64_t {
+                std::size_t n = sealer->read(buffer, count);
+                return sealer->failed() ? -1 : static_cast<std::int64_t>(n);
+            };
+        }
+        transport::UdpSendResult result = transport::sendReliableUdp(remote.ip, udp.port, udp.conv, udpOptions, writer.payloadSize(), source);
+        if (result == transport::UdpSendResult::Failed) {
+            LOG_ERROR("Send file error: reliable UDP transfer failed" << Logger::kv("ip", remote.ip));
+        }
+        if (result != transport::UdpSendResult::Unreachable) {
+            return result == transport::UdpSendResult::Sent;
+        }
+        LOG_DEBUG("no answer on UDP, sending over TCP" << Logger::kv("ip", remote.ip));
+    }
+    return sendStream(discovery::toBaseUrl(remote), writer, deviceInfo, cipher, nullptr, transportOptions).status == 200;
+}
+
+// The files of a request: a list, or a generator enumerating them while they are sent.
+struct SendPayload {
+    std::vector<flowdrop::File *> files;
+    flowdrop::fileGenerator generator;
+    flowdrop::SendEstimate estimate;
+    flowdrop::Checksum checksum = flowdrop::Checksum::XXH3;
+    bool encrypted = false;
+    std::optional<flowdrop::ReliableUdpOptions> reliableUdp;
+    bool pairing = false;
+    std::optional<flowdrop::TransportOptions> transportOptions;
+    std::optional<flowdrop::TransportPreset> transportPreset;
+    flowdrop::ProgressOptions progress;
+};
+
+// archive checksum type for the receiver, none if it cannot verify them
+std::uint64_t checksumType(flowdrop::Checksum checksum, unsigned capabilities) {
+    if ((capabilities & flowdrop_capability_checksum) == 0) {
+        return archive::checksumNone;
+    }
+    switch (checksum) {
+        case flowdrop::Checksum::XXH3:
+            return archive::checksumXxh3;
+        case flowdrop::Checksum::XXH3Tree:
+            return archive::checksumXxh3Tree;
+        default:
+            return archive::checksumNone;
+    }
+}
+
+// Runs the generator to the end, for receivers that need the whole file list in the ask.
+bool drainGenerator(SendPayload &payload) {
+    try {
+        while (flowdrop::File *file = payload.generator()) {
+            payload.files.push_back(file);
+        }
+    } catch (const std::exception &e) {
+        LOG_ERROR("unable to enumerate files: " << e.what());
+        for (flowdrop::File *file: payload.files) {
+            delete file;
+        }
+        payload.files.clear();
+        return false;
+    }
+    payload.generator = nullptr;
+    return true;
+}
+
+static const std::uint64_t minProbedPayload = 64 * 1024 * 1024;
+static const std::chrono::milliseconds probeBudget(500);
+
+// Options of the preset for the link to the receiver. Payloads too small to gain from tuning
+// are not worth a probe, they get the preset's typical link unless a probe is cached.
+flowdrop::TransportOptions tunedOptions(const std::string &baseUrl, flowdrop::TransportPreset preset, std::uint64_t payloadSize,
+                                        flowdrop::IEventListener *listener) {
+    std::optional<flowdrop::LinkProbe> probe = transport::ProbeCache::instance().get(baseUrl);
+    if (!probe.has_value() && payloadSize >= minProbedPayload) {
+        probe = transport::cachedProbe(baseUrl, probeBudget);
+    }
+    if (!probe.has_value()) {
+        return flowdrop::transportOptions(preset);
+    }
+    if (listener != nullptr) {
+        listener->onLinkProbed(probe.value());
+    }
+    return flowdrop::transportOptions(preset, probe->rtt, probe->uploadRate);
+}
+
+// Positional files can be read again when a trusted send is refused and then asked for.
+bool rereadable(const std::vector<flowdrop::File *> &files) {
+    return std::all_of(files.begin(), files.end(), [](flowdrop::File *file) {
+        return dynamic_cast<flowdrop::PositionalFile *>(file) != nullptr;
+    });
+}
+
+// Sends a file of the request without taking it over: the writers delete the files they send,
+// a trusted send that is refused must leave them to the ask that follows.
+class BorrowedFile : public flowdrop::PositionalFile {
+public:
+    explicit BorrowedFile(flowdrop::PositionalFile *file) : _file(file) {}
+
+    [[nodiscard]] std::string getRelativePath() const override {
+        return _file->getRelativePath();
+    }
+    [[nodiscard]] std::uint64_t getSize() const override {
+        return _file->getSize();
+    }
+    [[nodiscard]] std::uint64_t getCreatedTime() const override {
+        return _file->getCreatedTime();
+    }
+    [[nodiscard]] std::uint64_t getModifiedTime() const override {
+        return _file->getModifiedTime();
+    }
+    [[nodiscard]] std::filesystem::perms getPermissions() const override {
+        return _file->getPermissions();
+    }
+    void seek(std::uint64_t pos) override {
+        _offset = pos;
+    }
+    std::uint64_t read(char *buffer, std::uint64_t count) override {
+        std::uint64_t n = _file->readAt(_offset, buffer, count);
+        _offset += n;
+        return n;
+    }
+    std::uint64_t readAt(std::uint64_t offset, char *buffer, std::uint64_t count) const override {
+        return _file->readAt(offset, buffer, count);
+    }
+    [[nodiscard]] int nativeHandle() const override {
+        return _file->nativeHandle();
+    }
+
+private:
+    flowdrop::PositionalFile *_file;
+    std::uint64_t _offset = 0;
+};
+
+// The files to a paired receiver without an ask, in the format it had when pairing and always
+// sealed. A status of 403 when the receiver does not know the pairing, 421 from another device.
+SendResult sendTrusted(const std::string &baseUrl, SendPayload &payload, const pairing::Receiver &receiver, const TrustedSend &trust,
+                       flowdrop::IEventListener *listener, const flowdrop::DeviceInfo &deviceInfo,
+                       const flowdrop::TransportOptions *transportOptions) {
+    SessionCipher cipher;
+    cipher.key = trust.credential.key;
+    std::vector<flowdrop::File *> files;
+    files.reserve(payload.files.size());
+    for (flowdrop::File *file: payload.files) {
+        files.push_back(new BorrowedFile(static_cast<flowdrop::PositionalFile *>(file)));
+    }
+    SendResult result;
+    if ((receiver.capabilities & flowdrop_capability_stream_archive) == 0) {
+        result = sendFiles(baseUrl, files, listener, deviceInfo, &cipher, &trust, transportOptions, payload.progress);
+    } else {
+        archive::Writer writer(std::move(files), listener, checksumType(payload.checksum, receiver.capabilities), payload.progress);
+        if (listener != nullptr) {
+            listener->onSendingStart();
+        }
+        result = sendStream(baseUrl, writer, deviceInfo, &cipher, &trust, transportOptions);
     }
+    // the files are done with unless they go out again, to another address or after an ask
+    if (!result.unreachable && result.status != 403 && result.status != 421) {
+        for (flowdrop::File *file: payload.files) {
+            delete file;
+        }
+        payload.files.clear();
+    }
+    return result;
+}
 
+// Files of unknown size only fit in the stream archive, a receiver without it gets none of them.
+AskResult refuseUnknownSizes(SendPayload &payload, const discovery::Remote &remote) {
+    LOG_ERROR("receiver does not accept files of unknown size" << Logger::kv("ip", remote.ip));
+    for (flowdrop::File *file: payload.files) {
+        delete file;
+    }
+    payload.files.clear();
+    return ASK_INCOMPATIBLE;
+}
+
+// asking is set once the listener was told of the ask, an ask to another address is not told again.
+AskResult askAndSend(const discovery::Remote &remote, const std::string &receiverId, SendPayload &payload, const std::chrono::milliseconds askTimeout,
+                     const std::chrono::milliseconds connectTimeout, flowdrop::IEventListener *listener, const flowdrop::DeviceInfo &deviceInfo,
+                     bool &asking) {
+    std::string baseUrl = discovery::toBaseUrl(remote);
+
+    // only a receiver known to take the stream archive gets an estimated ask
+    bool pipelined = payload.generator != nullptr && (remote.capabilities & flowdrop_capability_stream_archive) != 0;
+    if (payload.generator != nullptr && !pipelined && !drainGenerator(payload)) {
+        return ASK_FAILED;
+    }
+    std::vector<flowdrop::File *> &files = payload.files;
+
+    UdpOffer udp;
+    // receivers without it ignore the transport header, and answer without a UDP port
+    bool askUdp = payload.reliableUdp.has_value();
+    if (askUdp) {
+        udp.window = std::clamp(payload.reliableUdp->window, transport::minUdpWindow, transport::maxUdpWindow);
+    }
+
+    // files of unknown size are announced with size 0
     std::vector<flowdrop::FileInfo> filesInfo(files.size());
+    bool unknownSizes = false;
+    std::uint64_t totalSize = 0;
     for (size_t i = 0; i < files.size(); ++i) {
         filesInfo[i].name = files[i]->getRelativePath();
         filesInfo[i].size = files[i]->getSize();
+        if (filesInfo[i].size == flowdrop::unknownFileSize) {
+            filesInfo[i].size = 0;
+            unknownSizes = true;
+        }
+        totalSize += filesInfo[i].size;
     }
-    if (!ask(baseUrl, filesInfo, askTimeout, deviceInfo)) {
-        if (listener != nullptr) {
+    // capabilities from the TXT record or the peer cache spare the receiver an ask it cannot take;
+    // without any, the answer tells
+    if (unknownSizes && remote.capabilities != 0 && (remote.capabilities & flowdrop_capability_stream_archive) == 0) {
+        return refuseUnknownSizes(payload, remote);
+    }
+    if (payload.transportPreset.has_value() && !payload.transportOptions.has_value()) {
+        payload.transportOptions = tunedOptions(baseUrl, payload.transportPreset.value(), pipelined ? payload.estimate.size : totalSize, listener);
+    }
+    const flowdrop::TransportOptions *transportOptions = payload.transportOptions.has_value() ? &payload.transportOptions.value() : nullptr;
+
+    std::optional<pairing::Receiver> paired;
+    if (payload.pairing && !receiverId.empty()) {
+        paired = pairing::Store::instance().receiver(receiverId);
+    }
+    std::optional<pairing::Credential> credential;
+    if (paired.has_value() && !pipelined && !unknownSizes && !payload.reliableUdp.has_value() && rereadable(files)) {
+        credential = pairing::newCredential(paired->token);
+    }
+    if (credential.has_value()) {
+        TrustedSend trust{credential.value(), receiverId};
+        SendResult result = sendTrusted(baseUrl, payload, paired.value(), trust, listener, deviceInfo, transportOptions);
+        // another device holds the address: it answers 421, or, not knowing the receiver header,
+        // refuses the trust without naming itself; the pairing is only dropped by the receiver
+        if (result.unreachable || result.status == 421 || (result.status == 403 && result.receiverId != receiverId)) {
+            return ASK_UNREACHABLE;
+        }
+        // the body may have arrived, it is not sent again
+        if (result.status == 0) {
+            return ASK_LOST;
+        }
+        if (result.status == 200) {
+            if (listener != nullptr) {
+                listener->onSendingEnd();
+            }
+            return ASK_ACCEPTED;
+        }
+        if (result.status != 403) {
+            LOG_ERROR("trusted send failed" << Logger::kv("id", receiverId) << Logger::kv("status", result.status));
+            return ASK_FAILED;
+        }
+        LOG_DEBUG("pairing refused, asking" << Logger::kv("id", receiverId));
+        pairing::Store::instance().removeReceiver(receiverId);
+        paired.reset();
+    }
+
+    std::optional<SessionCipher> cipher;
+    if (payload.encrypted) {
+        std::optional<crypto::KeyPair> keyPair = crypto::KeyPair::generate();
+        if (!keyPair.has_value()) {
+            LOG_ERROR("unable to generate a session key");
+            return ASK_FAILED;
+        }
+        cipher.emplace();
+        cipher->keyPair = keyPair.value();
+    }
+    SessionCipher *sessionCipher = cipher.has_value() ? &cipher.value() : nullptr;
+
+    // an unpaired receiver is asked to pair, older ones ignore it; one without a known id is not,
+    // its pairing could not be told apart from that of any other device at the address
+    std::optional<PairingOffer> pairOffer;
+    if (payload.pairing && !receiverId.empty() && !paired.has_value()) {
+        std::optional<crypto::KeyPair> keyPair = crypto::KeyPair::generate();
+        if (keyPair.has_value()) {
+            pairOffer.emplace();
+            pairOffer->keyPair = keyPair.value();
+        }
+    }
+    PairingOffer *pair = pairOffer.has_value() ? &pairOffer.value() : nullptr;
+
+    if (listener != nullptr && !asking) {
+        listener->onAskingReceiver();
+    }
+    asking = true;
+
+    unsigned capabilities = remote.capabilities;
+    bool binaryManifest = !pipelined && (capabilities & flowdrop_capability_ask_manifest) != 0;
+    const flowdrop::SendEstimate *estimate = pipelined ? &payload.estimate : nullptr;
+    AskResult askResult = ask(baseUrl, receiverId, filesInfo, askTimeout, connectTimeout, deviceInfo, binaryManifest, estimate, capabilities,
+                              sessionCipher, askUdp ? &udp : nullptr, pair, transportOptions);
+    if (askResult == ASK_UNSUPPORTED) {
+        LOG_DEBUG("binary manifest rejected, asking with JSON" << Logger::kv("ip", remote.ip));
+        askResult = ask(baseUrl, receiverId, filesInfo, askTimeout, connectTimeout, deviceInfo, false, nullptr, capabilities, sessionCipher,
+                        askUdp ? &udp : nullptr, pair, transportOptions);
+    }
+    if (askResult != ASK_ACCEPTED) {
+        if (askResult == ASK_DECLINED && listener != nullptr) {
             listener->onReceiverDeclined();
         }
-        return false;
+        return askResult;
     }
 
     if (listener != nullptr) {
         listener->onReceiverAccepted();
     }
+    // kept under the id the send was meant for, only when the receiver answered with it
+    if (pair != nullptr && pair->receiverId == receiverId) {
+        LOG_DEBUG("paired" << Logger::kv("id", receiverId));
+        pairing::Store::instance().putReceiver(receiverId, {pair->token, capabilities});
+    } else if (pair != nullptr && !pair->receiverId.empty()) {
+        LOG_ERROR("pairing answered by another device" << Logger::kv("id", receiverId) << Logger::kv("answered", pair->receiverId));
+    }
 
-    sendFiles(baseUrl, files, listener, deviceInfo);
+    bool delivered;
+    if (pipelined) {
+        FilePrefetcher prefetcher(std::move(payload.generator));
+        payload.generator = nullptr;
+        archive::Writer writer([&prefetcher]() {
+            return prefetcher.next();
+        }, listener, checksumType(payload.checksum, capabilities), payload.progress);
+        delivered = sendArchive(remote, writer, listener, deviceInfo, sessionCipher, udp,
+                                payload.reliableUdp.value_or(flowdrop::ReliableUdpOptions()), transportOptions);
+    } else if ((capabilities & flowdrop_capability_stream_archive) != 0) {
+        archive::Writer writer(files, listener, checksumType(payload.checksum, capabilities), payload.progress);
+        delivered = sendArchive(remote, writer, listener, deviceInfo, sessionCipher, udp,
+                                payload.reliableUdp.value_or(flowdrop::ReliableUdpOptions()), transportOptions);
+    } else if (unknownSizes) {
+        return refuseUnknownSizes(payload, remote);
+    } else {
+        delivered = sendFiles(baseUrl, files, listener, deviceInfo, sessionCipher, nullptr, transportOptions, payload.progress).status == 200;
+    }
+    // a write error, a checksum mismatch or a refused session on the receiver is no success
+    if (!delivered) {
+        return ASK_FAILED;
+    }
 
     if (listener != nullptr) {
         listener->onSendingEnd();
     }
 
-    return true;
+    return ASK_ACCEPTED;
 }
 
-bool send(const std::string &receiverId, std::vector<flowdrop::File *> &files,
+// connect timeout used when the address comes from the peer cache and may be outdated
+static const std::chrono::milliseconds cachedConnectTimeout(2 * 1000); // 2 secs
+static const std::chrono::milliseconds resolvedConnectTimeout(0); // curl default
+
+bool finishAsk(AskResult askResult, flowdrop::IEventListener *listener) {
+    if ((askResult == ASK_UNREACHABLE || askResult == ASK_LOST || askResult == ASK_INCOMPATIBLE) && listener != nullptr) {
+        listener->onReceiverDeclined();
+    }
+    return askResult == ASK_ACCEPTED;
+}
+
+bool send(const std::string &receiverId, SendPayload &payload,
           const std::chrono::milliseconds &resolveTimeout, const std::chrono::milliseconds &askTimeout,
           flowdrop::IEventListener *listener, const flowdrop::DeviceInfo &deviceInfo) {
     if (listener != nullptr) {
         listener->onResolving();
     }
 
+    bool asking = false;
+    discovery::PeerCache &peerCache = discovery::PeerCache::instance();
+    std::optional<discovery::Remote> cachedRemote = peerCache.get(receiverId);
+    if (cachedRemote.has_value()) {
+        if (listener != nullptr) {
+            listener->onResolved();
+        }
+        const discovery::Remote &remote = cachedRemote.value();
+        LOG_DEBUG("cached" << Logger::kv("ip", remote.ip) << Logger::kv("port", remote.port));
+        AskResult askResult = askAndSend(remote, receiverId, payload, askTimeout, cachedConnectTimeout, listener, deviceInfo, asking);
+        if (askResult != ASK_UNREACHABLE) {
+            return finishAsk(askResult, listener);
+        }
+        LOG_DEBUG("cached address unreachable, resolving" << Logger::kv("id", receiverId));
+        peerCache.invalidate(receiverId);
+    }
+
     std::promise<std::optional<discovery::Remote>> resolvePromise;
     std::future<std::optional<discovery::Remote>> resolveFuture = resolvePromise.get_future();
 
@@ -353,20 +1113,71 @@ bool send(const std::string &receiverId, std::vector<flowdrop::File *> &files,
             resolveThread.join();
             return false;
         }
-        if (listener != nullptr) {
+        // told once, a cached address that did not answer already was
+        if (listener != nullptr && !cachedRemote.has_value()) {
             listener->onResolved();
         }
         discovery::Remote remote = remoteOpt.value();
         resolveThread.join();
-        Logger::log(Logger::LEVEL_DEBUG, "fully resolved: " + remote.ip + ":" + std::to_string(remote.port));
-        return askAndSend(remote, files, askTimeout, listener, deviceInfo);
+        LOG_DEBUG("fully resolved" << Logger::kv("ip", remote.ip) << Logger::kv("port", remote.port));
+        peerCache.put(receiverId, remote);
+        return finishAsk(askAndSend(remote, receiverId, payload, askTimeout, resolvedConnectTimeout, listener, deviceInfo, asking), listener);
     } catch (std::exception &e) {
-        Logger::log(Logger::LEVEL_ERROR, "resolve error: " + std::string(e.what()));
+        LOG_ERROR("resolve error: " << e.what());
         resolveThread.join();
         return false;
     }
 }
 
+bool sendDirect(const std::vector<flowdrop::Address> &addresses, const std::string &receiverId, SendPayload &payload,
+                const std::chrono::milliseconds &resolveTimeout, const std::chrono::milliseconds &askTimeout,
+                flowdrop::IEventListener *listener, const flowdrop::DeviceInfo &deviceInfo) {
+    if (listener != nullptr) {
+        listener->onResolving();
+    }
+
+    // addresses carry no TXT record, the capabilities last seen for the receiver are assumed
+    unsigned capabilities = 0;
+    if (!receiverId.empty()) {
+        std::optional<discovery::Remote> cachedRemote = discovery::PeerCache::instance().get(receiverId);
+        if (cachedRemote.has_value()) {
+            capabilities = cachedRemote->capabilities;
+        }
+    }
+
+    std::vector<discovery::Remote> candidates;
+    candidates.reserve(addresses.size());
+    for (const flowdrop::Address &address: addresses) {
+        discovery::IPType ipType = address.host.find(':') != std::string::npos ? discovery::IPv6 : discovery::IPv4;
+        candidates.push_back({ipType, address.host, address.port, capabilities});
+    }
+
+    std::optional<discovery::Remote> remoteOpt;
+    if (candidates.size() == 1) {
+        remoteOpt = candidates.front();
+    } else {
+        remoteOpt = discovery::raceConnect(candidates, resolveTimeout);
+    }
+    if (!remoteOpt.has_value()) {
+        if (listener != nullptr) {
+            listener->onReceiverNotFound();
+        }
+        return false;
+    }
+    if (listener != nullptr) {
+        listener->onResolved();
+    }
+    const discovery::Remote &remote = remoteOpt.value();
+    LOG_DEBUG("direct" << Logger::kv("ip", remote.ip) << Logger::kv("port", remote.port));
+
+    bool asking = false;
+    AskResult askResult = askAndSend(remote, receiverId, payload, askTimeout, resolveTimeout, listener, deviceInfo, asking);
+    if (askResult != ASK_UNREACHABLE && !receiverId.empty()) {
+        discovery::PeerCache::instance().put(receiverId, remote);
+    }
+    return finishAsk(askResult, listener);
+}
+
 namespace flowdrop {
     class SendRequest::Impl {
     public:
@@ -387,6 +1198,13 @@ namespace flowdrop {
             _receiverId = id;
         }
 
+        [[nodiscard]] std::vector<Address> getReceiverAddresses() const {
+            return _receiverAddresses;
+        }
+        void setReceiverAddresses(const std::vector<Address> &addresses) {
+            _receiverAddresses = addresses;
+        }
+
         [[nodiscard]] std::vector<File *> getFiles() const {
             return _files;
         }
@@ -415,14 +1233,104 @@ namespace flowdrop {
             _eventListener = listener;
         }
 
+        [[nodiscard]] fileGenerator getFileGenerator() const {
+            return _fileGenerator;
+        }
+        void setFileGenerator(const fileGenerator &generator) {
+            _fileGenerator = generator;
+        }
+
+        [[nodiscard]] SendEstimate getEstimate() const {
+            return _estimate;
+        }
+        void setEstimate(const SendEstimate &estimate) {
+            _estimate = estimate;
+        }
+
+        [[nodiscard]] Checksum getChecksum() const {
+            return _checksum;
+        }
+        void setChecksum(Checksum checksum) {
+            _checksum = checksum;
+        }
+
+        [[nodiscard]] bool isEncrypted() const {
+            return _encrypted;
+        }
+        void setEncrypted(bool encrypted) {
+            _encrypted = encrypted;
+        }
+
+        [[nodiscard]] std::optional<ReliableUdpOptions> getReliableUdp() const {
+            return _reliableUdp;
+        }
+        void setReliableUdp(const std::optional<ReliableUdpOptions> &options) {
+            _reliableUdp = options;
+        }
+
+        [[nodiscard]] bool isPairing() const {
+            return _pairing;
+        }
+        void setPairing(bool pairing) {
+            _pairing = pairing;
+        }
+
+        [[nodiscard]] std::optional<TransportOptions> getTransportOptions() const {
+            return _transportOptions;
+        }
+        void setTransportOptions(const std::optional<TransportOptions> &options) {
+            _transportOptions = options;
+        }
+
+        [[nodiscard]] std::optional<TransportPreset> getTransportPreset() const {
+            return _transportPreset;
+        }
+        void setTransportPreset(const std::optional<TransportPreset> &preset) {
+            _transportPreset = preset;
+        }
+
+        [[nodiscard]] ProgressOptions getProgressOptions() const {
+            return _progressOptions;
+        }
+        void setProgressOptions(const ProgressOptions &options) {
+            _progressOptions = options;
+        }
+
         bool execute() {
-            return send(_receiverId, _files, _resolveTimeout, _askTimeout, _eventListener, _deviceInfo);
+            SendPayload payload;
+            payload.checksum = _checksum;
+            payload.encrypted = _encrypted;
+            payload.reliableUdp = _reliableUdp;
+            payload.pairing = _pairing;
+            payload.transportOptions = _transportOptions;
+            payload.transportPreset = _transportPreset;
+            payload.progress = _progressOptions;
+            if (_fileGenerator != nullptr) {
+                payload.generator = _fileGenerator;
+                payload.estimate = _estimate;
+            } else {
+                payload.files = _files;
+            }
+            if (!_receiverAddresses.empty()) {
+                return sendDirect(_receiverAddresses, _receiverId, payload, _resolveTimeout, _askTimeout, _eventListener, _deviceInfo);
+            }
+            return send(_receiverId, payload, _resolveTimeout, _askTimeout, _eventListener, _deviceInfo);
         }
 
     private:
         DeviceInfo _deviceInfo;
         std::string _receiverId;
+        std::vector<Address> _receiverAddresses;
         std::vector<File *> _files;
+        fileGenerator _fileGenerator;
+        SendEstimate _estimate;
+        Checksum _checksum = Checksum::XXH3;
+        bool _encrypted = false;
+        std::optional<ReliableUdpOptions> _reliableUdp;
+        bool _pairing = false;
+        std::optional<TransportOptions> _transportOptions;
+        std::optional<TransportPreset> _transportPreset;
+        ProgressOptions _progressOptions;
         std::chrono::milliseconds _resolveTimeout = std::chrono::milliseconds(10 * 1000); // 10 secs
         std::chrono::milliseconds _askTimeout = std::chrono::milliseconds(60 * 1000); // 60 secs
         IEventListener *_eventListener = nullptr;
@@ -441,11 +1349,66 @@ namespace flowdrop {
         return *this;
     }
 
+    [[maybe_unused]] SendRequest& SendRequest::setReceiverAddress(const Address& address) {
+        pImpl->setReceiverAddresses({address});
+        return *this;
+    }
+
+    [[maybe_unused]] SendRequest& SendRequest::setReceiverAddresses(const std::vector<Address>& addresses) {
+        pImpl->setReceiverAddresses(addresses);
+        return *this;
+    }
+
     [[maybe_unused]] SendRequest& SendRequest::setFiles(const std::vector<File *>& files) {
         pImpl->setFiles(files);
         return *this;
     }
 
+    [[maybe_unused]] SendRequest& SendRequest::setFileGenerator(const fileGenerator& generator) {
+        pImpl->setFileGenerator(generator);
+        return *this;
+    }
+
+    [[maybe_unused]] SendRequest& SendRequest::setEstimate(const SendEstimate& estimate) {
+        pImpl->setEstimate(estimate);
+        return *this;
+    }
+
+    [[maybe_unused]] SendRequest& SendRequest::setChecksum(Checksum checksum) {
+        pImpl->setChecksum(checksum);
+        return *this;
+    }
+
+    [[maybe_unused]] SendRequest& SendRequest::setEncrypted(bool encrypted) {
+        pImpl->setEncrypted(encrypted);
+        return *this;
+    }
+
+    [[maybe_unused]] SendRequest& SendRequest::setReliableUdp(const std::optional<ReliableUdpOptions>& options) {
+        pImpl->setReliableUdp(options);
+        return *this;
+    }
+
+    [[maybe_unused]] SendRequest& SendRequest::setPairing(bool pairing) {
+        pImpl->setPairing(pairing);
+        return *this;
+    }
+
+    [[maybe_unused]] SendRequest& SendRequest::setTransportOptions(const std::optional<TransportOptions>& options) {
+        pImpl->setTransportOptions(options);
+        return *this;
+    }
+
+    [[maybe_unused]] SendRequest& SendRequest::setTransportPreset(const std::optional<TransportPreset>& preset) {
+        pImpl->setTransportPreset(preset);
+        return *this;
+    }
+
+    [[maybe_unused]] SendRequest& SendRequest::setProgressOptions(const ProgressOptions& options) {
+        pImpl->setProgressOptions(options);
+        return *this;
+    }
+
     [[maybe_unused]] SendRequest& SendRequest::setResolveTimeout(const std::chrono::milliseconds& timeout) {
         pImpl->setResolveTimeout(timeout);
         return *this;
@@ -469,10 +1432,50 @@ namespace flowdrop {
         return pImpl->getReceiverId();
     }
 
+    [[maybe_unused]] std::vector<Address> SendRequest::getReceiverAddresses() const {
+        return pImpl->getReceiverAddresses();
+    }
+
     [[maybe_unused]] std::vector<File *> SendRequest::getFiles() const {
         return pImpl->getFiles();
     }
 
+    [[maybe_unused]] fileGenerator SendRequest::getFileGenerator() const {
+        return pImpl->getFileGenerator();
+    }
+
+    [[maybe_unused]] SendEstimate SendRequest::getEstimate() const {
+        return pImpl->getEstimate();
+    }
+
+    [[maybe_unused]] Checksum SendRequest::getChecksum() const {
+        return pImpl->getChecksum();
+    }
+
+    [[maybe_unused]] bool SendRequest::isEncrypted() const {
+        return pImpl->isEncrypted();
+    }
+
+    [[maybe_unused]] std::optional<ReliableUdpOptions> SendRequest::getReliableUdp() const {
+        return pImpl->getReliableUdp();
+    }
+
+    [[maybe_unused]] bool SendRequest::isPairing() const {
+        return pImpl->isPairing();
+    }
+
+    [[maybe_unused]] std::optional<TransportOptions> SendRequest::getTransportOptions() const {
+        return pImpl->getTransportOptions();
+    }
+
+    [[maybe_unused]] std::optional<TransportPreset> SendRequest::getTransportPreset() const {
+        return pImpl->getTransportPreset();
+    }
+
+    [[maybe_unused]] ProgressOptions SendRequest::getProgressOptions() const {
+        return pImpl->getProgressOptions();
+    }
+
     [[maybe_unused]] std::chrono::milliseconds SendRequest::getResolveTimeout() const {
         return pImpl->getResolveTimeout();
     }
@@ -9,6 +9,7 @@
 #include "core.h"
 #include "hv/HttpServer.h"
 #include "hv/hlog.h"
+#include <algorithm>
 #include <thread>
 #include <set>
 #include <utility>
@@ -18,27 +19,48 @@
 #include "specification.h"
 #include "virtualtfa.h"
 #include "logger.h"
+#include "ask_reader.hpp"
+#include "archive_extractor.hpp"
+#include "progress_throttle.hpp"
+#include "sealed_stream.hpp"
+#include "reliable_udp.hpp"
+#include "socket_tuning.hpp"
+#include "pairing.hpp"
+#include "link_probe.hpp"
+#include "os/random.h"
+#include "hv/hasync.h"
+#include "hv/EventLoop.h"
+#include <mutex>
+#include <unordered_map>
+
+// how long a key agreed in an accepted ask waits for its /send
+static const std::chrono::minutes sessionCipherLifetime(10);
 
 class ReceiveProgressListener {
 public:
-    ReceiveProgressListener(flowdrop::DeviceInfo sender, flowdrop::IEventListener *eventListener, tfa_size_t totalSize, std::vector<const virtual_tfa_file_info *> *receivedFiles) :
-            _sender(std::move(sender)), _eventListener(eventListener), _totalSize(totalSize), _receivedFiles(receivedFiles) {}
+    ReceiveProgressListener(flowdrop::DeviceInfo sender, flowdrop::IEventListener *eventListener, tfa_size_t totalSize, std::vector<const virtual_tfa_file_info *> *receivedFiles,
+                            const flowdrop::ProgressOptions &progress) :
+            _sender(std::move(sender)), _eventListener(eventListener), _totalSize(totalSize), _receivedFiles(receivedFiles),
+            _fileThrottle(progress), _totalThrottle(progress) {}
 
     void totalProgress(tfa_size_t currentSize) {
-        if (_eventListener != nullptr) {
+        // the last update always gets through
+        if (_eventListener != nullptr && (_totalThrottle.due(currentSize) || currentSize == _totalSize)) {
             _eventListener->onReceivingTotalProgress(_sender, _totalSize, currentSize);
         }
     }
 
     void fileStart(const virtual_tfa_file_info *fileInfo) {
+        _file = {fileInfo->name, fileInfo->size};
+        _fileThrottle.restart();
         if (_eventListener != nullptr) {
-            _eventListener->onReceivingFileStart(_sender, {fileInfo->name, fileInfo->size});
+            _eventListener->onReceivingFileStart(_sender, _file);
         }
     }
 
-    void fileProgress(const virtual_tfa_file_info *fileInfo, tfa_size_t currentSize) {
-        if (_eventListener != nullptr) {
-            _eventListener->onReceivingFileProgress(_sender, {fileInfo->name, fileInfo->size}, currentSize);
+    void fileProgress(const virtual_tfa_file_info * /*fileInfo*/, tfa_size_t currentSize) {
+        if (_eventListener != nullptr && _fileThrottle.due(currentSize)) {
+            _eventListener->onReceivingFileProgress(_sender, _file, currentSize);
         }
     }
 
@@ -54,8 +76,12 @@ public:
             copiedFileInfo->mode = fileInfo->mode;
             _receivedFiles->push_back(copiedFileInfo);
         }
+        _file.size = fileInfo->size;
         if (_eventListener != nullptr) {
-            _eventListener->onReceivingFileEnd(_sender, {fileInfo->name, fileInfo->size});
+            if (_fileThrottle.flush()) {
+                _eventListener->onReceivingFileProgress(_sender, _file, _fileThrottle.held());
+            }
+            _eventListener->onReceivingFileEnd(_sender, _file);
         }
     }
 
@@ -64,6 +90,9 @@ private:
     flowdrop::IEventListener *_eventListener;
     tfa_size_t _totalSize;
     std::vector<const virtual_tfa_file_info *> *_receivedFiles;
+    flowdrop::FileInfo _file; // of the file being received, passed to every event about it
+    ProgressThrottle _fileThrottle;
+    ProgressThrottle _totalThrottle;
 };
 
 namespace server_listener {
@@ -93,6 +122,60 @@ struct ReceiveSession {
     virtual_tfa_reader *tfa_reader = nullptr;
     tfa_size_t totalSize = 0;
     std::vector<const virtual_tfa_file_info *> *receivedFiles = nullptr;
+    // set instead of tfa_reader when the body is a stream archive
+    std::unique_ptr<archive::Extractor> extractor;
+    std::unique_ptr<archive::Reader> streamReader;
+    // set when the body is sealed, the plaintext goes to one of the readers above
+    std::unique_ptr<crypto::Opener> opener;
+    // the connection is not read while the writes drain
+    bool readPaused = false;
+};
+
+// A stream archive arriving over reliable UDP, sealed when a key was agreed on in the ask.
+class UdpReceiveSink : public transport::ReliableUdpSink {
+public:
+    UdpReceiveSink(std::unique_ptr<ReceiveSession> session, flowdrop::IEventListener *listener) :
+            _session(std::move(session)), _listener(listener) {}
+
+    bool write(const char *data, std::size_t size) override {
+        if (!_session->opener) {
+            return feed(data, size);
+        }
+        bool opened = _session->opener->feed(data, size, [this](const char *plaintext, std::size_t plaintextSize) {
+            return feed(plaintext, plaintextSize);
+        });
+        if (!opened) {
+            LOG_ERROR("sealed body error");
+        }
+        return opened;
+    }
+
+    [[nodiscard]] bool complete() const override {
+        return _session->streamReader->done() && (!_session->opener || _session->opener->done());
+    }
+
+    bool finish() override {
+        if (!_session->extractor->finish()) {
+            LOG_ERROR("stream archive not written");
+            return false;
+        }
+        if (_listener != nullptr) {
+            _listener->onReceivingEnd(_session->sender, _session->extractor->receivedBytes(), _session->extractor->receivedFiles());
+        }
+        return true;
+    }
+
+private:
+    bool feed(const char *data, std::size_t size) {
+        if (!_session->streamReader->feed(data, size)) {
+            LOG_ERROR("stream archive error" << Logger::kv("error", _session->streamReader->error()));
+            return false;
+        }
+        return true;
+    }
+
+    std::unique_ptr<ReceiveSession> _session;
+    flowdrop::IEventListener *_listener;
 };
 
 namespace flowdrop {
@@ -103,29 +186,186 @@ namespace flowdrop {
 
         DeviceInfo _deviceInfo;
         askCallback _askCallback;
+        pairCallback _pairCallback;
         std::filesystem::path _destDir;
         IEventListener *_listener = nullptr;
+        AskLimits _askLimits;
+        unsigned _writerThreads = std::min(std::max(std::thread::hardware_concurrency(), 2u), 8u);
+        std::optional<TransportOptions> _transportOptions;
+        ProgressOptions _progressOptions;
+        std::unique_ptr<archive::WriterPool> _writerPool;
+        std::unique_ptr<transport::ReliableUdpReceiver> _reliableUdp; // sessions write through _writerPool
+        transport::ProbeBudget _probeBudget;
         std::thread _sdThread;
         std::atomic<bool> *_sdStop = nullptr;
         hv::HttpServer _server;
-        //std::unordered_map<std::string, CachedSendRequest> _sendKeys;
-
-        void askHandler(const HttpRequestPtr &req, const HttpResponseWriterPtr &writer) {
-            std::string senderIp = req->client_addr.ip;
-            Logger::log(Logger::LEVEL_DEBUG, "ask_new: " + senderIp);
-
-            json j;
-            try {
-                j = json::parse(req->Body());
-            } catch (const std::exception &) {
-                Logger::log(Logger::LEVEL_DEBUG, "ask_invalid_json: " + senderIp);
-                writer->Begin();
-                writer->WriteStatus(HTTP_STATUS_BAD_REQUEST);
-                writer->WriteBody("Invalid JSON");
-                writer->End();
+
+        struct SessionCipher {
+            crypto::Key key;
+            std::chrono::steady_clock::time_point expires;
+        };
+        std::mutex _sessionCiphersMutex;
+        std::unordered_map<std::string, SessionCipher> _sessionCiphers; // by session id, used once
+
+        void rejectAsk(const HttpContextPtr &ctx, http_status status, const std::string &error) {
+            LOG_DEBUG("ask_rejected" << Logger::kv("ip", ctx->ip()) << Logger::kv("error", error));
+            reject(ctx, status, error);
+        }
+
+        // Answers right away and closes, the body is not read. With a receiverId the answer names us.
+        static void reject(const HttpContextPtr &ctx, http_status status, const std::string &error, const std::string &receiverId = {}) {
+            const HttpResponseWriterPtr &writer = ctx->writer;
+            writer->Begin();
+            writer->WriteStatus(status);
+            writer->WriteHeader("Connection", "close");
+            if (!receiverId.empty()) {
+                writer->WriteHeader(flowdrop_receiver_id_header, receiverId);
+            }
+            writer->WriteBody(error);
+            writer->End();
+            ctx->close();
+        }
+
+        // Meant for another device, the sender holds an outdated address of it.
+        bool misdirected(const HttpContextPtr &ctx) const {
+            std::string receiverId = ctx->request->GetHeader(flowdrop_receiver_id_header);
+            return !receiverId.empty() && receiverId != _deviceInfo.id;
+        }
+
+        // Agrees on the key of a sealed /send; answers with our key and the session id to present.
+        std::optional<crypto::Key> offerSessionCipher(const crypto::Key &peerKey, nlohmann::json &resp) {
+            std::optional<crypto::KeyPair> keyPair = crypto::KeyPair::generate();
+            if (!keyPair.has_value()) {
+                LOG_ERROR("unable to generate a session key");
+                return std::nullopt;
+            }
+            std::optional<crypto::Key> key = crypto::sessionKey(keyPair.value(), peerKey);
+            unsigned char id[16];
+            if (!key.has_value() || knotdrop_random_bytes(id, sizeof(id)) != 0) {
+                return std::nullopt;
+            }
+            std::string session = crypto::toHex(id, sizeof(id));
+            auto now = std::chrono::steady_clock::now();
+            {
+                std::lock_guard<std::mutex> lock(_sessionCiphersMutex);
+                for (auto it = _sessionCiphers.begin(); it != _sessionCiphers.end();) {
+                    it = it->second.expires < now ? _sessionCiphers.erase(it) : std::next(it);
+                }
+                _sessionCiphers[session] = {key.value(), now + sessionCipherLifetime};
+            }
+            resp["key"] = crypto::toHex(keyPair->publicKey.data(), keyPair->publicKey.size());
+            resp["session"] = session;
+            return key;
+        }
+
+        // The stream archive of an accepted ask may come over reliable UDP instead of /send;
+        // answers with the port and the session to use there.
+        void offerReliableUdp(const std::string &transportHeader, const DeviceInfo &sender, const std::optional<crypto::Key> &key,
+                              nlohmann::json &resp) {
+            if (transportHeader.rfind(flowdrop_transport_kcp, 0) != 0 || !_reliableUdp || !_reliableUdp->running()) {
+                return;
+            }
+            unsigned window = transport::minUdpWindow;
+            std::size_t at = transportHeader.find("window=");
+            if (at != std::string::npos) {
+                unsigned long requested = std::strtoul(transportHeader.c_str() + at + 7, nullptr, 10);
+                window = static_cast<unsigned>(std::min<unsigned long>(requested, transport::maxUdpWindow));
+            }
+            std::uint32_t conv = _reliableUdp->offer(window, [this, sender, key](std::uint64_t totalSize) -> std::unique_ptr<transport::ReliableUdpSink> {
+                if (!ensureDestDir()) {
+                    return nullptr;
+                }
+                std::unique_ptr<ReceiveSession> session(new ReceiveSession{sender, nullptr, totalSize, nullptr});
+                session->extractor = std::make_unique<archive::Extractor>(_destDir, sender, _listener, totalSize, _writerPool.get(),
+                                                                          _progressOptions);
+                session->streamReader = std::make_unique<archive::Reader>(*session->extractor);
+                if (key.has_value()) {
+                    session->opener = std::make_unique<crypto::Opener>(key.value());
+                }
+                if (_listener != nullptr) {
+                    _listener->onReceivingStart(sender, totalSize);
+                }
+                return std::make_unique<UdpReceiveSink>(std::move(session), _listener);
+            });
+            if (conv != 0) {
+                resp["udpPort"] = _reliableUdp->port();
+                resp["conv"] = conv;
+            }
+        }
+
+        // Pairs with the sender of an accepted ask that sent a pairing key, when the callback agrees;
+        // answers with our pairing key and id. Both sides derive the token, it is not sent. The
+        // sender id is only what the ask claims, an existing pairing is replaced only when the
+        // callback agreed to it as a re-pair.
+        void offerPairing(const std::string &pairHeader, const DeviceInfo &sender, nlohmann::json &resp) {
+            crypto::Key senderKey;
+            if (pairHeader.empty() || _pairCallback == nullptr || !crypto::fromHex(pairHeader, senderKey.data(), senderKey.size())) {
+                return;
+            }
+            bool repair = pairing::Store::instance().hasSender(sender.id);
+            if (!_pairCallback(sender, repair)) {
+                return;
+            }
+            std::optional<crypto::KeyPair> keyPair = crypto::KeyPair::generate();
+            if (!keyPair.has_value()) {
+                return;
+            }
+            std::optional<crypto::Key> token = crypto::sessionKey(keyPair.value(), senderKey);
+            if (!token.has_value()) {
+                return;
+            }
+            // paired meanwhile by another ask, which the callback was not asked about
+            if (!pairing::Store::instance().putSender(sender.id, token.value(), repair)) {
+                LOG_DEBUG("pairing kept" << Logger::kv("id", sender.id));
+                return;
+            }
+            LOG_DEBUG("paired" << Logger::kv("id", sender.id) << Logger::kv("repair", repair));
+            resp["pairKey"] = crypto::toHex(keyPair->publicKey.data(), keyPair->publicKey.size());
+            resp["id"] = _deviceInfo.id;
+        }
+
+        bool ensureDestDir() {
+            std::filesystem::file_status destStatus = status(_destDir);
+            if (!exists(destStatus)) {
+                create_directories(_destDir);
+            } else if (!is_directory(destStatus)) {
+                LOG_ERROR("Destination path is not directory");
+                return false;
+            }
+            return true;
+        }
+
+        std::optional<crypto::Key> takeSessionCipher(const std::string &session) {
+            std::lock_guard<std::mutex> lock(_sessionCiphersMutex);
+            auto it = _sessionCiphers.find(session);
+            if (it == _sessionCiphers.end()) {
+                return std::nullopt;
+            }
+            SessionCipher cipher = it->second;
+            _sessionCiphers.erase(it);
+            if (cipher.expires < std::chrono::steady_clock::now()) {
+                return std::nullopt;
+            }
+            return cipher.key;
+        }
+
+        // runs on the libhv thread pool, the ask callback may block while the user decides
+        void answerAsk(const HttpContextPtr &ctx, std::unique_ptr<manifest::AskReader> reader) {
+            std::string senderIp = ctx->ip();
+            flowdrop::SendAsk sendAsk;
+            if (!reader->finish(sendAsk)) {
+                rejectAsk(ctx, reader->tooLarge() ? HTTP_STATUS_PAYLOAD_TOO_LARGE : HTTP_STATUS_BAD_REQUEST, reader->error());
+                return;
+            }
+            reader.reset();
+
+            // the sender wants a sealed /send
+            std::string senderKeyHex = ctx->request->GetHeader(flowdrop_session_key_header);
+            crypto::Key senderKey;
+            if (!senderKeyHex.empty() && !crypto::fromHex(senderKeyHex, senderKey.data(), senderKey.size())) {
+                rejectAsk(ctx, HTTP_STATUS_BAD_REQUEST, "bad session key");
                 return;
             }
-            flowdrop::SendAsk sendAsk = j;
 
             if (_listener != nullptr) {
                 _listener->onSenderAsk(sendAsk.sender);
@@ -133,19 +373,26 @@ namespace flowdrop {
 
             bool accepted = _askCallback == nullptr || _askCallback(sendAsk);
 
-            /*std::string sendKey = flowdrop::generate_md5_id();
-            _sendKeys.insert({sendKey, {senderIp, sendAsk.sender}});
-            std::thread th([this, &sendKey](){
-                std::this_thread::sleep_for(std::chrono::minutes(1));
-            });*/
-
-            Logger::log(Logger::LEVEL_DEBUG, "ask_accepted: " + senderIp);
+            LOG_DEBUG("ask_accepted" << Logger::kv("ip", senderIp));
 
             nlohmann::json resp;
             resp["accepted"] = accepted;
-            //resp["key"] = sendKey;
+            resp["capabilities"] = flowdrop_capabilities;
+            std::optional<crypto::Key> sessionKey;
+            if (accepted && !senderKeyHex.empty()) {
+                sessionKey = offerSessionCipher(senderKey, resp);
+                if (!sessionKey.has_value()) {
+                    rejectAsk(ctx, HTTP_STATUS_BAD_REQUEST, "bad session key");
+                    return;
+                }
+            }
+            if (accepted) {
+                offerReliableUdp(ctx->request->GetHeader(flowdrop_transport_header), sendAsk.sender, sessionKey, resp);
+                offerPairing(ctx->request->GetHeader(flowdrop_pair_header), sendAsk.sender, resp);
+            }
             std::string respString = resp.dump();
 
+            const HttpResponseWriterPtr &writer = ctx->writer;
             writer->Begin();
             writer->WriteStatus(HTTP_STATUS_OK);
             writer->WriteHeader("Content-Type", APPLICATION_JSON);
@@ -153,6 +400,193 @@ namespace flowdrop {
             writer->End();
         }
 
+        int askHandler(const HttpContextPtr &ctx, http_parser_state state, const char *data, size_t size) {
+            auto *reader = (manifest::AskReader *) ctx->userdata;
+            switch (state) {
+                case HP_HEADERS_COMPLETE: {
+                    LOG_DEBUG("ask_new" << Logger::kv("ip", ctx->ip()));
+                    if (misdirected(ctx)) {
+                        rejectAsk(ctx, HTTP_STATUS_MISDIRECTED_REQUEST, "misdirected");
+                        return HTTP_STATUS_MISDIRECTED_REQUEST;
+                    }
+                    std::string contentType = ctx->request->GetHeader("Content-Type");
+                    bool binaryManifest = contentType.rfind(flowdrop_ask_manifest_content_type, 0) == 0;
+                    std::string contentLength = ctx->request->GetHeader("Content-Length");
+                    if (!contentLength.empty() && std::strtoull(contentLength.c_str(), nullptr, 10) > _askLimits.maxBodyBytes) {
+                        rejectAsk(ctx, HTTP_STATUS_PAYLOAD_TOO_LARGE, "ask body exceeds " + std::to_string(_askLimits.maxBodyBytes) + " bytes");
+                        return HTTP_STATUS_PAYLOAD_TOO_LARGE;
+                    }
+                    ctx->userdata = new manifest::AskReader(binaryManifest, _askLimits);
+                    continueIfExpected(ctx);
+                }
+                    break;
+                case HP_BODY: {
+                    if (reader && data && size && !reader->write(data, size)) {
+                        rejectAsk(ctx, reader->tooLarge() ? HTTP_STATUS_PAYLOAD_TOO_LARGE : HTTP_STATUS_BAD_REQUEST, reader->error());
+                        delete reader;
+                        ctx->userdata = nullptr;
+                    }
+                }
+                    break;
+                case HP_MESSAGE_COMPLETE: {
+                    if (!reader) {
+                        return HTTP_STATUS_BAD_REQUEST;
+                    }
+                    ctx->userdata = nullptr;
+                    hv::async([this, ctx, reader]() {
+                        answerAsk(ctx, std::unique_ptr<manifest::AskReader>(reader));
+                    });
+                    return HTTP_STATUS_NEXT;
+                }
+                case HP_ERROR: {
+                    delete reader;
+                    ctx->userdata = nullptr;
+                }
+                    break;
+                default:
+                    break;
+            }
+            return HTTP_STATUS_UNFINISHED;
+        }
+
+        // The body of an upload probe is discarded as it arrives.
+        int probeHandler(const HttpContextPtr &ctx, http_parser_state state) {
+            switch (state) {
+                case HP_HEADERS_COMPLETE: {
+                    std::string contentLength = ctx->request->GetHeader("Content-Length");
+                    if (contentLength.empty()) {
+                        ctx->response->status_code = HTTP_STATUS_LENGTH_REQUIRED;
+                        return HTTP_STATUS_LENGTH_REQUIRED;
+                    }
+                    std::size_t bytes = std::strtoull(contentLength.c_str(), nullptr, 10);
+                    if (bytes > flowdrop_probe_max_bytes) {
+                        ctx->response->status_code = HTTP_STATUS_PAYLOAD_TOO_LARGE;
+                        return HTTP_STATUS_PAYLOAD_TOO_LARGE;
+                    }
+                    if (!_probeBudget.take(ctx->ip(), bytes)) {
+                        reject(ctx, HTTP_STATUS_TOO_MANY_REQUESTS, "probe budget exceeded");
+                        return HTTP_STATUS_TOO_MANY_REQUESTS;
+                    }
+                    continueIfExpected(ctx);
+                }
+                    break;
+                case HP_MESSAGE_COMPLETE: {
+                    ctx->response->status_code = HTTP_STATUS_OK;
+                    ctx->send();
+                    return HTTP_STATUS_OK;
+                }
+                default:
+                    break;
+            }
+            return HTTP_STATUS_UNFINISHED;
+        }
+
+        // state handlers bypass libhv's own 100-continue handling
+        static void continueIfExpected(const HttpContextPtr &ctx) {
+            if (strcasecmp(ctx->request->GetHeader("Expect").c_str(), "100-continue") == 0) {
+                ctx->writer->write("HTTP/1.1 100 Continue\r\n\r\n");
+            }
+        }
+
+        // The pending writes are not waited for on the event loop: the writer pool tells when they
+        // are over, and the answer goes out from the loop of the connection.
+        int finishStream(const HttpContextPtr &ctx, ReceiveSession *session) {
+            resumeRead(ctx, session);
+            ctx->userdata = nullptr;
+            if (!session->streamReader->done()) {
+                delete session;
+                LOG_ERROR("stream archive truncated" << Logger::kv("ip", ctx->ip()));
+                HttpResponse *resp = ctx->response.get();
+                resp->Set("code", HTTP_STATUS_BAD_REQUEST);
+                resp->Set("message", "truncated archive");
+                return HTTP_STATUS_BAD_REQUEST;
+            }
+            hv::EventLoop *loop = hv::tlsEventLoop();
+            session->extractor->whenWritten([this, loop, ctx, session]() {
+                loop->queueInLoop([this, ctx, session]() {
+                    answerStream(ctx, std::unique_ptr<ReceiveSession>(session));
+                });
+            });
+            return HTTP_STATUS_NEXT;
+        }
+
+        void answerStream(const HttpContextPtr &ctx, std::unique_ptr<ReceiveSession> session) {
+            HttpResponse *resp = ctx->response.get();
+            if (!session->extractor->finish()) {
+                LOG_ERROR("stream archive not written" << Logger::kv("ip", ctx->ip()));
+                resp->status_code = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+                resp->Set("code", HTTP_STATUS_INTERNAL_SERVER_ERROR);
+                resp->Set("message", "write error");
+                ctx->send();
+                return;
+            }
+            resp->Set("code", HTTP_STATUS_OK);
+            resp->Set("message", http_status_str(HTTP_STATUS_OK));
+            ctx->send();
+            if (_listener != nullptr) {
+                _listener->onReceivingEnd(session->sender, session->extractor->receivedBytes(), session->extractor->receivedFiles());
+            }
+        }
+
+        // Past the in-flight limit of the writer pool the connection is not read, so a slow disk
+        // holds back this sender only and the event loop goes on serving the others. The pool
+        // hands the resume back to the loop once the writes drained.
+        static void throttleRead(const HttpContextPtr &ctx, ReceiveSession *session) {
+            if (!session->extractor || session->readPaused) {
+                return;
+            }
+            hv::EventLoop *loop = hv::tlsEventLoop();
+            std::weak_ptr<hv::HttpContext> weakCtx = ctx;
+            bool paused = session->extractor->pauseUntilDrained([loop, weakCtx, session]() {
+                loop->queueInLoop([weakCtx, session]() {
+                    HttpContextPtr ctx = weakCtx.lock();
+                    // the session may be over by then
+                    if (ctx != nullptr && ctx->userdata == session && session->extractor->drained()) {
+                        resumeRead(ctx, session);
+                    }
+                });
+            });
+            if (paused) {
+                session->readPaused = true;
+                ctx->writer->stopRead();
+            }
+        }
+
+        static void resumeRead(const HttpContextPtr &ctx, ReceiveSession *session) {
+            if (!session->readPaused) {
+                return;
+            }
+            session->readPaused = false;
+            ctx->writer->startRead();
+        }
+
+        static void dropSession(const HttpContextPtr &ctx, ReceiveSession *session) {
+            if (session->tfa_reader) {
+                virtual_tfa_reader_free(session->tfa_reader);
+                session->tfa_reader = nullptr;
+            }
+            delete session;
+            ctx->userdata = nullptr;
+        }
+
+        // HTTP_STATUS_UNFINISHED while the body is fine
+        static int receiveBody(const HttpContextPtr &ctx, ReceiveSession *session, const char *data, size_t size) {
+            if (session->streamReader) {
+                if (!session->streamReader->feed(data, size)) {
+                    LOG_ERROR("stream archive error" << Logger::kv("ip", ctx->ip()) << Logger::kv("error", session->streamReader->error()));
+                    return HTTP_STATUS_BAD_REQUEST;
+                }
+            } else if (session->tfa_reader) {
+                tfa_size_t bytes_read = 0;
+                int result = virtual_tfa_reader_read(session->tfa_reader, const_cast<char *>(data), size, &bytes_read);
+                if (result != 0 || bytes_read != size) {
+                    LOG_ERROR("Reading error" << Logger::kv("code", result));
+                    return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+                }
+            }
+            return HTTP_STATUS_UNFINISHED;
+        }
+
         int sendHandler(const HttpContextPtr &ctx, http_parser_state state, const char *data, size_t size) {
             //std::string senderIp = ctx->ip();
             int status_code = HTTP_STATUS_UNFINISHED;
@@ -163,40 +597,91 @@ namespace flowdrop {
                         ctx->close();
                         return HTTP_STATUS_BAD_REQUEST;
                     }
+                    if (misdirected(ctx)) {
+                        LOG_DEBUG("misdirected send" << Logger::kv("ip", ctx->ip()));
+                        reject(ctx, HTTP_STATUS_MISDIRECTED_REQUEST, "misdirected");
+                        return HTTP_STATUS_MISDIRECTED_REQUEST;
+                    }
                     auto headers = ctx->request.get()->headers;
                     auto it = headers.find(flowdrop_deviceinfo_header);
                     if (it == headers.end()) {
                         ctx->close();
                         return HTTP_STATUS_BAD_REQUEST;
                     }
-                    std::string senderStr = it->second;
-                    it = headers.find("Content-Length");
-                    if (it == headers.end()) {
+                    flowdrop::DeviceInfo sender;
+                    try {
+                        flowdrop::from_json(json::parse(it->second), sender);
+                    } catch (std::exception &) {
                         ctx->close();
                         return HTTP_STATUS_BAD_REQUEST;
                     }
-                    flowdrop::DeviceInfo sender;
-                    std::uint64_t totalSize;
+                    std::optional<crypto::Key> sessionKey;
+                    bool streamArchive = ctx->request->GetHeader("Content-Type").rfind(flowdrop_stream_archive_content_type, 0) == 0;
+                    // a paired sender comes without an ask, with a sealed body; refused before the body, it asks instead
+                    it = headers.find(flowdrop_trust_header);
+                    if (it != headers.end()) {
+                        std::string binding = pairing::requestBinding(ctx->request->Method(), ctx->request->Path(),
+                                                                      ctx->request->GetHeader(flowdrop_deviceinfo_header), streamArchive,
+                                                                      ctx->request->GetHeader(flowdrop_total_size_header));
+                        std::optional<pairing::Credential> credential = pairing::Store::instance().verify(sender.id, it->second, binding);
+                        if (!credential.has_value()) {
+                            LOG_DEBUG("trusted send refused" << Logger::kv("ip", ctx->ip()) << Logger::kv("id", sender.id));
+                            // named, the sender drops the pairing only when it reached us
+                            reject(ctx, HTTP_STATUS_FORBIDDEN, "unknown pairing", _deviceInfo.id);
+                            return HTTP_STATUS_FORBIDDEN;
+                        }
+                        sessionKey = credential->key;
+                    }
+                    it = headers.find(flowdrop_session_header);
+                    if (it != headers.end() && !sessionKey.has_value()) {
+                        sessionKey = takeSessionCipher(it->second);
+                        if (!sessionKey.has_value()) {
+                            LOG_ERROR("unknown session" << Logger::kv("ip", ctx->ip()));
+                            // answered with this status at message complete, the sender can tell it from a network error
+                            ctx->response->status_code = HTTP_STATUS_FORBIDDEN;
+                            return HTTP_STATUS_FORBIDDEN;
+                        }
+                    }
+                    // the stream archive and sealed bodies are sent chunked, with the payload size in a header
+                    it = headers.find(streamArchive || sessionKey.has_value() ? flowdrop_total_size_header : "Content-Length");
+                    if (it == headers.end() && !streamArchive) {
+                        ctx->close();
+                        return HTTP_STATUS_BAD_REQUEST;
+                    }
+                    std::uint64_t totalSize = flowdrop::unknownFileSize;
                     try {
-                        json jsonData = json::parse(senderStr);
-                        flowdrop::from_json(jsonData, sender);
-
-                        totalSize = std::stoull(it->second);
+                        if (it != headers.end()) {
+                            totalSize = std::stoull(it->second);
+                        }
                     } catch (std::exception &) {
                         ctx->close();
                         return HTTP_STATUS_BAD_REQUEST;
                     }
-                    std::filesystem::file_status destStatus = status(_destDir);
-                    if (!exists(destStatus)) {
-                        create_directories(_destDir);
-                    } else if (!is_directory(destStatus)) {
-                        Logger::log(Logger::LEVEL_ERROR, "Destination path is not directory");
+                    if (!ensureDestDir()) {
+                        ctx->response->status_code = HTTP_STATUS_INTERNAL_SERVER_ERROR;
                         return HTTP_STATUS_INTERNAL_SERVER_ERROR;
                     }
+                    if (streamArchive) {
+                        session = new ReceiveSession{sender, nullptr, totalSize, nullptr};
+                        session->extractor = std::make_unique<archive::Extractor>(_destDir, sender, _listener, totalSize, _writerPool.get(),
+                                                                                  _progressOptions);
+                        session->extractor->setFlowControl(true);
+                        session->streamReader = std::make_unique<archive::Reader>(*session->extractor);
+                        if (sessionKey.has_value()) {
+                            session->opener = std::make_unique<crypto::Opener>(sessionKey.value());
+                        }
+                        ctx->userdata = session;
+                        if (_listener != nullptr) {
+                            _listener->onReceivingStart(sender, totalSize);
+                        }
+                        continueIfExpected(ctx);
+                        break;
+                    }
                     auto *receivedFiles = new std::vector<const virtual_tfa_file_info *>;
                     virtual_tfa_reader *tfa_reader = virtual_tfa_reader_new();
                     if (!tfa_reader) {
-                        Logger::log(Logger::LEVEL_ERROR, "Failed to initialize virtual_tfa_reader");
+                        LOG_ERROR("Failed to initialize virtual_tfa_reader");
+                        ctx->response->status_code = HTTP_STATUS_INTERNAL_SERVER_ERROR;
                         return HTTP_STATUS_INTERNAL_SERVER_ERROR;
                     }
 
@@ -208,7 +693,7 @@ namespace flowdrop {
 
                     virtual_tfa_reader_set_dest(tfa_reader, destBuffer);
 
-                    auto *cppListener = static_cast<void *>(new ReceiveProgressListener(sender, _listener, totalSize, receivedFiles));
+                    auto *cppListener = static_cast<void *>(new ReceiveProgressListener(sender, _listener, totalSize, receivedFiles, _progressOptions));
                     auto *tfaListener = new virtual_tfa_listener{
                             server_listener::total_progress,
                             cppListener,
@@ -227,31 +712,57 @@ namespace flowdrop {
                             totalSize,
                             receivedFiles
                     };
+                    if (sessionKey.has_value()) {
+                        session->opener = std::make_unique<crypto::Opener>(sessionKey.value());
+                    }
                     ctx->userdata = session;
                     if (_listener != nullptr) {
                         _listener->onReceivingStart(sender, totalSize);
                     }
+                    continueIfExpected(ctx);
                 }
                     break;
                 case HP_BODY: {
                     if (session && data && size) {
-                        if (session->tfa_reader) {
-                            tfa_size_t bytes_read = 0;
-                            int result = virtual_tfa_reader_read(session->tfa_reader, const_cast<char *>(data), size, &bytes_read);
-                            if (result != 0 || bytes_read != size) {
-                                Logger::log(Logger::LEVEL_ERROR, "Reading error, code: " + std::to_string(result));
-                                ctx->close();
-                                return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+                        int bodyStatus = HTTP_STATUS_UNFINISHED;
+                        if (session->opener) {
+                            bool opened = session->opener->feed(data, size, [&](const char *plaintext, std::size_t plaintextSize) {
+                                bodyStatus = receiveBody(ctx, session, plaintext, plaintextSize);
+                                return bodyStatus == HTTP_STATUS_UNFINISHED;
+                            });
+                            if (!opened && bodyStatus == HTTP_STATUS_UNFINISHED) {
+                                LOG_ERROR("sealed body error" << Logger::kv("ip", ctx->ip()));
+                                bodyStatus = HTTP_STATUS_BAD_REQUEST;
                             }
+                        } else {
+                            bodyStatus = receiveBody(ctx, session, data, size);
                         }
+                        if (bodyStatus != HTTP_STATUS_UNFINISHED) {
+                            dropSession(ctx, session);
+                            ctx->close();
+                            return bodyStatus;
+                        }
+                        throttleRead(ctx, session);
                     }
                 }
                     break;
                 case HP_MESSAGE_COMPLETE: {
-                    status_code = HTTP_STATUS_OK;
+                    if (session && session->opener && !session->opener->done()) {
+                        LOG_ERROR("sealed body truncated" << Logger::kv("ip", ctx->ip()));
+                        dropSession(ctx, session);
+                        HttpResponse *resp = ctx->response.get();
+                        resp->Set("code", HTTP_STATUS_BAD_REQUEST);
+                        resp->Set("message", "truncated body");
+                        return HTTP_STATUS_BAD_REQUEST;
+                    }
+                    if (session && session->streamReader) {
+                        return finishStream(ctx, session);
+                    }
                     HttpResponse *resp = ctx->response.get();
-                    resp->Set("code", HTTP_STATUS_OK);
-                    resp->Set("message", http_status_str(HTTP_STATUS_OK));
+                    // without a session the body was refused at the headers, with the status set there
+                    status_code = session ? HTTP_STATUS_OK : resp->status_code;
+                    resp->Set("code", status_code);
+                    resp->Set("message", http_status_str(static_cast<http_status>(status_code)));
                     ctx->send();
                     if (session) {
                         if (_listener != nullptr) {
@@ -275,12 +786,7 @@ namespace flowdrop {
                     break;
                 case HP_ERROR: {
                     if (session) {
-                        if (session->tfa_reader) {
-                            virtual_tfa_reader_free(session->tfa_reader);
-                            session->tfa_reader = nullptr;
-                        }
-                        delete session;
-                        ctx->userdata = nullptr;
+                        dropSession(ctx, session);
                     }
                 }
                     break;
@@ -295,7 +801,7 @@ namespace flowdrop {
             if (port == 0) {
                 throw new std::runtime_error("unable to find free port");
             }
-            Logger::log(Logger::LEVEL_DEBUG, "server port: " + std::to_string(port));
+            LOG_DEBUG("server port: " << port);
 
             std::string slash = "/";
             std::string deviceInfoStr = json(_deviceInfo).dump();
@@ -304,13 +810,28 @@ namespace flowdrop {
 
             HttpService router;
             router.GET((slash + flowdrop_endpoint_device_info).c_str(),
-                       [&deviceInfoStr](HttpRequest *req, HttpResponse *resp) {
+                       [&deviceInfoStr](HttpRequest * /*req*/, HttpResponse *resp) {
                            resp->SetContentType(APPLICATION_JSON);
                            return resp->String(deviceInfoStr);
                        });
             router.POST((slash + flowdrop_endpoint_ask).c_str(),
-                        [this](const HttpRequestPtr &req, const HttpResponseWriterPtr &writer) {
-                            askHandler(req, writer);
+                        [this](const HttpContextPtr &ctx, http_parser_state state, const char *data,
+                                   size_t size) {
+                            return askHandler(ctx, state, data, size);
+                        });
+            router.GET((slash + flowdrop_endpoint_probe).c_str(),
+                       [this](HttpRequest *req, HttpResponse *resp) -> int {
+                           std::size_t bytes = std::min<std::size_t>(std::strtoull(req->GetParam("bytes").c_str(), nullptr, 10),
+                                                                     flowdrop_probe_max_bytes);
+                           if (!_probeBudget.take(req->client_addr.ip, bytes)) {
+                               return HTTP_STATUS_TOO_MANY_REQUESTS;
+                           }
+                           // not copied, the fill outlives every response
+                           return resp->Data((void *) transport::probeFill(), static_cast<int>(bytes));
+                       });
+            router.POST((slash + flowdrop_endpoint_probe).c_str(),
+                        [this](const HttpContextPtr &ctx, http_parser_state state, const char * /*data*/, size_t /*size*/) {
+                            return probeHandler(ctx, state);
                         });
             router.POST((slash + flowdrop_endpoint_send).c_str(),
                         [this](const HttpContextPtr &ctx, http_parser_state state, const char *data,
@@ -318,15 +839,23 @@ namespace flowdrop {
                             return sendHandler(ctx, state, data, size);
                         });
 
-            std::string id = _deviceInfo.id;
+            if (_writerThreads > 0) {
+                _writerPool = std::make_unique<archive::WriterPool>(_writerThreads);
+            }
+#if defined(IPV6_NOT_SUPPORTED)
+            _reliableUdp = std::make_unique<transport::ReliableUdpReceiver>(port, true);
+#else
+            _reliableUdp = std::make_unique<transport::ReliableUdpReceiver>(port, false);
+#endif
+
             _sdStop = new std::atomic<bool>(false);
-            _sdThread = std::thread([&id, &port, this]() {
+            _sdThread = std::thread([&port, this]() {
 #if defined(IPV6_NOT_SUPPORTED)
                 bool useIPv4 = true;
 #else
                 bool useIPv4 = false;
 #endif
-                discovery::announce(id, port, useIPv4, [this](){
+                discovery::announce(_deviceInfo, port, useIPv4, [this](){
                     return _sdStop->load();
                 });
             });
@@ -338,7 +867,6 @@ namespace flowdrop {
 #else
             _server.setHost("::");
 #endif
-            _server.setPort(port);
             _server.setThreadNum(3);
             bool started = false;
             _server.onWorkerStart = [this, &port, &started]() {
@@ -348,14 +876,23 @@ namespace flowdrop {
                     _listener->onReceiverStarted(port);
                 }
             };
-            //int sockfd = Bind(port, "::", SOCK_STREAM);
-            //sockfd = ListenFD(sockfd);
-            //_server.setListenFD(sockfd, 0);
+            if (_transportOptions.has_value()) {
+                int listenFd = transport::tunedListenSocket(port, _server.host, _transportOptions.value());
+                if (listenFd < 0) {
+                    throw std::runtime_error("unable to listen on port " + std::to_string(port));
+                }
+                _server.setListenFD(listenFd); // libhv listens itself only with a port set
+            } else {
+                _server.setPort(port);
+            }
             _server.run(true);
         }
 
         void stop() {
             _server.stop();
+            if (_reliableUdp) {
+                _reliableUdp->stop();
+            }
             *_sdStop = true;
             if (_sdThread.joinable()) {
                 _sdThread.join();
@@ -389,6 +926,14 @@ namespace flowdrop {
         return pImpl->_askCallback;
     }
 
+    void Server::setPairCallback(const pairCallback &pairCallback) {
+        pImpl->_pairCallback = pairCallback;
+    }
+
+    [[maybe_unused]] const pairCallback &Server::getPairCallback() const {
+        return pImpl->_pairCallback;
+    }
+
     void Server::setEventListener(IEventListener *listener) {
         pImpl->_listener = listener;
     }
@@ -397,6 +942,38 @@ namespace flowdrop {
         return pImpl->_listener;
     }
 
+    void Server::setAskLimits(const AskLimits &limits) {
+        pImpl->_askLimits = limits;
+    }
+
+    [[maybe_unused]] const AskLimits &Server::getAskLimits() const {
+        return pImpl->_askLimits;
+    }
+
+    void Server::setWriterThreads(unsigned threads) {
+        pImpl->_writerThreads = threads;
+    }
+
+    [[maybe_unused]] unsigned Server::getWriterThreads() const {
+        return pImpl->_writerThreads;
+    }
+
+    void Server::setTransportOptions(const std::optional<TransportOptions> &options) {
+        pImpl->_transportOptions = options;
+    }
+
+    [[maybe_unused]] const std::optional<TransportOptions> &Server::getTransportOptions() const {
+        return pImpl->_transportOptions;
+    }
+
+    void Server::setProgressOptions(const ProgressOptions &options) {
+        pImpl->_progressOptions = options;
+    }
+
+    [[maybe_unused]] const ProgressOptions &Server::getProgressOptions() const {
+        return pImpl->_progressOptions;
+    }
+
     void Server::run() {
         pImpl->run();
     }
@@ -0,0 +1,127 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+
+#include "socket_tuning.hpp"
+#include "hv/hsocket.h"
+#include "logger.h"
+#include <algorithm>
+
+// CURLOPT_UPLOAD_BUFFERSIZE limits
+static const std::uint64_t minUploadBuffer = 16 * 1024;
+static const std::uint64_t maxUploadBuffer = 2 * 1024 * 1024;
+
+namespace {
+
+    struct Preset {
+        std::chrono::microseconds rtt; // assumed when none is measured
+        std::uint64_t bandwidth; // bytes per second, assumed when none is measured
+        double bufferFactor; // socket buffers in bandwidth-delay products
+        std::uint64_t minBuffer;
+        std::uint64_t maxBuffer;
+        double lowatFactor; // TCP_NOTSENT_LOWAT in bandwidth-delay products, 0 leaves it
+        const char *congestionControl;
+    };
+
+    // LAN bulk: gigabit, sub-millisecond RTT, room for bursts of the receiver's disk.
+    // Wi-Fi: higher and jittery RTT, a short unsent queue so the congestion control sees
+    // the air instead of our buffer. Low memory: a single bandwidth-delay product, capped.
+    const Preset presets[] = {
+            {std::chrono::microseconds(1000), 125000000, 4, 256 * 1024, 16 * 1024 * 1024, 0, "bbr"},
+            {std::chrono::microseconds(5000), 25000000, 2, 128 * 1024, 4 * 1024 * 1024, 0.5, "bbr"},
+            {std::chrono::microseconds(2000), 12500000, 1, 32 * 1024, 256 * 1024, 0, ""},
+    };
+
+    bool setOption(int fd, int level, int name, const void *value, socklen_t size, const char *label) {
+        if (setsockopt(fd, level, name, static_cast<const char *>(value), size) != 0) {
+            LOG_DEBUG("socket option not applied" << Logger::kv("option", label));
+            return false;
+        }
+        return true;
+    }
+
+    bool setInt(int fd, int level, int name, int value, const char *label) {
+        return setOption(fd, level, name, &value, sizeof(value), label);
+    }
+
+    int sockoptCallback(void *clientp, curl_socket_t fd, curlsocktype purpose) {
+        if (purpose == CURLSOCKTYPE_IPCXN) {
+            transport::tuneSocket(static_cast<int>(fd), *static_cast<const flowdrop::TransportOptions *>(clientp));
+        }
+        return CURL_SOCKOPT_OK;
+    }
+
+} // namespace
+
+namespace flowdrop {
+
+    TransportOptions transportOptions(TransportPreset preset, const std::chrono::microseconds &rtt, std::uint64_t bandwidth) {
+        const Preset &p = presets[static_cast<int>(preset)];
+        double seconds = std::chrono::duration<double>(rtt.count() > 0 ? rtt : p.rtt).count();
+        double bdp = seconds * static_cast<double>(bandwidth > 0 ? bandwidth : p.bandwidth);
+        auto buffer = static_cast<std::uint64_t>(bdp * p.bufferFactor);
+        buffer = std::clamp(buffer, p.minBuffer, p.maxBuffer);
+
+        TransportOptions options;
+        options.uploadBufferSize = static_cast<std::size_t>(std::clamp(buffer / 4, minUploadBuffer, maxUploadBuffer));
+        options.sendBufferSize = static_cast<int>(buffer);
+        options.receiveBufferSize = static_cast<int>(buffer);
+        if (p.lowatFactor > 0) {
+            options.notSentLowat = static_cast<int>(std::clamp(static_cast<std::uint64_t>(bdp * p.lowatFactor), minUploadBuffer, buffer));
+        }
+        options.congestionControl = p.congestionControl;
+        return options;
+    }
+
+} // namespace flowdrop
+
+namespace transport {
+
+    void tuneSocket(int fd, const flowdrop::TransportOptions &options) {
+        if (options.sendBufferSize > 0) {
+            setInt(fd, SOL_SOCKET, SO_SNDBUF, options.sendBufferSize, "SO_SNDBUF");
+        }
+        if (options.receiveBufferSize > 0) {
+            setInt(fd, SOL_SOCKET, SO_RCVBUF, options.receiveBufferSize, "SO_RCVBUF");
+        }
+        setInt(fd, IPPROTO_TCP, TCP_NODELAY, options.noDelay ? 1 : 0, "TCP_NODELAY");
+#if defined(TCP_NOTSENT_LOWAT)
+        if (options.notSentLowat > 0) {
+            setInt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, options.notSentLowat, "TCP_NOTSENT_LOWAT");
+        }
+#endif
+#if defined(TCP_CONGESTION)
+        if (!options.congestionControl.empty()) {
+            setOption(fd, IPPROTO_TCP, TCP_CONGESTION, options.congestionControl.c_str(),
+                      static_cast<socklen_t>(options.congestionControl.size()), "TCP_CONGESTION");
+        }
+#endif
+    }
+
+    void tuneCurl(CURL *curl, const flowdrop::TransportOptions &options) {
+        if (options.uploadBufferSize > 0) {
+            long size = static_cast<long>(std::clamp<std::uint64_t>(options.uploadBufferSize, minUploadBuffer, maxUploadBuffer));
+            curl_easy_setopt(curl, CURLOPT_UPLOAD_BUFFERSIZE, size);
+        }
+        curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, options.noDelay ? 1L : 0L);
+        curl_easy_setopt(curl, CURLOPT_SOCKOPTFUNCTION, sockoptCallback);
+        curl_easy_setopt(curl, CURLOPT_SOCKOPTDATA, &options);
+    }
+
+    int tunedListenSocket(unsigned short port, const char *host, const flowdrop::TransportOptions &options) {
+        int fd = Bind(port, host, SOCK_STREAM);
+        if (fd < 0) {
+            return -1;
+        }
+        tuneSocket(fd, options);
+        if (listen(fd, SOMAXCONN) != 0) {
+            closesocket(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+} // namespace transport
@@ -0,0 +1,27 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+#pragma once
+
+#include "flowdrop/flowdrop.hpp"
+#include "curl/curl.h"
+
+namespace transport {
+
+    // Applies the socket settings of options to fd, skipping those the system lacks or refuses.
+    // Buffer sizes only take full effect before the connection is established.
+    void tuneSocket(int fd, const flowdrop::TransportOptions &options);
+
+    // Upload buffer of the request, and the socket settings on every connection it opens. A
+    // connection reused from the connection share keeps the settings it was opened with.
+    // options must outlive the transfer.
+    void tuneCurl(CURL *curl, const flowdrop::TransportOptions &options);
+
+    // Listening socket for the receiver with the settings applied, accepted connections inherit
+    // them; -1 on failure.
+    int tunedListenSocket(unsigned short port, const char *host, const flowdrop::TransportOptions &options);
+
+} // namespace transport
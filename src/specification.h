@@ -11,7 +11,41 @@ static const char *flowdrop_reg_type = "_flowdrop._tcp";
 static const char *flowdrop_dns_domain = "local.";
 static const char *flowdrop_txt_key_version = "v";
 static const char *flowdrop_txt_key_ipfamily = "ipf";
+static const int flowdrop_txt_info_version = 1;
+static const char *flowdrop_txt_key_info_version = "di";
+static const char *flowdrop_txt_key_name = "n";
+static const char *flowdrop_txt_key_model = "md";
+static const char *flowdrop_txt_key_platform = "pl";
+static const char *flowdrop_txt_key_system_version = "sv";
+static const char *flowdrop_txt_key_capabilities = "cap"; // decimal bit set of flowdrop_capability_*
+static const unsigned flowdrop_capability_ask_manifest = 1u << 0; // accepts the binary ask manifest
+static const unsigned flowdrop_capability_stream_archive = 1u << 1; // accepts the stream archive on /send
+static const unsigned flowdrop_capability_checksum = 1u << 2; // verifies stream archive entry checksums
+static const unsigned flowdrop_capability_encryption = 1u << 3; // answers an ask key, takes sealed /send bodies
+static const unsigned flowdrop_capability_reliable_udp = 1u << 4; // offers a KCP port for the stream archive in the ask answer
+static const unsigned flowdrop_capability_probe = 1u << 5; // serves /probe
+static const unsigned flowdrop_capability_pairing = 1u << 6; // pairs in the ask, takes /send of paired senders without one
+static const unsigned flowdrop_capabilities = flowdrop_capability_ask_manifest | flowdrop_capability_stream_archive |
+                                              flowdrop_capability_checksum | flowdrop_capability_encryption |
+                                              flowdrop_capability_reliable_udp | flowdrop_capability_probe |
+                                              flowdrop_capability_pairing;
+static const size_t flowdrop_txt_value_max_length = 63; // keeps the whole record well below 400 bytes (RFC 6763, 6.2)
 static const char *flowdrop_endpoint_device_info = "device_info";
 static const char *flowdrop_endpoint_ask = "ask";
 static const char *flowdrop_endpoint_send = "send";
+static const char *flowdrop_endpoint_probe = "probe"; // GET ?bytes=N answers N bytes, POST discards the body; 429 past the budget of the peer
+static const size_t flowdrop_probe_max_bytes = 8 * 1024 * 1024; // per probe request, either way
 static const char *flowdrop_deviceinfo_header = "x-deviceinfo";
+static const char *flowdrop_total_size_header = "x-totalsize"; // payload bytes of a stream archive, when known
+static const char *flowdrop_session_key_header = "x-sessionkey"; // hex X25519 key of the sender, on /ask
+static const char *flowdrop_session_header = "x-session"; // session id from the ask answer, on a sealed /send
+static const char *flowdrop_transport_header = "x-transport"; // "kcp; window=N" on /ask asks for a reliable UDP send
+static const char *flowdrop_transport_kcp = "kcp";
+static const char *flowdrop_pair_header = "x-pair"; // hex X25519 pairing key of the sender, on /ask
+static const char *flowdrop_trust_header = "x-trust"; // nonce and MAC of the request under the pairing token, on /send instead of an ask; see pairing.hpp
+static const char *flowdrop_receiver_id_header = "x-receiverid"; // id the sender means, on /ask and a trusted /send; echoed when refusing the trust
+static const char *flowdrop_ask_manifest_content_type = "application/x-flowdrop-manifest";
+static const char flowdrop_ask_manifest_magic[4] = {'F', 'D', 'M', '1'};
+static const char *flowdrop_stream_archive_content_type = "application/x-flowdrop-stream";
+static const char flowdrop_stream_archive_magic[4] = {'F', 'D', 'S', '1'};
+static const char flowdrop_reliable_udp_magic[4] = {'F', 'D', 'K', '1'}; // opens the KCP stream, then the payload size as u64le
@@ -0,0 +1,484 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+
+#include "stream_archive.hpp"
+#include "logger.h"
+#include "specification.h"
+#include "varint.hpp"
+#include <algorithm>
+#include <cstring>
+
+static const std::size_t chunkHeaderSize = 4;
+static const std::size_t stagedChunkSize = 256; // used only when the caller's buffer cannot hold a chunk header
+static const std::uint64_t maxNameLength = 64 * 1024;
+static const std::size_t maxHeaderSize = maxNameLength + 128;
+static const std::uint64_t flagSizeKnown = 1u << 0;
+static const std::uint64_t flagChecksum = 1u << 1;
+static const std::uint64_t recordEnd = 0;
+static const std::uint64_t recordEntry = 1;
+static const std::uint64_t defaultMode = 0644;
+
+static void putU32(char *out, std::uint32_t value) {
+    out[0] = static_cast<char>(value & 0xFF);
+    out[1] = static_cast<char>((value >> 8) & 0xFF);
+    out[2] = static_cast<char>((value >> 16) & 0xFF);
+    out[3] = static_cast<char>((value >> 24) & 0xFF);
+}
+
+static std::uint32_t getU32(const char *in) {
+    auto *bytes = reinterpret_cast<const unsigned char *>(in);
+    return static_cast<std::uint32_t>(bytes[0]) | static_cast<std::uint32_t>(bytes[1]) << 8 |
+           static_cast<std::uint32_t>(bytes[2]) << 16 | static_cast<std::uint32_t>(bytes[3]) << 24;
+}
+
+static void putU64(char *out, std::uint64_t value) {
+    putU32(out, static_cast<std::uint32_t>(value));
+    putU32(out + 4, static_cast<std::uint32_t>(value >> 32));
+}
+
+static std::uint64_t getU64(const char *in) {
+    return static_cast<std::uint64_t>(getU32(in)) | static_cast<std::uint64_t>(getU32(in + 4)) << 32;
+}
+
+namespace archive {
+
+    bool validChecksumType(std::uint64_t type) {
+        return type == checksumNone || type == checksumXxh3 || type == checksumXxh3Tree;
+    }
+
+    EntryHasher::EntryHasher(std::uint64_t type) : _type(type) {}
+
+    void EntryHasher::update(const char *data, std::size_t size) {
+        if (_type != checksumXxh3Tree) {
+            if (_type == checksumXxh3) {
+                _hasher.update(data, size);
+            }
+            return;
+        }
+        while (size > 0) {
+            std::size_t n = static_cast<std::size_t>(std::min<std::uint64_t>(size, checksumBlockSize - _blockBytes));
+            _hasher.update(data, n);
+            data += n;
+            size -= n;
+            _blockBytes += n;
+            if (_blockBytes == checksumBlockSize) {
+                char leaf[8];
+                putU64(leaf, _hasher.digest());
+                _leaves.update(leaf, sizeof(leaf));
+                _hasher = xxh3::Hasher();
+                _blockBytes = 0;
+            }
+        }
+    }
+
+    std::uint64_t EntryHasher::digest() const {
+        if (_type == checksumXxh3) {
+            return _hasher.digest();
+        }
+        if (_type != checksumXxh3Tree) {
+            return 0;
+        }
+        if (_blockBytes == 0) {
+            return _leaves.digest();
+        }
+        xxh3::Hasher leaves = _leaves;
+        char leaf[8];
+        putU64(leaf, _hasher.digest());
+        leaves.update(leaf, sizeof(leaf));
+        return leaves.digest();
+    }
+
+    Writer::Writer(std::vector<flowdrop::File *> files, flowdrop::IEventListener *listener, std::uint64_t checksumType,
+                   const flowdrop::ProgressOptions &progress) :
+            _files(std::move(files)), _listener(listener), _progress(progress), _checksumType(checksumType) {
+        for (flowdrop::File *file: _files) {
+            std::uint64_t size = file->getSize();
+            if (size == flowdrop::unknownFileSize || _payloadSize == flowdrop::unknownFileSize) {
+                _payloadSize = flowdrop::unknownFileSize;
+            } else {
+                _payloadSize += size;
+            }
+        }
+        _source = [this]() {
+            return _next < _files.size() ? _files[_next++] : nullptr;
+        };
+    }
+
+    Writer::Writer(flowdrop::fileGenerator source, flowdrop::IEventListener *listener, std::uint64_t checksumType,
+                   const flowdrop::ProgressOptions &progress) :
+            _source(std::move(source)), _listener(listener), _progress(progress), _checksumType(checksumType),
+            _payloadSize(flowdrop::unknownFileSize) {}
+
+    Writer::~Writer() {
+        delete _file;
+        for (std::size_t i = _next; i < _files.size(); ++i) {
+            delete _files[i];
+        }
+    }
+
+    bool Writer::failed() const {
+        return _failed;
+    }
+
+    std::uint64_t Writer::payloadSize() const {
+        return _payloadSize;
+    }
+
+    std::size_t Writer::read(char *buffer, std::size_t count) {
+        std::size_t written = 0;
+        while (written < count && !_failed) {
+            if (_pendingPos < _pending.size()) {
+                std::size_t n = std::min(count - written, _pending.size() - _pendingPos);
+                std::memcpy(buffer + written, _pending.data() + _pendingPos, n);
+                _pendingPos += n;
+                written += n;
+                continue;
+            }
+            _pending.clear();
+            _pendingPos = 0;
+            if (!_started) {
+                _started = true;
+                _pending.append(flowdrop_stream_archive_magic, sizeof(flowdrop_stream_archive_magic));
+                continue;
+            }
+            if (_file == nullptr) {
+                if (_finished) {
+                    break;
+                }
+                if (!nextEntry() && !_failed) {
+                    varint::put(_pending, recordEnd);
+                    _finished = true;
+                }
+                continue;
+            }
+
+            std::size_t room = count - written;
+            bool staged = room <= chunkHeaderSize;
+            if (staged && written > 0) {
+                break;
+            }
+            std::uint64_t want = staged ? stagedChunkSize : std::min(room - chunkHeaderSize, maxChunkSize);
+            if (_fileInfo.size != flowdrop::unknownFileSize) {
+                want = std::min(want, _fileInfo.size - _entryBytes);
+            }
+            char *out = buffer + written;
+            if (staged) {
+                _pending.resize(chunkHeaderSize + static_cast<std::size_t>(want));
+                out = &_pending[0];
+            }
+            std::uint64_t n = want > 0 ? readFile(out + chunkHeaderSize, want) : 0;
+            if (n == 0) {
+                _pending.clear();
+                endEntry();
+                continue;
+            }
+            putU32(out, static_cast<std::uint32_t>(n));
+            _hasher.update(out + chunkHeaderSize, static_cast<std::size_t>(n));
+            if (staged) {
+                _pending.resize(chunkHeaderSize + static_cast<std::size_t>(n));
+            } else {
+                written += chunkHeaderSize + static_cast<std::size_t>(n);
+            }
+            _entryBytes += n;
+            _sentBytes += n;
+            if (_listener != nullptr && _progress.due(_sentBytes)) {
+                _listener->onSendingFileProgress(_fileInfo, _entryBytes);
+                _listener->onSendingTotalProgress(_payloadSize, _sentBytes);
+            }
+        }
+        return _failed ? 0 : written;
+    }
+
+    bool Writer::nextEntry() {
+        try {
+            _file = _source();
+        } catch (const std::exception &e) {
+            LOG_ERROR("unable to get the next file: " << e.what());
+            _failed = true;
+            return false;
+        }
+        if (_file == nullptr) {
+            return false;
+        }
+        _positional = dynamic_cast<flowdrop::PositionalFile *>(_file);
+        _fileInfo = {_file->getRelativePath(), _file->getSize()};
+        _entryBytes = 0;
+        _hasher = EntryHasher(_checksumType);
+
+        bool sizeKnown = _fileInfo.size != flowdrop::unknownFileSize;
+        std::uint64_t flags = (sizeKnown ? flagSizeKnown : 0) | (_checksumType != checksumNone ? flagChecksum : 0);
+        varint::put(_pending, recordEntry);
+        varint::put(_pending, _fileInfo.name.size());
+        _pending += _fileInfo.name;
+        varint::put(_pending, flags);
+        if (sizeKnown) {
+            varint::put(_pending, _fileInfo.size);
+        }
+        std::filesystem::perms permissions = _file->getPermissions();
+        varint::put(_pending, permissions == std::filesystem::perms::unknown ? defaultMode : static_cast<std::uint64_t>(permissions) & 0777);
+        varint::put(_pending, _file->getCreatedTime());
+        varint::put(_pending, _file->getModifiedTime());
+        if (_checksumType != checksumNone) {
+            varint::put(_pending, _checksumType);
+        }
+
+        if (_listener != nullptr) {
+            _listener->onSendingFileStart(_fileInfo);
+        }
+        return true;
+    }
+
+    void Writer::endEntry() {
+        if (_fileInfo.size != flowdrop::unknownFileSize && _entryBytes != _fileInfo.size) {
+            LOG_ERROR("file shorter than its size" << Logger::kv("name", _fileInfo.name) << Logger::kv("size", _fileInfo.size)
+                                                   << Logger::kv("read", _entryBytes));
+            _failed = true;
+            return;
+        }
+        char end[chunkHeaderSize];
+        putU32(end, 0);
+        _pending.append(end, chunkHeaderSize);
+        varint::put(_pending, _entryBytes);
+        varint::put(_pending, _checksumType);
+        if (_checksumType != checksumNone) {
+            char checksum[8];
+            putU64(checksum, _hasher.digest());
+            _pending.append(checksum, sizeof(checksum));
+        }
+
+        _fileInfo.size = _entryBytes;
+        if (_listener != nullptr) {
+            if (_progress.flush()) {
+                _listener->onSendingFileProgress(_fileInfo, _entryBytes);
+                _listener->onSendingTotalProgress(_payloadSize, _sentBytes);
+            }
+            _listener->onSendingFileEnd(_fileInfo);
+        }
+        delete _file;
+        _file = nullptr;
+        _positional = nullptr;
+    }
+
+    std::uint64_t Writer::readFile(char *buffer, std::uint64_t count) {
+        if (_positional != nullptr) {
+            return _positional->readAt(_entryBytes, buffer, count);
+        }
+        return _file->read(buffer, count);
+    }
+
+    Reader::Reader(EntryHandler &handler) : _handler(handler) {}
+
+    bool Reader::done() const {
+        return _state == DONE;
+    }
+
+    const std::string &Reader::error() const {
+        return _error;
+    }
+
+    bool Reader::fail(const std::string &error) {
+        _state = FAILED;
+        _error = error;
+        return false;
+    }
+
+    bool Reader::feed(const char *data, std::size_t size) {
+        std::size_t pos = 0;
+        while (pos < size) {
+            switch (_state) {
+                case MAGIC: {
+                    std::size_t n = std::min(size - pos, sizeof(flowdrop_stream_archive_magic) - _buffer.size());
+                    _buffer.append(data + pos, n);
+                    pos += n;
+                    if (_buffer.size() == sizeof(flowdrop_stream_archive_magic)) {
+                        if (std::memcmp(_buffer.data(), flowdrop_stream_archive_magic, sizeof(flowdrop_stream_archive_magic)) != 0) {
+                            return fail("bad magic");
+                        }
+                        _buffer.clear();
+                        _state = HEADER;
+                    }
+                    break;
+                }
+                case HEADER:
+                case TRAILER: {
+                    // grow geometrically, so small records do not copy the rest of the input
+                    std::size_t n = std::min({size - pos, maxHeaderSize - _buffer.size(), std::max<std::size_t>(256, _buffer.size())});
+                    if (n == 0) {
+                        return fail("header too long");
+                    }
+                    _buffer.append(data + pos, n);
+                    pos += n;
+                    std::size_t before = _buffer.size();
+                    if (!(_state == HEADER ? parseHeader() : parseTrailer())) {
+                        return false;
+                    }
+                    if (_buffer.size() != before) {
+                        // parsed: whatever followed the record is fed again in the next state
+                        pos -= _buffer.size();
+                        _buffer.clear();
+                    }
+                    break;
+                }
+                case CHUNK_LENGTH: {
+                    std::size_t n = std::min(size - pos, chunkHeaderSize - _buffer.size());
+                    _buffer.append(data + pos, n);
+                    pos += n;
+                    if (_buffer.size() < chunkHeaderSize) {
+                        break;
+                    }
+                    std::uint32_t length = getU32(_buffer.data());
+                    _buffer.clear();
+                    if (length == 0) {
+                        _state = TRAILER;
+                    } else if (length > maxChunkSize) {
+                        return fail("chunk too large");
+                    } else if (_header.size.has_value() && length > _header.size.value() - _entryBytes) {
+                        return fail("file data exceeds its size");
+                    } else {
+                        _chunkRemaining = length;
+                        _state = CHUNK_DATA;
+                    }
+                    break;
+                }
+                case CHUNK_DATA: {
+                    std::size_t n = static_cast<std::size_t>(std::min<std::uint64_t>(size - pos, _chunkRemaining));
+                    if (!_handler.data(data + pos, n)) {
+                        return fail("rejected");
+                    }
+                    pos += n;
+                    _entryBytes += n;
+                    _chunkRemaining -= n;
+                    if (_chunkRemaining == 0) {
+                        _state = CHUNK_LENGTH;
+                    }
+                    break;
+                }
+                case DONE:
+                    return fail("trailing data");
+                case FAILED:
+                    return false;
+            }
+        }
+        return _state != FAILED;
+    }
+
+    // On success the parsed bytes are erased from _buffer, leaving what follows the record.
+    // An incomplete record leaves _buffer untouched.
+    bool Reader::parseHeader() {
+        const char *data = _buffer.data();
+        std::size_t length = _buffer.size();
+        std::size_t pos = 0;
+        std::uint64_t values[7];
+
+        std::uint64_t record;
+        varint::Result result = varint::get(data, length, pos, record);
+        if (result != varint::VARINT_OK) {
+            return result == varint::VARINT_INCOMPLETE || fail("bad varint");
+        }
+        if (record == recordEnd) {
+            _buffer.erase(0, pos);
+            _state = DONE;
+            return true;
+        }
+        if (record != recordEntry) {
+            return fail("unknown record");
+        }
+        std::uint64_t nameLength;
+        if ((result = varint::get(data, length, pos, nameLength)) != varint::VARINT_OK) {
+            return result == varint::VARINT_INCOMPLETE || fail("bad varint");
+        }
+        if (nameLength == 0 || nameLength > maxNameLength) {
+            return fail("bad name length");
+        }
+        if (length - pos < nameLength) {
+            return true;
+        }
+        std::size_t namePos = pos;
+        pos += static_cast<std::size_t>(nameLength);
+
+        // flags, [size], mode, ctime, mtime, [checksum type]
+        std::size_t fields = 4;
+        for (std::size_t i = 0; i < fields; ++i) {
+            if ((result = varint::get(data, length, pos, values[i])) != varint::VARINT_OK) {
+                return result == varint::VARINT_INCOMPLETE || fail("bad varint");
+            }
+            if (i == 0) {
+                if ((values[0] & ~(flagSizeKnown | flagChecksum)) != 0) {
+                    return fail("unknown flags");
+                }
+                if ((values[0] & flagSizeKnown) != 0) {
+                    ++fields;
+                }
+                if ((values[0] & flagChecksum) != 0) {
+                    ++fields;
+                }
+            }
+        }
+
+        std::size_t field = 1;
+        _header = {};
+        _header.name.assign(data + namePos, static_cast<std::size_t>(nameLength));
+        if (_header.name.find('\0') != std::string::npos) {
+            return fail("bad name");
+        }
+        if ((values[0] & flagSizeKnown) != 0) {
+            _header.size = values[field++];
+        }
+        _header.mode = static_cast<std::uint32_t>(values[field++] & 0777);
+        _header.ctime = values[field++];
+        _header.mtime = values[field++];
+        if ((values[0] & flagChecksum) != 0) {
+            _header.checksumType = values[field];
+            if (_header.checksumType == checksumNone || !validChecksumType(_header.checksumType)) {
+                return fail("unknown checksum type");
+            }
+        }
+        _buffer.erase(0, pos);
+        _entryBytes = 0;
+        if (!_handler.begin(_header)) {
+            return fail("rejected");
+        }
+        _state = CHUNK_LENGTH;
+        return true;
+    }
+
+    bool Reader::parseTrailer() {
+        const char *data = _buffer.data();
+        std::size_t length = _buffer.size();
+        std::size_t pos = 0;
+        EntryTrailer trailer;
+        std::uint64_t checksumType;
+
+        varint::Result result = varint::get(data, length, pos, trailer.size);
+        if (result == varint::VARINT_OK) {
+            result = varint::get(data, length, pos, checksumType);
+        }
+        if (result != varint::VARINT_OK) {
+            return result == varint::VARINT_INCOMPLETE || fail("bad varint");
+        }
+        if (trailer.size != _entryBytes || (_header.size.has_value() && _header.size.value() != _entryBytes)) {
+            return fail("size mismatch: " + _header.name);
+        }
+        if (checksumType != _header.checksumType) {
+            return fail("checksum type mismatch: " + _header.name);
+        }
+        if (checksumType != checksumNone) {
+            if (length - pos < 8) {
+                return true;
+            }
+            trailer.checksum = getU64(data + pos);
+            pos += 8;
+        }
+        _buffer.erase(0, pos);
+        if (!_handler.end(_header, trailer)) {
+            return fail("rejected");
+        }
+        _state = HEADER;
+        return true;
+    }
+
+} // namespace archive
@@ -0,0 +1,159 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+#pragma once
+
+#include "flowdrop/flowdrop.hpp"
+#include "xxh3.hpp"
+#include "progress_throttle.hpp"
+#include <cstdint>
+#include <optional>
+#include <string>
+
+// Stream archive, sent to /send as flowdrop_stream_archive_content_type. Unlike TFA it needs
+// no sizes up front, so it is sent with chunked transfer encoding:
+//   magic "FDS1"
+//   per file:
+//     varint 1, varint name length, name, varint flags (1 = size known, 2 = checksum),
+//     [varint size], varint mode, varint ctime, varint mtime, [varint checksum type]
+//     data chunks: u32le length, bytes; a zero length ends the data
+//     trailer: varint size, varint checksum type (0 = none, else as in the header), [u64le checksum]
+//   varint 0
+// Varints are unsigned LEB128 (see varint.hpp). Checksums cover the file data:
+//   1: XXH3-64 of the whole file
+//   2: XXH3-64 over the little-endian XXH3-64 leaves of its 1 MiB blocks
+// The checksum flag is only set for receivers announcing flowdrop_capability_checksum.
+namespace archive {
+
+    static const std::size_t maxChunkSize = 1024 * 1024;
+
+    static const std::uint64_t checksumNone = 0;
+    static const std::uint64_t checksumXxh3 = 1;
+    static const std::uint64_t checksumXxh3Tree = 2;
+    static const std::uint64_t checksumBlockSize = 1024 * 1024; // leaf size of checksumXxh3Tree
+
+    struct EntryHeader {
+        std::string name;
+        std::uint32_t mode = 0;
+        std::uint64_t ctime = 0;
+        std::uint64_t mtime = 0;
+        std::optional<std::uint64_t> size; // empty for sources of unknown length
+        std::uint64_t checksumType = checksumNone;
+    };
+
+    struct EntryTrailer {
+        std::uint64_t size = 0;
+        std::uint64_t checksum = 0; // meaningful only if the header has a checksum type
+    };
+
+    // Checksum of one entry's data, fed in file order in pieces of any size.
+    class EntryHasher {
+    public:
+        explicit EntryHasher(std::uint64_t type = checksumNone);
+
+        void update(const char *data, std::size_t size);
+        [[nodiscard]] std::uint64_t digest() const;
+
+    private:
+        std::uint64_t _type;
+        xxh3::Hasher _hasher; // whole file, or the current block
+        xxh3::Hasher _leaves;
+        std::uint64_t _blockBytes = 0;
+    };
+
+    bool validChecksumType(std::uint64_t type);
+
+    // Produces the archive piece by piece for a curl read function. File data is read straight
+    // into the caller's buffer behind the chunk length. Files are deleted once written, like
+    // the TFA input streams do. With a generator the next file is only pulled when the
+    // previous one is done, so enumeration and sending overlap.
+    class Writer {
+    public:
+        // checksumType applies to every entry, checksumNone for receivers without the capability
+        Writer(std::vector<flowdrop::File *> files, flowdrop::IEventListener *listener, std::uint64_t checksumType = checksumNone,
+               const flowdrop::ProgressOptions &progress = {});
+        Writer(flowdrop::fileGenerator source, flowdrop::IEventListener *listener, std::uint64_t checksumType = checksumNone,
+               const flowdrop::ProgressOptions &progress = {});
+        ~Writer();
+
+        Writer(const Writer &) = delete;
+        Writer &operator=(const Writer &) = delete;
+
+        std::size_t read(char *buffer, std::size_t count); // 0 at the end or on failure
+        [[nodiscard]] bool failed() const;
+
+        // sum of the file sizes, unknownFileSize if any of them is unknown or they come from a generator
+        [[nodiscard]] std::uint64_t payloadSize() const;
+
+    private:
+        bool nextEntry();
+        void endEntry();
+        std::uint64_t readFile(char *buffer, std::uint64_t count);
+
+        std::vector<flowdrop::File *> _files;
+        flowdrop::fileGenerator _source;
+        flowdrop::IEventListener *_listener;
+        ProgressThrottle _progress; // over the sent bytes, file and total progress go together
+        std::uint64_t _checksumType;
+        EntryHasher _hasher;
+        std::size_t _next = 0;
+        flowdrop::File *_file = nullptr;
+        flowdrop::PositionalFile *_positional = nullptr;
+        flowdrop::FileInfo _fileInfo;
+        std::uint64_t _entryBytes = 0;
+        std::uint64_t _payloadSize = 0;
+        std::uint64_t _sentBytes = 0;
+        std::string _pending;
+        std::size_t _pendingPos = 0;
+        bool _started = false;
+        bool _finished = false;
+        bool _failed = false;
+    };
+
+    class EntryHandler {
+    public:
+        virtual ~EntryHandler() = default;
+
+        // returning false aborts reading
+        virtual bool begin(const EntryHeader &header) = 0;
+        virtual bool data(const char *data, std::size_t size) = 0;
+        virtual bool end(const EntryHeader &header, const EntryTrailer &trailer) = 0;
+    };
+
+    // Push parser, file data is passed through to the handler without buffering.
+    class Reader {
+    public:
+        explicit Reader(EntryHandler &handler);
+
+        bool feed(const char *data, std::size_t size); // false once the input is invalid or aborted
+        [[nodiscard]] bool done() const;
+        [[nodiscard]] const std::string &error() const;
+
+    private:
+        enum State {
+            MAGIC,
+            HEADER,
+            CHUNK_LENGTH,
+            CHUNK_DATA,
+            TRAILER,
+            DONE,
+            FAILED
+        };
+
+        bool fail(const std::string &error);
+        bool parseHeader();
+        bool parseTrailer();
+
+        EntryHandler &_handler;
+        State _state = MAGIC;
+        std::string _error;
+        std::string _buffer;
+        EntryHeader _header;
+        std::uint64_t _chunkRemaining = 0;
+        std::uint64_t _entryBytes = 0;
+    };
+
+} // namespace archive
@@ -0,0 +1,58 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Unsigned LEB128, shared by the ask manifest and the stream archive.
+namespace varint {
+
+    inline void put(std::string &out, std::uint64_t value) {
+        while (value >= 0x80) {
+            out.push_back(static_cast<char>((value & 0x7F) | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+
+    inline std::uint64_t size(std::uint64_t value) {
+        std::uint64_t size = 1;
+        while (value >= 0x80) {
+            value >>= 7;
+            ++size;
+        }
+        return size;
+    }
+
+    enum Result {
+        VARINT_OK,
+        VARINT_INCOMPLETE,
+        VARINT_TOO_LONG
+    };
+
+    // reads a varint from data[pos, length), advances pos only on VARINT_OK
+    inline Result get(const char *data, std::size_t length, std::size_t &pos, std::uint64_t &value) {
+        std::uint64_t result = 0;
+        unsigned shift = 0;
+        for (std::size_t i = pos; i < length; ++i) {
+            auto byte = static_cast<unsigned char>(data[i]);
+            if (shift >= 64 || (shift == 63 && (byte & 0x7E) != 0)) {
+                return VARINT_TOO_LONG;
+            }
+            result |= static_cast<std::uint64_t>(byte & 0x7F) << shift;
+            shift += 7;
+            if ((byte & 0x80) == 0) {
+                pos = i + 1;
+                value = result;
+                return VARINT_OK;
+            }
+        }
+        return VARINT_INCOMPLETE;
+    }
+
+} // namespace varint
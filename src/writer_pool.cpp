@@ -0,0 +1,61 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+
+#include "writer_pool.hpp"
+#include <algorithm>
+
+namespace archive {
+
+    WriterPool::WriterPool(std::size_t threads) {
+        for (std::size_t i = 0; i < std::max<std::size_t>(threads, 1); ++i) {
+            auto worker = std::make_unique<Worker>();
+            worker->thread = std::thread(&WriterPool::run, std::ref(*worker));
+            _workers.push_back(std::move(worker));
+        }
+    }
+
+    WriterPool::~WriterPool() {
+        for (auto &worker: _workers) {
+            {
+                std::lock_guard<std::mutex> lock(worker->mutex);
+                worker->stopped = true;
+            }
+            worker->wakeup.notify_one();
+        }
+        for (auto &worker: _workers) {
+            worker->thread.join();
+        }
+    }
+
+    void WriterPool::submit(std::size_t key, std::function<void()> task) {
+        Worker &worker = *_workers[key % _workers.size()];
+        {
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            worker.tasks.push_back(std::move(task));
+        }
+        worker.wakeup.notify_one();
+    }
+
+    void WriterPool::run(Worker &worker) {
+        for (;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(worker.mutex);
+                worker.wakeup.wait(lock, [&worker] {
+                    return !worker.tasks.empty() || worker.stopped;
+                });
+                if (worker.tasks.empty()) {
+                    return;
+                }
+                task = std::move(worker.tasks.front());
+                worker.tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+} // namespace archive
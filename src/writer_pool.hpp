@@ -0,0 +1,45 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace archive {
+
+    // Fixed set of threads with one task queue each. Tasks submitted with the same key run on
+    // the same thread in submission order, so the writes of one file never race each other.
+    class WriterPool {
+    public:
+        explicit WriterPool(std::size_t threads);
+        ~WriterPool(); // runs what is already queued, then joins
+
+        WriterPool(const WriterPool &) = delete;
+        WriterPool &operator=(const WriterPool &) = delete;
+
+        void submit(std::size_t key, std::function<void()> task);
+
+    private:
+        struct Worker {
+            std::mutex mutex;
+            std::condition_variable wakeup;
+            std::deque<std::function<void()>> tasks;
+            bool stopped = false;
+            std::thread thread;
+        };
+
+        static void run(Worker &worker);
+
+        std::vector<std::unique_ptr<Worker>> _workers;
+    };
+
+} // namespace archive
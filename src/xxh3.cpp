@@ -0,0 +1,364 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+
+#include "xxh3.hpp"
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define XXH3_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
+
+typedef std::uint64_t u64;
+typedef std::uint32_t u32;
+typedef unsigned char u8;
+
+static const u32 prime32_1 = 0x9E3779B1U;
+static const u32 prime32_2 = 0x85EBCA77U;
+static const u32 prime32_3 = 0xC2B2AE3DU;
+static const u64 prime64_1 = 0x9E3779B185EBCA87ULL;
+static const u64 prime64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const u64 prime64_3 = 0x165667B19E3779F9ULL;
+static const u64 prime64_4 = 0x85EBCA77C2B2AE63ULL;
+static const u64 prime64_5 = 0x27D4EB2F165667C5ULL;
+static const u64 primeMx1 = 0x165667919E3779F9ULL;
+static const u64 primeMx2 = 0x9FB21C651E98DF25ULL;
+
+static const std::size_t stripeLength = 64;
+static const std::size_t secretConsumeRate = 8;
+static const std::size_t midsizeMax = 240;
+static const std::size_t secretSizeMin = 136;
+static const std::size_t secretLastAccStart = 7;
+static const std::size_t secretMergeAccsStart = 11;
+static const std::size_t midsizeStartOffset = 3;
+static const std::size_t midsizeLastOffset = 17;
+
+alignas(64) static const u8 defaultSecret[192] = {
+        0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+        0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+        0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+        0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+        0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+        0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+        0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+        0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+        0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+        0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+        0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+        0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+static const std::size_t secretLimit = sizeof(defaultSecret) - stripeLength;
+static const std::size_t stripesPerBlock = (sizeof(defaultSecret) - stripeLength) / secretConsumeRate;
+
+static u32 readLE32(const u8 *p) {
+    return static_cast<u32>(p[0]) | static_cast<u32>(p[1]) << 8 | static_cast<u32>(p[2]) << 16 | static_cast<u32>(p[3]) << 24;
+}
+
+static u64 readLE64(const u8 *p) {
+    return static_cast<u64>(readLE32(p)) | static_cast<u64>(readLE32(p + 4)) << 32;
+}
+
+static u64 rotl64(u64 value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static u32 swap32(u32 value) {
+    return ((value << 24) & 0xff000000) | ((value << 8) & 0x00ff0000) | ((value >> 8) & 0x0000ff00) | ((value >> 24) & 0x000000ff);
+}
+
+static u64 swap64(u64 value) {
+    return static_cast<u64>(swap32(static_cast<u32>(value))) << 32 | swap32(static_cast<u32>(value >> 32));
+}
+
+static u64 mul128Fold64(u64 lhs, u64 rhs) {
+#if defined(__SIZEOF_INT128__)
+    __uint128_t product = static_cast<__uint128_t>(lhs) * rhs;
+    return static_cast<u64>(product) ^ static_cast<u64>(product >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    u64 high;
+    u64 low = _umul128(lhs, rhs, &high);
+    return low ^ high;
+#else
+    u64 loLo = (lhs & 0xFFFFFFFF) * (rhs & 0xFFFFFFFF);
+    u64 hiLo = (lhs >> 32) * (rhs & 0xFFFFFFFF);
+    u64 loHi = (lhs & 0xFFFFFFFF) * (rhs >> 32);
+    u64 hiHi = (lhs >> 32) * (rhs >> 32);
+    u64 cross = (loLo >> 32) + (hiLo & 0xFFFFFFFF) + loHi;
+    u64 upper = (hiLo >> 32) + (cross >> 32) + hiHi;
+    u64 lower = (cross << 32) | (loLo & 0xFFFFFFFF);
+    return lower ^ upper;
+#endif
+}
+
+static u64 xxh64Avalanche(u64 h) {
+    h ^= h >> 33;
+    h *= prime64_2;
+    h ^= h >> 29;
+    h *= prime64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+static u64 avalanche(u64 h) {
+    h ^= h >> 37;
+    h *= primeMx1;
+    h ^= h >> 32;
+    return h;
+}
+
+static u64 rrmxmx(u64 h, u64 length) {
+    h ^= rotl64(h, 49) ^ rotl64(h, 24);
+    h *= primeMx2;
+    h ^= (h >> 35) + length;
+    h *= primeMx2;
+    return h ^ (h >> 28);
+}
+
+static u64 hashLength0To16(const u8 *input, std::size_t length, const u8 *secret) {
+    if (length > 8) {
+        u64 bitflip1 = readLE64(secret + 24) ^ readLE64(secret + 32);
+        u64 bitflip2 = readLE64(secret + 40) ^ readLE64(secret + 48);
+        u64 inputLo = readLE64(input) ^ bitflip1;
+        u64 inputHi = readLE64(input + length - 8) ^ bitflip2;
+        return avalanche(length + swap64(inputLo) + inputHi + mul128Fold64(inputLo, inputHi));
+    }
+    if (length >= 4) {
+        u32 input1 = readLE32(input);
+        u32 input2 = readLE32(input + length - 4);
+        u64 bitflip = readLE64(secret + 8) ^ readLE64(secret + 16);
+        u64 input64 = input2 + (static_cast<u64>(input1) << 32);
+        return rrmxmx(input64 ^ bitflip, length);
+    }
+    if (length > 0) {
+        u32 combined = static_cast<u32>(input[0]) << 16 | static_cast<u32>(input[length >> 1]) << 24 |
+                       static_cast<u32>(input[length - 1]) | static_cast<u32>(length) << 8;
+        u64 bitflip = readLE32(secret) ^ readLE32(secret + 4);
+        return xxh64Avalanche(combined ^ bitflip);
+    }
+    return xxh64Avalanche(readLE64(secret + 56) ^ readLE64(secret + 64));
+}
+
+static u64 mix16(const u8 *input, const u8 *secret) {
+    return mul128Fold64(readLE64(input) ^ readLE64(secret), readLE64(input + 8) ^ readLE64(secret + 8));
+}
+
+static u64 hashLength17To128(const u8 *input, std::size_t length, const u8 *secret) {
+    u64 acc = length * prime64_1;
+    if (length > 32) {
+        if (length > 64) {
+            if (length > 96) {
+                acc += mix16(input + 48, secret + 96);
+                acc += mix16(input + length - 64, secret + 112);
+            }
+            acc += mix16(input + 32, secret + 64);
+            acc += mix16(input + length - 48, secret + 80);
+        }
+        acc += mix16(input + 16, secret + 32);
+        acc += mix16(input + length - 32, secret + 48);
+    }
+    acc += mix16(input, secret);
+    acc += mix16(input + length - 16, secret + 16);
+    return avalanche(acc);
+}
+
+static u64 hashLength129To240(const u8 *input, std::size_t length, const u8 *secret) {
+    u64 acc = length * prime64_1;
+    std::size_t rounds = length / 16;
+    for (std::size_t i = 0; i < 8; ++i) {
+        acc += mix16(input + 16 * i, secret + 16 * i);
+    }
+    u64 accEnd = mix16(input + length - 16, secret + secretSizeMin - midsizeLastOffset);
+    acc = avalanche(acc);
+    for (std::size_t i = 8; i < rounds; ++i) {
+        accEnd += mix16(input + 16 * i, secret + 16 * (i - 8) + midsizeStartOffset);
+    }
+    return avalanche(acc + accEnd);
+}
+
+// One 64-byte stripe into the eight accumulators.
+static void accumulate512(u64 *acc, const u8 *input, const u8 *secret) {
+#if defined(XXH3_SSE2)
+    auto *xacc = reinterpret_cast<__m128i *>(acc);
+    for (std::size_t i = 0; i < 4; ++i) {
+        __m128i dataVec = _mm_loadu_si128(reinterpret_cast<const __m128i *>(input) + i);
+        __m128i keyVec = _mm_loadu_si128(reinterpret_cast<const __m128i *>(secret) + i);
+        __m128i dataKey = _mm_xor_si128(dataVec, keyVec);
+        __m128i dataKeyHi = _mm_shuffle_epi32(dataKey, _MM_SHUFFLE(0, 3, 0, 1));
+        __m128i product = _mm_mul_epu32(dataKey, dataKeyHi);
+        __m128i dataSwap = _mm_shuffle_epi32(dataVec, _MM_SHUFFLE(1, 0, 3, 2));
+        xacc[i] = _mm_add_epi64(product, _mm_add_epi64(xacc[i], dataSwap));
+    }
+#else
+    for (std::size_t lane = 0; lane < 8; ++lane) {
+        u64 dataValue = readLE64(input + lane * 8);
+        u64 dataKey = dataValue ^ readLE64(secret + lane * 8);
+        acc[lane ^ 1] += dataValue;
+        acc[lane] += (dataKey & 0xFFFFFFFF) * (dataKey >> 32);
+    }
+#endif
+}
+
+static void scramble(u64 *acc, const u8 *secret) {
+#if defined(XXH3_SSE2)
+    auto *xacc = reinterpret_cast<__m128i *>(acc);
+    const __m128i prime32 = _mm_set1_epi32(static_cast<int>(prime32_1));
+    for (std::size_t i = 0; i < 4; ++i) {
+        __m128i accVec = xacc[i];
+        __m128i dataVec = _mm_xor_si128(accVec, _mm_srli_epi64(accVec, 47));
+        __m128i keyVec = _mm_loadu_si128(reinterpret_cast<const __m128i *>(secret) + i);
+        __m128i dataKey = _mm_xor_si128(dataVec, keyVec);
+        __m128i dataKeyHi = _mm_shuffle_epi32(dataKey, _MM_SHUFFLE(0, 3, 0, 1));
+        __m128i productLo = _mm_mul_epu32(dataKey, prime32);
+        __m128i productHi = _mm_mul_epu32(dataKeyHi, prime32);
+        xacc[i] = _mm_add_epi64(productLo, _mm_slli_epi64(productHi, 32));
+    }
+#else
+    for (std::size_t lane = 0; lane < 8; ++lane) {
+        u64 value = acc[lane];
+        value ^= value >> 47;
+        value ^= readLE64(secret + lane * 8);
+        acc[lane] = value * prime32_1;
+    }
+#endif
+}
+
+static void accumulate(u64 *acc, const u8 *input, const u8 *secret, std::size_t stripes) {
+    for (std::size_t n = 0; n < stripes; ++n) {
+        accumulate512(acc, input + n * stripeLength, secret + n * secretConsumeRate);
+    }
+}
+
+static void initAcc(u64 *acc) {
+    acc[0] = prime32_3;
+    acc[1] = prime64_1;
+    acc[2] = prime64_2;
+    acc[3] = prime64_3;
+    acc[4] = prime64_4;
+    acc[5] = prime32_2;
+    acc[6] = prime64_5;
+    acc[7] = prime32_1;
+}
+
+static u64 mergeAccs(const u64 *acc, const u8 *secret, u64 start) {
+    u64 result = start;
+    for (std::size_t i = 0; i < 4; ++i) {
+        result += mul128Fold64(acc[2 * i] ^ readLE64(secret + 16 * i), acc[2 * i + 1] ^ readLE64(secret + 16 * i + 8));
+    }
+    return avalanche(result);
+}
+
+static u64 hashLong(const u8 *input, std::size_t length) {
+    alignas(16) u64 acc[8];
+    initAcc(acc);
+    std::size_t blockLength = stripeLength * stripesPerBlock;
+    std::size_t blocks = (length - 1) / blockLength;
+    for (std::size_t n = 0; n < blocks; ++n) {
+        accumulate(acc, input + n * blockLength, defaultSecret, stripesPerBlock);
+        scramble(acc, defaultSecret + secretLimit);
+    }
+    std::size_t stripes = ((length - 1) - blockLength * blocks) / stripeLength;
+    accumulate(acc, input + blocks * blockLength, defaultSecret, stripes);
+    accumulate512(acc, input + length - stripeLength, defaultSecret + secretLimit - secretLastAccStart);
+    return mergeAccs(acc, defaultSecret + secretMergeAccsStart, static_cast<u64>(length) * prime64_1);
+}
+
+// Accumulates whole stripes continuing a block that already has stripesSoFar of them.
+static const u8 *consumeStripes(u64 *acc, std::size_t &stripesSoFar, const u8 *input, std::size_t stripes) {
+    const u8 *secret = defaultSecret + stripesSoFar * secretConsumeRate;
+    if (stripes >= stripesPerBlock - stripesSoFar) {
+        std::size_t stripesThisBlock = stripesPerBlock - stripesSoFar;
+        do {
+            accumulate(acc, input, secret, stripesThisBlock);
+            scramble(acc, defaultSecret + secretLimit);
+            input += stripesThisBlock * stripeLength;
+            stripes -= stripesThisBlock;
+            stripesThisBlock = stripesPerBlock;
+            secret = defaultSecret;
+        } while (stripes >= stripesPerBlock);
+        stripesSoFar = 0;
+    }
+    if (stripes > 0) {
+        accumulate(acc, input, secret, stripes);
+        input += stripes * stripeLength;
+        stripesSoFar += stripes;
+    }
+    return input;
+}
+
+namespace xxh3 {
+
+    std::uint64_t hash64(const void *data, std::size_t size) {
+        auto *input = static_cast<const u8 *>(data);
+        if (size <= 16) {
+            return hashLength0To16(input, size, defaultSecret);
+        }
+        if (size <= 128) {
+            return hashLength17To128(input, size, defaultSecret);
+        }
+        if (size <= midsizeMax) {
+            return hashLength129To240(input, size, defaultSecret);
+        }
+        return hashLong(input, size);
+    }
+
+    Hasher::Hasher() {
+        initAcc(_acc);
+    }
+
+    void Hasher::update(const void *data, std::size_t size) {
+        auto *input = static_cast<const u8 *>(data);
+        const u8 *end = input + size;
+        _totalLength += size;
+        if (size <= bufferSize - _bufferedSize) {
+            std::memcpy(_buffer + _bufferedSize, input, size);
+            _bufferedSize += size;
+            return;
+        }
+        // the last stripe is always kept buffered, digest() needs it
+        if (_bufferedSize > 0) {
+            std::size_t load = bufferSize - _bufferedSize;
+            std::memcpy(_buffer + _bufferedSize, input, load);
+            input += load;
+            consumeStripes(_acc, _stripesSoFar, _buffer, bufferSize / stripeLength);
+            _bufferedSize = 0;
+        }
+        if (static_cast<std::size_t>(end - input) > bufferSize) {
+            std::size_t stripes = static_cast<std::size_t>(end - 1 - input) / stripeLength;
+            input = consumeStripes(_acc, _stripesSoFar, input, stripes);
+            std::memcpy(_buffer + bufferSize - stripeLength, input - stripeLength, stripeLength);
+        }
+        std::memcpy(_buffer, input, static_cast<std::size_t>(end - input));
+        _bufferedSize = static_cast<std::size_t>(end - input);
+    }
+
+    std::uint64_t Hasher::digest() const {
+        if (_totalLength <= midsizeMax) {
+            return hash64(_buffer, static_cast<std::size_t>(_totalLength));
+        }
+        alignas(16) u64 acc[8];
+        std::memcpy(acc, _acc, sizeof(acc));
+        const u8 *lastStripe;
+        u8 lastStripeCopy[stripeLength];
+        if (_bufferedSize >= stripeLength) {
+            std::size_t stripes = (_bufferedSize - 1) / stripeLength;
+            std::size_t stripesSoFar = _stripesSoFar;
+            consumeStripes(acc, stripesSoFar, _buffer, stripes);
+            lastStripe = _buffer + _bufferedSize - stripeLength;
+        } else {
+            std::size_t catchup = stripeLength - _bufferedSize;
+            std::memcpy(lastStripeCopy, _buffer + bufferSize - catchup, catchup);
+            std::memcpy(lastStripeCopy + catchup, _buffer, _bufferedSize);
+            lastStripe = lastStripeCopy;
+        }
+        accumulate512(acc, lastStripe, defaultSecret + secretLimit - secretLastAccStart);
+        return mergeAccs(acc, defaultSecret + secretMergeAccsStart, _totalLength * prime64_1);
+    }
+
+} // namespace xxh3
@@ -0,0 +1,36 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// XXH3 64-bit, seed 0 and the default secret: results match the reference XXH3_64bits().
+// The long-input loop uses SSE2 on x86-64 and portable code elsewhere.
+namespace xxh3 {
+
+    std::uint64_t hash64(const void *data, std::size_t size);
+
+    // Streaming form, any split of the input gives the same digest as hash64.
+    class Hasher {
+    public:
+        Hasher();
+
+        void update(const void *data, std::size_t size);
+        [[nodiscard]] std::uint64_t digest() const;
+
+    private:
+        static const std::size_t bufferSize = 256;
+
+        alignas(16) std::uint64_t _acc[8];
+        alignas(16) unsigned char _buffer[bufferSize];
+        std::size_t _bufferedSize = 0;
+        std::size_t _stripesSoFar = 0;
+        std::uint64_t _totalLength = 0;
+    };
+
+} // namespace xxh3
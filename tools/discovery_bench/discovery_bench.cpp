@@ -0,0 +1,320 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+
+// Discovery benchmark on the loopback DNS-SD backend: registers thousands of simulated
+// peers in-process and measures discover(), resolveAndQuery() and send() latency and CPU.
+
+#include "flowdrop/flowdrop.hpp"
+#include "discovery.hpp"
+#include "specification.h"
+#include "loopback_dnssd/loopback_dnssd.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <ctime>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    std::size_t peers = 1000;
+    loopback_dnssd::Conditions conditions;
+    std::chrono::seconds discoverTimeout{60};
+    std::size_t resolves = 50;
+    std::size_t sends = 10;
+    std::size_t churn = 0;
+    std::chrono::seconds ttl{10};
+    unsigned seed = 1;
+};
+
+class TinyFile : public flowdrop::File {
+public:
+    explicit TinyFile(std::string name) : _name(std::move(name)) {}
+
+    [[nodiscard]] std::string getRelativePath() const override {
+        return _name;
+    }
+    [[nodiscard]] std::uint64_t getSize() const override {
+        return sizeof(_data);
+    }
+    [[nodiscard]] std::uint64_t getCreatedTime() const override {
+        return 0;
+    }
+    [[nodiscard]] std::uint64_t getModifiedTime() const override {
+        return 0;
+    }
+    [[nodiscard]] std::filesystem::perms getPermissions() const override {
+        return std::filesystem::perms::owner_read | std::filesystem::perms::owner_write;
+    }
+    void seek(std::uint64_t pos) override {
+        _pos = std::min<std::uint64_t>(pos, sizeof(_data));
+    }
+    std::uint64_t read(char *buffer, std::uint64_t count) override {
+        std::uint64_t n = std::min<std::uint64_t>(count, sizeof(_data) - _pos);
+        std::memcpy(buffer, _data + _pos, static_cast<std::size_t>(n));
+        _pos += n;
+        return n;
+    }
+
+private:
+    std::string _name;
+    char _data[64] = "flowdrop discovery benchmark";
+    std::uint64_t _pos = 0;
+};
+
+class ReceiverListener : public flowdrop::IEventListener {
+public:
+    void onReceiverStarted(unsigned short port) override {
+        portPromise.set_value(port);
+    }
+
+    std::promise<unsigned short> portPromise;
+};
+
+static double msSince(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+static double cpuMsSince(std::clock_t start) {
+    return 1000.0 * static_cast<double>(std::clock() - start) / CLOCKS_PER_SEC;
+}
+
+static double percentile(std::vector<double> values, double p) {
+    if (values.empty()) return 0;
+    std::sort(values.begin(), values.end());
+    auto idx = static_cast<std::size_t>(p / 100.0 * static_cast<double>(values.size() - 1) + 0.5);
+    return values[std::min(idx, values.size() - 1)];
+}
+
+static void printLatency(const char *name, const std::vector<double> &values) {
+    std::cout << std::left << std::setw(10) << name << std::right << std::fixed << std::setprecision(2)
+              << " n " << std::setw(6) << values.size()
+              << " p50 " << std::setw(9) << percentile(values, 50)
+              << " p90 " << std::setw(9) << percentile(values, 90)
+              << " p99 " << std::setw(9) << percentile(values, 99)
+              << " max " << std::setw(9) << percentile(values, 100) << " ms" << std::endl;
+}
+
+static bool parseOptions(int argc, char **argv, Options &options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--no-ipv6") {
+            options.conditions.ipv6 = false;
+            continue;
+        }
+        if (arg == "--help" || arg == "-h" || i + 1 >= argc) {
+            std::cout << "usage: flowdrop_discovery_bench [options]\n"
+                         "  --peers N        simulated peers (default 1000)\n"
+                         "  --latency MS     reply latency (default 0)\n"
+                         "  --jitter MS      extra uniform reply latency (default 0)\n"
+                         "  --loss P         reply loss probability 0..1 (default 0)\n"
+                         "  --retry MS       mDNS retransmission interval (default 1000)\n"
+                         "  --timeout S      discover timeout (default 60)\n"
+                         "  --resolves N     resolveAndQuery calls to time (default 50)\n"
+                         "  --sends N        sends to the in-process receiver (default 10)\n"
+                         "  --churn N        peers to remove and rename under a DiscoverySession (default 0)\n"
+                         "  --ttl S          DiscoverySession peer TTL for --churn (default 10)\n"
+                         "  --no-ipv6        do not answer AAAA queries\n"
+                         "  --seed N         random seed (default 1)\n";
+            return false;
+        }
+        std::string value = argv[++i];
+        if (arg == "--peers") options.peers = std::stoul(value);
+        else if (arg == "--latency") options.conditions.latency = std::chrono::milliseconds(std::stoll(value));
+        else if (arg == "--jitter") options.conditions.jitter = std::chrono::milliseconds(std::stoll(value));
+        else if (arg == "--loss") options.conditions.lossRate = std::stod(value);
+        else if (arg == "--retry") options.conditions.retryInterval = std::chrono::milliseconds(std::stoll(value));
+        else if (arg == "--timeout") options.discoverTimeout = std::chrono::seconds(std::stoll(value));
+        else if (arg == "--resolves") options.resolves = std::stoul(value);
+        else if (arg == "--sends") options.sends = std::stoul(value);
+        else if (arg == "--churn") options.churn = std::stoul(value);
+        else if (arg == "--ttl") options.ttl = std::chrono::seconds(std::stoll(value));
+        else if (arg == "--seed") options.seed = static_cast<unsigned>(std::stoul(value));
+        else {
+            std::cerr << "unknown option: " << arg << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    try {
+        if (!parseOptions(argc, argv, options)) return 1;
+    } catch (const std::exception &e) {
+        std::cerr << "invalid arguments: " << e.what() << std::endl;
+        return 1;
+    }
+    loopback_dnssd::setConditions(options.conditions);
+    loopback_dnssd::setSeed(options.seed);
+
+    // one real receiver, every simulated peer points at its port
+    flowdrop::DeviceInfo receiverInfo;
+    receiverInfo.id = "bench-receiver";
+    receiverInfo.name = "bench receiver";
+    flowdrop::Server server(receiverInfo);
+    ReceiverListener receiverListener;
+    server.setDestDir(std::filesystem::temp_directory_path() / "flowdrop_discovery_bench");
+    server.setEventListener(&receiverListener);
+    std::thread serverThread([&server]() { server.run(); });
+    std::future<unsigned short> portFuture = receiverListener.portPromise.get_future();
+    if (portFuture.wait_for(std::chrono::seconds(10)) != std::future_status::ready) {
+        std::cerr << "receiver did not start" << std::endl;
+        return 1;
+    }
+    unsigned short port = portFuture.get();
+
+    std::vector<std::string> peerIds;
+    for (std::size_t i = 0; i < options.peers; ++i) {
+        std::string id = "peer" + std::to_string(i);
+        std::unordered_map<std::string, std::string> txt;
+        txt[flowdrop_txt_key_version] = std::to_string(flowdrop_version);
+        txt[flowdrop_txt_key_info_version] = std::to_string(flowdrop_txt_info_version);
+        txt[flowdrop_txt_key_name] = "Simulated " + std::to_string(i);
+        txt[flowdrop_txt_key_platform] = "loopback";
+        txt[flowdrop_txt_key_capabilities] = std::to_string(flowdrop_capability_ask_manifest);
+        loopback_dnssd::addService(id, flowdrop_reg_type, port, txt);
+        peerIds.push_back(id);
+    }
+
+    // discover
+    std::mutex foundMutex;
+    std::unordered_map<std::string, double> found;
+    std::clock_t cpuStart = std::clock();
+    Clock::time_point start = Clock::now();
+    flowdrop::discover([&](const flowdrop::DeviceInfo &deviceInfo) {
+        std::lock_guard<std::mutex> lock(foundMutex);
+        found.emplace(deviceInfo.id, msSince(start));
+    }, [&]() {
+        std::lock_guard<std::mutex> lock(foundMutex);
+        return found.size() > options.peers || Clock::now() - start > options.discoverTimeout;
+    });
+    double discoverMs = msSince(start);
+    double discoverCpuMs = cpuMsSince(cpuStart);
+    std::vector<double> foundTimes;
+    for (const auto &[id, ms]: found) foundTimes.push_back(ms);
+
+    // resolve
+    std::vector<double> resolveTimes;
+    std::size_t resolveFailures = 0;
+    cpuStart = std::clock();
+    for (std::size_t i = 0; i < options.resolves && !peerIds.empty(); ++i) {
+        const std::string &id = peerIds[(i * 7919) % peerIds.size()];
+        Clock::time_point resolveStart = Clock::now();
+        bool ok = false;
+        discovery::resolveAndQuery(id, [&ok](const std::optional<discovery::Remote> &remoteOpt) {
+            ok = remoteOpt.has_value();
+        });
+        if (ok) {
+            resolveTimes.push_back(msSince(resolveStart));
+        } else {
+            ++resolveFailures;
+        }
+    }
+    double resolveCpuMs = cpuMsSince(cpuStart);
+
+    // send
+    std::vector<double> sendTimes;
+    std::size_t sendFailures = 0;
+    flowdrop::DeviceInfo senderInfo;
+    senderInfo.id = "bench-sender";
+    for (std::size_t i = 0; i < options.sends; ++i) {
+        Clock::time_point sendStart = Clock::now();
+        flowdrop::SendRequest request;
+        request.setDeviceInfo(senderInfo);
+        request.setReceiverId(receiverInfo.id);
+        request.setFiles({new TinyFile("bench" + std::to_string(i) + ".txt")});
+        if (request.execute()) {
+            sendTimes.push_back(msSince(sendStart));
+        } else {
+            ++sendFailures;
+        }
+    }
+
+    // direct send, no mDNS at all
+    std::vector<double> directTimes;
+    std::size_t directFailures = 0;
+    for (std::size_t i = 0; i < options.sends; ++i) {
+        Clock::time_point sendStart = Clock::now();
+        flowdrop::SendRequest request;
+        request.setDeviceInfo(senderInfo);
+        request.setReceiverAddresses({{"::1", port}, {"127.0.0.1", port}});
+        request.setFiles({new TinyFile("direct" + std::to_string(i) + ".txt")});
+        if (request.execute()) {
+            directTimes.push_back(msSince(sendStart));
+        } else {
+            ++directFailures;
+        }
+    }
+
+    // churn: half of the peers go away, the other half change their name
+    std::vector<double> removedTimes;
+    std::vector<double> updatedTimes;
+    if (options.churn > 0) {
+        std::size_t churn = std::min(options.churn, peerIds.size());
+        std::mutex churnMutex;
+        std::condition_variable churnCv;
+        std::size_t added = 0;
+        Clock::time_point churnStart;
+        flowdrop::DiscoverySession session([&](flowdrop::DiscoveryEvent event, const flowdrop::DeviceInfo &deviceInfo) {
+            std::lock_guard<std::mutex> lock(churnMutex);
+            if (event == flowdrop::DiscoveryEvent::Added) ++added;
+            else if (event == flowdrop::DiscoveryEvent::Removed) removedTimes.push_back(msSince(churnStart));
+            else updatedTimes.push_back(msSince(churnStart));
+            churnCv.notify_all();
+        });
+        session.setPeerTTL(options.ttl);
+        session.start();
+        {
+            std::unique_lock<std::mutex> lock(churnMutex);
+            churnCv.wait_for(lock, options.discoverTimeout, [&]() { return added >= peerIds.size(); });
+            churnStart = Clock::now();
+        }
+        for (std::size_t i = 0; i < churn; ++i) {
+            if (i % 2 == 0) {
+                loopback_dnssd::removeService(peerIds[i]);
+                continue;
+            }
+            std::unordered_map<std::string, std::string> txt;
+            txt[flowdrop_txt_key_version] = std::to_string(flowdrop_version);
+            txt[flowdrop_txt_key_info_version] = std::to_string(flowdrop_txt_info_version);
+            txt[flowdrop_txt_key_name] = "Renamed " + std::to_string(i);
+            txt[flowdrop_txt_key_platform] = "loopback";
+            loopback_dnssd::addService(peerIds[i], flowdrop_reg_type, port, txt);
+        }
+        {
+            std::unique_lock<std::mutex> lock(churnMutex);
+            churnCv.wait_for(lock, options.ttl * 3 + std::chrono::seconds(10), [&]() { return removedTimes.size() + updatedTimes.size() >= churn; });
+        }
+        session.stop();
+    }
+
+    std::cout << "peers     " << options.peers << ", found " << foundTimes.size() << " in "
+              << std::fixed << std::setprecision(2) << discoverMs << " ms, cpu " << discoverCpuMs << " ms" << std::endl;
+    printLatency("discover", foundTimes);
+    printLatency("resolve", resolveTimes);
+    std::cout << "          resolve failures " << resolveFailures << ", cpu " << resolveCpuMs << " ms" << std::endl;
+    printLatency("send", sendTimes);
+    std::cout << "          send failures " << sendFailures << std::endl;
+    printLatency("direct", directTimes);
+    std::cout << "          direct send failures " << directFailures << std::endl;
+    if (options.churn > 0) {
+        printLatency("removed", removedTimes);
+        printLatency("updated", updatedTimes);
+    }
+
+    server.stop();
+    serverThread.join();
+    return 0;
+}
@@ -0,0 +1,538 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+
+// Concurrent-sender load generator: runs one flowdrop::Server in-process and
+// hammers it over loopback with many simultaneous ask+send sessions.
+
+#include "flowdrop/flowdrop.hpp"
+#include "curl/curl.h"
+#include "nlohmann/json.hpp"
+#include "virtualtfa.h"
+#include "ask_manifest.hpp"
+#include "specification.h"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <condition_variable>
+#include <cstring>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <unistd.h>
+#include <fstream>
+#endif
+
+using Clock = std::chrono::steady_clock;
+
+struct PayloadClass {
+    std::uint64_t fileSize;
+    std::size_t fileCount;
+    unsigned weight;
+};
+
+struct Options {
+    std::size_t senders = 100;
+    std::size_t concurrency = 0; // 0 = same as senders
+    double arrivalRate = 0; // sessions per second, 0 = all at once
+    std::vector<PayloadClass> mix = {{4 * 1024, 8, 60}, {256 * 1024, 2, 30}, {8 * 1024 * 1024, 1, 10}};
+    double slowFraction = 0;
+    std::uint64_t slowRate = 64 * 1024; // bytes per second
+    std::chrono::milliseconds askTimeout{60 * 1000};
+    bool binaryManifest = false;
+    std::filesystem::path destDir = std::filesystem::temp_directory_path() / "flowdrop_loadgen";
+    unsigned seed = 1;
+};
+
+struct SessionResult {
+    bool askOk = false;
+    bool sendOk = false;
+    double askMs = 0;
+    double ttfbMs = 0; // from the start of /send, the ask is not in it
+    double totalMs = 0;
+    std::uint64_t bytes = 0;
+};
+
+static std::uint64_t currentRss() {
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) {
+        return pmc.WorkingSetSize;
+    }
+    return 0;
+#elif defined(__linux__)
+    std::ifstream statm("/proc/self/statm");
+    std::uint64_t size = 0, resident = 0;
+    if (statm >> size >> resident) {
+        return resident * static_cast<std::uint64_t>(sysconf(_SC_PAGESIZE));
+    }
+    return 0;
+#else
+    struct rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return static_cast<std::uint64_t>(usage.ru_maxrss); // bytes on macOS
+#endif
+}
+
+// Synthetic file source: produces a cheap byte pattern and optionally throttles
+// itself to emulate a sender on a slow link or a slow local disk.
+class SyntheticFile : public flowdrop::File {
+public:
+    SyntheticFile(std::string name, std::uint64_t size, std::uint64_t bytesPerSecond) :
+            _name(std::move(name)), _size(size), _bytesPerSecond(bytesPerSecond), _started(Clock::now()) {}
+
+    [[nodiscard]] std::string getRelativePath() const override {
+        return _name;
+    }
+    [[nodiscard]] std::uint64_t getSize() const override {
+        return _size;
+    }
+    [[nodiscard]] std::uint64_t getCreatedTime() const override {
+        return 0;
+    }
+    [[nodiscard]] std::uint64_t getModifiedTime() const override {
+        return 0;
+    }
+    [[nodiscard]] std::filesystem::perms getPermissions() const override {
+        return std::filesystem::perms::owner_read | std::filesystem::perms::owner_write;
+    }
+    void seek(std::uint64_t pos) override {
+        _pos = std::min(pos, _size);
+    }
+    std::uint64_t read(char *buffer, std::uint64_t count) override {
+        std::uint64_t n = std::min(count, _size - _pos);
+        if (n == 0) return 0;
+        if (_bytesPerSecond != 0) {
+            auto due = _started + std::chrono::microseconds((_pos + n) * 1000000 / _bytesPerSecond);
+            std::this_thread::sleep_until(due);
+        }
+        std::memset(buffer, static_cast<int>(_pos & 0xff), static_cast<std::size_t>(n));
+        _pos += n;
+        return n;
+    }
+
+private:
+    std::string _name;
+    std::uint64_t _size;
+    std::uint64_t _bytesPerSecond;
+    Clock::time_point _started;
+    std::uint64_t _pos = 0;
+};
+
+class ReceiverListener : public flowdrop::IEventListener {
+public:
+    void onReceiverStarted(unsigned short port) override {
+        portPromise.set_value(port);
+    }
+
+    void onReceivingEnd(const flowdrop::DeviceInfo &, std::uint64_t, const std::vector<flowdrop::FileInfo> &) override {
+        ++completed;
+    }
+
+    std::promise<unsigned short> portPromise;
+    std::atomic<std::size_t> completed{0};
+};
+
+static size_t discardCallback(char *, size_t size, size_t nmemb, void *) {
+    return size * nmemb;
+}
+
+static size_t appendCallback(char *data, size_t size, size_t nmemb, std::string *response) {
+    response->append(data, size * nmemb);
+    return size * nmemb;
+}
+
+static double msSince(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+static nlohmann::json deviceInfoJson(const std::string &id) {
+    nlohmann::json j;
+    j["id"] = id;
+    j["name"] = "loadgen " + id;
+    return j;
+}
+
+static tfa_size_t streamRead(void *userdata, char *buffer, tfa_size_t size) {
+    return static_cast<flowdrop::File *>(userdata)->read(buffer, size);
+}
+
+static void streamClose(void *) {}
+
+static virtual_tfa_input_stream *streamSupplier(void *userdata) {
+    virtual_tfa_input_stream *stream = virtual_tfa_input_stream_new();
+    virtual_tfa_input_stream_set_read_function(stream, streamRead);
+    virtual_tfa_input_stream_set_read_userdata(stream, userdata);
+    virtual_tfa_input_stream_set_close_function(stream, streamClose);
+    virtual_tfa_input_stream_set_close_userdata(stream, userdata);
+    return stream;
+}
+
+struct UploadState {
+    virtual_tfa_writer *writer;
+    Clock::time_point start; // of the /send request
+    bool firstByte = false;
+    double ttfbMs = 0;
+};
+
+static size_t uploadRead(char *buffer, size_t size, size_t nmemb, void *userdata) {
+    auto *state = static_cast<UploadState *>(userdata);
+    size_t written = 0;
+    if (virtual_tfa_writer_write(state->writer, buffer, size * nmemb, &written) != 0) {
+        return CURL_READFUNC_ABORT;
+    }
+    if (!state->firstByte && written > 0) {
+        state->firstByte = true;
+        state->ttfbMs = msSince(state->start);
+    }
+    return written;
+}
+
+static size_t manifestReadCallback(char *buffer, size_t size, size_t nmemb, void *userdata) {
+    return static_cast<manifest::Encoder *>(userdata)->read(buffer, size * nmemb);
+}
+
+static SessionResult runSession(const std::string &baseUrl, std::size_t index, const PayloadClass &payload,
+                                bool slow, const Options &options) {
+    SessionResult result;
+    std::string id = "loadgen" + std::to_string(index);
+    std::vector<std::unique_ptr<SyntheticFile>> files;
+    nlohmann::json askJson;
+    askJson["sender"] = deviceInfoJson(id);
+    askJson["files"] = nlohmann::json::array();
+    std::vector<flowdrop::FileInfo> fileInfos;
+    for (std::size_t i = 0; i < payload.fileCount; ++i) {
+        std::string name = id + "/file" + std::to_string(i) + ".bin";
+        files.push_back(std::make_unique<SyntheticFile>(name, payload.fileSize, slow ? options.slowRate : 0));
+        askJson["files"].push_back({{"name", name}, {"size", payload.fileSize}});
+        fileInfos.push_back({name, payload.fileSize});
+    }
+    flowdrop::DeviceInfo sender;
+    sender.id = id;
+    manifest::Encoder encoder(sender, fileInfos);
+
+    Clock::time_point start = Clock::now();
+
+    CURL *curl = curl_easy_init();
+    if (!curl) return result;
+
+    std::string askBody;
+    std::string askResponse;
+    struct curl_slist *askHeaders = nullptr;
+    curl_easy_setopt(curl, CURLOPT_URL, (baseUrl + flowdrop_endpoint_ask).c_str());
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, static_cast<long>(options.askTimeout.count()));
+    if (options.binaryManifest) {
+        askHeaders = curl_slist_append(askHeaders, (std::string("Content-Type: ") + flowdrop_ask_manifest_content_type).c_str());
+        askHeaders = curl_slist_append(askHeaders, "Expect:");
+        curl_easy_setopt(curl, CURLOPT_POST, 1L);
+        curl_easy_setopt(curl, CURLOPT_READFUNCTION, manifestReadCallback);
+        curl_easy_setopt(curl, CURLOPT_READDATA, &encoder);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(encoder.size()));
+    } else {
+        askBody = askJson.dump();
+        askHeaders = curl_slist_append(askHeaders, "Content-Type: application/json");
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, askBody.c_str());
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, static_cast<long>(askBody.size()));
+    }
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, askHeaders);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, appendCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &askResponse);
+    CURLcode res = curl_easy_perform(curl);
+    curl_slist_free_all(askHeaders);
+    result.askMs = msSince(start);
+    if (res != CURLE_OK) {
+        curl_easy_cleanup(curl);
+        return result;
+    }
+    try {
+        result.askOk = nlohmann::json::parse(askResponse).at("accepted").get<bool>();
+    } catch (const std::exception &) {
+        result.askOk = false;
+    }
+    if (!result.askOk) {
+        curl_easy_cleanup(curl);
+        return result;
+    }
+
+    virtual_tfa_archive *archive = virtual_tfa_archive_new();
+    for (auto &file: files) {
+        virtual_tfa_entry *entry = virtual_tfa_entry_new();
+        char *name = new char[file->getRelativePath().size() + 1];
+        std::strcpy(name, file->getRelativePath().c_str());
+        virtual_tfa_entry_set_name(entry, name);
+        virtual_tfa_entry_set_size(entry, file->getSize());
+        virtual_tfa_entry_set_input_stream_supplier(entry, streamSupplier);
+        virtual_tfa_entry_set_input_stream_supplier_userdata(entry, file.get());
+        virtual_tfa_entry_set_mode(entry, static_cast<tfa_mode_t>(file->getPermissions()));
+        virtual_tfa_archive_add(archive, entry);
+    }
+    virtual_tfa_writer *writer = virtual_tfa_writer_new();
+    virtual_tfa_writer_set_archive(writer, archive);
+    tfa_size_t totalSize = virtual_tfa_writer_calc_size(writer);
+
+    UploadState upload{writer};
+    std::string deviceHeader = std::string(flowdrop_deviceinfo_header) + ": " + deviceInfoJson(id).dump();
+    struct curl_slist *sendHeaders = curl_slist_append(nullptr, deviceHeader.c_str());
+    curl_easy_reset(curl);
+    curl_easy_setopt(curl, CURLOPT_URL, (baseUrl + flowdrop_endpoint_send).c_str());
+    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+    curl_easy_setopt(curl, CURLOPT_READFUNCTION, uploadRead);
+    curl_easy_setopt(curl, CURLOPT_READDATA, &upload);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(totalSize));
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, sendHeaders);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, discardCallback);
+    upload.start = Clock::now();
+    res = curl_easy_perform(curl);
+    long status = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    curl_slist_free_all(sendHeaders);
+    curl_easy_cleanup(curl);
+
+    result.sendOk = res == CURLE_OK && status == 200;
+    result.ttfbMs = upload.ttfbMs;
+    result.totalMs = msSince(start);
+    result.bytes = result.sendOk ? totalSize : 0;
+
+    virtual_tfa_writer_free(writer);
+    virtual_tfa_archive_free(archive);
+    return result;
+}
+
+static std::uint64_t parseSize(const std::string &str) {
+    std::size_t idx = 0;
+    std::uint64_t value = std::stoull(str, &idx);
+    if (idx < str.size()) {
+        switch (std::toupper(static_cast<unsigned char>(str[idx]))) {
+            case 'K': value <<= 10; break;
+            case 'M': value <<= 20; break;
+            case 'G': value <<= 30; break;
+            default: throw std::invalid_argument("bad size suffix: " + str);
+        }
+    }
+    return value;
+}
+
+// "<size>*<count>:<weight>,..." e.g. "4K*8:60,256K*2:30,8M*1:10"
+static std::vector<PayloadClass> parseMix(const std::string &spec) {
+    std::vector<PayloadClass> mix;
+    std::size_t begin = 0;
+    while (begin < spec.size()) {
+        std::size_t end = spec.find(',', begin);
+        if (end == std::string::npos) end = spec.size();
+        std::string item = spec.substr(begin, end - begin);
+        std::size_t star = item.find('*');
+        std::size_t colon = item.find(':');
+        if (star == std::string::npos) {
+            throw std::invalid_argument("bad mix item: " + item);
+        }
+        PayloadClass payload{};
+        payload.fileSize = parseSize(item.substr(0, star));
+        payload.fileCount = std::stoul(item.substr(star + 1, colon == std::string::npos ? std::string::npos : colon - star - 1));
+        payload.weight = colon == std::string::npos ? 1 : static_cast<unsigned>(std::stoul(item.substr(colon + 1)));
+        mix.push_back(payload);
+        begin = end + 1;
+    }
+    if (mix.empty()) {
+        throw std::invalid_argument("empty payload mix");
+    }
+    return mix;
+}
+
+static void printUsage() {
+    std::cout << "usage: flowdrop_loadgen [options]\n"
+                 "  --senders N          total sessions (default 100)\n"
+                 "  --concurrency N      max simultaneous sessions (default: senders)\n"
+                 "  --rate R             Poisson arrival rate, sessions/s (default 0 = all at once)\n"
+                 "  --mix SPEC           payload mix, size*count:weight,... (default 4K*8:60,256K*2:30,8M*1:10)\n"
+                 "  --slow-fraction F    fraction of throttled senders, 0..1 (default 0)\n"
+                 "  --slow-rate SIZE     throughput of throttled senders per second (default 64K)\n"
+                 "  --ask-timeout MS     ask timeout (default 60000)\n"
+                 "  --manifest FORMAT    ask body, json or binary (default json)\n"
+                 "  --dest DIR           receiver destination directory\n"
+                 "  --seed N             random seed (default 1)\n";
+}
+
+static bool parseOptions(int argc, char **argv, Options &options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h") {
+            printUsage();
+            return false;
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "missing value for " << arg << std::endl;
+            return false;
+        }
+        std::string value = argv[++i];
+        if (arg == "--senders") options.senders = std::stoul(value);
+        else if (arg == "--concurrency") options.concurrency = std::stoul(value);
+        else if (arg == "--rate") options.arrivalRate = std::stod(value);
+        else if (arg == "--mix") options.mix = parseMix(value);
+        else if (arg == "--slow-fraction") options.slowFraction = std::stod(value);
+        else if (arg == "--slow-rate") options.slowRate = parseSize(value);
+        else if (arg == "--ask-timeout") options.askTimeout = std::chrono::milliseconds(std::stoll(value));
+        else if (arg == "--manifest" && (value == "json" || value == "binary")) options.binaryManifest = value == "binary";
+        else if (arg == "--dest") options.destDir = value;
+        else if (arg == "--seed") options.seed = static_cast<unsigned>(std::stoul(value));
+        else {
+            std::cerr << "unknown option: " << arg << std::endl;
+            printUsage();
+            return false;
+        }
+    }
+    if (options.concurrency == 0) {
+        options.concurrency = options.senders;
+    }
+    return true;
+}
+
+static double percentile(std::vector<double> values, double p) {
+    if (values.empty()) return 0;
+    std::sort(values.begin(), values.end());
+    auto idx = static_cast<std::size_t>(p / 100.0 * static_cast<double>(values.size() - 1) + 0.5);
+    return values[std::min(idx, values.size() - 1)];
+}
+
+static void printLatency(const char *name, const std::vector<double> &values) {
+    std::cout << std::left << std::setw(8) << name << std::right << std::fixed << std::setprecision(2)
+              << " p50 " << std::setw(9) << percentile(values, 50)
+              << " p90 " << std::setw(9) << percentile(values, 90)
+              << " p99 " << std::setw(9) << percentile(values, 99)
+              << " max " << std::setw(9) << percentile(values, 100) << " ms" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    try {
+        if (!parseOptions(argc, argv, options)) return 1;
+    } catch (const std::exception &e) {
+        std::cerr << "invalid arguments: " << e.what() << std::endl;
+        return 1;
+    }
+
+    curl_global_init(CURL_GLOBAL_NOTHING);
+
+    flowdrop::DeviceInfo receiverInfo;
+    receiverInfo.id = flowdrop::generate_md5_id();
+    receiverInfo.name = "loadgen receiver";
+    flowdrop::Server server(receiverInfo);
+    ReceiverListener receiverListener;
+    server.setDestDir(options.destDir);
+    server.setAskCallback([](const flowdrop::SendAsk &) { return true; });
+    server.setEventListener(&receiverListener);
+    std::thread serverThread([&server]() { server.run(); });
+
+    std::future<unsigned short> portFuture = receiverListener.portPromise.get_future();
+    if (portFuture.wait_for(std::chrono::seconds(10)) != std::future_status::ready) {
+        std::cerr << "receiver did not start" << std::endl;
+        return 1;
+    }
+    std::string baseUrl = "http://127.0.0.1:" + std::to_string(portFuture.get()) + "/";
+    std::uint64_t baselineRss = currentRss();
+
+    std::mt19937 rng(options.seed);
+    std::vector<unsigned> weights;
+    for (const PayloadClass &payload: options.mix) weights.push_back(payload.weight);
+    std::discrete_distribution<std::size_t> pickPayload(weights.begin(), weights.end());
+    std::bernoulli_distribution pickSlow(std::clamp(options.slowFraction, 0.0, 1.0));
+    std::exponential_distribution<double> interArrival(options.arrivalRate > 0 ? options.arrivalRate : 1.0);
+
+    std::vector<SessionResult> results(options.senders);
+    std::mutex slotsMutex;
+    std::condition_variable slotsCv;
+    std::size_t active = 0;
+    std::atomic<std::uint64_t> peakRss{baselineRss};
+    std::atomic<bool> sampling{true};
+    std::thread sampler([&]() {
+        while (sampling) {
+            std::uint64_t rss = currentRss();
+            std::uint64_t prev = peakRss.load();
+            while (rss > prev && !peakRss.compare_exchange_weak(prev, rss)) {}
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+    });
+
+    std::vector<std::thread> sessions;
+    sessions.reserve(options.senders);
+    Clock::time_point wallStart = Clock::now();
+    Clock::time_point nextArrival = wallStart;
+    for (std::size_t i = 0; i < options.senders; ++i) {
+        if (options.arrivalRate > 0) {
+            std::this_thread::sleep_until(nextArrival);
+            nextArrival += std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(interArrival(rng)));
+        }
+        {
+            std::unique_lock<std::mutex> lock(slotsMutex);
+            slotsCv.wait(lock, [&]() { return active < options.concurrency; });
+            ++active;
+        }
+        const PayloadClass &payload = options.mix[pickPayload(rng)];
+        bool slow = pickSlow(rng);
+        sessions.emplace_back([&, i, payload, slow]() {
+            results[i] = runSession(baseUrl, i, payload, slow, options);
+            {
+                std::lock_guard<std::mutex> lock(slotsMutex);
+                --active;
+            }
+            slotsCv.notify_one();
+        });
+    }
+    for (std::thread &session: sessions) {
+        session.join();
+    }
+    double wallSeconds = std::chrono::duration<double>(Clock::now() - wallStart).count();
+    sampling = false;
+    sampler.join();
+
+    std::vector<double> askLatency, ttfb, total;
+    std::size_t askErrors = 0, sendErrors = 0;
+    std::uint64_t bytes = 0;
+    for (const SessionResult &result: results) {
+        if (!result.askOk) {
+            ++askErrors;
+            continue;
+        }
+        askLatency.push_back(result.askMs);
+        if (!result.sendOk) {
+            ++sendErrors;
+            continue;
+        }
+        ttfb.push_back(result.ttfbMs);
+        total.push_back(result.totalMs);
+        bytes += result.bytes;
+    }
+
+    std::cout << "sessions  " << options.senders << " (concurrency " << options.concurrency
+              << ", completed by receiver " << receiverListener.completed.load() << ")" << std::endl;
+    std::cout << "errors    ask " << askErrors << ", send " << sendErrors << " ("
+              << std::fixed << std::setprecision(2)
+              << 100.0 * static_cast<double>(askErrors + sendErrors) / static_cast<double>(std::max<std::size_t>(options.senders, 1))
+              << "%)" << std::endl;
+    printLatency("ask", askLatency);
+    printLatency("ttfb", ttfb);
+    printLatency("session", total);
+    std::cout << "throughput " << static_cast<double>(bytes) / wallSeconds / (1024.0 * 1024.0) << " MiB/s ("
+              << bytes << " bytes in " << wallSeconds << " s)" << std::endl;
+    std::cout << "rss       baseline " << baselineRss / 1024 << " KiB, peak " << peakRss.load() / 1024
+              << " KiB, final " << currentRss() / 1024 << " KiB" << std::endl;
+
+    server.stop();
+    serverThread.join();
+    curl_global_cleanup();
+    return askErrors + sendErrors == 0 ? 0 : 2;
+}
@@ -0,0 +1,290 @@
+/*
+ * This file is part of libflowdrop.
+ *
+ * For license and copyright information please follow this link:
+ * https://github.com/noseam-env/libflowdrop/blob/master/LEGAL
+ */
+
+// Transfer benchmark: sends in-memory files over loopback to an in-process receiver, plain and
+// sealed, and measures the session cipher on its own. The cipher is checked against the RFC 7748
+// and RFC 8439 test vectors first. Small sends measure the per-request cost of ask and send.
+// Reliable UDP sends run under datagram loss injected in the sender, with and without FEC; TCP
+// cannot be made lossy in process, its lossless rate is the reference.
+
+#include "flowdrop/flowdrop.hpp"
+#include "crypto.hpp"
+#include "reliable_udp.hpp"
+#include <algorithm>
+#include <cstring>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    std::size_t sizeMiB = 256;
+    std::size_t files = 4;
+    std::size_t runs = 3;
+    std::size_t smallSends = 200;
+    std::size_t udpMiB = 32;
+    unsigned delayMs = 0;
+    std::optional<flowdrop::TransportPreset> preset;
+    std::filesystem::path destDir = std::filesystem::temp_directory_path() / "flowdrop_transfer_bench";
+};
+
+class ReceiverListener : public flowdrop::IEventListener {
+public:
+    std::promise<unsigned short> portPromise;
+
+    void onReceiverStarted(unsigned short port) override {
+        portPromise.set_value(port);
+    }
+};
+
+static double secondsSince(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static std::vector<unsigned char> fromHex(const char *hex) {
+    std::vector<unsigned char> bytes(std::strlen(hex) / 2);
+    crypto::fromHex(hex, bytes.data(), bytes.size());
+    return bytes;
+}
+
+static bool expect(const char *name, const unsigned char *actual, const char *hex) {
+    std::vector<unsigned char> expected = fromHex(hex);
+    bool ok = std::memcmp(actual, expected.data(), expected.size()) == 0;
+    if (!ok) {
+        std::cerr << "test vector failed: " << name << std::endl;
+    }
+    return ok;
+}
+
+static bool selfTest() {
+    bool ok = true;
+    {
+        // RFC 7748 5.2 and 6.1
+        std::vector<unsigned char> scalar = fromHex("a546e36bf0527c9d3b16154b82465edd62144c0ac1fc5a18506a2244ba449ac4");
+        std::vector<unsigned char> point = fromHex("e6db6867583030db3594c1a424b15f7c726624ec26b3353b10a903a6d0ab1c4c");
+        unsigned char out[32];
+        crypto::x25519(out, scalar.data(), point.data());
+        ok &= expect("x25519", out, "c3da55379de9c6908e94ea4df28d084f32eccf03491c71f754b4075577a28552");
+        std::vector<unsigned char> alice = fromHex("77076d0a7318a57d3c16c17251b26645df4c2f87ebc0992ab177fba51db92c2a");
+        std::vector<unsigned char> bobPublic = fromHex("de9edb7d7b7dc1b4d35b61c2ece435373f8343c85b78674dadfc7e146f882b4f");
+        crypto::x25519Base(out, alice.data());
+        ok &= expect("x25519 base", out, "8520f0098930a754748b7ddcb43ef75a0dbf3a0d26381af4eba4a98eaa9b4e6a");
+        crypto::x25519(out, alice.data(), bobPublic.data());
+        ok &= expect("x25519 shared", out, "4a5d9d5ba4ce2de1728e3bf480350f25e07e21c947d19e3376f09b3c1e161742");
+    }
+    {
+        // RFC 8439 2.5.2
+        std::vector<unsigned char> key = fromHex("85d6be7857556d337f4452fe42d506a80103808afb0db2fd4abff6af4149f51b");
+        const char *message = "Cryptographic Forum Research Group";
+        crypto::Poly1305 poly(key.data());
+        poly.update(reinterpret_cast<const unsigned char *>(message), std::strlen(message));
+        unsigned char tag[16];
+        poly.finish(tag);
+        ok &= expect("poly1305", tag, "a8061dc1305136c6c22b8baf0c0127a9");
+    }
+    {
+        // RFC 8439 2.8.2
+        crypto::Key key;
+        crypto::Nonce nonce;
+        std::vector<unsigned char> keyBytes = fromHex("808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f");
+        std::vector<unsigned char> nonceBytes = fromHex("070000004041424344454647");
+        std::vector<unsigned char> aad = fromHex("50515253c0c1c2c3c4c5c6c7");
+        std::copy(keyBytes.begin(), keyBytes.end(), key.begin());
+        std::copy(nonceBytes.begin(), nonceBytes.end(), nonce.begin());
+        const char *plaintext = "Ladies and Gentlemen of the class of '99: If I could offer you only one tip for the future, "
+                                "sunscreen would be it.";
+        std::size_t size = std::strlen(plaintext);
+        std::vector<unsigned char> ciphertext(size);
+        unsigned char tag[16];
+        crypto::seal(ciphertext.data(), tag, reinterpret_cast<const unsigned char *>(plaintext), size, aad.data(), aad.size(), key, nonce);
+        ok &= expect("aead ciphertext", ciphertext.data(), "d31a8d34648e60db7b86afbc53ef7ec2a4aded51296e08fea9e2b5a736ee62d6");
+        ok &= expect("aead tag", tag, "1ae10b594f09e26a7e902ecbd0600691");
+        std::vector<unsigned char> opened(size);
+        ok &= crypto::open(opened.data(), ciphertext.data(), size, tag, aad.data(), aad.size(), key, nonce) &&
+              std::memcmp(opened.data(), plaintext, size) == 0;
+        tag[0] ^= 1;
+        ok &= !crypto::open(opened.data(), ciphertext.data(), size, tag, aad.data(), aad.size(), key, nonce);
+    }
+    return ok;
+}
+
+static void cipherThroughput() {
+    std::vector<unsigned char> record(64 * 1024, 0x5a);
+    crypto::Key key{};
+    crypto::Nonce nonce{};
+    unsigned char tag[16];
+    std::size_t records = 4096;
+    Clock::time_point start = Clock::now();
+    for (std::size_t i = 0; i < records; ++i) {
+        nonce[0] = static_cast<unsigned char>(i);
+        crypto::seal(record.data(), tag, record.data(), record.size(), nullptr, 0, key, nonce);
+    }
+    double sealSeconds = secondsSince(start);
+    start = Clock::now();
+    for (std::size_t i = 0; i < 100; ++i) {
+        std::optional<crypto::KeyPair> keyPair = crypto::KeyPair::generate();
+    }
+    double keySeconds = secondsSince(start);
+    std::cout << "cipher    seal " << std::fixed << std::setprecision(0) << records * record.size() / 1e6 / sealSeconds
+              << " MB/s, key pair " << std::setprecision(2) << keySeconds * 10 << " ms" << std::endl;
+}
+
+static bool parseOptions(int argc, char **argv, Options &options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h" || i + 1 >= argc) {
+            std::cout << "usage: flowdrop_transfer_bench [options]\n"
+                         "  --size MIB       payload per send (default 256)\n"
+                         "  --files N        files the payload is split into (default 4)\n"
+                         "  --runs N         sends per mode, the best is reported (default 3)\n"
+                         "  --small N        sends of a single 4 KiB file per mode (default 200)\n"
+                         "  --udp MIB        payload per reliable UDP send, 0 skips them (default 32)\n"
+                         "  --delay MS       one-way delay added to UDP datagrams (default 0)\n"
+                         "  --preset NAME    transport options on both sides: lan, wifi or lowmem (default none)\n"
+                         "  --dest DIR       receiver destination directory\n";
+            return false;
+        }
+        std::string value = argv[++i];
+        if (arg == "--size") options.sizeMiB = std::stoul(value);
+        else if (arg == "--files") options.files = std::max<std::size_t>(1, std::stoul(value));
+        else if (arg == "--runs") options.runs = std::max<std::size_t>(1, std::stoul(value));
+        else if (arg == "--small") options.smallSends = std::stoul(value);
+        else if (arg == "--udp") options.udpMiB = std::stoul(value);
+        else if (arg == "--delay") options.delayMs = static_cast<unsigned>(std::stoul(value));
+        else if (arg == "--preset" && value == "lan") options.preset = flowdrop::TransportPreset::LanBulk;
+        else if (arg == "--preset" && value == "wifi") options.preset = flowdrop::TransportPreset::WiFi;
+        else if (arg == "--preset" && value == "lowmem") options.preset = flowdrop::TransportPreset::LowMemory;
+        else if (arg == "--dest") options.destDir = value;
+        else {
+            std::cerr << "unknown option: " << arg << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    try {
+        if (!parseOptions(argc, argv, options)) return 1;
+    } catch (const std::exception &e) {
+        std::cerr << "invalid arguments: " << e.what() << std::endl;
+        return 1;
+    }
+    if (!selfTest()) {
+        return 1;
+    }
+    cipherThroughput();
+    std::optional<flowdrop::TransportOptions> transportOptions;
+    if (options.preset.has_value()) {
+        transportOptions = flowdrop::transportOptions(options.preset.value());
+    }
+
+    flowdrop::DeviceInfo receiverInfo;
+    receiverInfo.id = "bench-receiver";
+    flowdrop::Server server(receiverInfo);
+    ReceiverListener receiverListener;
+    server.setDestDir(options.destDir);
+    server.setEventListener(&receiverListener);
+    server.setTransportOptions(transportOptions);
+    std::thread serverThread([&server]() { server.run(); });
+    std::future<unsigned short> portFuture = receiverListener.portPromise.get_future();
+    if (portFuture.wait_for(std::chrono::seconds(10)) != std::future_status::ready) {
+        std::cerr << "receiver did not start" << std::endl;
+        return 1;
+    }
+    unsigned short port = portFuture.get();
+
+    std::size_t fileSize = options.sizeMiB * 1024 * 1024 / options.files;
+    std::size_t udpFileSize = options.udpMiB * 1024 * 1024 / options.files;
+    auto payload = std::make_shared<std::vector<char>>(std::max(fileSize, udpFileSize));
+    for (std::size_t i = 0; i < payload->size(); ++i) {
+        (*payload)[i] = static_cast<char>(i * 2654435761u >> 24);
+    }
+
+    flowdrop::DeviceInfo senderInfo;
+    senderInfo.id = "bench-sender";
+    auto send = [&](std::vector<flowdrop::File *> files, bool encrypted, const std::optional<flowdrop::ReliableUdpOptions> &udp = std::nullopt) {
+        flowdrop::SendRequest request;
+        request.setDeviceInfo(senderInfo);
+        request.setReceiverAddress({"127.0.0.1", port});
+        request.setFiles(files);
+        request.setEncrypted(encrypted);
+        request.setReliableUdp(udp);
+        request.setTransportOptions(transportOptions);
+        bool sent = request.execute();
+        if (!sent) {
+            std::cerr << "send failed" << std::endl;
+        }
+        return sent;
+    };
+    double best[2] = {0, 0};
+    for (std::size_t run = 0; run < options.runs; ++run) {
+        for (int encrypted = 0; encrypted < 2; ++encrypted) {
+            std::vector<flowdrop::File *> files;
+            for (std::size_t i = 0; i < options.files; ++i) {
+                files.push_back(new flowdrop::MemoryFile("bench" + std::to_string(i) + ".bin", payload, payload->data(), fileSize));
+            }
+            Clock::time_point start = Clock::now();
+            if (send(files, encrypted != 0)) {
+                best[encrypted] = std::max(best[encrypted], fileSize * options.files / 1e6 / secondsSince(start));
+            }
+        }
+    }
+    std::cout << "plain     " << std::fixed << std::setprecision(0) << best[0] << " MB/s" << std::endl;
+    std::cout << "sealed    " << best[1] << " MB/s (" << std::setprecision(1)
+              << (best[0] > 0 ? 100.0 * best[1] / best[0] : 0.0) << "% of plain)" << std::endl;
+
+    for (int encrypted = 0; encrypted < 2 && options.smallSends > 0; ++encrypted) {
+        Clock::time_point start = Clock::now();
+        for (std::size_t i = 0; i < options.smallSends; ++i) {
+            send({new flowdrop::MemoryFile("small" + std::to_string(i) + ".bin", payload, payload->data(),
+                                           std::min<std::size_t>(4096, payload->size()))}, encrypted != 0);
+        }
+        std::cout << (encrypted ? "sealed" : "plain ") << "    small sends " << std::setprecision(2)
+                  << secondsSince(start) * 1000 / static_cast<double>(options.smallSends) << " ms each" << std::endl;
+    }
+
+    // best of the runs, 0 if every send failed
+    auto udpRate = [&](const std::optional<flowdrop::ReliableUdpOptions> &udp) {
+        double rate = 0;
+        for (std::size_t run = 0; run < options.runs; ++run) {
+            std::vector<flowdrop::File *> files;
+            for (std::size_t i = 0; i < options.files; ++i) {
+                files.push_back(new flowdrop::MemoryFile("udp" + std::to_string(i) + ".bin", payload, payload->data(), udpFileSize));
+            }
+            Clock::time_point start = Clock::now();
+            if (send(files, false, udp)) {
+                rate = std::max(rate, udpFileSize * options.files / 1e6 / secondsSince(start));
+            }
+        }
+        return rate;
+    };
+    if (udpFileSize > 0) {
+        std::cout << "tcp       lossless " << std::setprecision(0) << udpRate(std::nullopt) << " MB/s" << std::endl;
+        for (double loss: {0.0, 0.01, 0.05}) {
+            transport::setLossInjection(loss, std::chrono::milliseconds(options.delayMs));
+            for (unsigned fecGroup: {0u, 8u}) {
+                flowdrop::ReliableUdpOptions udp;
+                udp.fecGroup = fecGroup;
+                std::cout << "kcp       loss " << std::setprecision(0) << loss * 100 << "% fec " << (fecGroup ? "1/8" : "off")
+                          << " " << udpRate(udp) << " MB/s" << std::endl;
+            }
+        }
+        transport::setLossInjection(0, std::chrono::milliseconds(0));
+    }
+
+    server.stop();
+    serverThread.join();
+    std::error_code ec;
+    std::filesystem::remove_all(options.destDir, ec);
+    return 0;
+}